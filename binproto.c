@@ -0,0 +1,63 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <string.h>
+#include "binproto.h"
+// end:includes
+
+// start:definitions
+// Binary protocol header encoding, shared by server and client
+
+inline void bin_put_u32(unsigned char *buf, uint32_t v) {
+    buf[0] = (unsigned char) v;
+    buf[1] = (unsigned char) (v >> 8);
+    buf[2] = (unsigned char) (v >> 16);
+    buf[3] = (unsigned char) (v >> 24);
+}
+
+inline uint32_t bin_get_u32(const unsigned char *buf) {
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8 |
+           (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+/*
+ * Encode request header `hdr` into `buf`, which must be at least
+ * BIN_HDR_SIZE bytes long.
+ */
+
+void bin_encode_req(unsigned char *buf, const bin_req_hdr_t *hdr) {
+    buf[0] = hdr->op;
+    buf[1] = hdr->flags;
+    buf[2] = 0;
+    buf[3] = 0;
+    bin_put_u32(buf + 4, hdr->path_len);
+    bin_put_u32(buf + 8, hdr->payload_len);
+}
+
+void bin_decode_req(const unsigned char *buf, bin_req_hdr_t *hdr) {
+    hdr->op = buf[0];
+    hdr->flags = buf[1];
+    hdr->path_len = bin_get_u32(buf + 4);
+    hdr->payload_len = bin_get_u32(buf + 8);
+}
+
+/*
+ * Encode reply header `hdr` into `buf`, which must be at least
+ * BIN_HDR_SIZE bytes long.
+ */
+
+void bin_encode_reply(unsigned char *buf, const bin_reply_hdr_t *hdr) {
+    buf[0] = hdr->status;
+    memset(buf + 1, 0, 3);
+    bin_put_u32(buf + 4, hdr->count);
+    bin_put_u32(buf + 8, hdr->len);
+}
+
+void bin_decode_reply(const unsigned char *buf, bin_reply_hdr_t *hdr) {
+    hdr->status = buf[0];
+    hdr->count = bin_get_u32(buf + 4);
+    hdr->len = bin_get_u32(buf + 8);
+}
+// end:definitions
@@ -0,0 +1,88 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_BINPROTO_H
+#define API_RAMFS_BINPROTO_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+// end:includes
+
+// start:macros
+// Binary wire protocol. All integers are little-endian.
+//
+// Request:  | op:u8 | flags:u8 | reserved:u16 | path_len:u32 | payload_len:u32 |
+//           | path (path_len bytes) | payload (payload_len bytes) |
+// Reply:    | status:u8 | reserved:u8[3] | count:u32 | len:u32 |
+//           | body (len bytes) |
+//
+// `write` replies carry the number of bytes written in `count`, `read`
+// replies carry the content as body, `find` replies carry `count`
+// paths as body, each one prefixed by its length as u32. The `flags`
+// of a `find` request select how names are matched against the path:
+// 0 exact, 1 prefix, 2 suffix, 3 substring, 4 glob (see match.h).
+// `grep` requests search the files under the path for the payload,
+// as a literal or, if the flags are BIN_GREP_REGEX, as a regex, and
+// are answered like `find`.
+//
+// Between `begin` and `commit`, create, write and delete requests are
+// only queued and answered with BIN_STATUS_QUEUED. `commit` applies
+// all of them or none: if one would fail, the reply is BIN_STATUS_ERR
+// with its position in the batch, from 1, in `count`.
+//
+// `save` writes an image of the whole file system (see image.h) to
+// the file at the path, on the server side. `bgsave` replies as soon
+// as a child process started writing it, and fails if one still is.
+#define BIN_HDR_SIZE 12
+
+#define BIN_OP_CREATE     1
+#define BIN_OP_CREATE_DIR 2
+#define BIN_OP_READ       3
+#define BIN_OP_WRITE      4
+#define BIN_OP_DELETE     5
+#define BIN_OP_DELETE_R   6
+#define BIN_OP_FIND       7
+#define BIN_OP_EXIT       8
+#define BIN_OP_GREP       9
+#define BIN_OP_BEGIN      10
+#define BIN_OP_COMMIT     11
+#define BIN_OP_ABORT      12
+#define BIN_OP_SAVE       13
+#define BIN_OP_BGSAVE     14
+
+#define BIN_GREP_LITERAL  0
+#define BIN_GREP_REGEX    1
+
+#define BIN_STATUS_OK     0
+#define BIN_STATUS_ERR    1   // operation failed, like "no" in the text protocol
+#define BIN_STATUS_EINVAL 2   // malformed request or unknown opcode
+#define BIN_STATUS_QUEUED 3   // added to the batch, see `commit`
+// end:macros
+
+// start:datatypes
+typedef struct _bin_req_hdr {
+    uint8_t op;
+    uint8_t flags;
+    uint32_t path_len;
+    uint32_t payload_len;
+} bin_req_hdr_t;
+
+typedef struct _bin_reply_hdr {
+    uint8_t status;
+    uint32_t count;
+    uint32_t len;
+} bin_reply_hdr_t;
+// end:datatypes
+
+// start:declarations
+void     bin_put_u32(unsigned char *buf, uint32_t v);
+uint32_t bin_get_u32(const unsigned char *buf);
+void     bin_encode_req(unsigned char *buf, const bin_req_hdr_t *hdr);
+void     bin_decode_req(const unsigned char *buf, bin_req_hdr_t *hdr);
+void     bin_encode_reply(unsigned char *buf, const bin_reply_hdr_t *hdr);
+void     bin_decode_reply(const unsigned char *buf, bin_reply_hdr_t *hdr);
+// end:declarations
+
+#endif //API_RAMFS_BINPROTO_H
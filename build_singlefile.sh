@@ -7,7 +7,7 @@ which c2singlefile > /dev/null
 
 if [ $? == 0 ]; then
 	file="singlefile1.c"
-	c2singlefile utils.h utils.c hashtable.h hashtable.c ramfs.h ramfs.c ramfs_wrapped.h ramfs_wrapped.c main.c > $file
+	c2singlefile utils.h utils.c hashtable.h hashtable.c match.h match.c trigram.h trigram.c strsort.h strsort.c ramfs.h ringbuf.h ringbuf.c walker.h walker.c ramfs.c image.h image.c journal.h journal.c ramfs_wrapped.h ramfs_wrapped.c command.h command.c pipeline.h pipeline.c binproto.h binproto.c uring.h uring.c shard.h shard.c server.h server.c main.c > $file
 fi
 
-gcc -DEVAL -static -std=c99 -O2 -o api-ramfs $file -lm
+gcc -DEVAL -D_GNU_SOURCE -DHAVE_IO_URING -static -std=c99 -O2 -pthread -o api-ramfs $file -lm
@@ -0,0 +1,759 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include "command.h"
+#include "binproto.h"
+#include "ramfs_wrapped.h"
+#include "image.h"
+#include "journal.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Command parsing and dispatching, shared by all front-ends
+
+/*
+ * Tokenizes `line` in place and fills `cmd` with the operation and
+ * its arguments. Missing arguments are set to NULL.
+ * Returns the parsed operation.
+ */
+
+cmd_op_t cmd_parse(char *line, cmd_t *cmd) {
+    char *saveptr;
+    char *name;
+
+    memset(cmd, 0, sizeof(cmd_t));
+    cmd->line = line;
+
+    name = cmd->name = readcmd(line, &saveptr);
+    if (name == NULL) {
+        cmd->op = CMD_NONE;
+        return cmd->op;
+    }
+
+    if (strcmp(name, "create") == 0)
+        cmd->op = CMD_CREATE;
+    else if (strcmp(name, "create_dir") == 0)
+        cmd->op = CMD_CREATE_DIR;
+    else if (strcmp(name, "read") == 0)
+        cmd->op = CMD_READ;
+    else if (strcmp(name, "write") == 0)
+        cmd->op = CMD_WRITE;
+    else if (strcmp(name, "write_begin") == 0)
+        cmd->op = CMD_WRITE_BEGIN;
+    else if (strcmp(name, "delete") == 0)
+        cmd->op = CMD_DELETE;
+    else if (strcmp(name, "delete_r") == 0)
+        cmd->op = CMD_DELETE_R;
+    else if (strcmp(name, "find") == 0)
+        cmd->op = CMD_FIND;
+    else if (strcmp(name, "find_prefix") == 0) {
+        cmd->op = CMD_FIND;
+        cmd->match = MATCH_PREFIX;
+    } else if (strcmp(name, "find_suffix") == 0) {
+        cmd->op = CMD_FIND;
+        cmd->match = MATCH_SUFFIX;
+    } else if (strcmp(name, "find_substr") == 0) {
+        cmd->op = CMD_FIND;
+        cmd->match = MATCH_SUBSTR;
+    } else if (strcmp(name, "find_glob") == 0) {
+        cmd->op = CMD_FIND;
+        cmd->match = MATCH_GLOB;
+    } else if (strcmp(name, "find_in") == 0)
+        cmd->op = CMD_FIND_IN;
+    else if (strcmp(name, "count_in") == 0)
+        cmd->op = CMD_COUNT_IN;
+    else if (strcmp(name, "grep") == 0) {
+        cmd->op = CMD_GREP;
+        cmd->match = MATCH_SUBSTR;
+    } else if (strcmp(name, "grep_re") == 0) {
+        cmd->op = CMD_GREP;
+        cmd->match = MATCH_REGEX;
+    } else if (strcmp(name, "cache_stats") == 0)
+        cmd->op = CMD_CACHE_STATS;
+    else if (strcmp(name, "begin") == 0)
+        cmd->op = CMD_BEGIN;
+    else if (strcmp(name, "commit") == 0)
+        cmd->op = CMD_COMMIT;
+    else if (strcmp(name, "abort") == 0)
+        cmd->op = CMD_ABORT;
+    else if (strcmp(name, "save") == 0)
+        cmd->op = CMD_SAVE;
+    else if (strcmp(name, "bgsave") == 0)
+        cmd->op = CMD_BGSAVE;
+    else if (strcmp(name, "exit") == 0)
+        cmd->op = CMD_EXIT;
+    else
+        cmd->op = CMD_UNKNOWN;
+
+    // saveptr is already at the beginning of next token
+    for (int i = 0; i < CMD_MAX_ARGS; i++) {
+        cmd->args[i] = readcmd(NULL, &saveptr);
+        if (cmd->args[i] == NULL)
+            break;
+    }
+
+    return cmd->op;
+}
+
+/*
+ * Runs the parsed command `cmd` against `root` and appends its
+ * reply to `out`. Empty lines and `exit` produce no reply. Writes
+ * are queued in `txn` while a batch is open, see `cmd_txn`; without
+ * `txn` batches are refused.
+ */
+
+void cmd_exec(fs_node_t *root, fs_txn_t *txn, cmd_t *cmd, strbuf_t *out) {
+    int ret;
+
+    image_bgsave_tick(root);
+    if (txn != NULL && cmd_txn(txn, cmd, 0, out))
+        return;
+
+    switch (cmd->op) {
+        case CMD_CREATE:
+        case CMD_CREATE_DIR:
+        case CMD_WRITE:
+        case CMD_WRITE_BEGIN:
+        case CMD_DELETE:
+        case CMD_DELETE_R:
+            print_status(_cmd_apply(root, cmd, 0), out);
+            break;
+        case CMD_READ:
+            ramfs_read_w(root, cmd->args, out);
+            break;
+        case CMD_FIND:
+            if (cmd->match == MATCH_EXACT)
+                ramfs_find_w(root, cmd->args, out);
+            else
+                ramfs_find_match_w(root, cmd->args, cmd->match, out);
+            break;
+        case CMD_FIND_IN:
+            ramfs_find_in_w(root, cmd->args, out);
+            break;
+        case CMD_COUNT_IN:
+            ramfs_count_in_w(root, cmd->args, out);
+            break;
+        case CMD_GREP:
+            ramfs_grep_w(root, cmd->args, cmd->match, out);
+            break;
+        case CMD_CACHE_STATS:
+            ramfs_cache_stats_w(root, cmd->args, out);
+            break;
+        case CMD_SAVE:
+            ramfs_save_w(root, cmd->args, out);
+            break;
+        case CMD_BGSAVE:
+            ramfs_bgsave_w(root, cmd->args, out);
+            break;
+        case CMD_COMMIT:
+            if (txn == NULL) {
+                print_status(-1, out);
+                break;
+            }
+            txn->open = 0;
+            ret = _cmd_commit(root, txn);
+            _cmd_committed(out, 0, ret, txn->failed);
+            break;
+        case CMD_NONE:
+        case CMD_EXIT:
+            break;
+        default:
+            strbuf_puts(out, "no\n");
+    }
+}
+
+/*
+ * Starts `task` instead of running `cmd` if it is a `find`, `find_in`,
+ * `count_in` or `grep` with enough work to do (see `ramfs_task_find`),
+ * against a snapshot of `root`. Its reply is then appended by
+ * `cmd_resume`, in the binary protocol if `binary` is true. The
+ * command can be freed right away.
+ * Returns true if the task was started, false if `cmd` must be run
+ * the usual way.
+ */
+
+uint8_t cmd_start(fs_node_t *root, cmd_t *cmd, uint8_t binary, cmd_task_t *task) {
+    unsigned int maxdepth;
+    int ret = -1;
+
+    switch (cmd->op) {
+        case CMD_FIND:
+            if (cmd->match == MATCH_EXACT && cmd->args[0] != NULL)
+                ret = ramfs_task_find(&task->task, root, NULL, cmd->args[0], FIND_DEPTH_ALL, false);
+            break;
+        case CMD_FIND_IN:
+        case CMD_COUNT_IN:
+            if (cmd->args[0] != NULL && cmd->args[1] != NULL && _ramfs_maxdepth_w(cmd->args[2], &maxdepth) == 0)
+                ret = ramfs_task_find(&task->task, root, cmd->args[0], cmd->args[1], maxdepth,
+                                      cmd->op == CMD_COUNT_IN);
+            break;
+        case CMD_GREP:
+            // The binary pattern is the payload, it may contain NULs
+            if (binary)
+                ret = ramfs_task_grep(&task->task, root, cmd->args[0], cmd->match, cmd->payload, cmd->payload_len);
+            else if (cmd->args[0] != NULL && cmd->args[1] != NULL)
+                ret = ramfs_task_grep(&task->task, root, cmd->args[0], cmd->match, cmd->args[1],
+                                      strlen(cmd->args[1]));
+            break;
+        default:
+            break;
+    }
+    if (ret != 0)
+        return false;
+
+    task->op = cmd->op;
+    task->binary = binary;
+    task->replying = 0;
+    return true;
+}
+
+/*
+ * Runs `task` until `deadline` (see `now_ns`), appending to `out` the
+ * reply of its command once all the results are found, the same one
+ * `cmd_exec` or `cmd_exec_bin` would. The reply is appended a part at
+ * a time too, stopping once it grew by `room` bytes.
+ * Returns true once the reply is complete.
+ */
+
+uint8_t cmd_resume(cmd_task_t *task, strbuf_t *out, uint64_t deadline, size_t room) {
+    fs_task_t *t = &task->task;
+    unsigned char lenbuf[4];
+    size_t start = out->len;
+    size_t len, n = 0;
+    char *path;
+
+    if (!task->replying) {
+        if (!ramfs_task_step(t, deadline))
+            return false;
+        task->replying = 1;
+
+        if (task->op == CMD_COUNT_IN) {
+            strbuf_printf(out, "ok %zu\n", t->count);
+            return true;
+        }
+        if (task->binary) {
+            _cmd_bin_reply(out, BIN_STATUS_OK, (uint32_t) t->count, (uint32_t) (t->bytes + 4 * t->count));
+        } else if (t->count == 0) {
+            strbuf_puts(out, "no\n");
+            return true;
+        }
+    }
+
+    while ((path = ramfs_task_next(t, &len)) != NULL) {
+        if (task->binary) {
+            bin_put_u32(lenbuf, (uint32_t) len);
+            strbuf_append(out, (char *) lenbuf, 4);
+        } else {
+            strbuf_puts(out, "ok ");
+        }
+        strbuf_append(out, path, len);
+        if (!task->binary)
+            strbuf_puts(out, "\n");
+
+        if (out->len - start >= room || (++n % FS_TASK_CHECK == 0 && now_ns() >= deadline))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Releases `task`, whether its reply is complete or not.
+ */
+
+void cmd_task_close(cmd_task_t *task) {
+    ramfs_task_close(&task->task);
+}
+
+/*
+ * Handles the commands of client batch `txn` that need no tree:
+ * `begin`, `abort`, and the writes (`create`, `create_dir`, `write`,
+ * `write_begin`, `delete`, `delete_r`) sent while it is open, which
+ * are only queued, taking the payload over. `commit` is left to the
+ * caller unless the batch is empty or was never started. Other
+ * commands run right away, on the tree without the batch. Replies
+ * use the binary protocol if `binary` is true.
+ * Returns true if `cmd` was handled and its reply appended to `out`.
+ */
+
+uint8_t cmd_txn(fs_txn_t *txn, cmd_t *cmd, uint8_t binary, strbuf_t *out) {
+    fs_txn_op_t op;
+    char *content = NULL;
+    size_t len = 0;
+
+    switch (cmd->op) {
+        case CMD_BEGIN:
+            _cmd_status(out, binary, txn->open ? -1 : 0);
+            txn->open = 1;
+            return true;
+        case CMD_ABORT:
+            _cmd_status(out, binary, txn->open ? 0 : -1);
+            ramfs_txn_clear(txn);
+            txn->open = 0;
+            return true;
+        case CMD_COMMIT:
+            if (txn->open && txn->count > 0)
+                return false;
+            _cmd_status(out, binary, txn->open ? 0 : -1);
+            txn->open = 0;
+            return true;
+        case CMD_CREATE:
+            op = TXN_CREATE;
+            break;
+        case CMD_CREATE_DIR:
+            op = TXN_CREATE_DIR;
+            break;
+        case CMD_WRITE:
+        case CMD_WRITE_BEGIN:
+            op = TXN_WRITE;
+            break;
+        case CMD_DELETE:
+            op = TXN_DELETE;
+            break;
+        case CMD_DELETE_R:
+            op = TXN_DELETE_R;
+            break;
+        default:
+            return false;
+    }
+    if (!txn->open)
+        return false;
+
+    if (op == TXN_WRITE && !binary && cmd->op == CMD_WRITE && cmd->args[1] != NULL) {
+        len = strlen(cmd->args[1]);
+        content = malloc_or_die(len + 1);
+        memcpy(content, cmd->args[1], len);
+    } else if (op == TXN_WRITE && cmd->payload != NULL) {
+        // The batch adopts the payload, like the file would
+        content = cmd->payload;
+        len = cmd->payload_len;
+        cmd->payload = NULL;
+        if (binary)
+            cmd->args[1] = NULL;
+    }
+
+    // Malformed commands are refused right away
+    if (cmd->args[0] == NULL || (op == TXN_WRITE && content == NULL)) {
+        free(content);
+        _cmd_status(out, binary, -1);
+        return true;
+    }
+    ramfs_txn_add(txn, op, cmd->args[0], content, len);
+    if (binary)
+        _cmd_bin_reply(out, BIN_STATUS_QUEUED, 0, 0);
+    else
+        strbuf_puts(out, "queued\n");
+    return true;
+}
+
+/*
+ * (Internal) Run `cmd`, a `create`, `create_dir`, `write`,
+ * `write_begin`, `delete` or `delete_r` received with the binary
+ * protocol if `binary` is true, against `root`. It is logged first to
+ * the journal of the file system, if it has one, and cancelled if it
+ * fails without changing anything. The payload of a binary write or
+ * of `write_begin` is adopted by the file.
+ * Returns what the file system returned, -1 if an argument is missing.
+ */
+
+int _cmd_apply(fs_node_t *root, cmd_t *cmd, uint8_t binary) {
+    journal_t *journal = _ramfs_meta(root)->journal;
+    char *path = cmd->args[0];
+    char *content = NULL;
+    size_t len = 0, mark = 0;
+    uint8_t text = (uint8_t) (!binary && cmd->op == CMD_WRITE);
+    fs_txn_op_t op;
+    int ret = -1;
+
+    switch (cmd->op) {
+        case CMD_CREATE:
+            op = TXN_CREATE;
+            break;
+        case CMD_CREATE_DIR:
+            op = TXN_CREATE_DIR;
+            break;
+        case CMD_DELETE:
+            op = TXN_DELETE;
+            break;
+        case CMD_DELETE_R:
+            op = TXN_DELETE_R;
+            break;
+        default:
+            // The payload is missing if the size was invalid or the
+            // upload was truncated
+            op = TXN_WRITE;
+            content = text ? cmd->args[1] : cmd->payload;
+            len = text ? (content != NULL ? strlen(content) : 0) : cmd->payload_len;
+    }
+    if (path == NULL || (op == TXN_WRITE && content == NULL))
+        return -1;
+
+    if (journal != NULL)
+        mark = journal_log(journal, op, path, content, len);
+    switch (op) {
+        case TXN_CREATE:
+            ret = ramfs_create(root, path);
+            break;
+        case TXN_CREATE_DIR:
+            ret = ramfs_create_dir(root, path);
+            break;
+        case TXN_WRITE:
+            if (text) {
+                ret = ramfs_write_n(root, path, content, len);
+                break;
+            }
+            ret = ramfs_write_adopt(root, path, content, len);
+            cmd->payload = NULL;
+            if (binary)
+                cmd->args[1] = NULL;
+            break;
+        case TXN_DELETE:
+            ret = ramfs_delete(root, path);
+            break;
+        case TXN_DELETE_R:
+            ret = ramfs_delete_r(root, path);
+            break;
+    }
+    // A failed delete_r may have removed part of the subtree already
+    if (journal != NULL && ret < 0 && op != TXN_DELETE_R)
+        journal_cancel(journal, mark);
+    return ret;
+}
+
+/*
+ * (Internal) Commit batch `txn` against `root`, like `ramfs_txn_commit`,
+ * logging it first to the journal of the file system, if it has one.
+ */
+
+int _cmd_commit(fs_node_t *root, fs_txn_t *txn) {
+    journal_t *journal = _ramfs_meta(root)->journal;
+    size_t mark = journal != NULL ? journal_log_txn(journal, txn) : 0;
+    int ret = ramfs_txn_commit(root, txn);
+
+    if (journal != NULL && ret != 0)
+        journal_cancel(journal, mark);
+    return ret;
+}
+
+/*
+ * (Internal) Append to `out` a reply with no body telling whether an
+ * operation succeeded, `ret` being 0, or failed.
+ */
+
+void _cmd_status(strbuf_t *out, uint8_t binary, int ret) {
+    if (binary)
+        _cmd_bin_reply(out, ret < 0 ? BIN_STATUS_ERR : BIN_STATUS_OK, 0, 0);
+    else
+        print_status(ret < 0 ? -1 : 0, out);
+}
+
+/*
+ * (Internal) Append to `out` the reply to `commit`, which returned
+ * `ret`: on failure it carries the position of the operation that
+ * would have failed, `failed`.
+ */
+
+void _cmd_committed(strbuf_t *out, uint8_t binary, int ret, size_t failed) {
+    if (ret == 0)
+        _cmd_status(out, binary, 0);
+    else if (binary)
+        _cmd_bin_reply(out, BIN_STATUS_ERR, (uint32_t) failed, 0);
+    else
+        strbuf_printf(out, "no %zu\n", failed);
+}
+
+/*
+ * Prepares the payload buffer of a parsed `write_begin path size`
+ * command, which is followed in the input by exactly `size` raw bytes.
+ * The caller fills `cmd->payload` with them, so that the file can
+ * later adopt it without any further copy. If `size` is larger than
+ * CMD_MAX_PAYLOAD, or can't be allocated, `cmd->payload` is NULL: the
+ * caller skips the bytes, and the command fails.
+ * Returns 0 if raw bytes must be read, -1 if the command does not
+ * expect any (other commands, missing path or invalid size).
+ */
+
+int cmd_payload_begin(cmd_t *cmd) {
+    unsigned long long size;
+    char *end;
+
+    if (cmd->op != CMD_WRITE_BEGIN || cmd->args[0] == NULL || cmd->args[1] == NULL)
+        return -1;
+    if (*cmd->args[1] < '0' || *cmd->args[1] > '9')
+        return -1;
+
+    size = strtoull(cmd->args[1], &end, 10);
+    if (*end != '\0' || size > UINT32_MAX)
+        return -1;
+
+    cmd->payload = size <= CMD_MAX_PAYLOAD ? malloc((size_t) size + 1) : NULL;
+    cmd->payload_len = (size_t) size;
+    return 0;
+}
+
+/*
+ * Reads the raw bytes following a `write_begin` command from `in`
+ * straight into its payload buffer, see `cmd_payload_begin`.
+ * Returns 0 on success or if no bytes were expected, -1 if the
+ * input ended before the whole payload was read.
+ */
+
+int cmd_read_payload(reader_t *in, cmd_t *cmd) {
+    char skip[4096];
+    size_t left, n;
+
+    if (cmd_payload_begin(cmd) < 0)
+        return 0;
+
+    if (cmd->payload == NULL) {
+        for (left = cmd->payload_len; left > 0; left -= n)
+            if ((n = reader_read(in, skip, left < sizeof(skip) ? left : sizeof(skip))) == 0)
+                return -1;
+        return 0;
+    }
+    if (reader_read(in, cmd->payload, cmd->payload_len) != cmd->payload_len) {
+        free(cmd->payload);
+        cmd->payload = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * (Internal) Map a binary protocol opcode to a command.
+ */
+
+cmd_op_t _cmd_bin_op(uint8_t op) {
+    switch (op) {
+        case BIN_OP_CREATE:     return CMD_CREATE;
+        case BIN_OP_CREATE_DIR: return CMD_CREATE_DIR;
+        case BIN_OP_READ:       return CMD_READ;
+        case BIN_OP_WRITE:      return CMD_WRITE;
+        case BIN_OP_DELETE:     return CMD_DELETE;
+        case BIN_OP_DELETE_R:   return CMD_DELETE_R;
+        case BIN_OP_FIND:       return CMD_FIND;
+        case BIN_OP_GREP:       return CMD_GREP;
+        case BIN_OP_BEGIN:      return CMD_BEGIN;
+        case BIN_OP_COMMIT:     return CMD_COMMIT;
+        case BIN_OP_ABORT:      return CMD_ABORT;
+        case BIN_OP_SAVE:       return CMD_SAVE;
+        case BIN_OP_BGSAVE:     return CMD_BGSAVE;
+        case BIN_OP_EXIT:       return CMD_EXIT;
+        default:                return CMD_UNKNOWN;
+    }
+}
+
+/*
+ * (Internal) Fill `cmd` with the operation of the binary request
+ * header `hdr`. Invalid requests become CMD_UNKNOWN.
+ */
+
+void _cmd_bin_hdr(bin_req_hdr_t *hdr, cmd_t *cmd) {
+    cmd->op = _cmd_bin_op(hdr->op);
+    if (hdr->path_len > CMD_BIN_MAX_PATH)
+        cmd->op = CMD_UNKNOWN;
+
+    // Find requests carry the kind of match in the flags
+    if (cmd->op == CMD_FIND) {
+        if (hdr->flags > MATCH_GLOB)
+            cmd->op = CMD_UNKNOWN;
+        cmd->match = (match_kind_t) hdr->flags;
+    }
+    if (cmd->op == CMD_GREP) {
+        if (hdr->flags > BIN_GREP_REGEX)
+            cmd->op = CMD_UNKNOWN;
+        cmd->match = hdr->flags == BIN_GREP_REGEX ? MATCH_REGEX : MATCH_SUBSTR;
+    }
+}
+
+/*
+ * Reads one binary protocol request from `in` into `cmd`. Path and
+ * payload are read into newly allocated buffers stored in `cmd->line`
+ * and `cmd->payload`, which must be freed by the caller.
+ * Returns 0 on success, -1 on EOF or truncated request.
+ */
+
+int cmd_read_bin(reader_t *in, cmd_t *cmd) {
+    unsigned char hdrbuf[BIN_HDR_SIZE];
+    bin_req_hdr_t hdr;
+    char *buf, *payload;
+
+    memset(cmd, 0, sizeof(cmd_t));
+    if (reader_read(in, hdrbuf, BIN_HDR_SIZE) != BIN_HDR_SIZE)
+        return -1;
+    bin_decode_req(hdrbuf, &hdr);
+
+    _cmd_bin_hdr(&hdr, cmd);
+
+    // Both path and payload are NUL-terminated so they can be used
+    // as strings, the payload may contain more NULs. The payload gets
+    // its own buffer so that a write can hand it over to the file.
+    buf = malloc_or_die((size_t) hdr.path_len + 1);
+    payload = malloc_or_die((size_t) hdr.payload_len + 1);
+    if (reader_read(in, buf, hdr.path_len) != hdr.path_len ||
+        reader_read(in, payload, hdr.payload_len) != hdr.payload_len) {
+        free(buf);
+        free(payload);
+        return -1;
+    }
+    buf[hdr.path_len] = '\0';
+    payload[hdr.payload_len] = '\0';
+
+    cmd->line = buf;
+    cmd->args[0] = buf;
+    cmd->args[1] = cmd->payload = payload;
+    cmd->payload_len = hdr.payload_len;
+    return 0;
+}
+
+/*
+ * Parses one binary protocol request from the `len` bytes at `buf`
+ * into `cmd`. Path and payload are copied like in `cmd_read_bin`.
+ * Returns the number of bytes consumed, or 0 if `buf` does not hold
+ * a whole request yet.
+ */
+
+size_t cmd_parse_bin(const char *buf, size_t len, cmd_t *cmd) {
+    bin_req_hdr_t hdr;
+    size_t total;
+    char *copy, *payload;
+
+    if (len < BIN_HDR_SIZE)
+        return 0;
+    bin_decode_req((const unsigned char *) buf, &hdr);
+    total = BIN_HDR_SIZE + (size_t) hdr.path_len + hdr.payload_len;
+    if (len < total)
+        return 0;
+
+    memset(cmd, 0, sizeof(cmd_t));
+    _cmd_bin_hdr(&hdr, cmd);
+
+    copy = malloc_or_die((size_t) hdr.path_len + 1);
+    memcpy(copy, buf + BIN_HDR_SIZE, hdr.path_len);
+    copy[hdr.path_len] = '\0';
+    payload = malloc_or_die((size_t) hdr.payload_len + 1);
+    memcpy(payload, buf + BIN_HDR_SIZE + hdr.path_len, hdr.payload_len);
+    payload[hdr.payload_len] = '\0';
+
+    cmd->line = copy;
+    cmd->args[0] = copy;
+    cmd->args[1] = cmd->payload = payload;
+    cmd->payload_len = hdr.payload_len;
+    return total;
+}
+
+/*
+ * (Internal) Append a binary reply header to `out`.
+ */
+
+void _cmd_bin_reply(strbuf_t *out, uint8_t status, uint32_t count, uint32_t len) {
+    unsigned char buf[BIN_HDR_SIZE];
+    bin_reply_hdr_t hdr = {status, count, len};
+
+    bin_encode_reply(buf, &hdr);
+    strbuf_append(out, (char *) buf, BIN_HDR_SIZE);
+}
+
+/*
+ * (Internal) Append to `out` a successful binary reply carrying the
+ * `nres` paths in `results`.
+ */
+
+void _cmd_bin_paths(strbuf_t *out, char **results, size_t nres) {
+    unsigned char lenbuf[4];
+    size_t total = 0, len;
+
+    for (size_t i = 0; i < nres; i++)
+        total += 4 + strlen(results[i]);
+    _cmd_bin_reply(out, BIN_STATUS_OK, (uint32_t) nres, (uint32_t) total);
+    for (size_t i = 0; i < nres; i++) {
+        len = strlen(results[i]);
+        bin_put_u32(lenbuf, (uint32_t) len);
+        strbuf_append(out, (char *) lenbuf, 4);
+        strbuf_append(out, results[i], len);
+    }
+}
+
+/*
+ * Runs the binary command `cmd` against `root` and appends its
+ * binary reply to `out`, like `cmd_exec`. `exit` produces no reply.
+ */
+
+void cmd_exec_bin(fs_node_t *root, fs_txn_t *txn, cmd_t *cmd, strbuf_t *out) {
+    char *path = cmd->args[0];
+    char *content;
+    char **results;
+    size_t len, nres;
+    int ret = -1;
+
+    image_bgsave_tick(root);
+    if (txn != NULL && cmd_txn(txn, cmd, 1, out))
+        return;
+
+    switch (cmd->op) {
+        case CMD_CREATE:
+        case CMD_CREATE_DIR:
+        case CMD_DELETE:
+        case CMD_DELETE_R:
+            ret = _cmd_apply(root, cmd, 1);
+            break;
+        case CMD_WRITE:
+            // The file adopts the payload buffer, no copy is made
+            ret = _cmd_apply(root, cmd, 1);
+            if (ret >= 0) {
+                _cmd_bin_reply(out, BIN_STATUS_OK, (uint32_t) ret, 0);
+                return;
+            }
+            break;
+        case CMD_READ:
+            content = ramfs_read_n(root, path, &len);
+            if (content != NULL) {
+                _cmd_bin_reply(out, BIN_STATUS_OK, 0, (uint32_t) len);
+                strbuf_append(out, content, len);
+                return;
+            }
+            break;
+        case CMD_FIND:
+            if (cmd->match == MATCH_EXACT)
+                results = ramfs_find(root, path, &nres);
+            else
+                results = ramfs_find_match(root, cmd->match, path, &nres);
+            _cmd_bin_paths(out, results, nres);
+            free(results);
+            return;
+        case CMD_GREP:
+            // The pattern is the payload, literals may contain NULs
+            results = ramfs_grep(root, path, cmd->match, cmd->payload, cmd->payload_len, &nres);
+            _cmd_bin_paths(out, results, nres);
+            free(results);
+            return;
+        case CMD_COMMIT:
+            if (txn == NULL)
+                break;
+            txn->open = 0;
+            ret = _cmd_commit(root, txn);
+            _cmd_committed(out, 1, ret, txn->failed);
+            return;
+        case CMD_SAVE:
+            ret = path != NULL ? image_save(root, path) : -1;
+            break;
+        case CMD_BGSAVE:
+            ret = path != NULL ? image_bgsave(root, path) : -1;
+            break;
+        case CMD_NONE:
+        case CMD_EXIT:
+            return;
+        default:
+            _cmd_bin_reply(out, BIN_STATUS_EINVAL, 0, 0);
+            return;
+    }
+
+    _cmd_bin_reply(out, ret < 0 ? BIN_STATUS_ERR : BIN_STATUS_OK, 0, 0);
+}
+// end:definitions
@@ -0,0 +1,95 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_COMMAND_H
+#define API_RAMFS_COMMAND_H
+
+// start:includes
+#include "ramfs.h"
+#include "match.h"
+#include "binproto.h"
+#include "utils.h"
+// end:includes
+
+// start:macros
+#define CMD_MAX_ARGS 4
+// Longest path accepted by the binary protocol (255 levels of 255 chars)
+#define CMD_BIN_MAX_PATH 65536
+// Largest content accepted by `write_begin`, whose buffer is allocated
+// before the content arrives
+#define CMD_MAX_PAYLOAD (256 << 20)
+// end:macros
+
+// start:datatypes
+typedef enum _cmd_op {
+    CMD_NONE,       // empty line
+    CMD_CREATE,
+    CMD_CREATE_DIR,
+    CMD_READ,
+    CMD_WRITE,
+    CMD_WRITE_BEGIN, // followed by raw content bytes
+    CMD_DELETE,
+    CMD_DELETE_R,
+    CMD_FIND,
+    CMD_FIND_IN,
+    CMD_COUNT_IN,
+    CMD_GREP,
+    CMD_CACHE_STATS,
+    CMD_BEGIN,      // start a batch of writes, applied all together
+    CMD_COMMIT,
+    CMD_ABORT,
+    CMD_SAVE,       // write an image of the file system, see image.h
+    CMD_BGSAVE,     // the same, in a child process
+    CMD_EXIT,
+    CMD_UNKNOWN
+} cmd_op_t;
+
+// A parsed command. Arguments point inside `line`, which is
+// tokenized in place and must outlive the command. Binary writes and
+// `write_begin` carry their content in `payload`, a separate buffer
+// owned by the command until the file adopts it; binary commands
+// also expose it as args[1].
+typedef struct _cmd {
+    cmd_op_t op;
+    char *line;
+    char *name;
+    char *args[CMD_MAX_ARGS];
+    char *payload;
+    size_t payload_len;
+    match_kind_t match;     // how `find` compares names, or `grep` contents
+} cmd_t;
+
+// A long search run a slice at a time, see `cmd_start`
+typedef struct _cmd_task {
+    fs_task_t task;
+    cmd_op_t op;
+    uint8_t binary;
+    uint8_t replying;   // all the results were found
+} cmd_task_t;
+// end:datatypes
+
+// start:declarations
+cmd_op_t cmd_parse(char *line, cmd_t *cmd);
+void     cmd_exec(fs_node_t *root, fs_txn_t *txn, cmd_t *cmd, strbuf_t *out);
+uint8_t  cmd_txn(fs_txn_t *txn, cmd_t *cmd, uint8_t binary, strbuf_t *out);
+int      cmd_payload_begin(cmd_t *cmd);
+int      cmd_read_payload(reader_t *in, cmd_t *cmd);
+int      cmd_read_bin(reader_t *in, cmd_t *cmd);
+size_t   cmd_parse_bin(const char *buf, size_t len, cmd_t *cmd);
+void     cmd_exec_bin(fs_node_t *root, fs_txn_t *txn, cmd_t *cmd, strbuf_t *out);
+uint8_t  cmd_start(fs_node_t *root, cmd_t *cmd, uint8_t binary, cmd_task_t *task);
+uint8_t  cmd_resume(cmd_task_t *task, strbuf_t *out, uint64_t deadline, size_t room);
+void     cmd_task_close(cmd_task_t *task);
+
+void     _cmd_bin_reply(strbuf_t *out, uint8_t status, uint32_t count, uint32_t len);
+void     _cmd_bin_paths(strbuf_t *out, char **results, size_t nres);
+cmd_op_t _cmd_bin_op(uint8_t op);
+void     _cmd_bin_hdr(bin_req_hdr_t *hdr, cmd_t *cmd);
+int      _cmd_apply(fs_node_t *root, cmd_t *cmd, uint8_t binary);
+int      _cmd_commit(fs_node_t *root, fs_txn_t *txn);
+void     _cmd_status(strbuf_t *out, uint8_t binary, int ret);
+void     _cmd_committed(strbuf_t *out, uint8_t binary, int ret, size_t failed);
+// end:declarations
+
+#endif //API_RAMFS_COMMAND_H
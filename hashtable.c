@@ -84,11 +84,20 @@ uint8_t ht_setitem(ht_t *t, void *key, void *val) {
 /*
  * Unconditionally sets or replaces `key`'s value in hash table `t`.
  * See notes for `ht_setitem`.
+ * Returns the value replaced, or NULL if `key` was not there.
  */
 
-void ht_replitem(ht_t *t, void *key, void *val) {
+void *ht_replitem(ht_t *t, void *key, void *val) {
     size_t i = _ht_index(t, key);
-    _ht_replitem(t, i, key, val);
+    void *old = t->body[i].val;
+
+    if (t->body[i].key == NULL) {
+        _ht_replitem(t, i, key, val);
+        return NULL;
+    }
+    t->body[i].key = key;
+    t->body[i].val = val;
+    return old;
 }
 
 /*
@@ -166,6 +175,21 @@ void ht_grow(ht_t *t, size_t newsize) {
     free(oldbody);
 }
 
+/*
+ * Returns a new hash table holding the same items as `t`. Keys and
+ * values are shared, not copied.
+ */
+
+ht_t *ht_copy(ht_t *t) {
+    ht_t *copy = malloc_or_die(sizeof(ht_t));
+
+    copy->size = t->size;
+    copy->used = t->used;
+    copy->body = malloc_or_die(t->size * sizeof(ht_item_t));
+    memcpy(copy->body, t->body, t->size * sizeof(ht_item_t));
+    return copy;
+}
+
 /*
  * Frees hash table `t`'s data structures from memory.
  * No keys or values are freed.
@@ -40,9 +40,10 @@ ht_item_t  *_ht_body_new(size_t size);
 size_t      _ht_index(ht_t *t, void *key);
 void       *ht_getitem(ht_t *t, void *key);
 uint8_t     ht_setitem(ht_t *t, void *key, void *val);
-void        ht_replitem(ht_t *t, void *key, void *val);
+void       *ht_replitem(ht_t *t, void *key, void *val);
 void        ht_delitem(ht_t *t, void *key);
 void        ht_grow(ht_t *t, size_t newsize);
+ht_t       *ht_copy(ht_t *t);
 
 void _ht_replitem(ht_t *t, size_t pos, void *key, void *val);
 
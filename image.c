@@ -0,0 +1,606 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "image.h"
+#include "journal.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Binary images of a whole file system: written from a snapshot,
+// loaded back by mapping them
+
+/*
+ * Writes the file system of `root`, as it is when called, to a binary
+ * image at `path`. Writers can go on meanwhile, the image is written
+ * from a snapshot. It is written next to `path` first and moved over
+ * it once complete, so `path` is never left half written.
+ * Returns 0 on success, -1 on error, with errno set.
+ */
+
+int image_save(fs_node_t *root, const char *path) {
+    fs_snapshot_t *snap = ramfs_snapshot(root);
+    int ret = _image_save(snap, path);
+    int err = errno;
+
+    ramfs_snapshot_release(snap);
+    errno = err;
+    return ret;
+}
+
+/*
+ * Starts writing the file system of `root` to a binary image at
+ * `path`, like `image_save`, but in a child process, and returns right
+ * away. The child writes the tree as it was when called: the kernel
+ * keeps it for the child by copying each page the caller changes
+ * meanwhile, once. Names and contents still in a loaded image are
+ * never changed in place, so they are not copied. Only one save runs
+ * at a time, and `image_bgsave_poll` must be called until it is over,
+ * before the file system is destroyed.
+ * Returns 0 if the save started, -1 with errno set otherwise, EBUSY if
+ * one is running already.
+ */
+
+int image_bgsave(fs_node_t *root, const char *path) {
+    fs_meta_t *meta = _ramfs_meta(root);
+    image_bgsave_t *bg = meta->bgsave;
+    uint64_t start;
+    pid_t pid;
+    int err;
+
+    if (bg == NULL)
+        bg = meta->bgsave = calloc_or_die(1, sizeof(image_bgsave_t));
+    if (bg->pid > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    bg->minflt = _image_minflt();
+    start = now_ns();
+    // No writer can be halfway through a change while the tree is copied
+    _ramfs_snap_freeze(meta);
+    if ((pid = fork()) == 0) {
+        // Only this thread goes on in the child, and nothing changes the
+        // tree any more: there is nothing to lock, nor to preserve. The
+        // locks taken above can't be released here anyway.
+        meta->concurrent = 0;
+        _exit(_image_save(_ramfs_snap_take(meta, root), path) == 0 ? 0 : 1);
+    }
+    err = errno;
+    _ramfs_snap_thaw(meta);
+    if (pid < 0) {
+        errno = err;
+        return -1;
+    }
+
+    bg->pid = pid;
+    bg->path = malloc_or_die(strlen(path) + 1);
+    strcpy(bg->path, path);
+    bg->seq = meta->journal_seq;
+    bg->start_ns = now_ns();
+    bg->fork_ns += bg->start_ns - start;
+    bg->commands = 0;
+    return 0;
+}
+
+/*
+ * Checks whether the background save of the file system of `root`
+ * started by `image_bgsave` is over, waiting for it if `wait`, and
+ * accounts for it if so. The journal of the file system is told
+ * about it, see `_journal_saved`.
+ * Returns true if it is still running, false if it is over or there
+ * is none.
+ */
+
+uint8_t image_bgsave_poll(fs_node_t *root, uint8_t wait) {
+    fs_meta_t *meta = _ramfs_meta(root);
+    image_bgsave_t *bg = meta->bgsave;
+    struct rusage ru;
+    pid_t pid;
+    int status = 0;
+    uint8_t ok;
+
+    if (bg == NULL || bg->pid == 0)
+        return 0;
+    memset(&ru, 0, sizeof(struct rusage));
+    while ((pid = wait4(bg->pid, &status, wait ? 0 : WNOHANG, &ru)) < 0 && errno == EINTR)
+        continue;
+    if (pid == 0)
+        return 1;
+
+    ok = (uint8_t) (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    bg->saves++;
+    bg->failed += !ok;
+    bg->save_ns += now_ns() - bg->start_ns;
+    bg->faults += (uint64_t) (_image_minflt() - bg->minflt);
+    bg->child_faults += (uint64_t) ru.ru_minflt;
+    bg->busy_commands += bg->commands;
+#ifdef DEBUG
+    fprintf(stderr, "bgsave %s: %s after %.3f s, %ld faults here, %ld in the child\n", bg->path,
+            ok ? "done" : "failed", (double) (now_ns() - bg->start_ns) / 1e9, _image_minflt() - bg->minflt,
+            ru.ru_minflt);
+#endif
+    bg->pid = 0;
+    free(bg->path);
+    bg->path = NULL;
+
+    if (meta->journal != NULL)
+        _journal_saved(meta->journal, bg->seq, ok);
+    return 0;
+}
+
+/*
+ * Count a command run on the file system of `root` while a background
+ * save is running, and check whether it is over every
+ * IMAGE_BGSAVE_POLL of them. Front-ends call it for every command.
+ */
+
+void image_bgsave_tick(fs_node_t *root) {
+    image_bgsave_t *bg = _ramfs_meta(root)->bgsave;
+
+    if (bg != NULL && bg->pid > 0 && ++bg->commands % IMAGE_BGSAVE_POLL == 0)
+        image_bgsave_poll(root, 0);
+}
+
+/*
+ * Print what the background saves of the file system of `root` cost
+ * to `stream`, if there were any.
+ */
+
+void image_bgsave_print_stats(fs_node_t *root, FILE *stream) {
+    image_bgsave_t *bg = _ramfs_meta(root)->bgsave;
+    double secs;
+
+    if (bg == NULL || bg->saves == 0)
+        return;
+    secs = (double) bg->save_ns / 1e9;
+    fprintf(stream, "bgsave: %lu saves (%lu failed), fork %.3f ms avg, %.3f s avg\n",
+            (unsigned long) bg->saves, (unsigned long) bg->failed,
+            (double) bg->fork_ns / 1e6 / (double) bg->saves, secs / (double) bg->saves);
+    fprintf(stream, "  %lu page faults here meanwhile (%.1f MB), %lu in the children\n",
+            (unsigned long) bg->faults, (double) bg->faults * (double) sysconf(_SC_PAGESIZE) / 1e6,
+            (unsigned long) bg->child_faults);
+    fprintf(stream, "  %lu commands meanwhile (%.0f cmd/s)\n", (unsigned long) bg->busy_commands,
+            secs > 0 ? (double) bg->busy_commands / secs : 0.0);
+}
+
+/*
+ * (Internal) Write the file system seen by `snap` to a binary image at
+ * `path`, see `image_save`.
+ * Returns 0 on success, -1 on error, with errno set.
+ */
+
+int _image_save(fs_snapshot_t *snap, const char *path) {
+    image_writer_t w;
+    image_hdr_t hdr;
+    size_t len = strlen(path);
+    char *tmp = malloc_or_die(len + sizeof(".tmp"));
+    FILE *f;
+    int ret = -1, err = 0;
+
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+    // Measure every part first, so that each one has its place
+    memset(&w, 0, sizeof(image_writer_t));
+    w.content_off = 1;
+    _image_walk(snap, &w);
+
+    memset(&hdr, 0, sizeof(image_hdr_t));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_VERSION;
+    hdr.order = 0x01020304;
+    hdr.nnodes = w.nrec;
+    hdr.ndirs = w.ndirs;
+    hdr.records = sizeof(image_hdr_t);
+    hdr.names = hdr.records + w.nrec * sizeof(image_node_t);
+    hdr.contents = hdr.names + w.name_off;
+    hdr.size = hdr.contents + w.content_off;
+    hdr.bytes = w.bytes;
+    hdr.seq = snap->meta->journal_seq;
+
+    if (w.nrec > UINT32_MAX) {
+        err = EFBIG;
+    } else if ((f = fopen(tmp, "w")) == NULL) {
+        err = errno;
+    } else {
+        ret = _image_write(snap, &hdr, f, tmp);
+        if (fclose(f) != 0)
+            ret = -1;
+        if (ret == 0 && rename(tmp, path) != 0)
+            ret = -1;
+        if (ret != 0) {
+            err = errno;
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    if (ret != 0)
+        errno = err;
+    return ret;
+}
+
+/*
+ * (Internal) Ask for the `len` bytes at `p`, not used yet, to be
+ * backed by huge pages where they can: `fork` then copies one page
+ * table entry for each of them, instead of hundreds, and a page
+ * written to afterwards is still copied alone.
+ */
+
+void _image_huge(char *p, size_t len) {
+#ifdef MADV_HUGEPAGE
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) p + page - 1) & ~(uintptr_t) (page - 1);
+    uintptr_t end = ((uintptr_t) p + len) & ~(uintptr_t) (page - 1);
+
+    if (p != NULL && end > start)
+        madvise((void *) start, end - start, MADV_HUGEPAGE);
+#else
+    (void) p;
+    (void) len;
+#endif
+}
+
+/*
+ * (Internal) Returns the page faults this process took so far that
+ * didn't need the disk, such as the ones copying a page written to
+ * after a `fork`.
+ */
+
+long _image_minflt() {
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return ru.ru_minflt;
+}
+
+/*
+ * (Internal) Write the image described by `hdr` of the nodes seen by
+ * `snap` to `f`, open for writing on the file at `path`, and flush it
+ * to the disk. Names and contents are written at their place through
+ * streams of their own.
+ * Returns 0 on success, -1 on error.
+ */
+
+int _image_write(fs_snapshot_t *snap, image_hdr_t *hdr, FILE *f, const char *path) {
+    image_writer_t w;
+    int ret = 0;
+
+    memset(&w, 0, sizeof(image_writer_t));
+    w.recs = f;
+    w.names = fopen(path, "r+");
+    w.contents = fopen(path, "r+");
+    w.name_off = hdr->names;
+    w.empty = hdr->contents;
+    w.content_off = hdr->contents + 1;
+
+    if (w.names == NULL || w.contents == NULL || fwrite(hdr, sizeof(image_hdr_t), 1, f) != 1 ||
+        fseeko(w.names, (off_t) hdr->names, SEEK_SET) != 0 ||
+        fseeko(w.contents, (off_t) hdr->contents, SEEK_SET) != 0 || fputc('\0', w.contents) == EOF)
+        ret = -1;
+
+    if (ret == 0) {
+        _image_walk(snap, &w);
+        // The snapshot doesn't change, neither can what was measured
+        if (ferror(f) || ferror(w.names) || ferror(w.contents) || w.nrec != hdr->nnodes ||
+            w.content_off != hdr->size)
+            ret = -1;
+    }
+
+    if (w.names != NULL && fclose(w.names) != 0)
+        ret = -1;
+    if (w.contents != NULL && fclose(w.contents) != 0)
+        ret = -1;
+    if (ret == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0))
+        ret = -1;
+    return ret;
+}
+
+/*
+ * (Internal) Hand every node seen by `snap` to `_image_put`, depth
+ * first, parents before their children.
+ */
+
+void _image_walk(fs_snapshot_t *snap, image_writer_t *w) {
+    image_frame_t stack[256];
+    image_frame_t *f;
+    fs_node_t *child;
+    ht_t *children;
+    uint32_t rec;
+    int top = 0;
+
+    _image_put(w, snap, snap->root, 0);
+    stack[0].children = _ramfs_snap_children(snap, snap->root);
+    stack[0].next = 0;
+    stack[0].rec = 0;
+
+    while (top >= 0) {
+        f = &stack[top];
+        children = f->children;
+
+        while (f->next < children->size && children->body[f->next].key == NULL)
+            f->next++;
+        if (f->next >= children->size) {
+            top--;
+            continue;
+        }
+        child = children->body[f->next++].val;
+
+        rec = (uint32_t) w->nrec;
+        _image_put(w, snap, child, f->rec);
+        if (child->type != TYPE_DIR)
+            continue;
+        children = _ramfs_snap_children(snap, child);
+        if (children->used == 0)
+            continue;
+
+        top++;
+        stack[top].children = children;
+        stack[top].next = 0;
+        stack[top].rec = rec;
+    }
+}
+
+/*
+ * (Internal) Add the record of `node`, as seen by `snap`, whose
+ * parent is record `parent`, and its name and content, to the image
+ * written by `w`, or only count them if `w` has no streams.
+ */
+
+void _image_put(image_writer_t *w, fs_snapshot_t *snap, fs_node_t *node, uint32_t parent) {
+    image_node_t rec;
+    char *content = NULL;
+    uint32_t size = 0;
+    size_t nlen = 0;
+
+    memset(&rec, 0, sizeof(image_node_t));
+    rec.parent = parent;
+    rec.type = (uint8_t) node->type;
+    if (node->parent != NULL) {
+        nlen = strlen(node->name);
+        rec.name = w->name_off;
+        w->name_off += nlen + 1;
+    }
+    if (node->type == TYPE_DIR) {
+        rec.size = (uint32_t) _ramfs_snap_children(snap, node)->used;
+        w->ndirs += node->parent != NULL;
+    } else {
+        content = _ramfs_snap_content(snap, node, &size);
+        rec.size = size;
+        // Empty files share the content at the start of the contents
+        rec.content = w->empty;
+        if (size > 0) {
+            rec.content = w->content_off;
+            w->content_off += (uint64_t) size + 1;
+        }
+        w->bytes += size;
+    }
+    w->nrec++;
+
+    if (w->recs == NULL)
+        return;
+    fwrite(&rec, sizeof(image_node_t), 1, w->recs);
+    if (nlen > 0)
+        fwrite(node->name, 1, nlen + 1, w->names);
+    if (size > 0) {
+        fwrite(content, 1, size, w->contents);
+        fputc('\0', w->contents);
+    }
+}
+
+/*
+ * Loads the file system saved by `image_save` at `path`. The image is
+ * mapped, not read: names and contents are used where they are, and
+ * a content is only copied when it is replaced, so that contents
+ * never looked at are never read from the disk. Only the nodes and
+ * the name index are built. The image must not change until the file
+ * system is destroyed.
+ * Returns the new root, or NULL with errno set if the image can't be
+ * read or is not valid.
+ */
+
+fs_node_t *image_load(const char *path) {
+    struct stat st;
+    fs_node_t *root;
+    fs_meta_t *meta;
+    char *base;
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    // Too short for a header
+    errno = EINVAL;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(image_hdr_t)) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (_image_check(base, (size_t) st.st_size) != 0) {
+        munmap(base, (size_t) st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // The mapping goes away with the file system
+    root = ramfs_mkfs();
+    meta = FS_DIR(root)->meta;
+    meta->image = base;
+    meta->image_len = (size_t) st.st_size;
+    meta->journal_seq = ((image_hdr_t *) base)->seq;
+    if (_image_build(root, base) != 0) {
+#ifdef DEBUG
+        fprintf(stderr, "load %s failed: invalid tree\n", path);
+#endif
+        _ramfs_rmnode_r(root, 0);
+        _ramfs_rmnode(root, 0);
+        errno = EINVAL;
+        return NULL;
+    }
+    return root;
+}
+
+/*
+ * (Internal) Check that the `size` bytes at `base` are an image that
+ * can be loaded: every offset must be inside the part it belongs to,
+ * every parent a directory coming earlier, and every string must end
+ * where it should. Names are checked while loading.
+ * Returns 0 if they are, -1 otherwise.
+ */
+
+int _image_check(const char *base, size_t size) {
+    const image_hdr_t *hdr = (const image_hdr_t *) base;
+    const image_node_t *recs = (const image_node_t *) (base + sizeof(image_hdr_t));
+    const image_node_t *rec;
+    uint64_t ndirs = 0;
+
+    if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != IMAGE_VERSION ||
+        hdr->order != 0x01020304 || hdr->size != size || hdr->records != sizeof(image_hdr_t))
+        return -1;
+    if (hdr->nnodes == 0 || hdr->nnodes > UINT32_MAX || hdr->names < hdr->records ||
+        hdr->names - hdr->records != hdr->nnodes * sizeof(image_node_t) ||
+        hdr->contents < hdr->names || hdr->contents >= size)
+        return -1;
+    // Strings can't run past the end of their part
+    if (base[size - 1] != '\0' || base[hdr->contents] != '\0' ||
+        (hdr->contents > hdr->names && base[hdr->contents - 1] != '\0'))
+        return -1;
+    if (recs[0].type != TYPE_DIR || recs[0].size > MAX_CHILDREN)
+        return -1;
+
+    for (uint64_t i = 1; i < hdr->nnodes; i++) {
+        rec = &recs[i];
+        if (rec->parent >= i || recs[rec->parent].type != TYPE_DIR || rec->type > TYPE_FILE ||
+            rec->name < hdr->names || rec->name >= hdr->contents)
+            return -1;
+        // Offsets come from the file, adding them up could wrap around
+        if (rec->type == TYPE_FILE && (rec->content < hdr->contents || rec->content >= size ||
+                                       rec->size >= size - rec->content ||
+                                       base[rec->content + rec->size] != '\0'))
+            return -1;
+        if (rec->type == TYPE_DIR && rec->size > MAX_CHILDREN)
+            return -1;
+        ndirs += rec->type == TYPE_DIR;
+    }
+    return ndirs == hdr->ndirs ? 0 : -1;
+}
+
+/*
+ * (Internal) Add the nodes of the image at `base`, already checked,
+ * to the empty file system of `root`. They keep pointing to their
+ * name and content in the image, and are all allocated at once, in
+ * the order of the image.
+ * Returns 0 on success, -1 if the image breaks the limits on names,
+ * depth or children, or has two nodes with the same path: the nodes
+ * added so far are left in the file system then.
+ */
+
+int _image_build(fs_node_t *root, char *base) {
+    const image_hdr_t *hdr = (const image_hdr_t *) base;
+    const image_node_t *recs = (const image_node_t *) (base + hdr->records);
+    const image_node_t *rec;
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_node_t **nodes = malloc_or_die(hdr->nnodes * sizeof(fs_node_t *));
+    fs_node_t *node, *parent;
+    char *next;
+    uint32_t pos[FS_BLOOM_HASHES];
+    size_t nlen;
+    uint64_t n, i;
+    int ret = 0;
+
+    meta->arena_len = hdr->ndirs * sizeof(fs_dir_node_t) + (hdr->nnodes - 1 - hdr->ndirs) * sizeof(fs_node_t);
+    meta->arena = next = meta->arena_len > 0 ? calloc_or_die(1, meta->arena_len) : NULL;
+    _image_huge(meta->arena, meta->arena_len);
+    nodes[0] = root;
+    _image_size(root, recs[0].size);
+    for (n = 1; n < hdr->nnodes; n++) {
+        rec = &recs[n];
+        parent = nodes[rec->parent];
+        nlen = strlen(base + rec->name);
+        if (nlen == 0 || nlen > MAX_NAME_LENGTH || (uint8_t) (parent->depth + 1) == 0 ||
+            parent->data.children->used >= MAX_CHILDREN) {
+            ret = -1;
+            break;
+        }
+
+        node = (fs_node_t *) next;
+        next += rec->type == TYPE_DIR ? sizeof(fs_dir_node_t) : sizeof(fs_node_t);
+        node->parent = parent;
+        node->name = base + rec->name;
+        node->type = (fs_node_type_t) rec->type;
+        node->depth = (uint8_t) (parent->depth + 1);
+        if (node->type == TYPE_DIR) {
+            node->data.children = ht_new();
+            _image_size(node, rec->size);
+            FS_DIR(node)->meta = meta;
+            pthread_rwlock_init(&FS_DIR(node)->lock, NULL);
+        } else {
+            node->data.content = base + rec->content;
+            node->size = rec->size;
+        }
+
+        if (ht_setitem(parent->data.children, node->name, node) != 0) {
+            if (node->type == TYPE_DIR) {
+                ht_del(node->data.children);
+                pthread_rwlock_destroy(&FS_DIR(node)->lock);
+            }
+            ret = -1;
+            break;
+        }
+        _ramfs_index_add(meta, node);
+        meta->bytes += node->size;
+        nodes[n] = node;
+    }
+
+    // Count the nodes and names below every directory, children first,
+    // like adding them one by one would
+    for (i = n; i-- > 1;) {
+        node = nodes[i];
+        parent = node->parent;
+        _ramfs_bloom_pos(node->name, pos);
+        _ramfs_bloom_add(parent, pos);
+        FS_DIR(parent)->nodes++;
+        if (node->type == TYPE_DIR) {
+            FS_DIR(parent)->nodes += FS_DIR(node)->nodes;
+            _ramfs_bloom_merge(parent, node);
+        }
+    }
+
+    free(nodes);
+    return ret;
+}
+
+/*
+ * (Internal) Grow the children table of the empty directory `dir`
+ * to the size it would have once `nchildren` were added one by one,
+ * so that it is never grown while they are.
+ */
+
+void _image_size(fs_node_t *dir, uint32_t nchildren) {
+    ht_t *children = dir->data.children;
+    size_t size = children->size;
+
+    while ((float) nchildren / (float) size > 0.8)
+        size *= 2;
+    if (size != children->size)
+        ht_grow(children, size);
+}
+// end:definitions
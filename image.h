@@ -0,0 +1,116 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_IMAGE_H
+#define API_RAMFS_IMAGE_H
+
+// start:includes
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ramfs.h"
+// end:includes
+
+// start:macros
+#define IMAGE_MAGIC   "RAMFSIMG"
+#define IMAGE_VERSION 2
+// Commands between two checks for the end of a background save
+#define IMAGE_BGSAVE_POLL 1024
+// Longest a server waits for commands while a background save runs
+#define IMAGE_BGSAVE_POLL_MS 100
+// end:macros
+
+// start:datatypes
+// An image starts with this header, followed by one record per node,
+// then by the names and then by the contents, so that loading it only
+// reads the first two. Everything is referenced by offset from the
+// start of the file, and can be used wherever the file is mapped.
+typedef struct _image_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;     // 0x01020304 as written, tells the byte order apart
+    uint64_t nnodes;    // records, the root included
+    uint64_t ndirs;     // directory records, the root excluded
+    uint64_t records;   // offset of the first record
+    uint64_t names;
+    uint64_t contents;  // starts with the empty content, shared by empty files
+    uint64_t size;      // of the whole image
+    uint64_t bytes;     // content of all the files
+    uint64_t seq;       // last journal record it includes, see journal.h
+} image_hdr_t;
+
+// A node. Records are in depth-first order, so parents always come
+// before their children; the root is record 0. Names and contents
+// are terminated by a NUL not counted in `size`.
+typedef struct _image_node {
+    uint64_t name;      // offset of the name, 0 for the root
+    uint64_t content;   // offset of the content, files only
+    uint32_t parent;    // record of the parent directory
+    uint32_t size;      // content length, or children of a directory
+    uint8_t type;       // fs_node_type_t
+    char pad[7];
+} image_node_t;
+
+// Directory being written by `image_save`
+typedef struct _image_frame {
+    ht_t *children;     // its table as seen by the snapshot
+    size_t next;
+    uint32_t rec;
+} image_frame_t;
+
+// Where `image_save` writes records, names and contents, and how far
+// each of them got. Without streams it only measures them.
+typedef struct _image_writer {
+    FILE *recs;
+    FILE *names;
+    FILE *contents;
+    uint64_t nrec;
+    uint64_t ndirs;
+    uint64_t name_off;
+    uint64_t content_off;
+    uint64_t empty;     // offset of the empty content
+    uint64_t bytes;
+} image_writer_t;
+
+// Background saves of a file system, see `image_bgsave`. At most one
+// runs at a time.
+typedef struct _image_bgsave {
+    pid_t pid;          // of the child writing the image, 0 if none
+    char *path;
+    uint64_t seq;       // last journal record in the image
+    uint64_t start_ns;
+    long minflt;        // page faults taken here before it started
+    uint64_t commands;  // run meanwhile, see `image_bgsave_tick`
+
+    uint64_t saves;
+    uint64_t failed;
+    uint64_t fork_ns;
+    uint64_t save_ns;
+    uint64_t faults;    // taken here during the saves, mostly pages copied
+    uint64_t child_faults;
+    uint64_t busy_commands; // run during the saves
+} image_bgsave_t;
+// end:datatypes
+
+// start:declarations
+int        image_save(fs_node_t *root, const char *path);
+fs_node_t *image_load(const char *path);
+int        image_bgsave(fs_node_t *root, const char *path);
+uint8_t    image_bgsave_poll(fs_node_t *root, uint8_t wait);
+void       image_bgsave_tick(fs_node_t *root);
+void       image_bgsave_print_stats(fs_node_t *root, FILE *stream);
+
+int      _image_save(fs_snapshot_t *snap, const char *path);
+void     _image_huge(char *p, size_t len);
+long     _image_minflt();
+
+void     _image_walk(fs_snapshot_t *snap, image_writer_t *w);
+void     _image_put(image_writer_t *w, fs_snapshot_t *snap, fs_node_t *node, uint32_t parent);
+int      _image_write(fs_snapshot_t *snap, image_hdr_t *hdr, FILE *f, const char *path);
+int      _image_check(const char *base, size_t size);
+int      _image_build(fs_node_t *root, char *base);
+void     _image_size(fs_node_t *dir, uint32_t nchildren);
+// end:declarations
+
+#endif //API_RAMFS_IMAGE_H
@@ -0,0 +1,615 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "image.h"
+// end:includes
+
+// start:definitions
+// Write-ahead journal of a file system. Records are buffered as
+// commands are logged, and written out, and flushed to the disk
+// depending on the policy, once per batch of commands.
+
+/*
+ * Opens the journal at `path` for the file system of `root`, creating
+ * it if missing, after applying again the operations it has that the
+ * file system doesn't: those logged after the image it was loaded
+ * from, see `image_load`. A torn record at the end, left by a crash,
+ * is dropped along with whatever follows it. The operations logged
+ * from then on are flushed to the disk according to `sync`, at most
+ * every `window_ms` with JOURNAL_SYNC_WINDOW. With `image`, the
+ * journal is compacted into a new image at that path once it grows
+ * too large. Only one thread may use the file system meanwhile.
+ * Returns the journal, or NULL with errno set if it can't be used,
+ * EINVAL if it is not a journal or doesn't follow the file system.
+ */
+
+journal_t *journal_open(fs_node_t *root, const char *path, const char *image, journal_sync_t sync,
+                        uint64_t window_ms) {
+    fs_meta_t *meta = _ramfs_meta(root);
+    const journal_hdr_t *hdr;
+    struct stat st;
+    journal_t *j;
+    uint64_t nrec = 0;
+    size_t size, valid;
+    char *base;
+    int fd, err;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    size = (size_t) st.st_size;
+
+    j = calloc_or_die(1, sizeof(journal_t));
+    j->root = root;
+    j->path = malloc_or_die(strlen(path) + 1);
+    strcpy(j->path, path);
+    j->fd = fd;
+    j->image = image;
+    j->sync = sync;
+    j->window_ns = window_ms * 1000000;
+    strbuf_init(&j->buf);
+    j->synced_ns = now_ns();
+    j->compact_at = JOURNAL_COMPACT_SIZE;
+    if (image != NULL && stat(image, &st) == 0 && (uint64_t) st.st_size > j->compact_at)
+        j->compact_at = (uint64_t) st.st_size;
+
+    err = 0;
+    if (size > 0 && size < sizeof(journal_hdr_t)) {
+        err = EINVAL;
+    } else if (size > 0) {
+        if ((base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            err = errno;
+        } else {
+            hdr = (const journal_hdr_t *) base;
+            // Records older than the file system are skipped, but
+            // none can be missing
+            if (memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0 ||
+                hdr->version != JOURNAL_VERSION || hdr->order != 0x01020304 ||
+                (hdr->base > meta->journal_seq + 1 && size > sizeof(journal_hdr_t))) {
+                err = EINVAL;
+            } else {
+                j->base = hdr->base;
+                valid = _journal_replay(j, base, size, &nrec);
+                j->dropped = size - valid;
+                j->size = valid;
+            }
+            munmap(base, size);
+        }
+    }
+
+    // Start over if the file system already has every record, so that
+    // the next one gets the number that follows
+    if (err == 0 && (nrec == 0 || meta->journal_seq != j->base + nrec - 1) &&
+        _journal_reset(j, meta->journal_seq + 1, j->size) != 0)
+        err = errno;
+    else if (err == 0 && j->dropped > 0 && (ftruncate(j->fd, (off_t) j->size) != 0 || fdatasync(j->fd) != 0))
+        err = errno;
+
+    if (err != 0) {
+        close(j->fd);
+        free(j->path);
+        free(j);
+        errno = err;
+        return NULL;
+    }
+    meta->journal = j;
+    return j;
+}
+
+/*
+ * Logs operation `op` on `path` to journal `j`, before it is applied.
+ * `content` and `len` are the content of a write. The record is only
+ * buffered: it is written by the next `journal_commit`, which must not
+ * be called before the operation succeeded or was cancelled.
+ * Returns the mark to give to `journal_cancel` if it fails.
+ */
+
+size_t journal_log(journal_t *j, fs_txn_op_t op, const char *path, const char *content, size_t len) {
+    size_t mark;
+
+    if (j->buf.len >= JOURNAL_BUFFER_SIZE)
+        _journal_flush(j, 0);
+    mark = j->buf.len;
+    _journal_put(j, (uint8_t) op, path, strlen(path), content, op == TXN_WRITE ? len : 0);
+    _journal_seal(j, mark);
+    _ramfs_meta(j->root)->journal_seq++;
+    j->pending++;
+    j->logged++;
+    return mark;
+}
+
+/*
+ * Logs the operations of batch `txn` to journal `j` as a single record,
+ * before it is committed, like `journal_log`. The batch is applied
+ * again as a whole, or not at all if the record is torn.
+ * Returns the mark to give to `journal_cancel` if it fails.
+ */
+
+size_t journal_log_txn(journal_t *j, fs_txn_t *txn) {
+    fs_txn_item_t *item;
+    size_t mark, start;
+    uint32_t clen;
+
+    if (j->buf.len >= JOURNAL_BUFFER_SIZE)
+        _journal_flush(j, 0);
+    mark = j->buf.len;
+    _journal_put(j, JOURNAL_OP_BATCH, NULL, 0, NULL, 0);
+    start = j->buf.len;
+    for (size_t i = 0; i < txn->count; i++) {
+        item = &txn->items[i];
+        _journal_put(j, (uint8_t) item->op, item->path, strlen(item->path), item->content,
+                     item->op == TXN_WRITE ? item->len : 0);
+    }
+    clen = (uint32_t) (j->buf.len - start);
+    memcpy(j->buf.data + mark + offsetof(journal_rec_t, clen), &clen, sizeof(clen));
+    _journal_seal(j, mark);
+    _ramfs_meta(j->root)->journal_seq++;
+    j->pending++;
+    j->logged++;
+    return mark;
+}
+
+/*
+ * Removes from journal `j` the record logged at `mark`, the last one,
+ * because its operation failed.
+ */
+
+void journal_cancel(journal_t *j, size_t mark) {
+    j->buf.len = mark;
+    _ramfs_meta(j->root)->journal_seq--;
+    j->pending--;
+    j->logged--;
+}
+
+/*
+ * Writes the records logged to journal `j` since the last call, and
+ * flushes them to the disk if its policy says so, then compacts it if
+ * needed. Front-ends call it before sending the replies of the
+ * commands logged meanwhile. The process exits if the journal can't
+ * be written, as the replies would claim what it can't promise.
+ */
+
+void journal_commit(journal_t *j) {
+    uint8_t sync = 0;
+
+    if (j->pending > 0)
+        j->commits++;
+    if (j->sync == JOURNAL_SYNC_BATCH)
+        sync = 1;
+    else if (j->sync == JOURNAL_SYNC_WINDOW)
+        sync = (uint8_t) (now_ns() - j->synced_ns >= j->window_ns);
+    _journal_flush(j, sync);
+    j->pending = 0;
+
+    if (j->image != NULL && !j->compacting && j->size >= j->compact_at)
+        _journal_compact(j);
+}
+
+/*
+ * Returns the milliseconds left before journal `j` has to be flushed
+ * to the disk by `journal_commit`, or -1 if it doesn't have to.
+ */
+
+int journal_timeout(journal_t *j) {
+    uint64_t elapsed;
+
+    if (!j->dirty || j->sync != JOURNAL_SYNC_WINDOW)
+        return -1;
+    elapsed = now_ns() - j->synced_ns;
+    if (elapsed >= j->window_ns)
+        return 0;
+    return (int) ((j->window_ns - elapsed + 999999) / 1000000);
+}
+
+/*
+ * Writes and flushes to the disk what is left of journal `j`, then
+ * closes and frees it.
+ */
+
+void journal_close(journal_t *j) {
+    if (j->compacting)
+        image_bgsave_poll(j->root, 1);
+    _journal_flush(j, 1);
+    _ramfs_meta(j->root)->journal = NULL;
+    close(j->fd);
+    strbuf_free(&j->buf);
+    free(j->path);
+    free(j);
+}
+
+/*
+ * Print what journal `j` did to `stream`.
+ */
+
+void journal_print_stats(journal_t *j, FILE *stream) {
+    fprintf(stream, "journal: %lu records logged, %lu commits, %lu syncs (%.3f ms avg)\n",
+            (unsigned long) j->logged, (unsigned long) j->commits,
+            (unsigned long) j->syncs, j->syncs > 0 ? (double) j->sync_ns / 1e6 / (double) j->syncs : 0.0);
+    if (j->compactions > 0)
+        fprintf(stream, "  %lu compactions\n", (unsigned long) j->compactions);
+}
+
+/*
+ * (Internal) Append a record of operation `op` on the `plen` bytes at
+ * `path` with the `clen` bytes at `content` to the buffer of `j`,
+ * unchecked.
+ */
+
+void _journal_put(journal_t *j, uint8_t op, const char *path, size_t plen, const char *content, size_t clen) {
+    journal_rec_t rec;
+
+    memset(&rec, 0, sizeof(journal_rec_t));
+    rec.plen = (uint32_t) plen;
+    rec.clen = (uint32_t) clen;
+    rec.op = op;
+    strbuf_reserve(&j->buf, sizeof(journal_rec_t) + plen + clen);
+    strbuf_append(&j->buf, (const char *) &rec, sizeof(journal_rec_t));
+    if (plen > 0)
+        strbuf_append(&j->buf, path, plen);
+    if (clen > 0)
+        strbuf_append(&j->buf, content, clen);
+}
+
+/*
+ * (Internal) Set the check of the record at `mark` in the buffer of `j`,
+ * the last one.
+ */
+
+void _journal_seal(journal_t *j, size_t mark) {
+    uint32_t check = hash(j->buf.data + mark + sizeof(check), j->buf.len - mark - sizeof(check));
+
+    memcpy(j->buf.data + mark, &check, sizeof(check));
+}
+
+/*
+ * (Internal) Apply to the file system of `j` the records of the
+ * `size` bytes of journal at `base` it doesn't have yet. Their number
+ * is stored into `nrec`.
+ * Returns the length of the journal up to the first record that is
+ * torn or not valid.
+ */
+
+size_t _journal_replay(journal_t *j, const char *base, size_t size, uint64_t *nrec) {
+    fs_meta_t *meta = _ramfs_meta(j->root);
+    size_t pos = sizeof(journal_hdr_t);
+    size_t len;
+    uint64_t seq = j->base;
+    strbuf_t scratch;
+    fs_txn_t txn;
+
+    strbuf_init(&scratch);
+    ramfs_txn_init(&txn);
+    while ((len = _journal_next(base + pos, size - pos, 1)) > 0) {
+        if (seq > meta->journal_seq) {
+            _journal_apply(j->root, &scratch, base + pos, &txn);
+            meta->journal_seq = seq;
+            j->replayed++;
+        }
+        seq++;
+        pos += len;
+    }
+    strbuf_free(&scratch);
+    ramfs_txn_clear(&txn);
+    *nrec = seq - j->base;
+    return pos;
+}
+
+/*
+ * (Internal) Check that the `len` bytes at `data` start with a whole
+ * record, and that its check matches if `checked`. The records in a
+ * batch are checked as well, and can't be batches themselves.
+ * Returns the length of the record, or 0 if there is no valid one.
+ */
+
+size_t _journal_next(const char *data, size_t len, uint8_t checked) {
+    journal_rec_t rec;
+    size_t total, pos, n;
+
+    if (len < sizeof(journal_rec_t))
+        return 0;
+    memcpy(&rec, data, sizeof(journal_rec_t));
+    total = sizeof(journal_rec_t) + (size_t) rec.plen + (size_t) rec.clen;
+    if (total > len || (rec.op > TXN_DELETE_R && (rec.op != JOURNAL_OP_BATCH || !checked)) ||
+        (rec.op != TXN_WRITE && rec.op != JOURNAL_OP_BATCH && rec.clen > 0))
+        return 0;
+    if (checked && hash(data + sizeof(rec.check), total - sizeof(rec.check)) != rec.check)
+        return 0;
+
+    if (rec.op == JOURNAL_OP_BATCH) {
+        data += sizeof(journal_rec_t) + rec.plen;
+        for (pos = 0; pos < rec.clen; pos += n)
+            if ((n = _journal_next(data + pos, rec.clen - pos, 0)) == 0)
+                return 0;
+    }
+    return total;
+}
+
+/*
+ * (Internal) Apply the operation of the valid record at `data` to the
+ * file system of `root`, as it was when logged. Paths are copied to
+ * `scratch`, as the file system tokenizes them, and the operations
+ * of a batch are committed through `txn`.
+ */
+
+void _journal_apply(fs_node_t *root, strbuf_t *scratch, const char *data, fs_txn_t *txn) {
+    journal_rec_t rec;
+    const char *content;
+    char *copy;
+
+    memcpy(&rec, data, sizeof(journal_rec_t));
+    content = data + sizeof(journal_rec_t) + rec.plen;
+    if (rec.op == JOURNAL_OP_BATCH) {
+        for (size_t pos = 0; pos < rec.clen;) {
+            journal_rec_t item;
+            memcpy(&item, content + pos, sizeof(journal_rec_t));
+            pos += sizeof(journal_rec_t);
+            strbuf_reset(scratch);
+            strbuf_reserve(scratch, (size_t) item.plen + 1);
+            strbuf_append(scratch, content + pos, item.plen);
+            strbuf_append(scratch, "", 1);
+            pos += item.plen;
+            copy = NULL;
+            if (item.op == TXN_WRITE) {
+                copy = malloc_or_die((size_t) item.clen + 1);
+                memcpy(copy, content + pos, item.clen);
+            }
+            pos += item.clen;
+            ramfs_txn_add(txn, (fs_txn_op_t) item.op, scratch->data, copy, item.clen);
+        }
+        ramfs_txn_commit(root, txn);
+        return;
+    }
+
+    strbuf_reset(scratch);
+    strbuf_reserve(scratch, (size_t) rec.plen + 1);
+    strbuf_append(scratch, data + sizeof(journal_rec_t), rec.plen);
+    strbuf_append(scratch, "", 1);
+    switch (rec.op) {
+        case TXN_CREATE:
+            ramfs_create(root, scratch->data);
+            break;
+        case TXN_CREATE_DIR:
+            ramfs_create_dir(root, scratch->data);
+            break;
+        case TXN_WRITE:
+            ramfs_write_n(root, scratch->data, (char *) content, rec.clen);
+            break;
+        case TXN_DELETE:
+            ramfs_delete(root, scratch->data);
+            break;
+        case TXN_DELETE_R:
+            ramfs_delete_r(root, scratch->data);
+            break;
+    }
+}
+
+/*
+ * (Internal) Replace the journal of `j` with one whose first record is
+ * number `base`, holding the records of the old one from offset `from`
+ * on, if any. The new journal is written next to the old one and
+ * moved over it, so a crash leaves either of them.
+ * Returns 0 on success, -1 on error, with errno set.
+ */
+
+int _journal_reset(journal_t *j, uint64_t base, uint64_t from) {
+    journal_hdr_t hdr;
+    size_t len = strlen(j->path);
+    char *tmp = malloc_or_die(len + sizeof(".tmp"));
+    int fd, err = 0;
+
+    memcpy(tmp, j->path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+    memset(&hdr, 0, sizeof(journal_hdr_t));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.order = 0x01020304;
+    hdr.base = base;
+
+    errno = 0;
+    // Read as well by the next compaction, see `_journal_copy`
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        err = errno;
+    } else if (write(fd, &hdr, sizeof(journal_hdr_t)) != sizeof(journal_hdr_t) ||
+               _journal_copy(j->fd, fd, from, j->size - from) != 0 || fdatasync(fd) != 0 ||
+               rename(tmp, j->path) != 0) {
+        // A short write leaves errno alone
+        err = errno != 0 ? errno : EIO;
+        close(fd);
+        unlink(tmp);
+    } else {
+        close(j->fd);
+        j->fd = fd;
+        j->base = hdr.base;
+        j->size = sizeof(journal_hdr_t) + j->size - from;
+        j->dirty = 0;
+        // The new journal is in use either way, only the rename may
+        // not survive a crash yet
+        if (_journal_sync_dir(j->path) != 0)
+            err = errno;
+    }
+
+    free(tmp);
+    errno = err;
+    return err != 0 ? -1 : 0;
+}
+
+/*
+ * (Internal) Flush to the disk the directory holding `path`, so that
+ * a file renamed to it is still there after a crash.
+ * Returns 0 on success, -1 on error, with errno set.
+ */
+
+int _journal_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash == NULL ? 0 : slash == path ? 1 : (size_t) (slash - path);
+    char *dir = malloc_or_die(len + 2);
+    int fd, ret = -1;
+
+    if (len == 0)
+        dir[len++] = '.';
+    else
+        memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        int err;
+        ret = fsync(fd);
+        err = errno;
+        close(fd);
+        errno = err;
+    }
+    free(dir);
+    return ret;
+}
+
+/*
+ * (Internal) Copy the `len` bytes at offset `off` of the file open as
+ * `src` to the end of the one open as `dst`.
+ * Returns 0 on success, -1 on error, with errno set.
+ */
+
+int _journal_copy(int src, int dst, uint64_t off, uint64_t len) {
+    char *buf = malloc_or_die(JOURNAL_BUFFER_SIZE);
+    ssize_t n = 0;
+    uint64_t done = 0;
+    size_t put;
+
+    while (done < len) {
+        n = pread(src, buf, len - done < JOURNAL_BUFFER_SIZE ? (size_t) (len - done) : JOURNAL_BUFFER_SIZE,
+                  (off_t) (off + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (put = 0; put < (size_t) n;) {
+            ssize_t w = write(dst, buf + put, (size_t) n - put);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0)
+                break;
+            put += (size_t) w;
+        }
+        if (put < (size_t) n)
+            break;
+        done += (uint64_t) n;
+    }
+
+    free(buf);
+    if (done < len && n == 0)
+        errno = EIO;
+    return done < len ? -1 : 0;
+}
+
+/*
+ * (Internal) Start saving the file system of `j` to its image in the
+ * background, see `image_bgsave`. The journal goes on meanwhile, and
+ * is only cut once the image is complete, see `_journal_saved`. If a
+ * save is running already it is tried again at the next commit.
+ */
+
+void _journal_compact(journal_t *j) {
+    if (image_bgsave(j->root, j->image) != 0) {
+        if (errno != EBUSY)
+            j->compact_at = j->size * 2;
+#ifdef DEBUG
+        fprintf(stderr, "journal %s: compaction into %s failed: %s\n", j->path, j->image, strerror(errno));
+#endif
+        return;
+    }
+    // Every record logged so far was written out before the fork
+    j->compacting = 1;
+    j->compact_off = j->size;
+}
+
+/*
+ * (Internal) Called when a background save of the file system of `j`
+ * whose last record is number `seq` is over, successfully if `ok`. If
+ * it was the compaction of `j`, the records the image has are dropped
+ * from the journal, which is compacted again once it is as large as
+ * the image. If anything fails, it is tried again once the journal
+ * doubled.
+ */
+
+void _journal_saved(journal_t *j, uint64_t seq, uint8_t ok) {
+    struct stat st;
+
+    if (!j->compacting)
+        return;
+    j->compacting = 0;
+    // The records logged meanwhile are copied from the file
+    _journal_flush(j, 0);
+    if (!ok || _journal_reset(j, seq + 1, j->compact_off) != 0) {
+#ifdef DEBUG
+        fprintf(stderr, "journal %s: compaction into %s failed\n", j->path, j->image);
+#endif
+        j->compact_at = j->size * 2;
+        return;
+    }
+    j->compactions++;
+    j->compact_at = JOURNAL_COMPACT_SIZE;
+    if (stat(j->image, &st) == 0 && (uint64_t) st.st_size > j->compact_at)
+        j->compact_at = (uint64_t) st.st_size;
+}
+
+/*
+ * (Internal) Write the buffered records of `j` at the end of the
+ * journal, then flush it to the disk if `sync` and anything wasn't.
+ */
+
+void _journal_flush(journal_t *j, uint8_t sync) {
+    size_t off = 0;
+    ssize_t n;
+    uint64_t start;
+
+    while (off < j->buf.len) {
+        n = pwrite(j->fd, j->buf.data + off, j->buf.len - off, (off_t) (j->size + off));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            _journal_die(j);
+        off += (size_t) n;
+    }
+    if (off > 0) {
+        j->size += off;
+        j->dirty = 1;
+    }
+    strbuf_reset(&j->buf);
+    strbuf_shrink(&j->buf, JOURNAL_BUFFER_SIZE);
+
+    if (sync && j->dirty) {
+        start = now_ns();
+        if (fdatasync(j->fd) != 0)
+            _journal_die(j);
+        j->synced_ns = now_ns();
+        j->sync_ns += j->synced_ns - start;
+        j->syncs++;
+        j->dirty = 0;
+    }
+}
+
+/*
+ * (Internal) Exit because journal `j` can't be written.
+ */
+
+void _journal_die(journal_t *j) {
+    fprintf(stderr, "journal %s: %s\n", j->path, strerror(errno));
+    exit(4);
+}
+// end:definitions
@@ -0,0 +1,113 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_JOURNAL_H
+#define API_RAMFS_JOURNAL_H
+
+// start:includes
+#include <stdio.h>
+#include <stdint.h>
+#include "ramfs.h"
+#include "utils.h"
+// end:includes
+
+// start:macros
+#define JOURNAL_MAGIC   "RAMFSJNL"
+#define JOURNAL_VERSION 1
+// Record holding the operations of a committed batch
+#define JOURNAL_OP_BATCH 0xff
+// Replies wait for the records of at most this many commands
+#define JOURNAL_BATCH 256
+// Records buffered past this size are written out right away
+#define JOURNAL_BUFFER_SIZE (1 << 20)
+// A journal is compacted into its image once past this size, and
+// larger than the image
+#define JOURNAL_COMPACT_SIZE (64 << 20)
+// end:macros
+
+// start:datatypes
+// When records written to the journal are flushed to the disk
+typedef enum _journal_sync {
+    JOURNAL_SYNC_BATCH,     // before the replies of each batch are sent
+    JOURNAL_SYNC_WINDOW,    // at most once per window
+    JOURNAL_SYNC_NONE       // whenever the kernel sees fit
+} journal_sync_t;
+
+// A journal starts with this header, followed by the records of the
+// operations applied since the image it follows was saved, in order.
+// Each record has the next sequence number.
+typedef struct _journal_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;     // 0x01020304 as written, tells the byte order apart
+    uint64_t base;      // sequence number of the first record
+} journal_hdr_t;
+
+// An operation, followed by its path and its content, not terminated.
+// A batch has the records of its operations as content, unchecked.
+typedef struct _journal_rec {
+    uint32_t check;     // hash of the rest of the record
+    uint32_t plen;
+    uint32_t clen;
+    uint8_t op;         // fs_txn_op_t, or JOURNAL_OP_BATCH
+    char pad[3];
+} journal_rec_t;
+
+// Append-only log of the writes applied to a file system, so that
+// they can be applied again after a crash. Front-ends log operations
+// before running them, cancel the ones that failed, and commit the
+// journal before sending the replies of those that didn't.
+typedef struct _journal {
+    fs_node_t *root;
+    char *path;
+    int fd;
+    const char *image;  // compacted into, NULL if none
+    journal_sync_t sync;
+    uint64_t window_ns;
+    strbuf_t buf;       // records not written yet
+    unsigned int pending;   // commands logged since the last commit
+    uint64_t base;
+    uint64_t size;      // written so far
+    uint64_t compact_at;
+    uint8_t compacting;     // into an image saved in the background
+    uint64_t compact_off;   // of the first record not in that image
+    uint8_t dirty;      // written but not synced
+    uint64_t synced_ns;
+
+    uint64_t logged;
+    uint64_t replayed;
+    uint64_t dropped;   // bytes after the last complete record
+    uint64_t commits;
+    uint64_t syncs;
+    uint64_t sync_ns;
+    uint64_t compactions;
+} journal_t;
+// end:datatypes
+
+// start:declarations
+journal_t *journal_open(fs_node_t *root, const char *path, const char *image, journal_sync_t sync,
+                        uint64_t window_ms);
+size_t  journal_log(journal_t *j, fs_txn_op_t op, const char *path, const char *content, size_t len);
+size_t  journal_log_txn(journal_t *j, fs_txn_t *txn);
+void    journal_cancel(journal_t *j, size_t mark);
+void    journal_commit(journal_t *j);
+int     journal_timeout(journal_t *j);
+void    journal_close(journal_t *j);
+void    journal_print_stats(journal_t *j, FILE *stream);
+
+void    _journal_put(journal_t *j, uint8_t op, const char *path, size_t plen, const char *content, size_t clen);
+void    _journal_seal(journal_t *j, size_t mark);
+size_t  _journal_replay(journal_t *j, const char *base, size_t size, uint64_t *nrec);
+size_t  _journal_next(const char *data, size_t len, uint8_t checked);
+void    _journal_apply(fs_node_t *root, strbuf_t *scratch, const char *rec, fs_txn_t *txn);
+int     _journal_reset(journal_t *j, uint64_t base, uint64_t from);
+int     _journal_sync_dir(const char *path);
+int     _journal_copy(int src, int dst, uint64_t off, uint64_t len);
+void    _journal_compact(journal_t *j);
+void    _journal_saved(journal_t *j, uint64_t seq, uint8_t ok);
+void    _journal_flush(journal_t *j, uint8_t sync);
+void    _journal_die(journal_t *j);
+// end:declarations
+
+#endif //API_RAMFS_JOURNAL_H
@@ -0,0 +1,322 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "binproto.h"
+// end:includes
+
+// start:macros
+#define LG_MAX_EVENTS 256
+#define LG_READ_SIZE  65536
+// end:macros
+
+// start:datatypes
+typedef struct _lg_buf {
+    char *data;
+    size_t len;
+    size_t size;
+} lg_buf_t;
+
+typedef struct _lg_conn {
+    int fd;
+    unsigned int id;
+    lg_buf_t in;
+    lg_buf_t out;
+    size_t out_pos;
+    uint64_t *sent_at;      // send time of requests in flight, ring of `depth`
+    unsigned long issued;   // requests queued, setup included
+    unsigned long done;     // replies received, setup included
+    unsigned int seed;
+} lg_conn_t;
+
+typedef struct _lg_opts {
+    const char *path;
+    unsigned int conns;
+    unsigned long ops;
+    unsigned int depth;
+    unsigned int read_pct;
+    unsigned int files;
+    size_t payload;
+    uint8_t binary;
+} lg_opts_t;
+// end:datatypes
+
+// start:definitions
+// Load generator for the socket server: opens N connections, keeps
+// `depth` requests in flight on each one and reports aggregate
+// throughput and latency percentiles. Every connection first creates
+// its own directory and files, then issues a mix of reads and writes.
+
+uint64_t lg_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void lg_append(lg_buf_t *b, const void *data, size_t len) {
+    if (b->len + len > b->size) {
+        b->size = b->size > 0 ? b->size : 4096;
+        while (b->len + len > b->size)
+            b->size *= 2;
+        if ((b->data = realloc(b->data, b->size)) == NULL)
+            exit(3);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/*
+ * Queue a request. In text mode `payload` is quoted, in binary mode
+ * it is sent raw.
+ */
+
+void lg_request(lg_conn_t *c, lg_opts_t *o, uint8_t op, const char *name, const char *path,
+                const char *payload, size_t len) {
+    char hdr[BIN_HDR_SIZE];
+    bin_req_hdr_t h = {op, 0, (uint32_t) strlen(path), (uint32_t) len};
+
+    if (o->binary) {
+        bin_encode_req((unsigned char *) hdr, &h);
+        lg_append(&c->out, hdr, BIN_HDR_SIZE);
+        lg_append(&c->out, path, strlen(path));
+        lg_append(&c->out, payload, len);
+    } else {
+        lg_append(&c->out, name, strlen(name));
+        lg_append(&c->out, " ", 1);
+        lg_append(&c->out, path, strlen(path));
+        if (op == BIN_OP_WRITE) {
+            lg_append(&c->out, " \"", 2);
+            lg_append(&c->out, payload, len);
+            lg_append(&c->out, "\"", 1);
+        }
+        lg_append(&c->out, "\n", 1);
+    }
+}
+
+/*
+ * Queue the next request of connection `c`.
+ */
+
+void lg_issue(lg_conn_t *c, lg_opts_t *o, const char *payload) {
+    char path[64];
+    unsigned long n = c->issued;
+
+    c->sent_at[n % o->depth] = lg_now_ns();
+    c->issued++;
+
+    if (n == 0) {
+        snprintf(path, sizeof(path), "/lg%u", c->id);
+        lg_request(c, o, BIN_OP_CREATE_DIR, "create_dir", path, NULL, 0);
+    } else if (n <= o->files) {
+        snprintf(path, sizeof(path), "/lg%u/f%lu", c->id, n - 1);
+        lg_request(c, o, BIN_OP_CREATE, "create", path, NULL, 0);
+    } else {
+        snprintf(path, sizeof(path), "/lg%u/f%u", c->id, rand_r(&c->seed) % o->files);
+        if ((unsigned int) (rand_r(&c->seed) % 100) < o->read_pct)
+            lg_request(c, o, BIN_OP_READ, "read", path, NULL, 0);
+        else
+            lg_request(c, o, BIN_OP_WRITE, "write", path, payload, o->payload);
+    }
+}
+
+/*
+ * Consume complete replies from `c`'s input buffer, recording the
+ * latency of the measured (non-setup) ones.
+ * Returns the number of replies consumed.
+ */
+
+unsigned long lg_replies(lg_conn_t *c, lg_opts_t *o, uint64_t *lat, unsigned long *nlat) {
+    size_t pos = 0;
+    unsigned long count = 0;
+    bin_reply_hdr_t h;
+    char *nl;
+
+    for (;;) {
+        if (o->binary) {
+            if (c->in.len - pos < BIN_HDR_SIZE)
+                break;
+            bin_decode_reply((unsigned char *) c->in.data + pos, &h);
+            if (c->in.len - pos < BIN_HDR_SIZE + (size_t) h.len)
+                break;
+            pos += BIN_HDR_SIZE + h.len;
+        } else {
+            if ((nl = memchr(c->in.data + pos, '\n', c->in.len - pos)) == NULL)
+                break;
+            pos = (size_t) (nl - c->in.data) + 1;
+        }
+
+        if (c->done > o->files)
+            lat[(*nlat)++] = lg_now_ns() - c->sent_at[c->done % o->depth];
+        c->done++;
+        count++;
+    }
+
+    memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+    c->in.len -= pos;
+    return count;
+}
+
+int lg_flush(lg_conn_t *c) {
+    ssize_t n;
+    while (c->out_pos < c->out.len) {
+        n = send(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        if (n < 0)
+            return -1;
+        c->out_pos += (size_t) n;
+    }
+    c->out.len = c->out_pos = 0;
+    return 0;
+}
+
+int lg_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+void lg_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-b] [-c conns] [-n ops] [-d depth] [-r read%%] [-f files] [-z size] socket\n"
+                    "  -b  use the binary protocol (server must run with -b)\n"
+                    "  -c  connections (16)      -n  measured ops per connection (10000)\n"
+                    "  -d  requests in flight per connection (1)\n"
+                    "  -r  percentage of reads (50)  -f  files per connection (16)\n"
+                    "  -z  write payload size (64)\n", prog);
+}
+
+int main(int argc, char **argv) {
+    lg_opts_t o = {NULL, 16, 10000, 1, 50, 16, 64, 0};
+    struct epoll_event ev, events[LG_MAX_EVENTS];
+    struct sockaddr_un addr;
+    lg_conn_t *conns;
+    uint64_t *lat, start, elapsed;
+    unsigned long nlat = 0, total, finished = 0;
+    char *payload;
+    int opt, epfd;
+
+    while ((opt = getopt(argc, argv, "bc:n:d:r:f:z:")) != -1) {
+        switch (opt) {
+            case 'b': o.binary = 1; break;
+            case 'c': o.conns = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'n': o.ops = strtoul(optarg, NULL, 10); break;
+            case 'd': o.depth = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'r': o.read_pct = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'f': o.files = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'z': o.payload = strtoul(optarg, NULL, 10); break;
+            default: lg_usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || o.conns == 0 || o.depth == 0 || o.files == 0) {
+        lg_usage(argv[0]);
+        return 1;
+    }
+    o.path = argv[optind];
+
+    // Requests per connection: mkdir, file creation, measured ops
+    total = 1 + o.files + o.ops;
+
+    payload = malloc(o.payload + 1);
+    memset(payload, 'x', o.payload);
+    conns = calloc(o.conns, sizeof(lg_conn_t));
+    lat = malloc(o.conns * o.ops * sizeof(uint64_t));
+    if ((epfd = epoll_create1(0)) < 0 || payload == NULL || conns == NULL || lat == NULL) {
+        perror("setup");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, o.path, sizeof(addr.sun_path) - 1);
+
+    for (unsigned int i = 0; i < o.conns; i++) {
+        lg_conn_t *c = &conns[i];
+        c->id = i;
+        c->seed = i + 1;
+        c->sent_at = calloc(o.depth, sizeof(uint64_t));
+        if ((c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+            connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror("connect");
+            return 1;
+        }
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    start = lg_now_ns();
+    for (unsigned int i = 0; i < o.conns; i++) {
+        while (conns[i].issued < total && conns[i].issued - conns[i].done < o.depth)
+            lg_issue(&conns[i], &o, payload);
+        lg_flush(&conns[i]);
+    }
+
+    while (finished < o.conns) {
+        int nev = epoll_wait(epfd, events, LG_MAX_EVENTS, -1);
+        for (int i = 0; i < nev; i++) {
+            lg_conn_t *c = events[i].data.ptr;
+            ssize_t n;
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                lg_buf_t *in = &c->in;
+                if (in->size - in->len < LG_READ_SIZE) {
+                    in->size = in->len + LG_READ_SIZE;
+                    if ((in->data = realloc(in->data, in->size)) == NULL)
+                        exit(3);
+                }
+                n = recv(c->fd, in->data + in->len, LG_READ_SIZE, 0);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    fprintf(stderr, "connection %u closed by server\n", c->id);
+                    return 1;
+                }
+                if (n > 0)
+                    in->len += (size_t) n;
+
+                if (lg_replies(c, &o, lat, &nlat) > 0) {
+                    while (c->issued < total && c->issued - c->done < o.depth)
+                        lg_issue(c, &o, payload);
+                    if (c->done == total) {
+                        finished++;
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                    }
+                }
+            }
+            if (lg_flush(c) != 0) {
+                perror("send");
+                return 1;
+            }
+        }
+    }
+    elapsed = lg_now_ns() - start;
+
+    qsort(lat, nlat, sizeof(uint64_t), lg_cmp_u64);
+    printf("%u connections, %lu ops (%s, depth %u, %u%% reads, %zu B writes)\n",
+           o.conns, nlat, o.binary ? "binary" : "text", o.depth, o.read_pct, o.payload);
+    printf("throughput: %.0f ops/s\n", (double) (o.conns * total) * 1e9 / (double) elapsed);
+    if (nlat > 0)
+        printf("latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               (double) lat[nlat / 2] / 1e3, (double) lat[nlat * 99 / 100] / 1e3,
+               (double) lat[nlat * 999 / 1000] / 1e3, (double) lat[nlat - 1] / 1e3);
+
+    for (unsigned int i = 0; i < o.conns; i++) {
+        close(conns[i].fd);
+        free(conns[i].in.data);
+        free(conns[i].out.data);
+        free(conns[i].sent_at);
+    }
+    free(conns);
+    free(lat);
+    free(payload);
+    return 0;
+}
+// end:definitions
@@ -2,64 +2,328 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "utils.h"
-#include "ramfs_wrapped.h"
+#include "command.h"
+#include "pipeline.h"
+#include "server.h"
+#include "image.h"
+#include "journal.h"
 // end:includes
 
 // start:definitions
-int main() {
+/*
+ * Write the replies in `reply` to `out`, once `journal`, if any, has
+ * the records of their commands. Replies wait for the next commands,
+ * so that they are committed together, as long as these are already
+ * in `in`, up to JOURNAL_BATCH of them, unless `last`.
+ */
+
+void send_replies(journal_t *journal, reader_t *in, FILE *out, strbuf_t *reply, uint8_t last) {
+    if (journal != NULL) {
+        if (!last && journal->pending > 0 && journal->pending < JOURNAL_BATCH &&
+            reply->len < STRBUF_SPILL_SIZE && reader_ready(in))
+            return;
+        journal_commit(journal);
+    }
+    if (reply->len > 0)
+        fwrite(reply->data, 1, reply->len, out);
+    strbuf_reset(reply);
+}
+
+/*
+ * Sequential command loop: read, parse, execute and print one
+ * command at a time. Returns the number of commands executed.
+ */
+
+unsigned long run_sequential(fs_node_t *root, FILE *stream, FILE *out) {
     char *cmdline = NULL;
-    char *cmdline_saveptr;
     size_t cmdline_s = 0;
     ssize_t gl_ret;
+    unsigned long count = 0;
+    journal_t *journal = _ramfs_meta(root)->journal;
+    reader_t input, *in = &input;
+    strbuf_t reply;
+    fs_txn_t txn;
+    cmd_t cmd;
 
-    fs_node_t *root = ramfs_mkfs();
+    reader_init(in, fileno(stream));
+    strbuf_init(&reply);
+    ramfs_txn_init(&txn);
+    // Long replies (e.g. streamed find) are written out as they grow,
+    // unless they have to wait for the journal
+    if (journal == NULL)
+        reply.sink = out;
 
     do {
-        gl_ret = getline_depau(&cmdline, &cmdline_s, stdin);
-        cmdline = readcmd(cmdline, &cmdline_saveptr);
+        // Release the buffer if the previous line was oversized
+        if (cmdline_s > LINE_SHRINK_SIZE) {
+            free(cmdline);
+            cmdline = NULL;
+            cmdline_s = 0;
+        }
+        gl_ret = getline_depau(&cmdline, &cmdline_s, in);
 
         // Empty line
-        if (cmdline == NULL) {
+        if (cmd_parse(cmdline, &cmd) == CMD_NONE)
             continue;
-        }
 
-#ifdef DEBUG
-        printf("%lu %s ", get_linecount(), cmdline);
-        if (get_linecount() == 0) {
+        // Raw content of a streamed write goes straight to its buffer
+        if (cmd_read_payload(in, &cmd) < 0)
+            gl_ret = -1;
 
-            get_linecount();
-        }
+#ifdef DEBUG
+        strbuf_printf(&reply, "%lu %s ", get_linecount(), cmd.name);
 #endif
 
-        // cmdline_saveptr is already at the beginning of next token
-        if (strcmp(cmdline, "create") == 0) {
-            ramfs_create_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "create_dir") == 0) {
-            ramfs_create_dir_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "read") == 0) {
-            ramfs_read_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "write") == 0) {
-            ramfs_write_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "delete") == 0) {
-            ramfs_delete_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "delete_r") == 0) {
-            ramfs_delete_r_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "find") == 0) {
-            ramfs_find_w(root, cmdline_saveptr);
-        } else if (strcmp(cmdline, "exit") == 0) {
+        cmd_exec(root, &txn, &cmd, &reply);
+        free(cmd.payload);
+        send_replies(journal, in, out, &reply, cmd.op == CMD_EXIT);
+        count++;
+
+        if (cmd.op == CMD_EXIT)
             break;
-        } else {
-            printf("no\n");
-        }
 #ifdef DEBUG
         increment_linecount();
 #endif
     } while (gl_ret >= 0);
+    send_replies(journal, in, out, &reply, 1);
 
     // The same buffer is always used, eventually realloc'd.
     // We only need to free it once at the end.
     free(cmdline);
+    reader_free(in);
+    strbuf_free(&reply);
+    // A batch never committed is dropped
+    ramfs_txn_clear(&txn);
+    return count;
+}
+
+/*
+ * Sequential command loop for the binary protocol.
+ * Returns the number of commands executed.
+ */
+
+unsigned long run_sequential_bin(fs_node_t *root, FILE *stream, FILE *out) {
+    unsigned long count = 0;
+    journal_t *journal = _ramfs_meta(root)->journal;
+    reader_t input, *in = &input;
+    strbuf_t reply;
+    fs_txn_t txn;
+    cmd_t cmd;
+
+    reader_init(in, fileno(stream));
+    strbuf_init(&reply);
+    ramfs_txn_init(&txn);
+
+    while (cmd_read_bin(in, &cmd) == 0) {
+        cmd_exec_bin(root, &txn, &cmd, &reply);
+        free(cmd.line);
+        free(cmd.payload);
+        count++;
+
+        if (cmd.op == CMD_EXIT)
+            break;
+
+        send_replies(journal, in, out, &reply, 0);
+    }
+    send_replies(journal, in, out, &reply, 1);
+
+    reader_free(in);
+    strbuf_free(&reply);
+    ramfs_txn_clear(&txn);
+    return count;
+}
+
+int main(int argc, char **argv) {
+    uint8_t pipelined = 0;
+    uint8_t binary = 0;
+    uint8_t stats = 0;
+    uint8_t uring = 0;
+    uint8_t reap = 0;
+    uint8_t sliced = 0;
+    unsigned int jobs = 1;
+    unsigned int nshards = 0;
+    char *socket_path = NULL;
+    char *image_path = NULL;
+    char *journal_path = NULL;
+    journal_sync_t sync = JOURNAL_SYNC_BATCH;
+    uint64_t window = 0;
+    journal_t *journal = NULL;
+    fs_node_t *root;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "be:F:i:j:J:prsS:tU")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary = 1;
+                break;
+            case 'e':
+                nshards = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                if (strcmp(optarg, "batch") == 0) {
+                    sync = JOURNAL_SYNC_BATCH;
+                } else if (strcmp(optarg, "none") == 0) {
+                    sync = JOURNAL_SYNC_NONE;
+                } else {
+                    sync = JOURNAL_SYNC_WINDOW;
+                    window = strtoull(optarg, NULL, 10);
+                }
+                break;
+            case 'i':
+                image_path = optarg;
+                break;
+            case 'j':
+                jobs = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'p':
+                pipelined = 1;
+                break;
+            case 'r':
+                reap = 1;
+                break;
+            case 's':
+                stats = 1;
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 't':
+                sliced = 1;
+                break;
+            case 'U':
+                uring = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b] [-e shards] [-F sync] [-i image] [-j threads] [-J journal] [-p] [-r] [-s] "
+                                "[-S socket] [-t] [-U]\n"
+                                "  -b  binary protocol instead of text\n"
+                                "  -e  with -S, execute commands on this many shard threads\n"
+                                "  -F  with -J, flush it to the disk every batch (default), every this many ms, or none\n"
+                                "  -i  start from the image written by `save` to this file, if there is one\n"
+                                "  -j  threads used by find on large trees\n"
+                                "  -J  log writes to this journal, after replaying it; compacted into -i if given\n"
+                                "  -p  pipelined mode (reader, executor and writer threads)\n"
+                                "  -r  free large deleted subtrees on a background thread\n"
+                                "  -s  print statistics to stderr on exit\n"
+                                "  -S  serve clients on a Unix domain socket until SIGINT/SIGTERM\n"
+                                "  -t  with -S, run long searches a slice at a time between other commands\n"
+                                "  -U  use io_uring for I/O if the kernel supports it\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // Shards keep trees of their own
+    if (image_path != NULL && socket_path != NULL && nshards > 0) {
+        fprintf(stderr, "-i is not supported with -e\n");
+        return 1;
+    }
+    // The journal is written by the thread running the commands, and
+    // committed before their replies go out
+    if (journal_path != NULL && ((socket_path != NULL && nshards > 0) || (socket_path == NULL && pipelined))) {
+        fprintf(stderr, "-J is not supported with %s\n", pipelined ? "-p" : "-e");
+        return 1;
+    }
+    if (image_path == NULL || access(image_path, F_OK) != 0) {
+        root = ramfs_mkfs();
+    } else {
+        uint64_t start = now_ns();
+        if ((root = image_load(image_path)) == NULL) {
+            perror(image_path);
+            return 1;
+        }
+        if (stats)
+            fprintf(stderr, "image: %zu nodes loaded in %.3f s\n", FS_DIR(root)->meta->nodes,
+                    (double) (now_ns() - start) / 1e9);
+    }
+    if (journal_path != NULL) {
+        uint64_t start = now_ns();
+        if ((journal = journal_open(root, journal_path, image_path, sync, window)) == NULL) {
+            perror(journal_path);
+            return 1;
+        }
+        if (journal->dropped > 0)
+            fprintf(stderr, "%s: %lu bytes after the last complete record dropped\n", journal_path,
+                    (unsigned long) journal->dropped);
+        if (stats)
+            fprintf(stderr, "journal: %lu records replayed in %.3f s\n", (unsigned long) journal->replayed,
+                    (double) (now_ns() - start) / 1e9);
+    }
+    ramfs_set_threads(root, jobs);
+    if (reap)
+        ramfs_set_reaper(root, 1);
+
+    if (socket_path != NULL) {
+        server_t server;
+        shard_pool_t *shards = NULL;
+        if (server_open(&server, root, socket_path, binary) != 0) {
+            perror(socket_path);
+            return 1;
+        }
+        // The io_uring backend doesn't support shards
+        if (nshards > 0 && ((shards = shard_pool_new(nshards, jobs, binary, reap)) == NULL ||
+                            server_set_shards(&server, shards) != 0)) {
+            perror("shards");
+            return 1;
+        }
+        // Neither do slices
+        if (sliced && shards == NULL)
+            server_set_sliced(&server);
+        if (shards != NULL || sliced || journal != NULL || !uring || server_run_uring(&server) != 0) {
+            if (uring && stats)
+                fprintf(stderr, "io_uring not %s, using epoll\n", shards != NULL ? "supported with shards" :
+                                                                   sliced ? "supported with -t" :
+                                                                   journal != NULL ? "supported with -J" :
+                                                                   "available");
+            server_run(&server);
+        }
+        server_close(&server);
+        if (stats)
+            server_print_stats(&server, stderr);
+        if (shards != NULL)
+            shard_pool_del(shards);
+    } else {
+        server_t server;
+        uint8_t served = 0;
+
+        if (uring) {
+            served = (uint8_t) (journal == NULL && server_run_stdio_uring(&server, root, binary) == 0);
+            if (served && stats)
+                server_print_stats(&server, stderr);
+            else if (!served && stats)
+                fprintf(stderr, "io_uring not %s, using stdio\n", journal != NULL ? "supported with -J" : "available");
+        }
+
+        if (!served && pipelined) {
+            pipeline_t p;
+            pipeline_run(&p, root, stdin, stdout, binary);
+            if (stats)
+                pipeline_print_stats(&p, stderr);
+        } else if (!served) {
+            uint64_t start = now_ns();
+            unsigned long count = binary ? run_sequential_bin(root, stdin, stdout)
+                                         : run_sequential(root, stdin, stdout);
+            uint64_t elapsed = now_ns() - start;
+            if (stats)
+                fprintf(stderr, "sequential: %lu commands in %.3f s (%.0f cmd/s)\n", count,
+                        (double) elapsed / 1e9, elapsed > 0 ? (double) count * 1e9 / (double) elapsed : 0.0);
+        }
+    }
+
+    // Let a background save complete, it may be compacting the journal
+    image_bgsave_poll(root, 1);
+    if (stats)
+        image_bgsave_print_stats(root, stderr);
+    if (journal != NULL) {
+        if (stats)
+            journal_print_stats(journal, stderr);
+        journal_close(journal);
+    }
+
     // Remove root children
     _ramfs_rmnode_r(root, 0);
     // Remove root node
@@ -67,4 +331,4 @@ int main() {
 
     return 0;
 }
-// end:definitions
\ No newline at end of file
+// end:definitions
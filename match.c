@@ -0,0 +1,397 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "match.h"
+// end:includes
+
+// start:definitions
+// Name and content matching used by the find variants and grep
+
+/*
+ * Returns true if `name` matches `pattern`, `plen` bytes long, the way
+ * `kind` requires.
+ */
+
+uint8_t match_name(match_kind_t kind, const char *pattern, size_t plen, const char *name) {
+    size_t nlen;
+
+    switch (kind) {
+        case MATCH_EXACT:
+            return (uint8_t) (strcmp(name, pattern) == 0);
+        case MATCH_PREFIX:
+            return (uint8_t) (strncmp(name, pattern, plen) == 0);
+        case MATCH_SUFFIX:
+            nlen = strlen(name);
+            return (uint8_t) (nlen >= plen && memcmp(name + nlen - plen, pattern, plen) == 0);
+        case MATCH_SUBSTR:
+            return (uint8_t) (match_memmem(name, strlen(name), pattern, plen) != NULL);
+        case MATCH_GLOB:
+            return match_glob(pattern, name);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Find the first occurrence of the `nlen` bytes at `needle` in the
+ * `hlen` bytes at `hay`. With SSE2, 16 candidate positions are tested
+ * at once by comparing both the first and the last byte of the needle,
+ * and only the positions where both match are compared in full.
+ * Returns a pointer to the occurrence, or NULL.
+ */
+
+const char *match_memmem(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+    size_t i = 0;
+
+    if (nlen == 0)
+        return hay;
+    if (nlen > hlen)
+        return NULL;
+    if (nlen == 1)
+        return memchr(hay, needle[0], hlen);
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+
+    for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *) (hay + i + nlen - 1));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+
+        while (mask != 0) {
+            unsigned int bit = (unsigned int) __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Tail, or everything without SSE2
+    for (; i + nlen <= hlen; i++) {
+        if (hay[i] == needle[0] && hay[i + nlen - 1] == needle[nlen - 1] &&
+            memcmp(hay + i + 1, needle + 1, nlen - 2) == 0)
+            return hay + i;
+    }
+    return NULL;
+}
+
+/*
+ * (Internal) Match character `c` against the single pattern element
+ * at `pattern` (literal, `?`, `\x` or a `[...]` class), storing the
+ * start of the next element into `next`.
+ * Returns true if it matches.
+ */
+
+uint8_t _match_glob_one(const char *pattern, char c, const char **next) {
+    const char *p = pattern;
+    uint8_t negate = 0;
+    uint8_t found = 0;
+    unsigned char lo, hi;
+
+    if (*p == '?') {
+        *next = p + 1;
+        return 1;
+    }
+    if (*p == '\\' && p[1] != '\0') {
+        *next = p + 2;
+        return (uint8_t) (p[1] == c);
+    }
+    if (*p != '[') {
+        *next = p + 1;
+        return (uint8_t) (*p == c);
+    }
+
+    p++;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    // A leading ']' is part of the class, `\x` stands for `x`
+    do {
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        if (*p == '\0') {
+            // No closing bracket, '[' is a literal
+            *next = pattern + 1;
+            return (uint8_t) (c == '[');
+        }
+        lo = hi = (unsigned char) *p++;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            if (p[1] == '\\' && p[2] != '\0')
+                p++;
+            hi = (unsigned char) p[1];
+            p += 2;
+        }
+        if ((unsigned char) c >= lo && (unsigned char) c <= hi)
+            found = 1;
+    } while (*p != ']');
+
+    *next = p + 1;
+    return (uint8_t) (found != negate);
+}
+
+/*
+ * Returns true if `name` matches the shell glob `pattern`, which may
+ * contain `*`, `?`, `[...]` classes (negated by `!` or `^`, with
+ * ranges) and `\` escapes. A `*` is retried one character further
+ * whenever the rest of the pattern fails, without recursion.
+ */
+
+uint8_t match_glob(const char *pattern, const char *name) {
+    const char *p = pattern;
+    const char *n = name;
+    const char *star_p = NULL;
+    const char *star_n = NULL;
+    const char *next;
+
+    while (*n != '\0') {
+        if (*p == '*') {
+            while (*p == '*')
+                p++;
+            star_p = p;
+            star_n = n;
+            continue;
+        }
+        if (*p != '\0' && _match_glob_one(p, *n, &next)) {
+            p = next;
+            n++;
+            continue;
+        }
+        if (star_p == NULL)
+            return 0;
+        p = star_p;
+        n = ++star_n;
+    }
+
+    while (*p == '*')
+        p++;
+    return (uint8_t) (*p == '\0');
+}
+
+/*
+ * Store into `lit` the longest run of plain characters that every
+ * name matching `pattern` must contain, to be looked up in an index.
+ * Returns its length.
+ */
+
+size_t match_literal(match_kind_t kind, const char *pattern, const char **lit) {
+    const char *start = pattern;
+    const char *p = pattern;
+    size_t best = 0;
+
+    *lit = pattern;
+    if (kind != MATCH_GLOB)
+        return strlen(pattern);
+
+    for (;;) {
+        if (*p != '\0' && *p != '*' && *p != '?' && *p != '[' && *p != '\\') {
+            p++;
+            continue;
+        }
+
+        // End of a run of plain characters
+        if ((size_t) (p - start) > best) {
+            best = (size_t) (p - start);
+            *lit = start;
+        }
+        if (*p == '\0')
+            break;
+
+        // Skip the wildcard, escape or whole class
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '[') {
+            const char *end = _match_class_end(p);
+            p = end != NULL ? end : p + 1;
+        } else {
+            p++;
+        }
+        start = p;
+    }
+    return best;
+}
+
+/*
+ * (Internal) Returns a pointer past the closing bracket of the
+ * `[...]` class starting at `p`, or NULL if it is not closed.
+ */
+
+const char *_match_class_end(const char *p) {
+    const char *q = p + 1;
+
+    if (*q == '!' || *q == '^')
+        q++;
+    if (*q == ']')
+        q++;
+    while (*q != '\0' && *q != ']')
+        q += q[0] == '\\' && q[1] != '\0' ? 2 : 1;
+    return *q == ']' ? q + 1 : NULL;
+}
+
+/*
+ * Compile the regex `pattern` into `re`. Supported are literal
+ * characters, `\x` escapes, `.` (any character but a newline),
+ * `[...]` classes as in globs, the `*`, `+` and `?` quantifiers and
+ * the `^` and `$` anchors, which match at line boundaries.
+ * Returns 0 on success, -1 if the pattern has too many atoms.
+ */
+
+int match_re_compile(match_re_t *re, const char *pattern) {
+    const char *p = pattern;
+    const char *end;
+    match_re_atom_t *a;
+    size_t run = 0;
+
+    memset(re, 0, sizeof(match_re_t));
+    if (*p == '^') {
+        re->bol = 1;
+        p++;
+    }
+
+    while (*p != '\0') {
+        if (*p == '$' && p[1] == '\0') {
+            re->eol = 1;
+            break;
+        }
+        if (re->count == MATCH_RE_MAX)
+            return -1;
+
+        a = &re->atoms[re->count++];
+        if (*p == '.') {
+            a->type = MATCH_RE_ANY;
+            p++;
+        } else if (*p == '[' && (end = _match_class_end(p)) != NULL) {
+            a->type = MATCH_RE_CLASS;
+            a->cls = p;
+            p = end;
+        } else {
+            // Quantifiers with nothing to repeat are literals
+            if (*p == '\\' && p[1] != '\0')
+                p++;
+            a->type = MATCH_RE_CHAR;
+            a->c = *p++;
+        }
+
+        if (*p == '*' || *p == '+' || *p == '?') {
+            a->quant = (uint8_t) (*p == '*' ? MATCH_RE_STAR : *p == '+' ? MATCH_RE_PLUS : MATCH_RE_OPT);
+            p++;
+        }
+
+        // Track the longest run of plain characters
+        if (a->type == MATCH_RE_CHAR && a->quant == MATCH_RE_ONE) {
+            run++;
+            if (run > re->lit_len) {
+                re->lit_len = run;
+                for (size_t i = 0; i < run; i++)
+                    re->lit[i] = re->atoms[re->count - run + i].c;
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+    // Precompute the transitions of every atom
+    for (size_t i = 0; i < re->count; i++) {
+        a = &re->atoms[i];
+        for (int c = 0; c < 256; c++)
+            if (_match_re_atom(a, (char) c))
+                re->chars[c] |= (uint64_t) 1 << i;
+        if (a->quant == MATCH_RE_STAR || a->quant == MATCH_RE_PLUS)
+            re->loop |= (uint64_t) 1 << i;
+        if (a->quant == MATCH_RE_STAR || a->quant == MATCH_RE_OPT)
+            re->skip |= (uint64_t) 1 << i;
+    }
+
+    a = &re->atoms[0];
+    re->first = -1;
+    if (re->count > 0 && a->type == MATCH_RE_CHAR && (a->quant == MATCH_RE_ONE || a->quant == MATCH_RE_PLUS))
+        re->first = (unsigned char) a->c;
+    return 0;
+}
+
+/*
+ * (Internal) Returns true if character `c` matches atom `a`.
+ */
+
+uint8_t _match_re_atom(const match_re_atom_t *a, char c) {
+    const char *next;
+
+    switch (a->type) {
+        case MATCH_RE_CHAR:
+            return (uint8_t) (a->c == c);
+        case MATCH_RE_ANY:
+            return (uint8_t) (c != '\n');
+        default:
+            return (uint8_t) (c != '\n' && _match_glob_one(a->cls, c, &next));
+    }
+}
+
+/*
+ * (Internal) Add to the NFA state `set` the states reachable by
+ * skipping atoms that may match nothing. State `i` means atom `i` is
+ * next, state `count` means the regex matched.
+ */
+
+inline uint64_t _match_re_closure(const match_re_t *re, uint64_t set) {
+    uint64_t prev;
+
+    do {
+        prev = set;
+        set |= (set & re->skip) << 1;
+    } while (set != prev);
+    return set;
+}
+
+/*
+ * Returns true if the regex `re` matches somewhere in the `len` bytes
+ * at `s`. Buffers that don't contain the longest literal of the regex
+ * are ruled out with `match_memmem` first; the others are run through
+ * the NFA, one byte at a time, tracking all its states at once in a
+ * bit mask.
+ */
+
+uint8_t match_re_exec(const match_re_t *re, const char *s, size_t len) {
+    uint64_t start = _match_re_closure(re, 1);
+    uint64_t accept = (uint64_t) 1 << re->count;
+    uint64_t cur = 0, m;
+    const char *next;
+    size_t pos = 0;
+
+    if (re->lit_len > 0 && match_memmem(s, len, re->lit, re->lit_len) == NULL)
+        return 0;
+
+    for (;;) {
+        // Nothing in progress: skip to where a match can start
+        if (cur == 0 && pos > 0 && s[pos - 1] != '\n' && re->bol) {
+            if ((next = memchr(s + pos, '\n', len - pos)) == NULL)
+                return 0;
+            pos = (size_t) (next - s) + 1;
+        } else if (cur == 0 && re->first >= 0) {
+            if ((next = memchr(s + pos, re->first, len - pos)) == NULL)
+                return 0;
+            pos = (size_t) (next - s);
+        }
+
+        if (!re->bol || pos == 0 || s[pos - 1] == '\n')
+            cur |= start;
+        if ((cur & accept) && (!re->eol || pos == len || s[pos] == '\n'))
+            return 1;
+        if (pos == len)
+            return 0;
+
+        m = cur & re->chars[(unsigned char) s[pos]];
+        cur = _match_re_closure(re, m << 1 | (m & re->loop));
+        pos++;
+    }
+}
+// end:definitions
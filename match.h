@@ -0,0 +1,79 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_MATCH_H
+#define API_RAMFS_MATCH_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+// end:includes
+
+// start:macros
+// Longest regex accepted, in atoms, so that a set of NFA states fits
+// in a 64 bit word
+#define MATCH_RE_MAX 63
+
+#define MATCH_RE_CHAR  0
+#define MATCH_RE_ANY   1
+#define MATCH_RE_CLASS 2
+
+#define MATCH_RE_ONE  0
+#define MATCH_RE_STAR 1
+#define MATCH_RE_PLUS 2
+#define MATCH_RE_OPT  3
+// end:macros
+
+// start:datatypes
+// Ways a node name can match a find pattern. The values are used as
+// the `flags` of binary find requests. Regexes are only used by grep.
+typedef enum _match_kind {
+    MATCH_EXACT,
+    MATCH_PREFIX,
+    MATCH_SUFFIX,
+    MATCH_SUBSTR,
+    MATCH_GLOB,
+    MATCH_REGEX
+} match_kind_t;
+
+// One element of a regex: a character, `.` or a `[...]` class, with
+// an optional `*`, `+` or `?` quantifier
+typedef struct _match_re_atom {
+    uint8_t type;
+    uint8_t quant;
+    char c;
+    const char *cls;    // start of the class in the pattern
+} match_re_atom_t;
+
+// A compiled regex. Classes point into the pattern, which must
+// outlive it. Bit `i` of the masks stands for atom `i`.
+typedef struct _match_re {
+    match_re_atom_t atoms[MATCH_RE_MAX];
+    size_t count;
+    uint8_t bol;        // anchored to the start of a line
+    uint8_t eol;        // anchored to the end of a line
+    int first;          // character every match starts with, or -1
+    char lit[MATCH_RE_MAX];     // longest literal every match contains
+    size_t lit_len;
+    uint64_t chars[256];    // atoms matching each character
+    uint64_t loop;      // atoms that can repeat
+    uint64_t skip;      // atoms that can match nothing
+} match_re_t;
+// end:datatypes
+
+// start:declarations
+uint8_t     match_name(match_kind_t kind, const char *pattern, size_t plen, const char *name);
+const char *match_memmem(const char *hay, size_t hlen, const char *needle, size_t nlen);
+uint8_t     match_glob(const char *pattern, const char *name);
+size_t      match_literal(match_kind_t kind, const char *pattern, const char **lit);
+int         match_re_compile(match_re_t *re, const char *pattern);
+uint8_t     match_re_exec(const match_re_t *re, const char *s, size_t len);
+
+uint8_t     _match_glob_one(const char *pattern, char c, const char **next);
+const char *_match_class_end(const char *p);
+uint8_t     _match_re_atom(const match_re_atom_t *a, char c);
+uint64_t    _match_re_closure(const match_re_t *re, uint64_t set);
+// end:declarations
+
+#endif //API_RAMFS_MATCH_H
@@ -0,0 +1,232 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "command.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Pipelined front-end: one thread reads and parses commands, one
+// executes them against the tree and one writes the replies.
+// Stages are connected by SPSC ring buffers, so commands are executed
+// and replies are written in input order.
+
+/*
+ * (Internal) Push `item` to `rb`, accounting the time spent waiting
+ * for the consumer in `stats`.
+ */
+
+void _pipeline_push(ringbuf_t *rb, void *item, pipeline_stage_stats_t *stats) {
+    unsigned int spins = 0;
+    uint64_t start;
+
+    if (ringbuf_trypush(rb, item) == 0)
+        return;
+
+    start = now_ns();
+    while (ringbuf_trypush(rb, item) != 0)
+        ringbuf_backoff(&spins);
+    stats->wait_ns += now_ns() - start;
+}
+
+/*
+ * (Internal) Pop an item from `rb`, accounting the time spent waiting
+ * for the producer in `stats`.
+ */
+
+void *_pipeline_pop(ringbuf_t *rb, pipeline_stage_stats_t *stats) {
+    unsigned int spins = 0;
+    uint64_t start;
+    void *item;
+
+    if ((item = ringbuf_trypop(rb)) != NULL)
+        return item;
+
+    start = now_ns();
+    while ((item = ringbuf_trypop(rb)) == NULL)
+        ringbuf_backoff(&spins);
+    stats->wait_ns += now_ns() - start;
+    return item;
+}
+
+/*
+ * (Internal) Reader stage. Every line gets its own buffer, which is
+ * handed over to the executor together with the parsed command.
+ * Streamed write content is read into the command payload here.
+ */
+
+void *_pipeline_reader(void *arg) {
+    pipeline_t *p = arg;
+    ssize_t gl_ret;
+    cmd_t *cmd;
+
+    if (p->binary) {
+        do {
+            cmd = malloc_or_die(sizeof(cmd_t));
+            if (cmd_read_bin(&p->in, cmd) < 0)
+                cmd->op = CMD_EXIT;
+            else
+                p->reader.items++;
+            _pipeline_push(p->cmds, cmd, &p->reader);
+        } while (cmd->op != CMD_EXIT);
+        return NULL;
+    }
+
+    do {
+        char *line = NULL;
+        size_t line_s = 0;
+
+        gl_ret = getline_depau(&line, &line_s, &p->in);
+        cmd = malloc_or_die(sizeof(cmd_t));
+        cmd_parse(line, cmd);
+        if (cmd_read_payload(&p->in, cmd) < 0)
+            gl_ret = -1;
+        p->reader.items++;
+
+        // At EOF the last (partial) line is still executed, then
+        // the executor is told to stop
+        if (gl_ret < 0 && cmd->op != CMD_EXIT) {
+            _pipeline_push(p->cmds, cmd, &p->reader);
+            cmd = calloc_or_die(1, sizeof(cmd_t));
+            cmd->op = CMD_EXIT;
+        }
+        _pipeline_push(p->cmds, cmd, &p->reader);
+    } while (gl_ret >= 0 && cmd->op != CMD_EXIT);
+
+    return NULL;
+}
+
+/*
+ * (Internal) Executor stage. Replies are batched until the batch is
+ * large enough or there are no more commands ready to be executed.
+ */
+
+void *_pipeline_executor(void *arg) {
+    pipeline_t *p = arg;
+    pipeline_reply_t *reply = NULL;
+    fs_txn_t txn;
+    cmd_t *cmd;
+    uint8_t done = 0;
+
+    ramfs_txn_init(&txn);
+    while (!done) {
+        cmd = _pipeline_pop(p->cmds, &p->executor);
+
+        if (reply == NULL) {
+            reply = calloc_or_die(1, sizeof(pipeline_reply_t));
+            strbuf_init(&reply->out);
+        }
+
+        if (p->binary)
+            cmd_exec_bin(p->root, &txn, cmd, &reply->out);
+        else
+            cmd_exec(p->root, &txn, cmd, &reply->out);
+        p->executor.items++;
+
+        done = cmd->op == CMD_EXIT;
+        reply->last = done;
+        free(cmd->line);
+        free(cmd->payload);
+        free(cmd);
+
+        // Ship the batch if it's big enough, or if waiting for the
+        // next command could delay replies
+        if (done || reply->out.len >= PIPELINE_BATCH_SIZE ||
+            ringbuf_empty(p->cmds)) {
+            _pipeline_push(p->replies, reply, &p->executor);
+            reply = NULL;
+        }
+    }
+
+    ramfs_txn_clear(&txn);
+    return NULL;
+}
+
+/*
+ * (Internal) Writer stage.
+ */
+
+void *_pipeline_writer(void *arg) {
+    pipeline_t *p = arg;
+    pipeline_reply_t *reply;
+    uint8_t done = 0;
+
+    while (!done) {
+        reply = _pipeline_pop(p->replies, &p->writer);
+        if (reply->out.len > 0)
+            fwrite(reply->out.data, 1, reply->out.len, p->out);
+        p->writer.items++;
+
+        done = reply->last;
+        strbuf_free(&reply->out);
+        free(reply);
+    }
+    fflush(p->out);
+
+    return NULL;
+}
+
+/*
+ * Run the pipelined command loop reading from `in` and writing to `out`
+ * until `exit` or EOF, executing commands against `root`. If `binary`
+ * is true the binary protocol is used instead of the text one.
+ * Statistics are stored into `p`.
+ */
+
+void pipeline_run(pipeline_t *p, fs_node_t *root, FILE *in, FILE *out, uint8_t binary) {
+    pthread_t threads[3];
+    uint64_t start;
+
+    memset(p, 0, sizeof(pipeline_t));
+    p->root = root;
+    reader_init(&p->in, fileno(in));
+    p->out = out;
+    p->binary = binary;
+    p->cmds = ringbuf_new(PIPELINE_QUEUE_SIZE);
+    p->replies = ringbuf_new(PIPELINE_QUEUE_SIZE);
+
+    start = now_ns();
+    if (pthread_create(&threads[0], NULL, _pipeline_reader, p) != 0 ||
+        pthread_create(&threads[1], NULL, _pipeline_executor, p) != 0 ||
+        pthread_create(&threads[2], NULL, _pipeline_writer, p) != 0) {
+        exit(4);
+    }
+
+    for (int i = 0; i < 3; i++)
+        pthread_join(threads[i], NULL);
+    p->wall_ns = now_ns() - start;
+
+    ringbuf_del(p->cmds);
+    ringbuf_del(p->replies);
+    reader_free(&p->in);
+}
+
+/*
+ * Print throughput and per-stage utilization of the last run of `p`
+ * to `stream`. A stage is busy whenever it is not waiting on a queue.
+ */
+
+void pipeline_print_stats(pipeline_t *p, FILE *stream) {
+    double wall = (double) p->wall_ns / 1e9;
+    pipeline_stage_stats_t *stages[3] = {&p->reader, &p->executor, &p->writer};
+    const char *names[3] = {"reader", "executor", "writer"};
+
+    fprintf(stream, "pipeline: %lu commands in %.3f s (%.0f cmd/s)\n",
+            (unsigned long) p->executor.items, wall,
+            wall > 0 ? (double) p->executor.items / wall : 0.0);
+    for (int i = 0; i < 3; i++) {
+        double busy = p->wall_ns > 0
+                      ? 100.0 * (1.0 - (double) stages[i]->wait_ns / (double) p->wall_ns)
+                      : 0.0;
+        fprintf(stream, "  %-8s %10lu items, %5.1f%% busy\n", names[i],
+                (unsigned long) stages[i]->items, busy < 0 ? 0.0 : busy);
+    }
+}
+// end:definitions
@@ -0,0 +1,58 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_PIPELINE_H
+#define API_RAMFS_PIPELINE_H
+
+// start:includes
+#include <stdio.h>
+#include <stdint.h>
+#include "ramfs.h"
+#include "ringbuf.h"
+#include "utils.h"
+// end:includes
+
+// start:macros
+#define PIPELINE_QUEUE_SIZE 1024
+// Replies are batched by the executor up to this size
+#define PIPELINE_BATCH_SIZE 4096
+// end:macros
+
+// start:datatypes
+typedef struct _pipeline_stage_stats {
+    uint64_t items;
+    uint64_t wait_ns;
+} pipeline_stage_stats_t;
+
+typedef struct _pipeline_reply {
+    strbuf_t out;
+    uint8_t last;
+} pipeline_reply_t;
+
+typedef struct _pipeline {
+    fs_node_t *root;
+    reader_t in;
+    FILE *out;
+    uint8_t binary;
+    ringbuf_t *cmds;
+    ringbuf_t *replies;
+    pipeline_stage_stats_t reader;
+    pipeline_stage_stats_t executor;
+    pipeline_stage_stats_t writer;
+    uint64_t wall_ns;
+} pipeline_t;
+// end:datatypes
+
+// start:declarations
+void pipeline_run(pipeline_t *p, fs_node_t *root, FILE *in, FILE *out, uint8_t binary);
+void pipeline_print_stats(pipeline_t *p, FILE *stream);
+
+void  _pipeline_push(ringbuf_t *rb, void *item, pipeline_stage_stats_t *stats);
+void *_pipeline_pop(ringbuf_t *rb, pipeline_stage_stats_t *stats);
+void *_pipeline_reader(void *arg);
+void *_pipeline_executor(void *arg);
+void *_pipeline_writer(void *arg);
+// end:declarations
+
+#endif //API_RAMFS_PIPELINE_H
@@ -6,7 +6,12 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include "ramfs.h"
+#include "walker.h"
+#include "strsort.h"
 #include "utils.h"
 // end:includes
 
@@ -31,17 +36,21 @@ inline fs_node_t *ramfs_mkfs() {
 
 int ramfs_create_node(fs_node_t *root, char *path, fs_node_type_t type) {
     char *newnode = NULL;
-    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode);
+    fs_node_t *locked;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, true, &locked);
 
     // Check for error
     if (node == NULL || newnode == NULL) {
 #ifdef DEBUG
         fprintf(stderr, "create node %s failed: node and newnode are null\n", path);
 #endif
+        if (locked != NULL)
+            _ramfs_unlock(locked);
         return -1;
     }
 
     _ramfs_mknode(node, newnode, type, NULL);
+    _ramfs_unlock(locked);
     return 0;
 }
 
@@ -70,11 +79,33 @@ inline int ramfs_create_dir(fs_node_t *root, char *path) {
  * Find node at `path` under `root` and return its content.
  */
 
-char *ramfs_read(fs_node_t *root, char *path) {
+inline char *ramfs_read(fs_node_t *root, char *path) {
+    size_t len;
+    return ramfs_read_n(root, path, &len);
+}
+
+/*
+ * Find node at `path` under `root` and return its content. The
+ * content length is stored into `len`, the content may contain
+ * NUL bytes but it is always NUL-terminated. The content is not
+ * copied: in concurrent mode use `ramfs_read_copy` instead. In RCU
+ * mode it stays valid until the next quiescent state of the caller.
+ */
+
+char *ramfs_read_n(fs_node_t *root, char *path, size_t *len) {
     char *newnode = NULL;
+#ifdef DEBUG
     char *backpath = calloc_or_die(strlen(path) + 1, sizeof(char));
     strcpy(backpath, path);
-    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode);
+#endif
+    fs_node_t *locked = NULL;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, false,
+                                          FS_DIR(root)->meta->rcu ? NULL : &locked);
+    char *content;
+    uint32_t size;
+
+    if (locked != NULL)
+        _ramfs_unlock(locked);
 
     // Check for error
     if (node == NULL || newnode != NULL || node->type != TYPE_FILE) {
@@ -94,46 +125,112 @@ char *ramfs_read(fs_node_t *root, char *path) {
 #ifdef DEBUG
     free(backpath);
 #endif
-    return node->data.content;
+    content = _ramfs_content_get(node, &size);
+    *len = size;
+    return content;
+}
+
+/*
+ * Like `ramfs_read_n`, but returns a copy of the content, taken while
+ * no other thread can change it. The copy must be freed.
+ */
+
+char *ramfs_read_copy(fs_node_t *root, char *path, size_t *len) {
+    char *newnode = NULL;
+    char *copy = NULL;
+    char *content;
+    uint32_t size;
+    fs_node_t *locked = NULL;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, false,
+                                          FS_DIR(root)->meta->rcu ? NULL : &locked);
+
+    if (node != NULL && newnode == NULL && node->type == TYPE_FILE) {
+        _ramfs_content_lock(node, false);
+        content = _ramfs_content_get(node, &size);
+        *len = size;
+        copy = malloc_or_die(size + 1);
+        memcpy(copy, content, size + 1);
+        _ramfs_content_unlock(node, false);
+    }
+    if (locked != NULL)
+        _ramfs_unlock(locked);
+    return copy;
 }
 
 /*
  * Write `content` to file node at `path` under `root`.
  * Content is duplicated before storing, make sure it is freed.
- * Returns 0 on success, -1 on error.
+ * Returns the content length on success, -1 on error.
  */
 
-int ramfs_write(fs_node_t *root, char *path, char *content) {
+inline int ramfs_write(fs_node_t *root, char *path, char *content) {
+    return ramfs_write_n(root, path, content, strlen(content));
+}
+
+/*
+ * Write `len` bytes of `content` to file node at `path` under `root`.
+ * Content may contain NUL bytes. It is duplicated before storing,
+ * make sure it is freed.
+ * Returns the content length on success, -1 on error.
+ */
+
+int ramfs_write_n(fs_node_t *root, char *path, char *content, size_t len) {
+    char *copy = malloc_or_die(len + 1);
+
+    memcpy(copy, content, len);
+    return ramfs_write_adopt(root, path, copy, len);
+}
+
+/*
+ * Replace the content of file node at `path` under `root` with the
+ * `len` bytes at `content`, without copying them. `content` must be
+ * allocated with malloc and hold at least `len + 1` bytes, the last
+ * one is overwritten with the terminator. It is owned by the node
+ * afterwards, or freed on error.
+ * Returns the content length on success, -1 on error.
+ */
+
+int ramfs_write_adopt(fs_node_t *root, char *path, char *content, size_t len) {
     char *newnode = NULL;
 #ifdef DEBUG
     char *backpath = calloc_or_die(strlen(path) + 1, sizeof(char));
     strcpy(backpath, path);
 #endif
-    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode);
+    fs_node_t *locked;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, false, &locked);
 
     // Check for error
-    if (node == NULL || newnode != NULL || node->type != TYPE_FILE) {
+    if (node == NULL || newnode != NULL || node->type != TYPE_FILE || len > UINT32_MAX) {
 #ifdef DEBUG
         if (newnode != NULL)
             fprintf(stderr, "write %s failed: node does not exist\n", backpath);
         if (node != NULL && node->type != TYPE_FILE)
             fprintf(stderr, "write %s failed: node is not a file\n", backpath);
+        if (len > UINT32_MAX)
+            fprintf(stderr, "write %s failed: content too long\n", backpath);
         if (node == NULL)
             fprintf(stderr, "write %s failed: node is null\n", backpath);
         else
             dump_node(node);
         free(backpath);
 #endif
+        if (locked != NULL)
+            _ramfs_unlock(locked);
+        free(content);
         return -1;
     }
 #ifdef DEBUG
     free(backpath);
 #endif
 
-    size_t len = strlen(content);
-    free(node->data.content);
-    node->data.content = calloc_or_die(len + 1, sizeof(char));
-    strncpy(node->data.content, content, len);
+    // Files can't go away while their directory is locked, even for
+    // reading, so writers to different files don't wait for each other
+    _ramfs_content_lock(node, true);
+    __atomic_add_fetch(&_ramfs_meta(node)->bytes, len - node->size, __ATOMIC_RELAXED);
+    content[len] = '\0';
+    _ramfs_content_set(node, content, (uint32_t) len);
+    _ramfs_content_unlock(node, true);
+    _ramfs_unlock(locked);
 
     return (int) len;
 }
@@ -146,300 +243,2812 @@ int ramfs_write(fs_node_t *root, char *path, char *content) {
 
 int ramfs_delete(fs_node_t *root, char *path) {
     char *newnode = NULL;
-    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode);
+    fs_node_t *locked;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, true, &locked);
+    int ret = -1;
 
     // Do not delete root
     if (node == root) {
 #ifdef DEBUG
         fprintf(stderr, "delete failed: trying to remove root");
 #endif
-        return -1;
+    } else if (node != NULL && newnode == NULL) {
+        ret = _ramfs_rmnode(node, false);
     }
 
-    // Check for error
-    if (node == NULL || newnode != NULL)
-        return -1;
-
-    return _ramfs_rmnode(node, false);
+    if (locked != NULL)
+        _ramfs_unlock(locked);
+    return ret;
 }
 
 /*
  * Recursively delete node and all its children at `path` under `root`.
  * Everything is freed, make sure you don't keep any references.
+ * With a reaper (see `ramfs_set_reaper`) a large directory is only
+ * unlinked, and freed later.
  * If path is an empty string or '/', the root node is NOT deleted.
  * Returns 0 if all nodes were deleted, -1 otherwise.
  */
 
 int ramfs_delete_r(fs_node_t *root, char *path) {
     char *newnode = NULL;
-    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode);
+    fs_node_t *locked;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, true, &locked);
+    int ret;
 
     // Check for error
-    if (node == NULL || newnode != NULL)
+    if (node == NULL || newnode != NULL) {
+        if (locked != NULL)
+            _ramfs_unlock(locked);
         return -1;
+    }
 
-    return _ramfs_rmnode_r(node, false);
+    // The subtree locks itself from `node` down. Emptying the root
+    // needs no parent locked.
+    if (node == root)
+        _ramfs_unlock(locked);
+    ret = _ramfs_rmnode_r(node, false);
+    if (node != root)
+        _ramfs_unlock(locked);
+    return ret;
 }
 
 /*
- * Recursively search for `keyword` under `root`. `nres` is the pointer
+ * Search for nodes named `keyword` under `root`, using the name index
+ * so that only the matching nodes are visited. `nres` is the pointer
  * to a size_t where the number of results will be stored.
  * Returns a sorted array of strings containing the path of each
- * result. The results and the array need to be disposed of.
+ * result. The strings are stored in the same allocation as the array,
+ * only the array needs to be disposed of. Results are served from the
+ * find cache while no node named `keyword` was added or removed.
+ * The index is read under the tree lock even in RCU mode, which is
+ * still much cheaper than `ramfs_find_walk`.
  */
 
 char **ramfs_find(fs_node_t *root, char *keyword, size_t *nres) {
-    size_t len = FIND_ARRAY_SIZE;
-    size_t pos = 0;
-    *nres = 0;
-    char **results = malloc_or_die(len*sizeof(char**));
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    char **results;
+
+    _ramfs_tree_lock(meta, false);
+    if ((results = _ramfs_cache_get(meta, keyword, keyword, nres)) == NULL) {
+        results = _ramfs_find_index(meta, keyword, nres);
+        _ramfs_cache_put(meta, keyword, keyword, results, *nres);
+    }
+    _ramfs_tree_unlock(meta);
+    return results;
+}
 
-    // Find all matching nodes first
-    *nres += _ramfs_find(root, "", keyword, &results, &len, &pos);
+/*
+ * Like `ramfs_find`, but walks the tree instead of using the name
+ * index, skipping the subtrees whose summary rules the keyword out.
+ * Large trees are walked in parallel if more than one thread was
+ * configured with `ramfs_set_threads`.
+ */
 
-    // Sort their paths
-    qsort(results, *nres, sizeof(char *), _pathcmp);
+char **ramfs_find_walk(fs_node_t *root, char *keyword, size_t *nres) {
+    fs_meta_t *meta = _ramfs_meta(root);
+    fs_find_res_t res = {0};
+    char **results;
 
+    _ramfs_reader_lock(meta);
+    if (meta->threads > 1 && __atomic_load_n(&meta->nodes, __ATOMIC_RELAXED) >= FIND_PAR_MIN_NODES) {
+        fs_find_par_t par;
+        walker_t w;
+
+        _ramfs_find_par_init(&par, keyword, meta->threads);
+        if (_ramfs_bloom_has(root, par.bloom))
+            walker_run(&w, root, par.nthreads, _ramfs_find_visit, _ramfs_find_done, &par);
+        results = _ramfs_find_par_merge(&par, nres);
+    } else {
+        _ramfs_find(root, keyword, FIND_DEPTH_ALL, &res);
+        results = _ramfs_find_res_finish(&res, nres);
+    }
+    _ramfs_reader_unlock(meta);
     return results;
 }
 
-// Internal functions
+/*
+ * Like `ramfs_find`, but only looks for nodes under the directory at
+ * `path`, at most `maxdepth` levels below it (1 for its children).
+ * Nothing matches if `path` is not a directory.
+ */
+
+char **ramfs_find_in(fs_node_t *root, char *path, char *keyword, unsigned int maxdepth, size_t *nres) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    size_t plen = strlen(path), klen = strlen(keyword);
+    char *newnode = NULL;
+    fs_node_t *dir, *locked = NULL;
+    fs_find_res_t res = {0};
+    char **results;
+    char *key;
+
+    // Keywords have no slashes, so "path/maxdepth/keyword" is
+    // unambiguous. The path is tokenized while resolving it.
+    key = malloc_or_die(plen + klen + 16);
+    snprintf(key, plen + klen + 16, "%s/%u/%s", path, maxdepth, keyword);
+
+    // Once the tree lock is held the directory can't go away. The
+    // cache reads the name index, so it is not used in RCU mode.
+    dir = _ramfs_resolve_node(root, path, &newnode, false, meta->rcu ? NULL : &locked);
+    _ramfs_reader_lock(meta);
+    if (locked != NULL)
+        _ramfs_unlock(locked);
+
+    if (meta->rcu || (results = _ramfs_cache_get(meta, key, keyword, nres)) == NULL) {
+        if (dir != NULL && newnode == NULL && dir->type == TYPE_DIR && !_ramfs_detached(meta, dir))
+            _ramfs_find_under(dir, keyword, maxdepth, &res);
+        results = _ramfs_find_res_finish(&res, nres);
+        if (!meta->rcu)
+            _ramfs_cache_put(meta, key, keyword, results, *nres);
+    }
+    _ramfs_reader_unlock(meta);
+    free(key);
+    return results;
+}
 
 /*
- * (Internal) Creates a new node of type `type` named `name` under `parent`
- * and returns it. If `parent` and `name` are NULL and `type` is TYPE_DIR,
- * a root node is created. If `data` is NULL, an hash table will be created
- * for TYPE_DIR, and an empty string for TYPE_FILE.
- * If node couldn't be created, NULL is returned.
+ * Store into `count` the number of nodes `ramfs_find_in` would
+ * return, without building their paths.
+ * Returns 0 on success, -1 if `path` is not a directory.
  */
 
-fs_node_t *_ramfs_mknode(fs_node_t *parent, char *name, fs_node_type_t type, void *data) {
-    char *namecopy = NULL;
+int ramfs_count_in(fs_node_t *root, char *path, char *keyword, unsigned int maxdepth, size_t *count) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    char *newnode = NULL;
+    fs_node_t *locked = NULL;
+    fs_node_t *dir = _ramfs_resolve_node(root, path, &newnode, false, meta->rcu ? NULL : &locked);
 
-    // Files don't have children
-    if (parent != NULL && parent->type == TYPE_FILE) {
-#ifdef DEBUG
-        fprintf(stderr, "mknode %s parent %s failed: file can't have children\n", name, parent->name);
-#endif
-        return NULL;
-    }
-    // Unless the node is root and is a directory, name can't be empty or NULL
-    if ((parent == NULL && type != TYPE_DIR) ||
-        (parent != NULL && (name == NULL || strlen(name) == 0))) {
-#ifdef DEBUG
-        fprintf(stderr, "mknode %s parent %s failed: empty name\n", name, parent->name);
-#endif
-        return NULL;
-    }
-    // If node is root, name must be NULL
-    if (parent == NULL && name != NULL) {
-#ifdef DEBUG
-        fprintf(stderr, "mknode %s failed: root node can't have a name\n", name);
-#endif
-        return NULL;
+    if (dir == NULL || newnode != NULL || dir->type != TYPE_DIR) {
+        if (locked != NULL)
+            _ramfs_unlock(locked);
+        return -1;
     }
+    _ramfs_reader_lock(meta);
+    if (locked != NULL)
+        _ramfs_unlock(locked);
+    *count = _ramfs_detached(meta, dir) ? 0 : _ramfs_find_under(dir, keyword, maxdepth, NULL);
+    _ramfs_reader_unlock(meta);
+    return 0;
+}
 
-    if (name != NULL) {
-        // Check max name length
-        size_t nlen = strlen(name);
-        if (nlen > MAX_NAME_LENGTH) {
-#ifdef DEBUG
-            fprintf(stderr, "create node %s failed: name too long\n", name);
-#endif
-            return NULL;
-        }
+/*
+ * Returns the number of nodes named `keyword` under `root`.
+ */
 
-        namecopy = calloc_or_die(nlen + 1, sizeof(char));
-        // Copy the name so it isn't freed later
-        strcpy(namecopy, name);
+size_t ramfs_find_count(fs_node_t *root, char *keyword) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_name_entry_t *entry;
+    size_t count;
+
+    _ramfs_tree_lock(meta, false);
+    entry = ht_getitem(meta->names, keyword);
+    count = entry != NULL ? entry->count : 0;
+    for (uint32_t i = 0; entry != NULL && meta->detached > 0 && i < entry->count; i++)
+        count -= _ramfs_detached(meta, entry->nodes[i]);
+    _ramfs_tree_unlock(meta);
+    return count;
+}
+
+/*
+ * Search for nodes whose name matches `pattern` the way `kind`
+ * requires (see `match_name`) under `root`. Only distinct names are
+ * checked: if the pattern contains a literal of at least 3 chars,
+ * just the names sharing its rarest trigram, otherwise all of them.
+ * Returns a sorted array of paths like `ramfs_find`.
+ */
+
+char **ramfs_find_match(fs_node_t *root, match_kind_t kind, char *pattern, size_t *nres) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_find_res_t res = {0};
+    fs_name_entry_t *entry;
+    uint32_t codes[TG_MAX_CODES];
+    tg_list_t *best = NULL, *l;
+    size_t plen = strlen(pattern);
+    size_t lit_len, ncodes;
+    const char *lit;
+
+    if (kind == MATCH_EXACT)
+        return ramfs_find(root, pattern, nres);
+
+    lit_len = match_literal(kind, pattern, &lit);
+    if (lit_len > MAX_NAME_LENGTH)
+        return _ramfs_find_res_finish(&res, nres);
+
+    if (lit_len >= 3)
+        _ramfs_trigrams(meta);
+    _ramfs_tree_lock(meta, false);
+    if (lit_len >= 3) {
+        ncodes = tg_codes(lit, lit_len, codes);
+        for (size_t k = 0; k < ncodes; k++) {
+            // A trigram no name contains rules everything out
+            if ((l = tg_get(meta->trigrams, codes[k])) == NULL || l->count == 0) {
+                best = NULL;
+                break;
+            }
+            if (best == NULL || l->count < best->count)
+                best = l;
+        }
+        for (uint32_t i = 0; best != NULL && i < best->count; i++) {
+            entry = best->items[i].item;
+            if (match_name(kind, pattern, plen, entry->name))
+                _ramfs_find_entry(meta, &res, entry);
+        }
+    } else {
+        for (size_t i = 0; i < meta->names->size; i++) {
+            if (meta->names->body[i].key == NULL)
+                continue;
+            entry = meta->names->body[i].val;
+            if (match_name(kind, pattern, plen, entry->name))
+                _ramfs_find_entry(meta, &res, entry);
+        }
     }
+    _ramfs_tree_unlock(meta);
 
+    return _ramfs_find_res_finish(&res, nres);
+}
 
-    if (data == NULL && type == TYPE_DIR)
-        data = ht_new();
-    else if (data == NULL && type == TYPE_FILE)
-        data = calloc_or_die(1, sizeof(char));
+/*
+ * Open cursor `c` on the nodes named `keyword` under `root`. Results
+ * are then fetched in sorted order with `ramfs_find_next`, visiting
+ * the children of every directory in path order, so that the first
+ * ones are available right away and nothing is accumulated.
+ * The cursor must be closed with `ramfs_find_close`. In concurrent
+ * mode no node can be added or removed until then.
+ */
 
-    uint8_t depth = (uint8_t) (parent != NULL ? parent->depth + 1 : 0);
+void ramfs_find_open(fs_find_cursor_t *c, fs_node_t *root, char *keyword) {
+    memset(c, 0, sizeof(fs_find_cursor_t));
+    c->meta = FS_DIR(root)->meta;
+    _ramfs_tree_lock(c->meta, false);
+    c->keyword = keyword;
+    _ramfs_bloom_pos(keyword, c->bloom);
+    c->path = malloc_or_die(FIND_PATH_SIZE);
+    c->path[0] = '/';
+    _ramfs_cursor_load(c, root, 1);
+}
 
-    if (parent != NULL && depth == 0) {
-        // Overflow <3 maximum depth exceeded
-#ifdef DEBUG
-        fprintf(stderr, "mknode %s parent %s failed: maximum depth reached\n", name, parent->name);
-#endif
-        return NULL;
-    }
+/*
+ * Returns the path of the next result of cursor `c` and stores its
+ * length into `len`, or NULL if there are no more results. The path
+ * is only valid until the next call.
+ */
 
-    if (parent != NULL && parent->data.children->used >= MAX_CHILDREN) {
-        // Parent can't accept more children
-#ifdef DEBUG
-        fprintf(stderr, "mknode %s parent %s failed: maximum number of children reached\n", name, parent->name);
-#endif
-        return NULL;
+char *ramfs_find_next(fs_find_cursor_t *c, size_t *len) {
+    fs_cursor_frame_t *f;
+    fs_cursor_item_t *item;
+    size_t nlen;
+
+    while (c->top >= 0) {
+        f = &c->stack[c->top];
+        if (f->next == f->count) {
+            c->top--;
+            continue;
+        }
+        item = &f->items[f->next++];
+        nlen = strlen(item->node->name);
+        memcpy(c->path + f->pathlen, item->node->name, nlen);
+
+        if (!item->subtree) {
+            c->path[f->pathlen + nlen] = '\0';
+            *len = f->pathlen + nlen;
+            return c->path;
+        }
 
+        c->path[f->pathlen + nlen] = '/';
+        c->top++;
+        _ramfs_cursor_load(c, item->node, f->pathlen + nlen + 1);
     }
 
-    fs_node_t *node = calloc_or_die(1, sizeof(fs_node_t));
-    node->parent = parent;
-    node->name = namecopy;
-    node->type = type;
-    node->data.raw = data;
-    node->depth = depth;
+    return NULL;
+}
 
-    // If node is not root, add it to its parent
-    if (parent != NULL)
-        // If node already exists, error
-        if (ht_setitem(parent->data.children, namecopy, node) != 0) {
-            // We malloc'd memory so we need to free it.
-            // The chance this event happens is so low that checking for
-            // it earlier is worse than cleaning up.
-#ifdef DEBUG
-            fprintf(stderr, "mknode %s parent %s failed: node exists\n", name, parent->name);
-#endif
-            free(node);
-            return NULL;
-        }
-    return node;
+/*
+ * Release the memory used by cursor `c`.
+ */
+
+void ramfs_find_close(fs_find_cursor_t *c) {
+    for (int i = 0; i < 256; i++)
+        free(c->stack[i].items);
+    free(c->path);
+    _ramfs_tree_unlock(c->meta);
 }
 
 /*
- * (Internal) Delete node `node` and free its content. If
- * `no_rm_from_parent` is true, it is not removed from its parent.
- * Returns 0 on success, -1 on error.
+ * Search the content of the files at or under `path` for the `plen`
+ * bytes at `pattern`, either as a literal (MATCH_SUBSTR, may contain
+ * NUL bytes) or as a regex (MATCH_REGEX, see `match_re_compile`).
+ * Directories are handed out to threads like in `ramfs_find_walk`,
+ * large files are too, so that they are scanned in parallel.
+ * Returns the sorted paths of the matching files, laid out like the
+ * results of `ramfs_find`. The number of results is stored into
+ * `nres`. Nothing matches if the path does not exist or the regex is
+ * too long.
  */
 
-int _ramfs_rmnode(fs_node_t *node, uint8_t no_rm_from_parent) {
-    // Make sure directory is empty
-    if (node->type == TYPE_DIR && node->data.children->used > 0) {
-#ifdef DEBUG
-        fprintf(stderr, "rmnode %s failed: directory not empty\n", node->name);
-        dump_node(node);
-#endif
-        return -1;
+char **ramfs_grep(fs_node_t *root, char *path, match_kind_t kind, char *pattern, size_t plen, size_t *nres) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    char *newnode = NULL;
+    fs_node_t *locked = NULL;
+    fs_node_t *node = _ramfs_resolve_node(root, path, &newnode, false, meta->rcu ? NULL : &locked);
+    fs_find_res_t res = {0};
+    unsigned int nthreads = 1;
+    fs_find_par_t par;
+    match_re_t re;
+    walker_t w;
+    char **results;
+
+    // Files are locked one at a time while being scanned
+    _ramfs_reader_lock(meta);
+    if (locked != NULL)
+        _ramfs_unlock(locked);
+
+    if (node == NULL || newnode != NULL || _ramfs_detached(meta, node) ||
+        (kind == MATCH_REGEX && match_re_compile(&re, pattern) != 0)) {
+        _ramfs_reader_unlock(meta);
+        return _ramfs_find_res_finish(&res, nres);
     }
 
-    // Destroy node data
-    if (node->type == TYPE_DIR) {
-        ht_del(node->data.children);
-    } else {
-        free(node->data.content);
-    }
+    if (meta->threads > 1 && (__atomic_load_n(&meta->nodes, __ATOMIC_RELAXED) >= FIND_PAR_MIN_NODES ||
+                              __atomic_load_n(&meta->bytes, __ATOMIC_RELAXED) >= GREP_PAR_MIN_BYTES))
+        nthreads = meta->threads;
+
+    _ramfs_find_par_init(&par, pattern, nthreads);
+    par.klen = plen;
+    par.kind = kind;
+    par.re = &re;
+    walker_run(&w, node, nthreads, _ramfs_grep_visit, _ramfs_find_done, &par);
+    results = _ramfs_find_par_merge(&par, nres);
+    _ramfs_reader_unlock(meta);
+    return results;
+}
 
-    // Remove from parent (unless no_rm_from_parent is true)
-    if (!no_rm_from_parent && node->parent != NULL)
-        ht_delitem(node->parent->data.children, node->name);
+/*
+ * Set the number of threads used by find on the file system rooted
+ * at `root`.
+ */
 
-    // Destroy node
-    free(node->name);
-    node->name = NULL;
-    free(node);
+void ramfs_set_threads(fs_node_t *root, unsigned int nthreads) {
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > WALKER_MAX_THREADS)
+        nthreads = WALKER_MAX_THREADS;
+    FS_DIR(root)->meta->threads = nthreads;
+}
 
-    return 0;
+/*
+ * Returns the find cache of the file system of `root`, to read its
+ * counters.
+ */
+
+const fs_find_cache_t *ramfs_find_cache(fs_node_t *root) {
+    return &FS_DIR(root)->meta->cache;
 }
 
+/*
+ * Make the file system rooted at `root` safe to use from several
+ * threads at once. Path lookups lock one directory after the other,
+ * releasing each one once its child is locked, so that threads working
+ * in different subtrees don't wait for each other; file contents have
+ * their own locks. Finds and greps only block nodes from being added
+ * or removed. It must be called before any other thread uses the file
+ * system, and can't be undone.
+ */
+
+void ramfs_set_concurrent(fs_node_t *root) {
+    FS_DIR(root)->meta->concurrent = FS_LOCK_TREE | FS_LOCK_NODES;
+}
 
 /*
- * (Internal) Recursively delete node `node` and all its children. If
- * `no_rm_from_parent` is used internally to speed up deletion.
- * It should always be 0/false.
- * Returns 0 if all nodes were removed, -1 otherwise.
+ * Like `ramfs_set_concurrent`, but reads, path lookups and finds take
+ * no locks and write no shared memory. Children tables and file
+ * contents are never changed in place: writers replace them with a
+ * modified copy, and what they replace or remove is only freed once
+ * every reader went through a quiescent state. Threads reading the
+ * file system must be registered with `ramfs_rcu_register` and call
+ * `ramfs_rcu_quiescent` regularly, when they hold no pointers into
+ * it: the content returned by `ramfs_read` stays valid until then.
+ * Writes to the tree still lock it and wait for each other.
  */
 
-int _ramfs_rmnode_r(fs_node_t *node, uint8_t no_rm_from_parent) {
-    size_t i;
-    ht_item_t *item;
-    int error = 0;
+void ramfs_set_rcu(fs_node_t *root) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_rcu_t *rcu = calloc_or_die(1, sizeof(fs_rcu_t));
 
-    // Node has children
-    if (node->type == TYPE_DIR && node->data.children->used > 0) {
-        for (i = 0; i < node->data.children->size; i++) {
-            if (node->data.children->body[i].key == NULL)
-                continue;
-            item = &node->data.children->body[i];
-            // Always use no_rm_from_parent when recursively calling self
-            // Hashtable is going to be deleted anyway, no need to remove
-            // children from parent.
-            error |= _ramfs_rmnode_r(item->val, true);
-        }
-        node->data.children->used = 0;
-    }
+    rcu->epoch = 1;
+    pthread_mutex_init(&rcu->lock, NULL);
+    meta->rcu_state = rcu;
+    meta->rcu = 1;
+    meta->concurrent = FS_LOCK_TREE | FS_LOCK_NODES;
+}
 
-    // Node is (now) a leaf
-    if (node->parent != NULL  // node is not root and
-        && (node->type == TYPE_FILE // (node is file or
-            || (node->type == TYPE_DIR // node is dir and
-                && node->data.children->used == 0))) { // dir is empty)
-        error |= _ramfs_rmnode(node, no_rm_from_parent);
-    }
+/*
+ * Make `delete_r` reply right away on large directories: the subtree
+ * is unlinked from its parent, and its nodes are freed later in
+ * slices of FS_REAP_SLICE, holding the tree lock for each one, so
+ * that writers wait for a slice at most. Until then they are skipped
+ * by finds. If `thread` is true the file system frees them on a
+ * thread of its own, and takes the tree lock even if it is used by a
+ * single thread; otherwise its user does, by calling `ramfs_reap`.
+ * It must be called before any other thread uses the file system,
+ * and can't be undone: the thread exits, once it freed everything,
+ * together with the root.
+ */
 
-    return error != 0 ? -1 : 0;
+void ramfs_set_reaper(fs_node_t *root, uint8_t thread) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_reaper_t *reaper = calloc_or_die(1, sizeof(fs_reaper_t));
+
+    pthread_mutex_init(&reaper->lock, NULL);
+    pthread_cond_init(&reaper->cond, NULL);
+    reaper->threaded = thread;
+    reaper->sp = -1;
+    meta->reaper = reaper;
+    if (!thread)
+        return;
+    meta->concurrent |= FS_LOCK_TREE;
+    if (pthread_create(&reaper->thread, NULL, _ramfs_reaper_thread, meta) != 0)
+        exit(4);
 }
 
 /*
- * (Internal) Returns human-readable path of `node` up to the root node.
+ * Free the next FS_REAP_SLICE nodes of the directories unlinked by
+ * `delete_r`, if the reaper of the file system of `root` has no
+ * thread (see `ramfs_set_reaper`).
+ * Returns true if some are left.
  */
 
-char *_ramfs_getpath(fs_node_t *node) {
-    char *dirnames[255] = {0};
-    fs_node_t *n = node;
+uint8_t ramfs_reap(fs_node_t *root) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_reaper_t *reaper = meta->reaper;
 
-    unsigned int len = 256;
-    unsigned int pos = 0;
-    char *string = malloc_or_die(len * sizeof(char));
-    char *tmp;
+    if (reaper == NULL || reaper->threaded || (reaper->sp < 0 && reaper->count == 0))
+        return false;
+    return _ramfs_reap_slice(meta);
+}
 
-    for (; n != NULL; n = n->parent)
-        dirnames[n->depth] = n->name;
+/*
+ * Register the calling thread as a reader of the file system of
+ * `root`, in RCU mode. It counts as being in a read-side critical
+ * section until its next call to `ramfs_rcu_quiescent`.
+ * Returns the reader id, or -1 if there are too many readers.
+ */
 
-    string[0] = '/';
-    pos++;
+int ramfs_rcu_register(fs_node_t *root) {
+    fs_rcu_t *rcu = FS_DIR(root)->meta->rcu_state;
+    uint64_t free_slot;
 
-    for (int i = 1; i <= 255 && dirnames[i] != NULL; i++) {
-        tmp = dirnames[i];
-        for (int j = 0; tmp != NULL && tmp[j] != '\0'; j++) {
-            // len-3 to make sure there are some spare chars
-            if (pos + 1 > len - 3) {
-                len += 256;
-                string = realloc_or_die(string, len);
-            }
-            string[pos] = tmp[j];
-            pos++;
-        }
-        string[pos] = '/';
-        pos++;
+    for (int i = 0; i < FS_RCU_MAX_READERS; i++) {
+        free_slot = 0;
+        if (__atomic_compare_exchange_n(&rcu->readers[i].epoch, &free_slot,
+                                        __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST),
+                                        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return i;
     }
+    return -1;
+}
 
-    // Remove trailing / if node is not directory
-    if (node->type != TYPE_DIR)
-        pos--;
+/*
+ * Report that reader `id` holds no pointers into the file system of
+ * `root`: everything retired so far may be freed as far as it is
+ * concerned. Only its own cache line is written.
+ */
 
-    // Terminate key
-    string[pos] = '\0';
+void ramfs_rcu_quiescent(fs_node_t *root, int id) {
+    fs_rcu_t *rcu = FS_DIR(root)->meta->rcu_state;
 
-    return string;
+    __atomic_store_n(&rcu->readers[id].epoch, __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
 }
 
 /*
- * (Internal) Walk tree starting from `root` to find the node at `path`.
- * If the node is found, it is returned. If the node was not found, but
- * its direct parent was, the parent is returned and the new node name
- * is stored into `newname`, so that the new node can be created.
- * Otherwise, NULL is returned.
+ * Unregister reader `id` of the file system of `root`. It must hold
+ * no pointers into it.
  */
 
-fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname) {
-    char *saveptr = NULL;
-    char *tok;
-    fs_node_t *node;
-    fs_node_t *nodes[2] = {0};
-    *nodes = root;
-    uint8_t pos = 1;
-    uint16_t count = 1;
+void ramfs_rcu_unregister(fs_node_t *root, int id) {
+    __atomic_store_n(&FS_DIR(root)->meta->rcu_state->readers[id].epoch, 0, __ATOMIC_RELEASE);
+}
 
-    if ((tok = strtok_depau(path, "/", &saveptr)) != NULL && count <= 255) {
-        do {
-            if (strcmp(tok, "") == 0)
-                continue;
+/*
+ * Take a snapshot of the file system of `root`, in constant time.
+ * Nothing is copied until the tree is changed: writers then preserve
+ * the children table or content of each node they change, once per
+ * snapshot, and removed nodes are only freed once no snapshot can see
+ * them. The snapshot can be read from any thread, without locking
+ * the tree, until it is released.
+ * Returns the snapshot.
+ */
+
+fs_snapshot_t *ramfs_snapshot(fs_node_t *root) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_snapshot_t *snap;
+
+    _ramfs_snap_freeze(meta);
+    snap = _ramfs_snap_take(meta, root);
+    _ramfs_snap_thaw(meta);
+    return snap;
+}
+
+/*
+ * Release snapshot `snap`. What it preserved is handed to the next
+ * older snapshot if that one needs it too, and freed otherwise.
+ */
+
+void ramfs_snapshot_release(fs_snapshot_t *snap) {
+    fs_meta_t *meta = snap->meta;
+    fs_snapshot_t *older = snap->older;
+    fs_snap_state_t *st, *mine;
+    fs_node_t *node;
+
+    _ramfs_snap_freeze(meta);
+    for (size_t i = 0; i < snap->states_size; i++) {
+        st = &snap->states[i];
+        if (st->node == NULL)
+            continue;
+        // The older snapshot would have found this state here, unless
+        // it has one of its own
+        if (older != NULL && st->node->born < older->epoch &&
+            ((mine = _ramfs_snap_slot(older, st->node)) == NULL || mine->node == NULL))
+            _ramfs_snap_insert(older, st->node, st->data, st->size);
+        else
+            _ramfs_dispose(meta, st->data, st->node->type == TYPE_DIR ? RCU_TABLE : RCU_CONTENT);
+    }
+    for (size_t i = 0; i < snap->nburied; i++) {
+        node = snap->buried[i];
+        if (older != NULL && node->born < older->epoch) {
+            if (older->nburied == older->buried_size) {
+                older->buried_size = older->buried_size > 0 ? older->buried_size * 2 : FIND_ARRAY_SIZE;
+                older->buried = realloc_or_die(older->buried, older->buried_size * sizeof(fs_node_t *));
+            }
+            older->buried[older->nburied++] = node;
+        } else {
+            _ramfs_dispose(meta, node, RCU_NODE);
+        }
+    }
+
+    if (older != NULL)
+        older->newer = snap->newer;
+    if (snap->newer != NULL)
+        snap->newer->older = older;
+    else
+        meta->snaps = older;
+    _ramfs_snap_thaw(meta);
+
+    free(snap->states);
+    free(snap->buried);
+    free(snap);
+}
+
+/*
+ * Like `ramfs_read_n`, but reads the file at `path` as it was when
+ * snapshot `snap` was taken. The content stays valid until the
+ * snapshot is released.
+ */
+
+char *ramfs_snapshot_read(fs_snapshot_t *snap, char *path, size_t *len) {
+    fs_node_t *node = _ramfs_snap_resolve(snap, path);
+    char *content;
+    uint32_t size;
+
+    if (node == NULL || node->type != TYPE_FILE)
+        return NULL;
+    content = _ramfs_snap_content(snap, node, &size);
+    *len = size;
+    return content;
+}
+
+/*
+ * Like `ramfs_find_in`, but searches the tree as it was when snapshot
+ * `snap` was taken, by walking it.
+ */
+
+char **ramfs_snapshot_find(fs_snapshot_t *snap, char *path, char *keyword, unsigned int maxdepth, size_t *nres) {
+    fs_node_t *dir = _ramfs_snap_resolve(snap, path);
+    fs_find_res_t res = {0};
+
+    if (dir != NULL && dir->type == TYPE_DIR)
+        _ramfs_snap_find(snap, dir, keyword, maxdepth, &res);
+    return _ramfs_find_res_finish(&res, nres);
+}
+
+/*
+ * Start task `t`: a `ramfs_find_in` of `keyword` under the directory
+ * at `path`, at most `maxdepth` levels below it, or a `ramfs_find` if
+ * `path` is NULL, run a slice at a time by `ramfs_task_step` against
+ * a snapshot of the file system of `root`. If `count_only` is true
+ * the results are only counted, like `ramfs_count_in` does. Neither
+ * `path` nor `keyword` are changed or kept, and the find cache is
+ * left alone.
+ * Returns 0 if the task was started, -1 if `path` is not a directory
+ * or there is less than FS_TASK_MIN_WORK to do: nothing was done
+ * then, and the search is better run the usual way.
+ */
+
+int ramfs_task_find(fs_task_t *t, fs_node_t *root, char *path, char *keyword, unsigned int maxdepth,
+                    uint8_t count_only) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_name_entry_t *entry;
+    fs_snapshot_t *snap;
+    fs_node_t *dir = root;
+    fs_node_t **nodes = NULL;
+    size_t nnodes = 0, len;
+    char *copy;
+
+    if (maxdepth == 0)
+        return -1;
+
+    // The nodes named `keyword` are exactly the ones the snapshot sees
+    _ramfs_snap_freeze(meta);
+    snap = _ramfs_snap_take(meta, root);
+    if ((entry = ht_getitem(meta->names, keyword)) != NULL && entry->count >= FS_TASK_MIN_WORK) {
+        nodes = malloc_or_die(entry->count * sizeof(fs_node_t *));
+        for (uint32_t i = 0; i < entry->count; i++)
+            if (!_ramfs_detached(meta, entry->nodes[i]))
+                nodes[nnodes++] = entry->nodes[i];
+    }
+    _ramfs_snap_thaw(meta);
+
+    if (path != NULL) {
+        len = strlen(path);
+        copy = memcpy(malloc_or_die(len + 1), path, len + 1);
+        dir = _ramfs_snap_resolve(snap, copy);
+        free(copy);
+    }
+    // Walking is cheaper than checking more nodes than there are under
+    // the directory, but the count is fewer than either anyway
+    if (nnodes < FS_TASK_MIN_WORK || dir == NULL || dir->type != TYPE_DIR ||
+        __atomic_load_n(&FS_DIR(dir)->nodes, __ATOMIC_RELAXED) < FS_TASK_MIN_WORK) {
+        free(nodes);
+        ramfs_snapshot_release(snap);
+        return -1;
+    }
+
+    _ramfs_task_init(t, snap, dir, maxdepth, (uint8_t) (nnodes > FS_DIR(dir)->nodes));
+    len = strlen(keyword);
+    t->keyword = memcpy(malloc_or_die(len + 1), keyword, len + 1);
+    t->klen = len;
+    t->count_only = count_only;
+    if (t->top < 0) {
+        t->nodes = nodes;
+        t->nnodes = nnodes;
+    } else {
+        free(nodes);
+    }
+    return 0;
+}
+
+/*
+ * Start task `t`, a `ramfs_grep` of the `plen` bytes at `pattern`
+ * under the directory at `path`, like `ramfs_task_find`. Neither
+ * `path` nor `pattern` are changed or kept.
+ * Returns 0 if the task was started, -1 if `path` is not a directory
+ * with at least FS_TASK_MIN_WORK nodes or the regex is too long.
+ */
+
+int ramfs_task_grep(fs_task_t *t, fs_node_t *root, char *path, match_kind_t kind, char *pattern, size_t plen) {
+    size_t len = strlen(path);
+    char *copy = memcpy(malloc_or_die(len + 1), path, len + 1);
+    fs_snapshot_t *snap = ramfs_snapshot(root);
+    fs_node_t *dir = _ramfs_snap_resolve(snap, copy);
+
+    free(copy);
+    if (dir == NULL || dir->type != TYPE_DIR ||
+        __atomic_load_n(&FS_DIR(dir)->nodes, __ATOMIC_RELAXED) < FS_TASK_MIN_WORK) {
+        ramfs_snapshot_release(snap);
+        return -1;
+    }
+
+    _ramfs_task_init(t, snap, dir, FIND_DEPTH_ALL, true);
+    t->grep = 1;
+    t->kind = kind;
+    // Regex classes point into the pattern
+    t->keyword = memcpy(malloc_or_die(plen + 1), pattern, plen);
+    t->keyword[plen] = '\0';
+    t->klen = plen;
+    if (kind == MATCH_REGEX && match_re_compile(&t->re, t->keyword) != 0) {
+        ramfs_task_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run task `t` until `deadline` (see `now_ns`) is past, or until all
+ * its results are found. Those found meanwhile are sorted.
+ * Returns true once they are all found, see `ramfs_task_next`.
+ */
+
+uint8_t ramfs_task_step(fs_task_t *t, uint64_t deadline) {
+    fs_find_par_t *runs = &t->runs;
+
+    if (t->done)
+        return true;
+
+    // Room for the results of this slice
+    if (runs->nthreads == t->runs_size) {
+        t->runs_size = t->runs_size > 0 ? t->runs_size * 2 : 16;
+        runs->res = realloc_or_die(runs->res, t->runs_size * sizeof(fs_find_res_t));
+        runs->sorted = realloc_or_die(runs->sorted, t->runs_size * sizeof(char **));
+        memset(runs->res + runs->nthreads, 0, (t->runs_size - runs->nthreads) * sizeof(fs_find_res_t));
+        memset(runs->sorted + runs->nthreads, 0, (t->runs_size - runs->nthreads) * sizeof(char **));
+    }
+
+    if (t->top >= 0)
+        _ramfs_task_walk(t, deadline);
+    else
+        _ramfs_task_index(t, deadline);
+
+    // An empty run is filled by the next slice instead
+    if (runs->res[runs->nthreads].count > 0)
+        _ramfs_find_sort(runs, runs->nthreads++);
+    t->done = (uint8_t) (t->top < 0 && t->next == t->nnodes);
+    return t->done;
+}
+
+/*
+ * Returns the path of the next result of task `t` in sorted order,
+ * once `ramfs_task_step` found them all, and stores its length into
+ * `len`, or NULL if there are no more. The path stays valid until
+ * the task is closed.
+ */
+
+char *ramfs_task_next(fs_task_t *t, size_t *len) {
+    fs_find_par_t *runs = &t->runs;
+    size_t n = runs->nthreads > 0 ? runs->nthreads : 1;
+    unsigned int j;
+    char *path;
+
+    // Every run has results
+    if (t->heap == NULL) {
+        t->heap = malloc_or_die(n * sizeof(unsigned int));
+        t->pos = calloc_or_die(n, sizeof(size_t));
+        for (j = 0; j < runs->nthreads; j++)
+            t->heap[t->hlen++] = j;
+        for (size_t i = t->hlen / 2; i-- > 0;)
+            _ramfs_find_sift(runs, t->heap, t->hlen, t->pos, i);
+    }
+    if (t->hlen == 0)
+        return NULL;
+
+    j = t->heap[0];
+    path = runs->sorted[j][t->pos[j]];
+    if (++t->pos[j] == runs->res[j].count)
+        t->heap[0] = t->heap[--t->hlen];
+    _ramfs_find_sift(runs, t->heap, t->hlen, t->pos, 0);
+    *len = strlen(path);
+    return path;
+}
+
+/*
+ * Release task `t`, whether it is over or not, and its snapshot.
+ */
+
+void ramfs_task_close(fs_task_t *t) {
+    for (size_t j = 0; j < t->runs_size; j++) {
+        free(t->runs.res[j].arena);
+        free(t->runs.res[j].offs);
+        free(t->runs.sorted[j]);
+    }
+    free(t->runs.res);
+    free(t->runs.sorted);
+    free(t->heap);
+    free(t->pos);
+    free(t->nodes);
+    free(t->path);
+    free(t->keyword);
+    ramfs_snapshot_release(t->snap);
+}
+
+/*
+ * Start an empty batch of operations in `txn`.
+ */
+
+void ramfs_txn_init(fs_txn_t *txn) {
+    memset(txn, 0, sizeof(fs_txn_t));
+}
+
+/*
+ * Queue operation `op` on `path` in batch `txn`. The path is copied.
+ * The `len` bytes at `content` are the content of a write, allocated
+ * like for `ramfs_write_adopt`: the batch owns them afterwards.
+ */
+
+void ramfs_txn_add(fs_txn_t *txn, fs_txn_op_t op, char *path, char *content, size_t len) {
+    size_t plen = strlen(path);
+    fs_txn_item_t *item;
+
+    if (txn->count == txn->size) {
+        txn->size = txn->size > 0 ? txn->size * 2 : FIND_ARRAY_SIZE;
+        txn->items = realloc_or_die(txn->items, txn->size * sizeof(fs_txn_item_t));
+    }
+    item = &txn->items[txn->count++];
+    memset(item, 0, sizeof(fs_txn_item_t));
+    item->op = op;
+    item->path = malloc_or_die(plen + 1);
+    memcpy(item->path, path, plen + 1);
+    item->content = content;
+    item->len = len;
+    item->pos = txn->count;
+}
+
+/*
+ * Apply the operations of batch `txn` to the file system of `root` in
+ * order, as if each one ran on its own, but only if none of them
+ * fails. Every path is resolved once, and every operation is checked
+ * against what the ones before it leave, before anything is changed.
+ * In concurrent mode the directories it goes through are locked
+ * meanwhile, from the root down, and the tree lock is held while it
+ * is applied, so path lookups, finds and greps of other threads never
+ * see the batch half done. Readers in RCU mode take no locks, and
+ * may: tables and contents are published one at a time.
+ * The batch is emptied.
+ * Returns 0 on success, or -1 if nothing was changed because the
+ * operation at position `txn->failed` would fail.
+ */
+
+int ramfs_txn_commit(fs_node_t *root, fs_txn_t *txn) {
+    int ret;
+
+    if ((ret = _ramfs_txn_check(root, txn)) == 0)
+        _ramfs_txn_apply(root, txn);
+    _ramfs_txn_unlock(txn, (uint8_t) (ret == 0));
+    ramfs_txn_clear(txn);
+    return ret;
+}
+
+/*
+ * Drop the operations queued in batch `txn`, with the content of their
+ * writes, and everything checking them learned about the tree.
+ */
+
+void ramfs_txn_clear(fs_txn_t *txn) {
+    fs_txn_node_t *n, *next;
+
+    for (size_t i = 0; i < txn->count; i++) {
+        free(txn->items[i].path);
+        free(txn->items[i].content);
+    }
+    free(txn->items);
+    for (n = txn->nodes; n != NULL; n = next) {
+        next = n->next;
+        if (n->children != NULL)
+            ht_del(n->children);
+        free(n);
+    }
+    txn->items = NULL;
+    txn->count = txn->size = 0;
+    txn->nodes = NULL;
+}
+
+// Internal functions
+
+/*
+ * (Internal) Creates a new node of type `type` named `name` under `parent`
+ * and returns it. If `parent` and `name` are NULL and `type` is TYPE_DIR,
+ * a root node is created. If `data` is NULL, an hash table will be created
+ * for TYPE_DIR, and an empty string for TYPE_FILE.
+ * If node couldn't be created, NULL is returned.
+ */
+
+fs_node_t *_ramfs_mknode(fs_node_t *parent, char *name, fs_node_type_t type, void *data) {
+    fs_node_t *node = _ramfs_node_new(parent, name, type, data);
+    fs_meta_t *meta;
+
+    if (node == NULL || parent == NULL)
+        return node;
+
+    meta = FS_DIR(parent)->meta;
+    _ramfs_tree_lock(meta, true);
+    node = _ramfs_node_link(parent, node);
+    _ramfs_tree_unlock(meta);
+    return node;
+}
+
+/*
+ * (Internal) Allocate the node `_ramfs_mknode` creates, without adding
+ * it to `parent`, see `_ramfs_node_link`. A root is complete already.
+ * Returns NULL if the node can't be created.
+ */
+
+fs_node_t *_ramfs_node_new(fs_node_t *parent, char *name, fs_node_type_t type, void *data) {
+    char *namecopy = NULL;
+
+    // Files don't have children
+    if (parent != NULL && parent->type == TYPE_FILE) {
+#ifdef DEBUG
+        fprintf(stderr, "mknode %s parent %s failed: file can't have children\n", name, parent->name);
+#endif
+        return NULL;
+    }
+    // Unless the node is root and is a directory, name can't be empty or NULL
+    if ((parent == NULL && type != TYPE_DIR) ||
+        (parent != NULL && (name == NULL || strlen(name) == 0))) {
+#ifdef DEBUG
+        fprintf(stderr, "mknode %s parent %s failed: empty name\n", name, parent->name);
+#endif
+        return NULL;
+    }
+    // If node is root, name must be NULL
+    if (parent == NULL && name != NULL) {
+#ifdef DEBUG
+        fprintf(stderr, "mknode %s failed: root node can't have a name\n", name);
+#endif
+        return NULL;
+    }
+
+    if (name != NULL) {
+        // Check max name length
+        size_t nlen = strlen(name);
+        if (nlen > MAX_NAME_LENGTH) {
+#ifdef DEBUG
+            fprintf(stderr, "create node %s failed: name too long\n", name);
+#endif
+            return NULL;
+        }
+
+        namecopy = calloc_or_die(nlen + 1, sizeof(char));
+        // Copy the name so it isn't freed later
+        strcpy(namecopy, name);
+    }
+
+
+    if (data == NULL && type == TYPE_DIR)
+        data = ht_new();
+    else if (data == NULL && type == TYPE_FILE)
+        data = calloc_or_die(1, sizeof(char));
+
+    uint8_t depth = (uint8_t) (parent != NULL ? parent->depth + 1 : 0);
+
+    if (parent != NULL && depth == 0) {
+        // Overflow <3 maximum depth exceeded
+#ifdef DEBUG
+        fprintf(stderr, "mknode %s parent %s failed: maximum depth reached\n", name, parent->name);
+#endif
+        return NULL;
+    }
+
+    if (parent != NULL && parent->data.children->used >= MAX_CHILDREN) {
+        // Parent can't accept more children
+#ifdef DEBUG
+        fprintf(stderr, "mknode %s parent %s failed: maximum number of children reached\n", name, parent->name);
+#endif
+        return NULL;
+
+    }
+
+    // Directories carry a pointer to the file system state
+    fs_node_t *node = calloc_or_die(1, type == TYPE_DIR ? sizeof(fs_dir_node_t) : sizeof(fs_node_t));
+    node->parent = parent;
+    node->name = namecopy;
+    node->type = type;
+    node->data.raw = data;
+    node->depth = depth;
+
+    if (parent == NULL) {
+        fs_meta_t *meta = calloc_or_die(1, sizeof(fs_meta_t));
+
+        meta->names = ht_new();
+        meta->cache.entries = ht_new();
+        meta->threads = 1;
+        pthread_rwlock_init(&meta->lock, NULL);
+        for (int i = 0; i < FS_CONTENT_LOCKS; i++)
+            pthread_rwlock_init(&meta->content_locks[i], NULL);
+        pthread_mutex_init(&meta->cache_lock, NULL);
+        pthread_mutex_init(&meta->snap_lock, NULL);
+        FS_DIR(node)->meta = meta;
+    } else if (type == TYPE_DIR) {
+        FS_DIR(node)->meta = FS_DIR(parent)->meta;
+    }
+    if (type == TYPE_DIR)
+        pthread_rwlock_init(&FS_DIR(node)->lock, NULL);
+    return node;
+}
+
+/*
+ * (Internal) Add `node`, allocated by `_ramfs_node_new`, to its
+ * parent `parent`. The tree lock must be held for writing.
+ * Returns `node`, or NULL if `parent` has a child with its name, in
+ * which case it is freed.
+ */
+
+fs_node_t *_ramfs_node_link(fs_node_t *parent, fs_node_t *node) {
+    fs_meta_t *meta = FS_DIR(parent)->meta;
+    uint32_t pos[FS_BLOOM_HASHES];
+
+    // Snapshots taken so far can't see it
+    node->born = node->saved = meta->snap_epoch;
+    // If node already exists, error
+    if (_ramfs_children_add(parent, node->name, node) != 0) {
+        // We malloc'd memory so we need to free it.
+        // The chance this event happens is so low that checking for
+        // it earlier is worse than cleaning up.
+#ifdef DEBUG
+        fprintf(stderr, "mknode %s parent %s failed: node exists\n", node->name, parent->name);
+#endif
+        if (node->type == TYPE_DIR) {
+            pthread_rwlock_destroy(&FS_DIR(node)->lock);
+            ht_del(node->data.children);
+        } else {
+            free(node->data.content);
+        }
+        free(node->name);
+        free(node);
+        return NULL;
+    }
+
+    _ramfs_index_add(meta, node);
+    _ramfs_bloom_pos(node->name, pos);
+    for (fs_node_t *up = parent; up != NULL; up = up->parent) {
+        __atomic_store_n(&FS_DIR(up)->nodes, FS_DIR(up)->nodes + 1, __ATOMIC_RELAXED);
+        _ramfs_bloom_add(up, pos);
+    }
+    return node;
+}
+
+/*
+ * (Internal) Delete node `node` and free its content. If
+ * `no_rm_from_parent` is true, it is not removed from its parent.
+ * The parent must be locked for writing.
+ * Returns 0 on success, -1 on error.
+ */
+
+int _ramfs_rmnode(fs_node_t *node, uint8_t no_rm_from_parent) {
+    fs_meta_t *meta = _ramfs_meta(node);
+    int ret;
+
+    // Wait for the lookups going through the directory
+    if (node->type == TYPE_DIR)
+        _ramfs_lock(node, true);
+
+    // Make sure directory is empty
+    if (node->type == TYPE_DIR && node->data.children->used > 0) {
+#ifdef DEBUG
+        fprintf(stderr, "rmnode %s failed: directory not empty\n", node->name);
+        dump_node(node);
+#endif
+        _ramfs_unlock(node);
+        return -1;
+    }
+
+    // The root takes the file system state, and its locks, with it
+    if (node->parent == NULL)
+        return _ramfs_rmnode_locked(node, no_rm_from_parent);
+
+    _ramfs_tree_lock(meta, true);
+    ret = _ramfs_rmnode_locked(node, no_rm_from_parent);
+    _ramfs_tree_unlock(meta);
+    return ret;
+}
+
+/*
+ * (Internal) Delete node `node`, which must be empty, like
+ * `_ramfs_rmnode`. The tree lock must be held for writing and, for a
+ * directory, its own lock too, which is released.
+ * Returns 0.
+ */
+
+int _ramfs_rmnode_locked(fs_node_t *node, uint8_t no_rm_from_parent) {
+    fs_meta_t *meta = _ramfs_meta(node);
+    // Readers may still be looking at it in RCU mode, and so may
+    // snapshots: it is freed together with its data later
+    uint8_t retire = meta->rcu && node->parent != NULL;
+
+    if (node->parent != NULL && _ramfs_snap_bury(node))
+        retire = 2;
+
+    // Destroy node data
+    if (node->type == TYPE_FILE)
+        __atomic_sub_fetch(&meta->bytes, node->size, __ATOMIC_RELAXED);
+    if (!retire && node->type == TYPE_DIR)
+        ht_del(node->data.children);
+    else if (!retire)
+        _ramfs_free_data(meta, node->data.content);
+
+    // Remove from parent (unless no_rm_from_parent is true)
+    if (!no_rm_from_parent && node->parent != NULL)
+        _ramfs_children_del(node->parent, node->name);
+
+    // Nobody can be waiting for it: that takes the parent lock
+    if (node->type == TYPE_DIR) {
+        _ramfs_unlock(node);
+        pthread_rwlock_destroy(&FS_DIR(node)->lock);
+    }
+
+    // Remove from the name index, or drop the file system state
+    // together with the root
+    if (node->parent != NULL) {
+        uint32_t pos[FS_BLOOM_HASHES];
+
+        _ramfs_index_del(FS_DIR(node->parent)->meta, node);
+        _ramfs_bloom_pos(node->name, pos);
+        for (fs_node_t *up = node->parent; up != NULL; up = up->parent) {
+            __atomic_store_n(&FS_DIR(up)->nodes, FS_DIR(up)->nodes - 1, __ATOMIC_RELAXED);
+            _ramfs_bloom_del(up, pos);
+        }
+    } else {
+        // Detached subtrees are still in the name index
+        if (meta->reaper != NULL)
+            _ramfs_reaper_stop(meta);
+        while (meta->snaps != NULL)
+            ramfs_snapshot_release(meta->snaps);
+        if (meta->rcu) {
+            _ramfs_rcu_reclaim(meta, true);
+            free(meta->rcu_state->retired);
+            pthread_mutex_destroy(&meta->rcu_state->lock);
+            free(meta->rcu_state);
+        }
+        ht_del(meta->names);
+        if (meta->trigrams != NULL)
+            tg_del(meta->trigrams);
+        _ramfs_cache_clear(&meta->cache);
+        pthread_rwlock_destroy(&meta->lock);
+        for (int i = 0; i < FS_CONTENT_LOCKS; i++)
+            pthread_rwlock_destroy(&meta->content_locks[i]);
+        pthread_mutex_destroy(&meta->cache_lock);
+        pthread_mutex_destroy(&meta->snap_lock);
+        // Nothing can point into the image any more
+        if (meta->image != NULL)
+            munmap(meta->image, meta->image_len);
+        free(meta->arena);
+        free(meta->bgsave);
+        free(meta);
+    }
+
+    // Destroy node, the root has no name and took `meta` with it
+    if (retire == 1)
+        _ramfs_rcu_retire(meta, node, RCU_NODE);
+    if (retire)
+        return 0;
+    if (node->parent != NULL) {
+        _ramfs_free_data(meta, node->name);
+        node->name = NULL;
+        _ramfs_free_node(meta, node);
+    } else {
+        free(node);
+    }
+
+    return 0;
+}
+
+
+/*
+ * (Internal) Recursively delete node `node` and all its children. If
+ * `no_rm_from_parent` is used internally to speed up deletion.
+ * It should always be 0/false. The parent must be locked for writing.
+ * Every directory of the subtree is locked first, from `node` down,
+ * and then the tree lock is held while the nodes are removed.
+ * Returns 0 if all nodes were removed, -1 otherwise.
+ */
+
+int _ramfs_rmnode_r(fs_node_t *node, uint8_t no_rm_from_parent) {
+    fs_meta_t *meta = _ramfs_meta(node);
+    fs_node_t *root = node->parent == NULL ? node : NULL;
+    int error;
+
+    // Large subtrees are left to the reaper
+    if (!no_rm_from_parent && _ramfs_detach(node))
+        return 0;
+
+    _ramfs_lock_r(node);
+    _ramfs_tree_lock(meta, true);
+    error = _ramfs_rmnode_r_locked(node, no_rm_from_parent);
+    _ramfs_tree_unlock(meta);
+
+    // The root is only emptied
+    if (root != NULL)
+        _ramfs_unlock(root);
+    return error;
+}
+
+/*
+ * (Internal) Lock directory `node` and all the directories below it
+ * for writing, parents first, so that no lookup is left inside.
+ */
+
+void _ramfs_lock_r(fs_node_t *node) {
+    ht_t *children;
+
+    if (node->type != TYPE_DIR || !(FS_DIR(node)->meta->concurrent & FS_LOCK_NODES))
+        return;
+
+    _ramfs_lock(node, true);
+    children = node->data.children;
+    for (size_t i = 0; i < children->size; i++)
+        if (children->body[i].key != NULL)
+            _ramfs_lock_r(children->body[i].val);
+}
+
+/*
+ * (Internal) Unlink directory `node` from its parent, which must be
+ * locked for writing, and hand it over to the reaper, if there is one
+ * and the subtree has more than FS_REAP_SLICE nodes. They are taken
+ * out of the counts and summaries of the directories above at once,
+ * and `node` loses its parent: writers still inside it in concurrent
+ * mode stop there when counting theirs. Not done while a snapshot is
+ * alive, as snapshots build paths through the parents.
+ * Returns true if the subtree was detached.
+ */
+
+uint8_t _ramfs_detach(fs_node_t *node) {
+    fs_meta_t *meta = _ramfs_meta(node);
+    fs_reaper_t *reaper = meta->reaper;
+    fs_node_t *parent = node->parent;
+    uint32_t pos[FS_BLOOM_HASHES];
+    size_t n;
+
+    if (reaper == NULL || parent == NULL || node->type != TYPE_DIR ||
+        __atomic_load_n(&FS_DIR(node)->nodes, __ATOMIC_RELAXED) < FS_REAP_SLICE)
+        return false;
+
+    _ramfs_tree_lock(meta, true);
+    if (meta->snaps != NULL) {
+        _ramfs_tree_unlock(meta);
+        return false;
+    }
+    n = FS_DIR(node)->nodes + 1;
+    _ramfs_children_del(parent, node->name);
+    _ramfs_bloom_pos(node->name, pos);
+    for (fs_node_t *up = parent; up != NULL; up = up->parent) {
+        __atomic_store_n(&FS_DIR(up)->nodes, FS_DIR(up)->nodes - n, __ATOMIC_RELAXED);
+        _ramfs_bloom_sub(up, node);
+        _ramfs_bloom_del(up, pos);
+    }
+    __atomic_store_n(&node->parent, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&meta->detached, meta->detached + 1, __ATOMIC_RELAXED);
+    // Its nodes leave the name index one by one, long after this
+    _ramfs_cache_flush(meta);
+    _ramfs_tree_unlock(meta);
+
+    pthread_mutex_lock(&reaper->lock);
+    if (reaper->count == reaper->size) {
+        reaper->size = reaper->size > 0 ? reaper->size * 2 : 16;
+        reaper->queue = realloc_or_die(reaper->queue, reaper->size * sizeof(fs_node_t *));
+    }
+    reaper->queue[reaper->count++] = node;
+    pthread_cond_signal(&reaper->cond);
+    pthread_mutex_unlock(&reaper->lock);
+    return true;
+}
+
+/*
+ * (Internal) Returns true if `node` of `meta` is in a subtree
+ * detached by `_ramfs_detach` and not freed yet: its topmost ancestor
+ * has a name, unlike the root. The tree lock must be held.
+ */
+
+uint8_t _ramfs_detached(fs_meta_t *meta, fs_node_t *node) {
+    if (__atomic_load_n(&meta->detached, __ATOMIC_RELAXED) == 0)
+        return false;
+    while (node->parent != NULL)
+        node = node->parent;
+    return (uint8_t) (node->name != NULL);
+}
+
+/*
+ * (Internal) Body of the reaper thread of file system `arg`: free the
+ * subtrees queued by `_ramfs_detach`, oldest last, until
+ * `_ramfs_reaper_stop` is called and the queue is empty.
+ */
+
+void *_ramfs_reaper_thread(void *arg) {
+    fs_meta_t *meta = arg;
+    fs_reaper_t *reaper = meta->reaper;
+
+    pthread_mutex_lock(&reaper->lock);
+    for (;;) {
+        while (reaper->count == 0 && !reaper->stop)
+            pthread_cond_wait(&reaper->cond, &reaper->lock);
+        if (reaper->count == 0)
+            break;
+        pthread_mutex_unlock(&reaper->lock);
+        while (_ramfs_reap_slice(meta))
+            sched_yield();
+        pthread_mutex_lock(&reaper->lock);
+    }
+    pthread_mutex_unlock(&reaper->lock);
+    return NULL;
+}
+
+/*
+ * (Internal) Free the next FS_REAP_SLICE slots of children tables of
+ * the detached subtrees of `meta`, going on with the one left by the
+ * previous slice or starting with the newest one queued, the
+ * children of each directory before it. The tree lock is held for
+ * writing meanwhile, the nodes are only freed afterwards: a single
+ * free can take long once the allocator holds millions of small free
+ * chunks.
+ * Returns true if some are left.
+ */
+
+uint8_t _ramfs_reap_slice(fs_meta_t *meta) {
+    fs_reaper_t *reaper = meta->reaper;
+    fs_find_frame_t *f;
+    fs_node_t *dead[FS_REAP_SLICE];
+    fs_node_t *child, *top;
+    size_t ndead = 0;
+    uint8_t more;
+
+    _ramfs_tree_lock(meta, true);
+    for (unsigned int work = 0; work < FS_REAP_SLICE; work++) {
+        if (reaper->sp < 0) {
+            pthread_mutex_lock(&reaper->lock);
+            top = reaper->count > 0 ? reaper->queue[--reaper->count] : NULL;
+            pthread_mutex_unlock(&reaper->lock);
+            if (top == NULL)
+                break;
+            _ramfs_reap_drain(meta, top);
+            reaper->sp = 0;
+            reaper->stack[0].dir = top;
+            reaper->stack[0].children = _ramfs_children(top);
+            reaper->stack[0].next = 0;
+        }
+
+        f = &reaper->stack[reaper->sp];
+        if (f->next == f->children->size) {
+            if (_ramfs_reap_node(meta, f->dir))
+                dead[ndead++] = f->dir;
+            if (reaper->sp-- == 0)
+                __atomic_store_n(&meta->detached, meta->detached - 1, __ATOMIC_RELAXED);
+        } else if (f->children->body[f->next].key == NULL) {
+            f->next++;
+        } else {
+            child = f->children->body[f->next++].val;
+            if (child->type == TYPE_DIR) {
+                _ramfs_reap_drain(meta, child);
+                f = &reaper->stack[++reaper->sp];
+                f->dir = child;
+                f->children = _ramfs_children(child);
+                f->next = 0;
+            } else if (_ramfs_reap_node(meta, child)) {
+                dead[ndead++] = child;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&reaper->lock);
+    more = (uint8_t) (reaper->sp >= 0 || reaper->count > 0);
+    pthread_mutex_unlock(&reaper->lock);
+    _ramfs_tree_unlock(meta);
+
+    for (size_t i = 0; i < ndead; i++)
+        _ramfs_dispose(meta, dead[i], RCU_NODE);
+    return more;
+}
+
+/*
+ * (Internal) Remove `node`, a detached node whose children were
+ * removed already, like `_ramfs_rmnode_locked` but leaving its parent
+ * alone. The tree lock must be held for writing.
+ * Returns true if it is to be disposed of, false if a snapshot keeps
+ * it.
+ */
+
+uint8_t _ramfs_reap_node(fs_meta_t *meta, fs_node_t *node) {
+    _ramfs_index_del(meta, node);
+    if (node->type == TYPE_FILE)
+        __atomic_sub_fetch(&meta->bytes, node->size, __ATOMIC_RELAXED);
+    else
+        pthread_rwlock_destroy(&FS_DIR(node)->lock);
+    meta->reaper->reaped++;
+    return (uint8_t) !_ramfs_snap_bury(node);
+}
+
+/*
+ * (Internal) Wait for the writers that were inside detached directory
+ * `dir` in concurrent mode, holding the tree lock for writing: nobody
+ * can enter it again, so its children table won't change anymore.
+ * The tree lock is let go meanwhile if some of them are still there.
+ */
+
+void _ramfs_reap_drain(fs_meta_t *meta, fs_node_t *dir) {
+    if (!(meta->concurrent & FS_LOCK_NODES))
+        return;
+    if (pthread_rwlock_trywrlock(&FS_DIR(dir)->lock) != 0) {
+        // They may be waiting for the tree lock
+        _ramfs_tree_unlock(meta);
+        pthread_rwlock_wrlock(&FS_DIR(dir)->lock);
+        _ramfs_tree_lock(meta, true);
+    }
+    pthread_rwlock_unlock(&FS_DIR(dir)->lock);
+}
+
+/*
+ * (Internal) Let the reaper of `meta` free the subtrees still queued,
+ * wait for its thread to exit, if it has one, and free it.
+ */
+
+void _ramfs_reaper_stop(fs_meta_t *meta) {
+    fs_reaper_t *reaper = meta->reaper;
+
+    if (!reaper->threaded) {
+        while (_ramfs_reap_slice(meta))
+            continue;
+    } else {
+        pthread_mutex_lock(&reaper->lock);
+        reaper->stop = 1;
+        pthread_cond_signal(&reaper->cond);
+        pthread_mutex_unlock(&reaper->lock);
+        pthread_join(reaper->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&reaper->lock);
+    pthread_cond_destroy(&reaper->cond);
+    free(reaper->queue);
+    free(reaper);
+    meta->reaper = NULL;
+}
+
+/*
+ * (Internal) Body of `_ramfs_rmnode_r`, once the subtree and the tree
+ * are locked.
+ */
+
+int _ramfs_rmnode_r_locked(fs_node_t *node, uint8_t no_rm_from_parent) {
+    fs_meta_t *meta = _ramfs_meta(node);
+    size_t i;
+    ht_item_t *item;
+    ht_t *children = node->type == TYPE_DIR ? node->data.children : NULL;
+    uint8_t keep = false;
+    int error = 0;
+
+    // In RCU mode the subtree is unlinked before any of it is retired,
+    // or readers past a quiescent state could still reach it. The root
+    // stays, with an empty table: the keys of the old one are freed,
+    // and a snapshot may take the old table.
+    if (node->parent == NULL && children->used > 0) {
+        if ((keep = _ramfs_snap_wants(node)))
+            _ramfs_snap_keep(node, children, 0);
+        __atomic_store_n(&node->data.children, ht_new(), __ATOMIC_RELEASE);
+    } else if (meta->rcu && node->parent != NULL && !no_rm_from_parent) {
+        _ramfs_children_del(node->parent, node->name);
+        no_rm_from_parent = true;
+    }
+
+    // Node has children
+    if (children != NULL && children->used > 0) {
+        for (i = 0; i < children->size; i++) {
+            if (children->body[i].key == NULL)
+                continue;
+            item = &children->body[i];
+            // Always use no_rm_from_parent when recursively calling self
+            // Hashtable is going to be deleted anyway, no need to remove
+            // children from parent.
+            error |= _ramfs_rmnode_r_locked(item->val, true);
+        }
+
+        if (node->parent == NULL && !keep)
+            _ramfs_dispose(meta, children, RCU_TABLE);
+    }
+
+    // Node is (now) a leaf, unless some child could not be removed
+    if (node->parent != NULL && error == 0)
+        error |= _ramfs_rmnode_locked(node, no_rm_from_parent);
+
+    return error != 0 ? -1 : 0;
+}
+
+/*
+ * (Internal) Check the operations of batch `txn` against the file
+ * system of `root` in order, each one against what the ones before it
+ * leave, without changing anything. Paths are tokenized in place, and
+ * each name is looked up in the tree once: the versions kept in `txn`
+ * answer from then on. In concurrent mode the root, and each directory
+ * of the tree looked up, are locked for writing, parents first, until
+ * `_ramfs_txn_unlock`.
+ * Returns 0 if all of them can be applied, otherwise -1, and the
+ * position of the first one that can't is stored into `txn->failed`.
+ */
+
+int _ramfs_txn_check(fs_node_t *root, fs_txn_t *txn) {
+    fs_txn_node_t *top = _ramfs_txn_node(txn, NULL, root, TYPE_DIR, true, 0);
+    fs_txn_node_t *dir, *node;
+    fs_txn_node_t *last = NULL;     // directory of the previous operation
+    fs_txn_item_t *item;
+    uint8_t ok;
+    char *name, *slash, *prev = NULL;
+    size_t dlen, plen = 0;
+
+    _ramfs_lock(root, true);
+    top->locked = 1;
+    top->nchildren = _ramfs_children(root)->used;
+    for (size_t i = 0; i < txn->count; i++) {
+        item = &txn->items[i];
+        // Operations in a row on the same directory resolve it once
+        slash = strrchr(item->path, '/');
+        dlen = slash != NULL ? (size_t) (slash - item->path) : 0;
+        if (last != NULL && dlen == plen && slash[1] != '\0' && _ramfs_txn_same_dir(prev, item->path, dlen)) {
+            dir = last;
+            name = slash + 1;
+        } else {
+            dir = _ramfs_txn_resolve(txn, top, item->path, &name);
+            last = dlen > 0 && dir != NULL && name == item->path + dlen + 1 ? dir : NULL;
+        }
+        prev = item->path;
+        plen = dlen;
+        node = dir != NULL && name != NULL ? _ramfs_txn_child(txn, dir, name) : dir;
+        ok = node != NULL && (node->exists || item->op == TXN_CREATE || item->op == TXN_CREATE_DIR);
+
+        switch (item->op) {
+            case TXN_CREATE:
+            case TXN_CREATE_DIR:
+                // No deeper than `_ramfs_resolve_node` lets a node be created
+                ok = ok && node != top && !node->exists && strlen(name) <= MAX_NAME_LENGTH &&
+                     dir->nchildren < MAX_CHILDREN && dir->depth < 254;
+                if (!ok)
+                    break;
+                // No operation holds the version of a missing node: it
+                // becomes the new one
+                node->type = item->op == TXN_CREATE ? TYPE_FILE : TYPE_DIR;
+                node->exists = 1;
+                node->fresh = 1;
+                dir->nchildren++;
+                break;
+            case TXN_WRITE:
+                ok = ok && node->type == TYPE_FILE && item->len <= UINT32_MAX;
+                break;
+            case TXN_DELETE:
+                ok = ok && node != top && (node->type == TYPE_FILE || node->nchildren == 0);
+                if (!ok)
+                    break;
+                node->gone = 1;
+                _ramfs_txn_replace(dir, _ramfs_txn_node(txn, name, NULL, node->type, false, node->depth));
+                dir->nchildren--;
+                break;
+            case TXN_DELETE_R:
+                if (!ok)
+                    break;
+                _ramfs_txn_lock_r(txn, node);
+                if (node == top) {
+                    // The root is only emptied
+                    if (top->children != NULL)
+                        ht_del(top->children);
+                    top->children = NULL;
+                    top->nchildren = 0;
+                    top->fresh = 1;
+                    break;
+                }
+                node->gone = 1;
+                _ramfs_txn_replace(dir, _ramfs_txn_node(txn, name, NULL, node->type, false, node->depth));
+                dir->nchildren--;
+                break;
+        }
+        if (ok && node->type == TYPE_DIR && (item->op == TXN_DELETE || item->op == TXN_DELETE_R))
+            last = NULL;
+
+        if (!ok) {
+#ifdef DEBUG
+            fprintf(stderr, "txn check failed at operation %zu\n", item->pos);
+#endif
+            txn->failed = item->pos;
+            return -1;
+        }
+        item->dir = dir;
+        item->node = node;
+    }
+    return 0;
+}
+
+/*
+ * (Internal) Apply the operations of batch `txn`, checked with
+ * `_ramfs_txn_check`, to the file system of `root`, which left it
+ * locked. Directories created are locked too. The tree lock is held
+ * for writing all along, so that finds and greps see all of the batch
+ * or none of it.
+ */
+
+void _ramfs_txn_apply(fs_node_t *root, fs_txn_t *txn) {
+    fs_meta_t *meta = FS_DIR(root)->meta;
+    fs_txn_item_t *item;
+    fs_node_t *node;
+
+    _ramfs_tree_lock(meta, true);
+    for (size_t i = 0; i < txn->count; i++) {
+        item = &txn->items[i];
+        switch (item->op) {
+            case TXN_CREATE:
+            case TXN_CREATE_DIR:
+                node = _ramfs_node_new(item->dir->node, item->node->name, item->node->type, NULL);
+                node = _ramfs_node_link(item->dir->node, node);
+                if (node->type == TYPE_DIR)
+                    _ramfs_lock(node, true);
+                item->node->node = node;
+                item->node->locked = (uint8_t) (node->type == TYPE_DIR);
+                break;
+            case TXN_WRITE:
+                node = item->node->node;
+                _ramfs_content_lock(node, true);
+                __atomic_add_fetch(&meta->bytes, item->len - node->size, __ATOMIC_RELAXED);
+                item->content[item->len] = '\0';
+                _ramfs_content_set(node, item->content, (uint32_t) item->len);
+                _ramfs_content_unlock(node, true);
+                item->content = NULL;
+                break;
+            case TXN_DELETE:
+                _ramfs_rmnode_locked(item->node->node, false);
+                break;
+            case TXN_DELETE_R:
+                _ramfs_rmnode_r_locked(item->node->node, false);
+                break;
+        }
+    }
+    _ramfs_tree_unlock(meta);
+}
+
+/*
+ * (Internal) Release the locks taken for batch `txn` by
+ * `_ramfs_txn_check` and `_ramfs_txn_apply`, but those of the
+ * directories removed if it was `applied`. Children go first.
+ */
+
+void _ramfs_txn_unlock(fs_txn_t *txn, uint8_t applied) {
+    for (fs_txn_node_t *n = txn->nodes; n != NULL; n = n->next)
+        if (n->locked && !(applied && n->gone))
+            _ramfs_unlock(n->node);
+}
+
+/*
+ * (Internal) Look up, and lock, all the directories below version
+ * `dir` in batch `txn` that are still in the tree, for `delete_r`, and
+ * mark every version below it as gone.
+ */
+
+void _ramfs_txn_lock_r(fs_txn_t *txn, fs_txn_node_t *dir) {
+    ht_t *children;
+    fs_txn_node_t *node;
+
+    if (dir->type != TYPE_DIR)
+        return;
+    if (!dir->fresh && dir->node != NULL) {
+        children = _ramfs_children(dir->node);
+        for (size_t i = 0; i < children->size; i++)
+            if (children->body[i].key != NULL && ((fs_node_t *) children->body[i].val)->type == TYPE_DIR)
+                _ramfs_txn_child(txn, dir, children->body[i].key);
+    }
+    if (dir->children == NULL)
+        return;
+    for (size_t i = 0; i < dir->children->size; i++) {
+        if (dir->children->body[i].key == NULL)
+            continue;
+        for (node = dir->children->body[i].val; node != NULL; node = node->prev) {
+            node->gone = 1;
+            _ramfs_txn_lock_r(txn, node);
+        }
+    }
+}
+
+/*
+ * (Internal) Returns a new version of a node for batch `txn`, named
+ * `name`, standing for `node` of the tree if not NULL.
+ */
+
+fs_txn_node_t *_ramfs_txn_node(fs_txn_t *txn, char *name, fs_node_t *node, fs_node_type_t type,
+                               uint8_t exists, uint8_t depth) {
+    fs_txn_node_t *n = calloc_or_die(1, sizeof(fs_txn_node_t));
+
+    n->name = name;
+    n->node = node;
+    n->type = type;
+    n->exists = exists;
+    n->depth = depth;
+    n->next = txn->nodes;
+    txn->nodes = n;
+    return n;
+}
+
+/*
+ * (Internal) Returns the current version of the child named `name` of
+ * directory `dir` in batch `txn`. The tree is only looked up the first
+ * time, and only if some of the children of `dir` may be there: a
+ * child that doesn't exist gets a version as well. Directories found
+ * are locked like `dir`.
+ */
+
+fs_txn_node_t *_ramfs_txn_child(fs_txn_t *txn, fs_txn_node_t *dir, char *name) {
+    fs_txn_node_t *node;
+    fs_node_t *live = NULL;
+
+    if (dir->children == NULL)
+        dir->children = ht_new();
+    else if ((node = ht_getitem(dir->children, name)) != NULL)
+        return node;
+
+    if (!dir->fresh)
+        live = ht_getitem(_ramfs_children(dir->node), name);
+    node = _ramfs_txn_node(txn, name, live, live != NULL ? live->type : TYPE_FILE, live != NULL,
+                           (uint8_t) (dir->depth + 1));
+    if (live != NULL && live->type == TYPE_DIR) {
+        _ramfs_lock(live, true);
+        node->locked = 1;
+        node->nchildren = _ramfs_children(live)->used;
+    }
+    ht_setitem(dir->children, name, node);
+    return node;
+}
+
+/*
+ * (Internal) Resolve `path` in batch `txn`, from the version `root` of
+ * the root. `path` is tokenized in place, and its last name is stored
+ * into `name`, or NULL if the path is the root.
+ * Returns the directory holding that name, or the root, or NULL if a
+ * directory on the way doesn't exist at this point of the batch.
+ */
+
+fs_txn_node_t *_ramfs_txn_resolve(fs_txn_t *txn, fs_txn_node_t *root, char *path, char **name) {
+    char *saveptr = NULL;
+    char *tok, *next;
+    fs_txn_node_t *dir = root;
+    fs_txn_node_t *node;
+
+    *name = NULL;
+    if ((tok = strtok_depau(path, "/", &saveptr)) == NULL)
+        return root;
+    while ((next = strtok_depau(NULL, "/", &saveptr)) != NULL) {
+        node = _ramfs_txn_child(txn, dir, tok);
+        // Like for `_ramfs_resolve_node`, a longer path whose first
+        // directory is missing stands for that directory
+        if (dir == root && !node->exists)
+            break;
+        if (!node->exists || node->type != TYPE_DIR)
+            return NULL;
+        dir = node;
+        tok = next;
+    }
+    *name = tok;
+    return dir;
+}
+
+/*
+ * (Internal) Returns true if the first `len` bytes of `path` are the
+ * same as those of `prev`, which may have been tokenized already.
+ */
+
+uint8_t _ramfs_txn_same_dir(const char *prev, const char *path, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (prev[i] != path[i] && !(prev[i] == '\0' && path[i] == '/'))
+            return false;
+    return true;
+}
+
+/*
+ * (Internal) Make `node` the current version of its name in directory
+ * `dir`, which was already looked up.
+ */
+
+void _ramfs_txn_replace(fs_txn_node_t *dir, fs_txn_node_t *node) {
+    node->prev = ht_replitem(dir->children, node->name, node);
+}
+
+/*
+ * (Internal) Returns human-readable path of `node` up to the root node.
+ */
+
+char *_ramfs_getpath(fs_node_t *node) {
+    char *dirnames[255] = {0};
+    fs_node_t *n = node;
+
+    unsigned int len = 256;
+    unsigned int pos = 0;
+    char *string = malloc_or_die(len * sizeof(char));
+    char *tmp;
+
+    for (; n != NULL; n = n->parent)
+        dirnames[n->depth] = n->name;
+
+    string[0] = '/';
+    pos++;
+
+    for (int i = 1; i <= 255 && dirnames[i] != NULL; i++) {
+        tmp = dirnames[i];
+        for (int j = 0; tmp != NULL && tmp[j] != '\0'; j++) {
+            // len-3 to make sure there are some spare chars
+            if (pos + 1 > len - 3) {
+                len += 256;
+                string = realloc_or_die(string, len);
+            }
+            string[pos] = tmp[j];
+            pos++;
+        }
+        string[pos] = '/';
+        pos++;
+    }
+
+    // Remove trailing / if node is not directory
+    if (node->type != TYPE_DIR)
+        pos--;
+
+    // Terminate key
+    string[pos] = '\0';
+
+    return string;
+}
+
+/*
+ * (Internal) Returns the length of the path of `node`, without
+ * trailing slash for directories.
+ */
+
+size_t _ramfs_nodepath_len(fs_node_t *node) {
+    size_t len = 0;
+
+    if (node->parent == NULL)
+        return 1;
+    for (; node->parent != NULL; node = node->parent)
+        len += strlen(node->name) + 1;
+    return len;
+}
+
+/*
+ * (Internal) Write the path of `node`, `len` bytes long as returned
+ * by `_ramfs_nodepath_len`, into `path`, filling it from the end.
+ * `path` is not terminated.
+ */
+
+void _ramfs_nodepath_fill(fs_node_t *node, char *path, size_t len) {
+    size_t nlen;
+
+    path[0] = '/';
+    for (; node->parent != NULL; node = node->parent) {
+        nlen = strlen(node->name);
+        len -= nlen;
+        memcpy(path + len, node->name, nlen);
+        path[--len] = '/';
+    }
+}
+
+/*
+ * (Internal) Returns the path of `node` up to the root node, without
+ * trailing slash for directories.
+ */
+
+char *_ramfs_nodepath(fs_node_t *node) {
+    size_t len = _ramfs_nodepath_len(node);
+    char *path = malloc_or_die(len + 1);
+
+    _ramfs_nodepath_fill(node, path, len);
+    path[len] = '\0';
+    return path;
+}
+
+/*
+ * (Internal) Returns the state of the file system `node` belongs to.
+ */
+
+inline fs_meta_t *_ramfs_meta(fs_node_t *node) {
+    return FS_DIR(node->type == TYPE_DIR ? node : node->parent)->meta;
+}
+
+/*
+ * (Internal) Lock the children table of directory `dir`, for writing
+ * if `write` is true. Nothing happens unless the file system is in
+ * concurrent mode.
+ */
+
+void _ramfs_lock(fs_node_t *dir, uint8_t write) {
+    if (!(FS_DIR(dir)->meta->concurrent & FS_LOCK_NODES))
+        return;
+    if (write)
+        pthread_rwlock_wrlock(&FS_DIR(dir)->lock);
+    else
+        pthread_rwlock_rdlock(&FS_DIR(dir)->lock);
+}
+
+/*
+ * (Internal) Release the lock taken with `_ramfs_lock`.
+ */
+
+void _ramfs_unlock(fs_node_t *dir) {
+    if (FS_DIR(dir)->meta->concurrent & FS_LOCK_NODES)
+        pthread_rwlock_unlock(&FS_DIR(dir)->lock);
+}
+
+/*
+ * (Internal) Lock the shape of the tree and the name index of `meta`,
+ * for writing if `write` is true. It must be taken after any directory
+ * lock and is only held briefly by writers.
+ */
+
+void _ramfs_tree_lock(fs_meta_t *meta, uint8_t write) {
+    if (!meta->concurrent)
+        return;
+    if (write)
+        pthread_rwlock_wrlock(&meta->lock);
+    else
+        pthread_rwlock_rdlock(&meta->lock);
+}
+
+/*
+ * (Internal) Release the lock taken with `_ramfs_tree_lock`.
+ */
+
+void _ramfs_tree_unlock(fs_meta_t *meta) {
+    if (meta->concurrent)
+        pthread_rwlock_unlock(&meta->lock);
+}
+
+/*
+ * (Internal) Lock the content of `file`, for writing if `write` is
+ * true. Files share a fixed set of locks, picked by address. Readers
+ * in RCU mode don't lock, see `_ramfs_content_get`.
+ */
+
+void _ramfs_content_lock(fs_node_t *file, uint8_t write) {
+    fs_meta_t *meta = _ramfs_meta(file);
+    pthread_rwlock_t *lock = &meta->content_locks[FS_CONTENT_STRIPE(file)];
+
+    if (!(meta->concurrent & FS_LOCK_NODES) || (meta->rcu && !write))
+        return;
+    if (write)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+}
+
+/*
+ * (Internal) Release the lock taken with `_ramfs_content_lock`, with
+ * the same `write`.
+ */
+
+void _ramfs_content_unlock(fs_node_t *file, uint8_t write) {
+    fs_meta_t *meta = _ramfs_meta(file);
+
+    if ((meta->concurrent & FS_LOCK_NODES) && (!meta->rcu || write))
+        pthread_rwlock_unlock(&meta->content_locks[FS_CONTENT_STRIPE(file)]);
+}
+
+/*
+ * (Internal) Lock out the writers that change the shape of the tree
+ * while a find or grep reads it, unless in RCU mode: there it can't
+ * change under the reader.
+ */
+
+void _ramfs_reader_lock(fs_meta_t *meta) {
+    if (!meta->rcu)
+        _ramfs_tree_lock(meta, false);
+}
+
+/*
+ * (Internal) Release the lock taken with `_ramfs_reader_lock`.
+ */
+
+void _ramfs_reader_unlock(fs_meta_t *meta) {
+    if (!meta->rcu)
+        _ramfs_tree_unlock(meta);
+}
+
+/*
+ * (Internal) Returns the children table of directory `dir`. In RCU
+ * mode it is the last one published, which is never changed again.
+ */
+
+inline ht_t *_ramfs_children(fs_node_t *dir) {
+    return __atomic_load_n(&dir->data.children, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * (Internal) Add `node`, named `name`, to the children of directory
+ * `dir`. In RCU mode, or if a snapshot needs the old table, a modified
+ * copy of the table replaces it, and the old one is retired or handed
+ * to the snapshot. The tree lock must be held for writing.
+ * Returns 0 on success, 1 if a child with that name exists.
+ */
+
+uint8_t _ramfs_children_add(fs_node_t *dir, char *name, fs_node_t *node) {
+    fs_meta_t *meta = FS_DIR(dir)->meta;
+    ht_t *old = dir->data.children;
+    uint8_t keep = _ramfs_snap_wants(dir);
+    ht_t *copy;
+
+    if (!meta->rcu && !keep)
+        return ht_setitem(old, name, node);
+
+    copy = ht_copy(old);
+    if (ht_setitem(copy, name, node) != 0) {
+        ht_del(copy);
+        return 1;
+    }
+    if (keep)
+        _ramfs_snap_keep(dir, old, 0);
+    __atomic_store_n(&dir->data.children, copy, __ATOMIC_RELEASE);
+    if (!keep)
+        _ramfs_rcu_retire(meta, old, RCU_TABLE);
+    return 0;
+}
+
+/*
+ * (Internal) Remove the child named `name` of directory `dir`, like
+ * `_ramfs_children_add`.
+ */
+
+void _ramfs_children_del(fs_node_t *dir, char *name) {
+    fs_meta_t *meta = FS_DIR(dir)->meta;
+    ht_t *old = dir->data.children;
+    uint8_t keep = _ramfs_snap_wants(dir);
+    ht_t *copy;
+
+    if (!meta->rcu && !keep) {
+        ht_delitem(old, name);
+        return;
+    }
+
+    copy = ht_copy(old);
+    ht_delitem(copy, name);
+    if (keep)
+        _ramfs_snap_keep(dir, old, 0);
+    __atomic_store_n(&dir->data.children, copy, __ATOMIC_RELEASE);
+    if (!keep)
+        _ramfs_rcu_retire(meta, old, RCU_TABLE);
+}
+
+/*
+ * (Internal) Returns the content of `file` and stores its size into
+ * `size`. In RCU mode the two are read without locks, again if a
+ * writer replaced them in the meantime.
+ */
+
+char *_ramfs_content_get(fs_node_t *file, uint32_t *size) {
+    fs_meta_t *meta = _ramfs_meta(file);
+    uint32_t *seq = &meta->content_seq[FS_CONTENT_STRIPE(file)];
+    uint32_t s;
+    char *content;
+
+    if (!meta->rcu) {
+        *size = file->size;
+        return file->data.content;
+    }
+
+    do {
+        while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        content = __atomic_load_n(&file->data.content, __ATOMIC_ACQUIRE);
+        *size = __atomic_load_n(&file->size, __ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(seq, __ATOMIC_ACQUIRE) != s);
+    return content;
+}
+
+/*
+ * (Internal) Replace the content of `file` with the `size` bytes at
+ * `content`, already terminated. The content must be locked for
+ * writing. The old content is handed to the newest snapshot if it
+ * needs it, or freed, or retired in RCU mode.
+ */
+
+void _ramfs_content_set(fs_node_t *file, char *content, uint32_t size) {
+    fs_meta_t *meta = _ramfs_meta(file);
+    uint32_t *seq = &meta->content_seq[FS_CONTENT_STRIPE(file)];
+    char *old = file->data.content;
+    uint8_t keep = _ramfs_snap_wants(file);
+
+    if (keep)
+        _ramfs_snap_keep(file, old, file->size);
+
+    if (!meta->rcu) {
+        file->data.content = content;
+        file->size = size;
+        if (!keep)
+            _ramfs_free_data(meta, old);
+        return;
+    }
+
+    __atomic_add_fetch(seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&file->data.content, content, __ATOMIC_RELEASE);
+    __atomic_store_n(&file->size, size, __ATOMIC_RELEASE);
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+    if (!keep && !_ramfs_in_image(meta, old))
+        _ramfs_rcu_retire(meta, old, RCU_CONTENT);
+}
+
+/*
+ * (Internal) Hand `ptr` over to the reclaimer of `meta`, to be freed
+ * once no reader can still see it. Retired memory is looked at in
+ * batches.
+ */
+
+void _ramfs_rcu_retire(fs_meta_t *meta, void *ptr, fs_rcu_kind_t kind) {
+    fs_rcu_t *rcu = meta->rcu_state;
+
+    pthread_mutex_lock(&rcu->lock);
+    if (rcu->count == rcu->size) {
+        rcu->size = rcu->size > 0 ? rcu->size * 2 : FS_RCU_BATCH;
+        rcu->retired = realloc_or_die(rcu->retired, rcu->size * sizeof(fs_rcu_retired_t));
+    }
+    rcu->retired[rcu->count].ptr = ptr;
+    rcu->retired[rcu->count].kind = kind;
+    // Readers that saw this epoch or a later one can't reach `ptr`
+    rcu->retired[rcu->count].epoch = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+    rcu->count++;
+    if (rcu->count >= FS_RCU_BATCH && rcu->count % FS_RCU_BATCH == 0)
+        _ramfs_rcu_reclaim(meta, false);
+    pthread_mutex_unlock(&rcu->lock);
+}
+
+/*
+ * (Internal) Free the retired memory of `meta` that no registered
+ * reader can still see, or all of it if `all` is true. The reclaimer
+ * lock must be held, unless `all` is.
+ */
+
+void _ramfs_rcu_reclaim(fs_meta_t *meta, uint8_t all) {
+    fs_rcu_t *rcu = meta->rcu_state;
+    uint64_t min = UINT64_MAX, e;
+    size_t kept = 0;
+
+    for (int i = 0; i < FS_RCU_MAX_READERS && !all; i++)
+        if ((e = __atomic_load_n(&rcu->readers[i].epoch, __ATOMIC_SEQ_CST)) != 0 && e < min)
+            min = e;
+
+    for (size_t i = 0; i < rcu->count; i++) {
+        if (all || rcu->retired[i].epoch <= min) {
+            _ramfs_rcu_free(meta, &rcu->retired[i]);
+            rcu->reclaimed++;
+        } else {
+            rcu->retired[kept++] = rcu->retired[i];
+        }
+    }
+    rcu->count = kept;
+}
+
+/*
+ * (Internal) Free retired memory `r` of `meta`. A node takes its
+ * content or children table and its name with it.
+ */
+
+void _ramfs_rcu_free(fs_meta_t *meta, fs_rcu_retired_t *r) {
+    fs_node_t *node = r->ptr;
+
+    switch (r->kind) {
+        case RCU_CONTENT:
+            _ramfs_free_data(meta, r->ptr);
+            break;
+        case RCU_TABLE:
+            ht_del(r->ptr);
+            break;
+        case RCU_NODE:
+            if (node->type == TYPE_DIR)
+                ht_del(node->data.children);
+            else
+                _ramfs_free_data(meta, node->data.content);
+            _ramfs_free_data(meta, node->name);
+            _ramfs_free_node(meta, node);
+            break;
+    }
+}
+
+/*
+ * (Internal) Free `ptr`, a content, children table or node of `meta`
+ * according to `kind`, or retire it in RCU mode.
+ */
+
+void _ramfs_dispose(fs_meta_t *meta, void *ptr, fs_rcu_kind_t kind) {
+    fs_rcu_retired_t r = {ptr, kind, 0};
+
+    if (meta->rcu)
+        _ramfs_rcu_retire(meta, ptr, kind);
+    else
+        _ramfs_rcu_free(meta, &r);
+}
+
+/*
+ * (Internal) Returns true if `ptr` is in the image `meta` was loaded
+ * from, see `image_load`.
+ */
+
+inline uint8_t _ramfs_in_image(fs_meta_t *meta, const void *ptr) {
+    return (uint8_t) (meta->image != NULL && (const char *) ptr >= meta->image &&
+                      (const char *) ptr < meta->image + meta->image_len);
+}
+
+/*
+ * (Internal) Free a name or content of `meta`, unless it is still the
+ * one in its image: that goes away with the whole file system.
+ */
+
+void _ramfs_free_data(fs_meta_t *meta, void *ptr) {
+    if (!_ramfs_in_image(meta, ptr))
+        free(ptr);
+}
+
+/*
+ * (Internal) Free `node` of `meta`, unless it was loaded from an
+ * image: those are freed all together with the file system.
+ */
+
+void _ramfs_free_node(fs_meta_t *meta, fs_node_t *node) {
+    if (meta->arena == NULL || (char *) node < meta->arena || (char *) node >= meta->arena + meta->arena_len)
+        free(node);
+}
+
+/*
+ * (Internal) Stop every writer of `meta` while the list of snapshots
+ * changes: the ones changing the shape of the tree hold the tree lock,
+ * the ones replacing contents a content lock.
+ */
+
+void _ramfs_snap_freeze(fs_meta_t *meta) {
+    if (!meta->concurrent)
+        return;
+    pthread_rwlock_wrlock(&meta->lock);
+    for (int i = 0; i < FS_CONTENT_LOCKS; i++)
+        pthread_rwlock_wrlock(&meta->content_locks[i]);
+    pthread_mutex_lock(&meta->snap_lock);
+}
+
+/*
+ * (Internal) Release the locks taken with `_ramfs_snap_freeze`.
+ */
+
+void _ramfs_snap_thaw(fs_meta_t *meta) {
+    if (!meta->concurrent)
+        return;
+    pthread_mutex_unlock(&meta->snap_lock);
+    for (int i = FS_CONTENT_LOCKS - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&meta->content_locks[i]);
+    pthread_rwlock_unlock(&meta->lock);
+}
+
+/*
+ * (Internal) Take a snapshot of the file system `meta` of `root`,
+ * like `ramfs_snapshot`, once its writers are stopped.
+ * Returns the snapshot.
+ */
+
+fs_snapshot_t *_ramfs_snap_take(fs_meta_t *meta, fs_node_t *root) {
+    fs_snapshot_t *snap = calloc_or_die(1, sizeof(fs_snapshot_t));
+
+    snap->meta = meta;
+    snap->root = root;
+    // Nodes created from now on are born in the snapshot epoch, so it
+    // can't see them
+    snap->epoch = ++meta->snap_epoch;
+    snap->older = meta->snaps;
+    if (meta->snaps != NULL)
+        meta->snaps->newer = snap;
+    meta->snaps = snap;
+    return snap;
+}
+
+/*
+ * (Internal) Returns true if the newest snapshot needs the current
+ * state of `node` to be preserved before it changes. The caller holds
+ * the lock a writer of that state takes.
+ */
+
+inline uint8_t _ramfs_snap_wants(fs_node_t *node) {
+    fs_snapshot_t *newest = _ramfs_meta(node)->snaps;
+
+    return (uint8_t) (newest != NULL && node->saved < newest->epoch);
+}
+
+/*
+ * (Internal) Hand `data`, the children table or content of `node`
+ * which is about to be replaced, over to the newest snapshot. It must
+ * be done before the new one is published: readers of a snapshot look
+ * at the live node first, and at the preserved states afterwards.
+ */
+
+void _ramfs_snap_keep(fs_node_t *node, void *data, uint32_t size) {
+    fs_meta_t *meta = _ramfs_meta(node);
+
+    if (meta->concurrent)
+        pthread_mutex_lock(&meta->snap_lock);
+    _ramfs_snap_insert(meta->snaps, node, data, size);
+    node->saved = meta->snap_epoch;
+    if (meta->concurrent)
+        pthread_mutex_unlock(&meta->snap_lock);
+}
+
+/*
+ * (Internal) Keep `node`, which is being removed, for the newest
+ * snapshot if it can see it. Its data, name and the node itself are
+ * freed once no snapshot can. The tree lock must be held for writing.
+ * Returns true if the node was kept.
+ */
+
+uint8_t _ramfs_snap_bury(fs_node_t *node) {
+    fs_meta_t *meta = _ramfs_meta(node);
+    fs_snapshot_t *newest = meta->snaps;
+
+    if (newest == NULL || node->born >= newest->epoch)
+        return false;
+
+    if (meta->concurrent)
+        pthread_mutex_lock(&meta->snap_lock);
+    if (newest->nburied == newest->buried_size) {
+        newest->buried_size = newest->buried_size > 0 ? newest->buried_size * 2 : FIND_ARRAY_SIZE;
+        newest->buried = realloc_or_die(newest->buried, newest->buried_size * sizeof(fs_node_t *));
+    }
+    newest->buried[newest->nburied++] = node;
+    if (meta->concurrent)
+        pthread_mutex_unlock(&meta->snap_lock);
+    return true;
+}
+
+/*
+ * (Internal) Returns the slot of `node` among the states preserved by
+ * `snap`, the free slot where it would go, or NULL if `snap` preserved
+ * nothing yet.
+ */
+
+fs_snap_state_t *_ramfs_snap_slot(fs_snapshot_t *snap, fs_node_t *node) {
+    size_t mask = snap->states_size - 1;
+    size_t i;
+
+    if (snap->states_size == 0)
+        return NULL;
+
+    i = (size_t) (((uintptr_t) node >> 4) * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+    while (snap->states[i].node != NULL && snap->states[i].node != node)
+        i = (i + 1) & mask;
+    return &snap->states[i];
+}
+
+/*
+ * (Internal) Store `data` as the state of `node` preserved by `snap`,
+ * which has none yet.
+ */
+
+void _ramfs_snap_insert(fs_snapshot_t *snap, fs_node_t *node, void *data, uint32_t size) {
+    fs_snap_state_t *old = snap->states;
+    size_t old_size = snap->states_size;
+    fs_snap_state_t *st;
+
+    // Keep the table at most half full
+    if ((snap->nstates + 1) * 2 > snap->states_size) {
+        snap->states_size = old_size > 0 ? old_size * 2 : FIND_ARRAY_SIZE;
+        snap->states = calloc_or_die(snap->states_size, sizeof(fs_snap_state_t));
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i].node != NULL)
+                *_ramfs_snap_slot(snap, old[i].node) = old[i];
+        free(old);
+    }
+
+    st = _ramfs_snap_slot(snap, node);
+    st->node = node;
+    st->data = data;
+    st->size = size;
+    snap->nstates++;
+}
+
+/*
+ * (Internal) Look for the state `node` had when `snap` was taken
+ * among the preserved ones: it is in the first snapshot, from `snap`
+ * on, that has one. Stores it into `data` and `size`.
+ * Returns true if found, false if the live node still has it.
+ */
+
+uint8_t _ramfs_snap_state(fs_snapshot_t *snap, fs_node_t *node, void **data, uint32_t *size) {
+    fs_meta_t *meta = snap->meta;
+    fs_snap_state_t *st = NULL;
+
+    if (meta->concurrent)
+        pthread_mutex_lock(&meta->snap_lock);
+    for (fs_snapshot_t *s = snap; s != NULL; s = s->newer) {
+        if ((st = _ramfs_snap_slot(s, node)) != NULL && st->node != NULL) {
+            *data = st->data;
+            *size = st->size;
+            break;
+        }
+    }
+    if (meta->concurrent)
+        pthread_mutex_unlock(&meta->snap_lock);
+    return (uint8_t) (st != NULL && st->node != NULL);
+}
+
+/*
+ * (Internal) Returns the children table of `dir` as seen by `snap`.
+ * The live table is read first: if it is replaced afterwards, the
+ * writer preserves it before, so it is found anyway.
+ */
+
+ht_t *_ramfs_snap_children(fs_snapshot_t *snap, fs_node_t *dir) {
+    ht_t *children = _ramfs_children(dir);
+    void *data;
+    uint32_t size;
+
+    if (_ramfs_snap_state(snap, dir, &data, &size))
+        return data;
+    return children;
+}
+
+/*
+ * (Internal) Returns the content of `file` as seen by `snap`, storing
+ * its size into `size`, like `_ramfs_snap_children`.
+ */
+
+char *_ramfs_snap_content(fs_snapshot_t *snap, fs_node_t *file, uint32_t *size) {
+    char *content;
+    void *data;
+    uint32_t kept;
+
+    _ramfs_content_lock(file, false);
+    content = _ramfs_content_get(file, size);
+    _ramfs_content_unlock(file, false);
+
+    if (_ramfs_snap_state(snap, file, &data, &kept)) {
+        *size = kept;
+        return data;
+    }
+    return content;
+}
+
+/*
+ * (Internal) Returns the node at `path` as seen by `snap`, or NULL if
+ * there was none. `path` is tokenized in place.
+ */
+
+fs_node_t *_ramfs_snap_resolve(fs_snapshot_t *snap, char *path) {
+    char *saveptr = NULL;
+    char *tok;
+    fs_node_t *node = snap->root;
+
+    for (tok = strtok_depau(path, "/", &saveptr); tok != NULL; tok = strtok_depau(NULL, "/", &saveptr)) {
+        if (*tok == '\0')
+            continue;
+        if (node->type != TYPE_DIR)
+            return NULL;
+        if ((node = ht_getitem(_ramfs_snap_children(snap, node), tok)) == NULL)
+            return NULL;
+    }
+    return node;
+}
+
+/*
+ * (Internal) Like `_ramfs_find`, but walks the tree as seen by `snap`.
+ * Name summaries describe the live tree, so every directory is
+ * entered.
+ * Returns the number of results found.
+ */
+
+size_t _ramfs_snap_find(fs_snapshot_t *snap, fs_node_t *dir, char *keyword, unsigned int maxdepth,
+                        fs_find_res_t *res) {
+    fs_find_frame_t stack[256];
+    fs_find_frame_t *f;
+    fs_node_t *child;
+    ht_t *children;
+    char *path;
+    size_t path_size = FIND_ARENA_SIZE;
+    size_t klen = strlen(keyword);
+    size_t nlen;
+    size_t nres = 0;
+    int top = 0;
+
+    if (maxdepth == 0)
+        return 0;
+
+    stack[0].dir = dir;
+    stack[0].children = _ramfs_snap_children(snap, dir);
+    stack[0].next = 0;
+    stack[0].pathlen = dir->parent != NULL ? _ramfs_nodepath_len(dir) + 1 : 1;
+    while (stack[0].pathlen > path_size)
+        path_size *= 2;
+    path = malloc_or_die(path_size);
+    if (dir->parent != NULL)
+        _ramfs_nodepath_fill(dir, path, stack[0].pathlen - 1);
+    path[stack[0].pathlen - 1] = '/';
+
+    while (top >= 0) {
+        f = &stack[top];
+        children = f->children;
+
+        while (f->next < children->size && children->body[f->next].key == NULL)
+            f->next++;
+        if (f->next >= children->size) {
+            top--;
+            continue;
+        }
+        child = children->body[f->next++].val;
+
+        if (strcmp(child->name, keyword) == 0) {
+            char *dst = _ramfs_find_res_reserve(res, f->pathlen + klen);
+            memcpy(dst, path, f->pathlen);
+            memcpy(dst + f->pathlen, keyword, klen);
+            nres++;
+        }
+
+        if (child->type != TYPE_DIR || (unsigned int) top + 1 >= maxdepth)
+            continue;
+        children = _ramfs_snap_children(snap, child);
+        if (children->used == 0)
+            continue;
+
+        nlen = strlen(child->name);
+        if (f->pathlen + nlen + 1 > path_size) {
+            path_size *= 2;
+            path = realloc_or_die(path, path_size);
+        }
+        memcpy(path + f->pathlen, child->name, nlen);
+        path[f->pathlen + nlen] = '/';
+
+        top++;
+        stack[top].dir = child;
+        stack[top].children = children;
+        stack[top].next = 0;
+        stack[top].pathlen = f->pathlen + nlen + 1;
+    }
+
+    free(path);
+    return nres;
+}
+
+/*
+ * (Internal) Prepare task `t` to search under `dir`, at most
+ * `maxdepth` levels below it, as seen by `snap`, which it takes over.
+ * If `walk` is true the directories are walked from `dir` down.
+ */
+
+void _ramfs_task_init(fs_task_t *t, fs_snapshot_t *snap, fs_node_t *dir, unsigned int maxdepth, uint8_t walk) {
+    memset(t, 0, sizeof(fs_task_t));
+    t->meta = snap->meta;
+    t->snap = snap;
+    t->dir = dir;
+    t->maxdepth = maxdepth;
+    t->top = -1;
+    if (!walk)
+        return;
+
+    t->top = 0;
+    t->stack[0].dir = dir;
+    t->stack[0].children = _ramfs_snap_children(snap, dir);
+    t->stack[0].next = 0;
+    t->stack[0].pathlen = dir->parent != NULL ? _ramfs_nodepath_len(dir) + 1 : 1;
+    t->path_size = FIND_ARENA_SIZE;
+    while (t->stack[0].pathlen > t->path_size)
+        t->path_size *= 2;
+    t->path = malloc_or_die(t->path_size);
+    if (dir->parent != NULL)
+        _ramfs_nodepath_fill(dir, t->path, t->stack[0].pathlen - 1);
+    t->path[t->stack[0].pathlen - 1] = '/';
+}
+
+/*
+ * (Internal) Check the nodes task `t` took from the name index, until
+ * `deadline`, keeping the ones under its directory, close enough.
+ * Nodes removed meanwhile are kept for the snapshot, together with
+ * their parents.
+ */
+
+void _ramfs_task_index(fs_task_t *t, uint64_t deadline) {
+    fs_find_res_t *res = &t->runs.res[t->runs.nthreads];
+    uint8_t depth = t->dir->depth;
+    fs_node_t *node, *up;
+    size_t len;
+
+    while (t->next < t->nnodes) {
+        node = up = t->nodes[t->next++];
+        if (node->depth > depth && (unsigned int) (node->depth - depth) <= t->maxdepth) {
+            while (up->depth > depth)
+                up = up->parent;
+            if (up == t->dir && !t->count_only) {
+                len = _ramfs_nodepath_len(node);
+                _ramfs_nodepath_fill(node, _ramfs_find_res_reserve(res, len), len);
+                t->bytes += len;
+            }
+            if (up == t->dir)
+                t->count++;
+        }
+        if (t->next % FS_TASK_CHECK == 0 && now_ns() >= deadline)
+            return;
+    }
+}
+
+/*
+ * (Internal) Walk the directories of task `t` as seen by its
+ * snapshot, going on from where the previous slice stopped, until
+ * `deadline`. Name summaries describe the live tree, so every
+ * directory is entered.
+ */
+
+void _ramfs_task_walk(fs_task_t *t, uint64_t deadline) {
+    fs_find_res_t *res = &t->runs.res[t->runs.nthreads];
+    fs_find_frame_t *f;
+    fs_node_t *child;
+    ht_t *children;
+    unsigned int work = 0;
+    size_t nlen;
+    char *dst;
+
+    while (t->top >= 0) {
+        if (++work % FS_TASK_CHECK == 0 && now_ns() >= deadline)
+            return;
+
+        f = &t->stack[t->top];
+        children = f->children;
+        while (f->next < children->size && children->body[f->next].key == NULL)
+            f->next++;
+        if (f->next >= children->size) {
+            t->top--;
+            continue;
+        }
+        child = children->body[f->next++].val;
+        nlen = strlen(child->name);
+
+        if (_ramfs_task_match(t, child)) {
+            if (!t->count_only) {
+                dst = _ramfs_find_res_reserve(res, f->pathlen + nlen);
+                memcpy(dst, t->path, f->pathlen);
+                memcpy(dst + f->pathlen, child->name, nlen);
+                t->bytes += f->pathlen + nlen;
+            }
+            t->count++;
+        }
+
+        if (child->type != TYPE_DIR || (unsigned int) t->top + 1 >= t->maxdepth)
+            continue;
+        children = _ramfs_snap_children(t->snap, child);
+        if (children->used == 0)
+            continue;
+
+        if (f->pathlen + nlen + 1 > t->path_size) {
+            t->path_size *= 2;
+            t->path = realloc_or_die(t->path, t->path_size);
+        }
+        memcpy(t->path + f->pathlen, child->name, nlen);
+        t->path[f->pathlen + nlen] = '/';
+
+        t->top++;
+        t->stack[t->top].dir = child;
+        t->stack[t->top].children = children;
+        t->stack[t->top].next = 0;
+        t->stack[t->top].pathlen = f->pathlen + nlen + 1;
+    }
+}
+
+/*
+ * (Internal) Returns true if `node` is a result of task `t`: a node
+ * named like its keyword, or a file whose content, as seen by its
+ * snapshot, matches its grep.
+ */
+
+uint8_t _ramfs_task_match(fs_task_t *t, fs_node_t *node) {
+    uint32_t size;
+    char *content;
+
+    if (!t->grep)
+        return (uint8_t) (strcmp(node->name, t->keyword) == 0);
+    if (node->type != TYPE_FILE)
+        return false;
+
+    content = _ramfs_snap_content(t->snap, node, &size);
+    if (t->kind == MATCH_REGEX)
+        return match_re_exec(&t->re, content, size);
+    return (uint8_t) (match_memmem(content, size, t->keyword, t->klen) != NULL);
+}
+
+/*
+ * (Internal) Add `node` to the name index of `meta`.
+ */
+
+void _ramfs_index_add(fs_meta_t *meta, fs_node_t *node) {
+    fs_name_entry_t *entry = ht_getitem(meta->names, node->name);
+
+    if (entry == NULL) {
+        size_t nlen = strlen(node->name);
+
+        entry = calloc_or_die(1, sizeof(fs_name_entry_t));
+        // The entry outlives any of the nodes, keep a copy of the name
+        entry->name = malloc_or_die(nlen + 1);
+        memcpy(entry->name, node->name, nlen + 1);
+        ht_setitem(meta->names, entry->name, entry);
+
+        // Distinct names are indexed by trigram for substring queries,
+        // once there was one
+        if (meta->trigrams != NULL)
+            _ramfs_index_trigrams(meta->trigrams, entry);
+    }
+
+    if (entry->count == entry->size) {
+        entry->size = entry->size > 0 ? entry->size * 2 : 1;
+        entry->nodes = realloc_or_die(entry->nodes, entry->size * sizeof(fs_node_t *));
+    }
+    node->idx_slot = entry->count;
+    entry->nodes[entry->count++] = node;
+    entry->gen = ++meta->gen;
+    __atomic_store_n(&meta->nodes, meta->nodes + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * (Internal) Add the name of `entry` to trigram index `t`, if it is
+ * long enough to have trigrams.
+ */
+
+void _ramfs_index_trigrams(tg_index_t *t, fs_name_entry_t *entry) {
+    size_t nlen = strlen(entry->name);
+
+    if (nlen < 3)
+        return;
+    entry->tg_slots = malloc_or_die((nlen - 2) * sizeof(uint32_t));
+    tg_add(t, entry, entry->name, nlen, entry->tg_slots);
+}
+
+/*
+ * (Internal) Index the distinct names of `meta` by trigram, unless
+ * they already are. Done on the first substring query, so that file
+ * systems never searched that way don't pay for the index in memory
+ * nor on every insert; it is kept up to date from then on.
+ */
+
+void _ramfs_trigrams(fs_meta_t *meta) {
+    tg_index_t *t;
+
+    if (__atomic_load_n(&meta->trigrams, __ATOMIC_ACQUIRE) != NULL)
+        return;
+
+    _ramfs_tree_lock(meta, true);
+    if (meta->trigrams == NULL) {
+        t = tg_new();
+        for (size_t i = 0; i < meta->names->size; i++)
+            if (meta->names->body[i].key != NULL)
+                _ramfs_index_trigrams(t, meta->names->body[i].val);
+        __atomic_store_n(&meta->trigrams, t, __ATOMIC_RELEASE);
+    }
+    _ramfs_tree_unlock(meta);
+}
+
+/*
+ * (Internal) Remove `node` from the name index of `meta`, moving the
+ * last node with the same name into its slot.
+ */
+
+void _ramfs_index_del(fs_meta_t *meta, fs_node_t *node) {
+    fs_name_entry_t *entry = ht_getitem(meta->names, node->name);
+    fs_node_t *last;
+
+    if (entry == NULL)
+        return;
+
+    last = entry->nodes[--entry->count];
+    entry->nodes[node->idx_slot] = last;
+    last->idx_slot = node->idx_slot;
+    entry->gen = ++meta->gen;
+    __atomic_store_n(&meta->nodes, meta->nodes - 1, __ATOMIC_RELAXED);
+
+    if (entry->count == 0) {
+        ht_delitem(meta->names, entry->name);
+        if (entry->tg_slots != NULL) {
+            tg_remove(meta->trigrams, entry->name, strlen(entry->name), entry->tg_slots);
+            free(entry->tg_slots);
+        }
+        free(entry->name);
+        free(entry->nodes);
+        free(entry);
+    }
+}
+
+/*
+ * (Internal) Walk tree starting from `root` to find the node at `path`.
+ * If the node is found, it is returned. If the node was not found, but
+ * its direct parent was, the parent is returned and the new node name
+ * is stored into `newname`, so that the new node can be created.
+ * Otherwise, NULL is returned.
+ * In concurrent mode each directory is locked before the lock of its
+ * parent is released. The directory holding the returned node, or the
+ * returned directory itself if `newname` is set or it is the root, is
+ * left locked, for writing if `write` is true, and stored into
+ * `locked` to be unlocked by the caller. `locked` is NULL if NULL is
+ * returned. Readers in RCU mode pass a NULL `locked` and lock nothing.
+ */
+
+fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname, uint8_t write, fs_node_t **locked) {
+    char *saveptr = NULL;
+    char *tok;
+    fs_node_t *node;
+    fs_node_t *nodes[2] = {0};
+    *nodes = root;
+    uint8_t pos = 1;
+    uint16_t count = 1;
+    // The last name is looked up in the directory locked as requested,
+    // the ones before only need to be read
+    size_t names = _ramfs_path_depth(path);
+    uint16_t depth = (uint16_t) (names > 255 ? 255 : names);
+    fs_node_t *held = root;
+    uint8_t lock = (uint8_t) (locked != NULL);
+
+    if (lock)
+        _ramfs_lock(root, (uint8_t) (write && depth <= 1));
+
+    if ((tok = strtok_depau(path, "/", &saveptr)) != NULL && count <= 255) {
+        do {
+            if (strcmp(tok, "") == 0)
+                continue;
             if (*newname != NULL) {
                 // If we reach here it means that two nodes weren't found.
                 // Path is too long, signal it by setting last node to root
@@ -462,7 +3071,7 @@ fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname) {
                 *newname = NULL;
                 break;
             }
-            nodes[pos] = ht_getitem(nodes[!pos]->data.children, tok);
+            nodes[pos] = ht_getitem(_ramfs_children(nodes[!pos]), tok);
             if (nodes[pos] == NULL && *newname == NULL) {
                 // Node not found, it's probably a new node
                 *newname = tok;
@@ -470,6 +3079,11 @@ fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname) {
                 continue;
                 // Go on to check if there is an extra token to read
             }
+            if (lock && count < depth && nodes[pos]->type == TYPE_DIR) {
+                _ramfs_lock(nodes[pos], (uint8_t) (write && count + 1 == depth));
+                _ramfs_unlock(held);
+                held = nodes[pos];
+            }
             pos = (uint8_t) !pos;
             count++;
         } while ((tok = strtok_depau(NULL, "/", &saveptr)) != NULL && count <= 255);
@@ -491,64 +3105,869 @@ fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname) {
     if (nodes[pos] == root || nodes[pos] == NULL) {
         // count == 1 means path was "/"
         // count == 2 && *newname != NULL means path was "/dir" and "dir" did not exist
-        if (count == 1 || (count == 2 && *newname != NULL))
+        if (count == 1 || (count == 2 && *newname != NULL)) {
+            // A longer path whose first directory is missing also ends up
+            // here, with the root only locked for reading
+            if (lock && write && depth > 1) {
+                _ramfs_unlock(root);
+                _ramfs_lock(root, true);
+            }
+            if (lock)
+                *locked = root;
             return root;
+        }
 #ifdef DEBUG
         fprintf(stderr, "resolve node %s failed: could not resolve path\n", path);
 #endif
+        if (lock) {
+            _ramfs_unlock(held);
+            *locked = NULL;
+        }
         return NULL;
     }
 
     node = nodes[pos];
+    if (lock)
+        *locked = held;
     return node;
 }
 
 /*
- * (Internal) Recursively search nodes matching `keyword` within `root`
- * and its children (if any). `results` is a pointer to an array of strings that
- * will be updated with any matches. `len` a pointer to the length of the array
- * and `pos` to the current position in it.
+ * (Internal) Returns the number of names in `path`.
+ */
+
+size_t _ramfs_path_depth(const char *path) {
+    size_t depth = 0;
+
+    for (; *path != '\0'; path++)
+        if (*path != '/' && (path[1] == '/' || path[1] == '\0'))
+            depth++;
+    return depth;
+}
+
+/*
+ * (Internal) Search nodes named `keyword` under directory `dir`, at
+ * most `maxdepth` levels below it, adding their paths to `res`, or
+ * only counting them if `res` is NULL. The tree is walked depth-first
+ * with an explicit stack, extending and truncating a single path
+ * buffer in place, and nothing is allocated for nodes that don't
+ * match. Subdirectories whose summary rules the keyword out are not
+ * entered.
  * Returns the number of results found.
  */
 
-size_t _ramfs_find(fs_node_t *node, char *curpath, char *keyword, char ***results, size_t *len, size_t *pos) {
-    size_t i;
+size_t _ramfs_find(fs_node_t *dir, char *keyword, unsigned int maxdepth, fs_find_res_t *res) {
+    fs_find_frame_t stack[256];
+    fs_find_frame_t *f;
+    fs_node_t *child;
+    ht_t *children;
+    char *path = NULL;
+    size_t path_size = FIND_ARENA_SIZE;
+    size_t klen = strlen(keyword);
+    size_t nlen;
     size_t nres = 0;
+    uint32_t pos[FS_BLOOM_HASHES];
+    int top = 0;
+
+    _ramfs_bloom_pos(keyword, pos);
+    if (!_ramfs_bloom_has(dir, pos))
+        return 0;
+
+    stack[0].dir = dir;
+    stack[0].next = 0;
+    stack[0].pathlen = 0;
+
+    // Paths are only needed when collecting them
+    if (res != NULL) {
+        stack[0].pathlen = dir->parent != NULL ? _ramfs_nodepath_len(dir) + 1 : 1;
+        while (stack[0].pathlen > path_size)
+            path_size *= 2;
+        path = malloc_or_die(path_size);
+        if (dir->parent != NULL)
+            _ramfs_nodepath_fill(dir, path, stack[0].pathlen - 1);
+        path[stack[0].pathlen - 1] = '/';
+    }
+
+    while (top >= 0) {
+        f = &stack[top];
+        children = _ramfs_children(f->dir);
 
-    // node is not root
-    if (node->name != NULL) {
-        // Try to match current node
-        if (strcmp(node->name, keyword) == 0) {
-            if ((*pos)+1 >= *len) {
-                *len += FIND_ARRAY_SIZE;
-                *results = realloc_or_die(*results, *len*sizeof(char**));
+        // Next child of the directory on top of the stack
+        while (f->next < children->size && children->body[f->next].key == NULL)
+            f->next++;
+        if (f->next >= children->size) {
+            top--;
+            continue;
+        }
+        child = children->body[f->next++].val;
+
+        // Copy the path out only on a match
+        if (strcmp(child->name, keyword) == 0) {
+            if (res != NULL) {
+                char *dst = _ramfs_find_res_reserve(res, f->pathlen + klen);
+                memcpy(dst, path, f->pathlen);
+                memcpy(dst + f->pathlen, keyword, klen);
             }
-            (*results)[*pos] = strcat_auto(2, curpath, node->name);
-            (*pos)++;
             nres++;
         }
-    }
-    if (node->type == TYPE_DIR && node->data.children->used > 0) {
-        for (i = 0; i < node->data.children->size; i++) {
-            if (node->data.children->body[i].key != NULL) {
-                char *newpath = strcat_auto(3, curpath, node->name, "/");
-                nres += _ramfs_find(node->data.children->body[i].val,
-                                    newpath, keyword, results, len, pos);
-                free(newpath);
-            }
+
+        if (child->type != TYPE_DIR || _ramfs_children(child)->used == 0 ||
+            (unsigned int) top + 1 >= maxdepth || !_ramfs_bloom_has(child, pos))
+            continue;
+
+        if (res == NULL) {
+            top++;
+            stack[top].dir = child;
+            stack[top].next = 0;
+            continue;
+        }
+
+        // Descend, extending the path with the directory name
+        nlen = strlen(child->name);
+        if (f->pathlen + nlen + 1 > path_size) {
+            path_size *= 2;
+            path = realloc_or_die(path, path_size);
         }
+        memcpy(path + f->pathlen, child->name, nlen);
+        path[f->pathlen + nlen] = '/';
+
+        top++;
+        stack[top].dir = child;
+        stack[top].next = 0;
+        stack[top].pathlen = f->pathlen + nlen + 1;
     }
 
+    free(path);
+    return nres;
+}
+
+/*
+ * (Internal) Like `_ramfs_find`, but if there are fewer nodes named
+ * `keyword` in the whole file system than nodes under `dir`, the
+ * name index is used instead of walking: each of those nodes is kept
+ * if `dir` is among its ancestors, close enough. Nodes of detached
+ * subtrees, still in the index until reaped, never are.
+ * Returns the number of results found.
+ */
 
+size_t _ramfs_find_under(fs_node_t *dir, char *keyword, unsigned int maxdepth, fs_find_res_t *res) {
+    fs_meta_t *meta = FS_DIR(dir)->meta;
+    fs_name_entry_t *entry;
+    fs_node_t *node, *up;
+    size_t nres = 0, len, count;
+
+    // Readers can't look at the index in RCU mode
+    if (maxdepth == 0)
+        return 0;
+    if (meta->rcu)
+        return _ramfs_find(dir, keyword, maxdepth, res);
+    entry = ht_getitem(meta->names, keyword);
+    if (entry == NULL)
+        return 0;
+    count = entry->count;
+    for (uint32_t i = 0; meta->detached > 0 && i < entry->count; i++)
+        count -= _ramfs_detached(meta, entry->nodes[i]);
+    if (count > FS_DIR(dir)->nodes)
+        return _ramfs_find(dir, keyword, maxdepth, res);
+
+    for (uint32_t i = 0; i < entry->count; i++) {
+        node = up = entry->nodes[i];
+        if (node->depth <= dir->depth || (unsigned int) (node->depth - dir->depth) > maxdepth)
+            continue;
+        // The root of a detached subtree has no parent
+        while (up->depth > dir->depth && up->parent != NULL)
+            up = up->parent;
+        if (up != dir)
+            continue;
+
+        if (res != NULL) {
+            len = _ramfs_nodepath_len(node);
+            _ramfs_nodepath_fill(node, _ramfs_find_res_reserve(res, len), len);
+        }
+        nres++;
+    }
     return nres;
 }
 
 /*
- * (Internal) Helper function used to compare paths when sorting them
+ * (Internal) Add a result `len` bytes long to `res` and return where
+ * it must be written. The terminator is added here.
+ */
+
+char *_ramfs_find_res_reserve(fs_find_res_t *res, size_t len) {
+    char *dst;
+
+    if (res->arena_len + len + 1 > res->arena_size) {
+        res->arena_size = res->arena_size > 0 ? res->arena_size : FIND_ARENA_SIZE;
+        while (res->arena_len + len + 1 > res->arena_size)
+            res->arena_size *= 2;
+        res->arena = realloc_or_die(res->arena, res->arena_size);
+    }
+    if (res->count == res->offs_size) {
+        res->offs_size = res->offs_size > 0 ? res->offs_size * 2 : FIND_ARRAY_SIZE;
+        res->offs = realloc_or_die(res->offs, res->offs_size * sizeof(size_t));
+    }
+
+    res->offs[res->count++] = res->arena_len;
+    dst = res->arena + res->arena_len;
+    dst[len] = '\0';
+    res->arena_len += len + 1;
+    return dst;
+}
+
+/*
+ * (Internal) Turn the results collected in `res` into a sorted array
+ * of strings, allocated in one block together with the strings, and
+ * release `res`. The number of results is stored into `nres`.
+ */
+
+char **_ramfs_find_res_finish(fs_find_res_t *res, size_t *nres) {
+    size_t ptrs = (res->count > 0 ? res->count : 1) * sizeof(char *);
+    char **results = malloc_or_die(ptrs + res->arena_len);
+    char *strings = (char *) results + ptrs;
+
+    if (res->arena_len > 0)
+        memcpy(strings, res->arena, res->arena_len);
+    for (size_t i = 0; i < res->count; i++)
+        results[i] = strings + res->offs[i];
+    *nres = res->count;
+
+    // Sort their paths
+    strsort(results, *nres);
+
+    free(res->arena);
+    free(res->offs);
+    return results;
+}
+
+/*
+ * (Internal) Prepare `par` for a find of `keyword` on `nthreads`
+ * threads.
+ */
+
+void _ramfs_find_par_init(fs_find_par_t *par, char *keyword, unsigned int nthreads) {
+    memset(par, 0, sizeof(fs_find_par_t));
+    par->keyword = keyword;
+    par->klen = strlen(keyword);
+    _ramfs_bloom_pos(keyword, par->bloom);
+    par->nthreads = nthreads;
+    par->res = calloc_or_die(nthreads, sizeof(fs_find_res_t));
+    par->sorted = calloc_or_die(nthreads, sizeof(char **));
+}
+
+/*
+ * (Internal) Walker callback: match the children of `dir` against the
+ * keyword and queue its subdirectories.
+ */
+
+void _ramfs_find_visit(struct _walker *w, unsigned int tid, fs_node_t *dir, const char *path, size_t pathlen) {
+    fs_find_par_t *par = w->arg;
+    ht_t *children = _ramfs_children(dir);
+    fs_node_t *child;
+    char *dst;
+
+    for (size_t i = 0; i < children->size; i++) {
+        if (children->body[i].key == NULL)
+            continue;
+        child = children->body[i].val;
+
+        if (strcmp(child->name, par->keyword) == 0) {
+            dst = _ramfs_find_res_reserve(&par->res[tid], pathlen + par->klen);
+            memcpy(dst, path, pathlen);
+            memcpy(dst + pathlen, par->keyword, par->klen);
+        }
+        if (child->type == TYPE_DIR && _ramfs_children(child)->used > 0 &&
+            _ramfs_bloom_has(child, par->bloom))
+            walker_push(w, tid, child);
+    }
+}
+
+/*
+ * (Internal) Sort the results collected by thread `tid`.
+ */
+
+void _ramfs_find_sort(fs_find_par_t *par, unsigned int tid) {
+    fs_find_res_t *res = &par->res[tid];
+    char **sorted = malloc_or_die((res->count > 0 ? res->count : 1) * sizeof(char *));
+
+    for (size_t i = 0; i < res->count; i++)
+        sorted[i] = res->arena + res->offs[i];
+    strsort(sorted, res->count);
+    par->sorted[tid] = sorted;
+}
+
+/*
+ * (Internal) Walker callback: a thread is done walking.
+ */
+
+void _ramfs_find_done(struct _walker *w, unsigned int tid) {
+    _ramfs_find_sort(w->arg, tid);
+}
+
+/*
+ * (Internal) Thread body building and sorting the paths of one slice
+ * of the nodes in the name index entry of a find.
+ */
+
+void *_ramfs_find_slice(void *arg) {
+    fs_find_slice_t *slice = arg;
+    fs_find_par_t *par = slice->par;
+    fs_find_res_t *res = &par->res[slice->tid];
+    size_t count = par->entry->count;
+    size_t from = count * slice->tid / par->nthreads;
+    size_t to = count * (slice->tid + 1) / par->nthreads;
+    size_t len;
+
+    for (size_t i = from; i < to; i++) {
+        len = _ramfs_nodepath_len(par->entry->nodes[i]);
+        _ramfs_nodepath_fill(par->entry->nodes[i], _ramfs_find_res_reserve(res, len), len);
+    }
+    _ramfs_find_sort(par, slice->tid);
+    return NULL;
+}
+
+/*
+ * (Internal) Restore the heap property of `heap`, a min-heap of
+ * threads keyed by their next sorted result, from position `i` down.
+ */
+
+void _ramfs_find_sift(fs_find_par_t *par, unsigned int *heap, size_t hlen, size_t *pos, size_t i) {
+    size_t min, l, r;
+    unsigned int tmp;
+
+    for (;;) {
+        min = i;
+        l = 2 * i + 1;
+        r = l + 1;
+        if (l < hlen && strcmp(par->sorted[heap[l]][pos[heap[l]]],
+                               par->sorted[heap[min]][pos[heap[min]]]) < 0)
+            min = l;
+        if (r < hlen && strcmp(par->sorted[heap[r]][pos[heap[r]]],
+                               par->sorted[heap[min]][pos[heap[min]]]) < 0)
+            min = r;
+        if (min == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/*
+ * (Internal) Merge the sorted results of all the threads of `par`
+ * into one sorted array, laid out like the one returned by
+ * `_ramfs_find_res_finish`, and release `par`.
+ */
+
+char **_ramfs_find_par_merge(fs_find_par_t *par, size_t *nres) {
+    size_t *base = malloc_or_die(par->nthreads * sizeof(size_t));
+    size_t *pos = calloc_or_die(par->nthreads, sizeof(size_t));
+    unsigned int *heap = malloc_or_die(par->nthreads * sizeof(unsigned int));
+    size_t count = 0, strings_len = 0, hlen = 0, ptrs, out = 0;
+    fs_find_res_t *res;
+    char **results;
+    char *strings;
+    unsigned int j;
+
+    for (j = 0; j < par->nthreads; j++) {
+        base[j] = strings_len;
+        strings_len += par->res[j].arena_len;
+        count += par->res[j].count;
+        if (par->res[j].count > 0)
+            heap[hlen++] = j;
+    }
+
+    ptrs = (count > 0 ? count : 1) * sizeof(char *);
+    results = malloc_or_die(ptrs + strings_len);
+    strings = (char *) results + ptrs;
+    for (j = 0; j < par->nthreads; j++)
+        if (par->res[j].arena_len > 0)
+            memcpy(strings + base[j], par->res[j].arena, par->res[j].arena_len);
+
+    for (size_t i = hlen / 2; i-- > 0;)
+        _ramfs_find_sift(par, heap, hlen, pos, i);
+
+    while (hlen > 0) {
+        j = heap[0];
+        res = &par->res[j];
+        results[out++] = strings + base[j] + (par->sorted[j][pos[j]] - res->arena);
+        if (++pos[j] == res->count)
+            heap[0] = heap[--hlen];
+        _ramfs_find_sift(par, heap, hlen, pos, 0);
+    }
+    *nres = count;
+
+    for (j = 0; j < par->nthreads; j++) {
+        free(par->res[j].arena);
+        free(par->res[j].offs);
+        free(par->sorted[j]);
+    }
+    free(par->res);
+    free(par->sorted);
+    free(base);
+    free(pos);
+    free(heap);
+    return results;
+}
+
+/*
+ * (Internal) Returns true if the content of `file` matches the grep
+ * described by `par`.
+ */
+
+inline uint8_t _ramfs_grep_match(fs_find_par_t *par, fs_node_t *file) {
+    uint32_t size;
+    char *content = _ramfs_content_get(file, &size);
+
+    if (par->kind == MATCH_REGEX)
+        return match_re_exec(par->re, content, size);
+    return (uint8_t) (match_memmem(content, size, par->keyword, par->klen) != NULL);
+}
+
+/*
+ * (Internal) Walker callback: scan the files in directory `node`,
+ * queueing its subdirectories and its large files, or scan `node`
+ * itself if it is one of those files. Each file is locked while it is
+ * looked at.
+ */
+
+void _ramfs_grep_visit(struct _walker *w, unsigned int tid, fs_node_t *node, const char *path, size_t pathlen) {
+    fs_find_par_t *par = w->arg;
+    ht_t *children;
+    fs_node_t *child;
+    size_t nlen;
+    char *dst;
+
+    // The walker adds a slash after the path of the file
+    if (node->type == TYPE_FILE) {
+        _ramfs_content_lock(node, false);
+        if (_ramfs_grep_match(par, node))
+            memcpy(_ramfs_find_res_reserve(&par->res[tid], pathlen - 1), path, pathlen - 1);
+        _ramfs_content_unlock(node, false);
+        return;
+    }
+
+    children = _ramfs_children(node);
+    for (size_t i = 0; i < children->size; i++) {
+        if (children->body[i].key == NULL)
+            continue;
+        child = children->body[i].val;
+
+        if (child->type == TYPE_DIR) {
+            if (_ramfs_children(child)->used > 0)
+                walker_push(w, tid, child);
+            continue;
+        }
+
+        _ramfs_content_lock(child, false);
+        if (w->nthreads > 1 && __atomic_load_n(&child->size, __ATOMIC_RELAXED) >= GREP_SPLIT_SIZE) {
+            walker_push(w, tid, child);
+        } else if (_ramfs_grep_match(par, child)) {
+            nlen = strlen(child->name);
+            dst = _ramfs_find_res_reserve(&par->res[tid], pathlen + nlen);
+            memcpy(dst, path, pathlen);
+            memcpy(dst + pathlen, child->name, nlen);
+        }
+        _ramfs_content_unlock(child, false);
+    }
+}
+
+/*
+ * (Internal) Add the paths of all the nodes of name index entry
+ * `entry` of `meta` to `res`, but those of detached subtrees.
+ */
+
+void _ramfs_find_entry(fs_meta_t *meta, fs_find_res_t *res, fs_name_entry_t *entry) {
+    size_t len;
+
+    for (uint32_t i = 0; i < entry->count; i++) {
+        if (_ramfs_detached(meta, entry->nodes[i]))
+            continue;
+        len = _ramfs_nodepath_len(entry->nodes[i]);
+        _ramfs_nodepath_fill(entry->nodes[i], _ramfs_find_res_reserve(res, len), len);
+    }
+}
+
+/*
+ * (Internal) Fill the cursor frame on top of the stack with the
+ * matching children of `dir` and its non-empty subdirectories, sorted
+ * in path order. `pathlen` is the length of the path of `dir`.
+ */
+
+void _ramfs_cursor_load(fs_find_cursor_t *c, fs_node_t *dir, size_t pathlen) {
+    fs_cursor_frame_t *f = &c->stack[c->top];
+    ht_t *children = dir->data.children;
+    fs_node_t *child;
+
+    f->count = 0;
+    f->next = 0;
+    f->pathlen = pathlen;
+
+    for (size_t i = 0; i < children->size; i++) {
+        if (children->body[i].key == NULL)
+            continue;
+        child = children->body[i].val;
+
+        // Make room for both the node and its subtree
+        if (f->count + 2 > f->size) {
+            f->size = f->size > 0 ? f->size * 2 : 16;
+            f->items = realloc_or_die(f->items, f->size * sizeof(fs_cursor_item_t));
+        }
+        if (strcmp(child->name, c->keyword) == 0) {
+            f->items[f->count].node = child;
+            f->items[f->count++].subtree = 0;
+        }
+        if (child->type == TYPE_DIR && child->data.children->used > 0 &&
+            _ramfs_bloom_has(child, c->bloom)) {
+            f->items[f->count].node = child;
+            f->items[f->count++].subtree = 1;
+        }
+    }
+
+    qsort(f->items, f->count, sizeof(fs_cursor_item_t), _ramfs_cursor_cmp);
+}
+
+/*
+ * (Internal) Compare two cursor items in path order: a subtree sorts
+ * as the directory name followed by a slash.
+ */
+
+int _ramfs_cursor_cmp(const void *p1, const void *p2) {
+    const fs_cursor_item_t *a = p1;
+    const fs_cursor_item_t *b = p2;
+    const unsigned char *x = (const unsigned char *) a->node->name;
+    const unsigned char *y = (const unsigned char *) b->node->name;
+    int cx, cy;
+
+    while (*x != '\0' && *x == *y) {
+        x++;
+        y++;
+    }
+    cx = *x != '\0' ? *x : (a->subtree ? '/' : 0);
+    cy = *y != '\0' ? *y : (b->subtree ? '/' : 0);
+    return cx - cy;
+}
+
+/*
+ * (Internal) Search for nodes named `keyword` through the name index of
+ * `meta`, like `ramfs_find` but bypassing the cache.
+ */
+
+char **_ramfs_find_index(fs_meta_t *meta, char *keyword, size_t *nres) {
+    fs_name_entry_t *entry = ht_getitem(meta->names, keyword);
+    fs_find_res_t res = {0};
+
+    // Build and sort large result sets on several threads, unless some
+    // of the nodes have to be skipped
+    if (entry != NULL && meta->threads > 1 && entry->count >= FIND_PAR_MIN_RESULTS &&
+        __atomic_load_n(&meta->detached, __ATOMIC_RELAXED) == 0) {
+        pthread_t threads[WALKER_MAX_THREADS];
+        fs_find_slice_t slices[WALKER_MAX_THREADS];
+        fs_find_par_t par;
+
+        _ramfs_find_par_init(&par, keyword, meta->threads);
+        par.entry = entry;
+        for (unsigned int i = 0; i < par.nthreads; i++) {
+            slices[i].par = &par;
+            slices[i].tid = i;
+        }
+        for (unsigned int i = 1; i < par.nthreads; i++)
+            if (pthread_create(&threads[i], NULL, _ramfs_find_slice, &slices[i]) != 0)
+                exit(4);
+        _ramfs_find_slice(&slices[0]);
+        for (unsigned int i = 1; i < par.nthreads; i++)
+            pthread_join(threads[i], NULL);
+
+        return _ramfs_find_par_merge(&par, nres);
+    }
+
+    if (entry != NULL)
+        _ramfs_find_entry(meta, &res, entry);
+
+    return _ramfs_find_res_finish(&res, nres);
+}
+
+/*
+ * (Internal) Look up the results of query `key`, a find of `keyword`,
+ * in the cache of `meta`. An entry stored before a node named
+ * `keyword` was last added or removed is dropped. If no node has that
+ * name, only an empty result is still valid. The tree lock must be
+ * held.
+ * Returns a copy of the results, storing their number into `nres`, or
+ * NULL on a miss.
+ */
+
+char **_ramfs_cache_get(fs_meta_t *meta, char *key, char *keyword, size_t *nres) {
+    fs_find_cache_t *cache = &meta->cache;
+    fs_cache_entry_t *cached;
+    fs_name_entry_t *entry;
+    char **results = NULL;
+
+    if (meta->concurrent)
+        pthread_mutex_lock(&meta->cache_lock);
+    cache->lookups++;
+    if ((cached = ht_getitem(cache->entries, key)) != NULL) {
+        entry = ht_getitem(meta->names, keyword);
+        if (entry != NULL ? entry->gen <= cached->gen : cached->nres == 0) {
+            cache->hits++;
+            cached->used = cache->lookups;
+            *nres = cached->nres;
+            results = _ramfs_results_copy(cached->results, cached->nres, cached->size);
+        } else {
+            cache->invalidations++;
+            _ramfs_cache_drop(cache, cached);
+        }
+    }
+    if (results == NULL)
+        cache->misses++;
+    if (meta->concurrent)
+        pthread_mutex_unlock(&meta->cache_lock);
+    return results;
+}
+
+/*
+ * (Internal) Store a copy of the `nres` results of query `key` into
+ * the cache of `meta`, evicting the least recently used entries to
+ * make room. `keyword` must be the end of `key`. The tree lock must be
+ * held. Results another thread already stored are kept.
+ */
+
+void _ramfs_cache_put(fs_meta_t *meta, char *key, char *keyword, char **results, size_t nres) {
+    fs_find_cache_t *cache = &meta->cache;
+    fs_cache_entry_t *entry, *lru;
+    size_t size = (nres > 0 ? nres : 1) * sizeof(char *);
+    size_t klen = strlen(key);
+    ht_item_t *body;
+
+    for (size_t i = 0; i < nres; i++)
+        size += strlen(results[i]) + 1;
+    if (size > FIND_CACHE_MAX_BYTES / 4)
+        return;
+
+    if (meta->concurrent)
+        pthread_mutex_lock(&meta->cache_lock);
+    if (ht_getitem(cache->entries, key) != NULL) {
+        if (meta->concurrent)
+            pthread_mutex_unlock(&meta->cache_lock);
+        return;
+    }
+
+    while (cache->entries->used >= FIND_CACHE_MAX_ENTRIES ||
+           (cache->entries->used > 0 && cache->bytes + size > FIND_CACHE_MAX_BYTES)) {
+        lru = NULL;
+        body = cache->entries->body;
+        for (size_t i = 0; i < cache->entries->size; i++) {
+            entry = body[i].val;
+            if (body[i].key != NULL && (lru == NULL || entry->used < lru->used))
+                lru = entry;
+        }
+        cache->evictions++;
+        _ramfs_cache_drop(cache, lru);
+    }
+
+    entry = malloc_or_die(sizeof(fs_cache_entry_t));
+    entry->key = malloc_or_die(klen + 1);
+    memcpy(entry->key, key, klen + 1);
+    entry->keyword = entry->key + klen - strlen(keyword);
+    entry->results = _ramfs_results_copy(results, nres, size);
+    entry->nres = nres;
+    entry->size = size;
+    entry->gen = meta->gen;
+    entry->used = cache->lookups;
+    ht_setitem(cache->entries, entry->key, entry);
+    cache->bytes += size;
+    if (meta->concurrent)
+        pthread_mutex_unlock(&meta->cache_lock);
+}
+
+/*
+ * (Internal) Remove `entry` from `cache` and free it.
+ */
+
+void _ramfs_cache_drop(fs_find_cache_t *cache, fs_cache_entry_t *entry) {
+    ht_delitem(cache->entries, entry->key);
+    cache->bytes -= entry->size;
+    free(entry->results);
+    free(entry->key);
+    free(entry);
+}
+
+/*
+ * (Internal) Free all the entries of `cache` and its table.
+ */
+
+void _ramfs_cache_clear(fs_find_cache_t *cache) {
+    ht_item_t *body = cache->entries->body;
+
+    for (size_t i = 0; i < cache->entries->size; i++) {
+        if (body[i].key == NULL)
+            continue;
+        fs_cache_entry_t *entry = body[i].val;
+        free(entry->results);
+        free(entry->key);
+        free(entry);
+    }
+    ht_del(cache->entries);
+}
+
+/*
+ * (Internal) Drop every entry of the cache of `meta`, keeping its
+ * counters. The tree lock must be held for writing.
+ */
+
+void _ramfs_cache_flush(fs_meta_t *meta) {
+    fs_find_cache_t *cache = &meta->cache;
+
+    if (meta->concurrent)
+        pthread_mutex_lock(&meta->cache_lock);
+    cache->invalidations += cache->entries->used;
+    _ramfs_cache_clear(cache);
+    cache->entries = ht_new();
+    cache->bytes = 0;
+    if (meta->concurrent)
+        pthread_mutex_unlock(&meta->cache_lock);
+}
+
+/*
+ * (Internal) Returns a copy of the `nres` results at `results`, laid
+ * out like the ones of `ramfs_find` in `size` bytes.
+ */
+
+char **_ramfs_results_copy(char **results, size_t nres, size_t size) {
+    char **copy = malloc_or_die(size);
+    char *strings = (char *) copy + (nres > 0 ? nres : 1) * sizeof(char *);
+    size_t len;
+
+    for (size_t i = 0; i < nres; i++) {
+        len = strlen(results[i]) + 1;
+        memcpy(strings, results[i], len);
+        copy[i] = strings;
+        strings += len;
+    }
+    return copy;
+}
+
+/*
+ * (Internal) Store into `pos` the counters standing for `name` in the
+ * summaries of the directories, derived from a single hash.
+ */
+
+void _ramfs_bloom_pos(const char *name, uint32_t *pos) {
+    uint32_t h = hash(name, strlen(name));
+    uint32_t step = (h >> 16 | h << 16) | 1;
+
+    for (uint32_t k = 0; k < FS_BLOOM_HASHES; k++)
+        pos[k] = (h + k * step) & (FS_BLOOM_SIZE - 1);
+}
+
+/*
+ * (Internal) Count a name, whose counters are `pos`, in the summary
+ * of directory `dir`. Counters stop at FS_BLOOM_MAX.
+ */
+
+void _ramfs_bloom_add(fs_node_t *dir, const uint32_t *pos) {
+    uint8_t *bloom = FS_DIR(dir)->bloom;
+    unsigned int shift, c;
+
+    for (int k = 0; k < FS_BLOOM_HASHES; k++) {
+        shift = (pos[k] & 1) * 4;
+        c = (unsigned int) (bloom[pos[k] / 2] >> shift) & 0xf;
+        if (c < FS_BLOOM_MAX)
+            __atomic_store_n(&bloom[pos[k] / 2], (uint8_t) (bloom[pos[k] / 2] + (1 << shift)), __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * (Internal) Count the names counted in the summary of directory
+ * `sub` in the one of directory `dir` too, as if they were added one
+ * by one with `_ramfs_bloom_add`. Only used while nobody else can
+ * see `dir`.
+ */
+
+void _ramfs_bloom_merge(fs_node_t *dir, fs_node_t *sub) {
+    uint8_t *bloom = FS_DIR(dir)->bloom;
+    const uint8_t *names = FS_DIR(sub)->bloom;
+    unsigned int shift, c;
+
+    for (size_t i = 0; i < sizeof(FS_DIR(dir)->bloom); i++) {
+        if (names[i] == 0)
+            continue;
+        for (shift = 0; shift <= 4; shift += 4) {
+            c = ((bloom[i] >> shift) & 0xf) + ((names[i] >> shift) & 0xf);
+            if (c > FS_BLOOM_MAX)
+                c = FS_BLOOM_MAX;
+            bloom[i] = (uint8_t) ((bloom[i] & ~(0xf << shift)) | (c << shift));
+        }
+    }
+}
+
+/*
+ * (Internal) Stop counting a name, whose counters are `pos`, in the
+ * summary of directory `dir`. Saturated counters can't tell how many
+ * names they stand for and are left alone, unless the directory is
+ * now empty and the whole summary can be cleared.
  */
 
-int _pathcmp(const void *p1, const void *p2) {
-    return strcmp(* (char * const *) p1, * (char * const *) p2);
+void _ramfs_bloom_del(fs_node_t *dir, const uint32_t *pos) {
+    uint8_t *bloom = FS_DIR(dir)->bloom;
+    unsigned int shift, c;
+
+    // Readers don't lock in RCU mode, so bytes are stored one by one
+    if (FS_DIR(dir)->nodes == 0) {
+        for (size_t i = 0; i < sizeof(FS_DIR(dir)->bloom); i++)
+            __atomic_store_n(&bloom[i], 0, __ATOMIC_RELAXED);
+        return;
+    }
+    for (int k = 0; k < FS_BLOOM_HASHES; k++) {
+        shift = (pos[k] & 1) * 4;
+        c = (unsigned int) (bloom[pos[k] / 2] >> shift) & 0xf;
+        if (c > 0 && c < FS_BLOOM_MAX)
+            __atomic_store_n(&bloom[pos[k] / 2], (uint8_t) (bloom[pos[k] / 2] - (1 << shift)), __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * (Internal) Stop counting the names counted in the summary of
+ * directory `sub`, which is being detached from below directory
+ * `dir`, like `_ramfs_bloom_del`. Counters of `dir` that aren't
+ * saturated count those names exactly, so they are never less than
+ * the ones of `sub`.
+ */
+
+void _ramfs_bloom_sub(fs_node_t *dir, fs_node_t *sub) {
+    uint8_t *bloom = FS_DIR(dir)->bloom;
+    const uint8_t *names = FS_DIR(sub)->bloom;
+    unsigned int shift, c, s, b;
+
+    if (FS_DIR(dir)->nodes == 0)
+        return;
+    for (size_t i = 0; i < sizeof(FS_DIR(dir)->bloom); i++) {
+        if (names[i] == 0)
+            continue;
+        b = bloom[i];
+        for (shift = 0; shift <= 4; shift += 4) {
+            c = (bloom[i] >> shift) & 0xf;
+            s = (unsigned int) (names[i] >> shift) & 0xf;
+            if (c < FS_BLOOM_MAX && s <= c)
+                b -= s << shift;
+        }
+        __atomic_store_n(&bloom[i], (uint8_t) b, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * (Internal) Returns false if no node below directory `dir` can have
+ * the name whose counters are `pos`.
+ */
+
+inline uint8_t _ramfs_bloom_has(fs_node_t *dir, const uint32_t *pos) {
+    const uint8_t *bloom = FS_DIR(dir)->bloom;
+
+    for (int k = 0; k < FS_BLOOM_HASHES; k++)
+        if (((__atomic_load_n(&bloom[pos[k] / 2], __ATOMIC_RELAXED) >> ((pos[k] & 1) * 4)) & 0xf) == 0)
+            return 0;
+    return 1;
 }
 
 #ifdef DEBUG
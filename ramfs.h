@@ -6,13 +6,61 @@
 #define API_RAMFS_RAMFS_H
 
 // start:includes
+#include <pthread.h>
 #include "hashtable.h"
+#include "match.h"
+#include "trigram.h"
+#include "ringbuf.h"
 // end:includes
 
 // start:macros
 #define MAX_NAME_LENGTH 255
 #define MAX_CHILDREN    1024
 #define FIND_ARRAY_SIZE 64
+#define FIND_ARENA_SIZE 4096
+// Smaller trees and result sets are not worth spawning threads for
+#define FIND_PAR_MIN_NODES   65536
+#define FIND_PAR_MIN_RESULTS 16384
+// Larger result sets are streamed in order instead of sorted at once
+#define FIND_STREAM_MIN_RESULTS 65536
+#define FIND_PATH_SIZE  (256 * 256 + 1)
+// No node is deeper than this, a find limited to it sees everything
+#define FIND_DEPTH_ALL  255
+// Grep hands files at least this large to other threads on their own,
+// and only uses threads once the file system holds enough content
+#define GREP_SPLIT_SIZE    65536
+#define GREP_PAR_MIN_BYTES (1 << 20)
+// Summary of the names below a directory: 4 bit counters, two per
+// byte, 128 bytes per directory
+#define FS_BLOOM_SIZE   256
+#define FS_BLOOM_HASHES 3
+#define FS_BLOOM_MAX    15
+// Results of exact finds are kept until a node with their name is
+// added or removed. No single result set may take more than a quarter
+// of the space.
+#define FIND_CACHE_MAX_ENTRIES 256
+#define FIND_CACHE_MAX_BYTES   (16 << 20)
+// File contents are guarded by one of these locks in concurrent mode,
+// picked by node address
+#define FS_CONTENT_LOCKS 64
+// Threads that can read in RCU mode at once, and how much memory is
+// retired before trying to free it
+#define FS_RCU_MAX_READERS 64
+#define FS_RCU_BATCH       256
+// Locks a file system takes, see `fs_meta_t`. The tree lock, and the
+// snapshot and cache locks, also guard what its user shares with the
+// reaper thread; directory and content locks are only needed once
+// several threads use it.
+#define FS_LOCK_TREE  1
+#define FS_LOCK_NODES 2
+// Nodes the reaper frees before letting writers in again. Smaller
+// subtrees are freed right away by `delete_r`.
+#define FS_REAP_SLICE 1024
+// Searches doing less work than this, in nodes or results, are not
+// worth running a slice at a time (see `fs_task_t`). The clock is
+// looked at every FS_TASK_CHECK nodes.
+#define FS_TASK_MIN_WORK 16384
+#define FS_TASK_CHECK    256
 // end:macros
 
 // start:datatypes
@@ -30,29 +78,478 @@ typedef union _fs_node_data {
 typedef struct _fs_node {
     char *name;
     struct _fs_node *parent;
-    fs_node_type_t type;
     fs_node_data_u data;
+    fs_node_type_t type;
+    uint32_t size;      // content length, files only
+    uint32_t idx_slot;  // position in its name index entry
+    uint32_t born;      // snapshot epoch it was created in
+    uint32_t saved;     // snapshot epoch its state was last preserved in
     uint8_t depth;
 } fs_node_t;
+
+// All the nodes with the same name, in no particular order
+typedef struct _fs_name_entry {
+    char *name;
+    struct _fs_node **nodes;
+    uint32_t count;
+    uint32_t size;
+    uint32_t *tg_slots;     // positions in the trigram posting lists
+    uint64_t gen;           // when a node with this name was last added or removed
+} fs_name_entry_t;
+
+// Results of a find, laid out like the ones returned by `ramfs_find`
+typedef struct _fs_cache_entry {
+    char *key;          // the keyword, or scope and keyword for find_in
+    char *keyword;      // points into `key`
+    char **results;
+    size_t nres;
+    size_t size;        // bytes of `results`
+    uint64_t gen;       // file system generation when it was stored
+    uint64_t used;      // lookup it last served, for eviction
+} fs_cache_entry_t;
+
+// Find results by query. An entry is stale, and dropped when looked
+// up, once the name index entry of its keyword changed after it was
+// stored: results only change when nodes with that name come or go.
+typedef struct _fs_find_cache {
+    ht_t *entries;      // key -> fs_cache_entry_t
+    size_t bytes;
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+} fs_find_cache_t;
+
+// Memory retired by a writer in RCU mode, freed once every reader
+// went through a quiescent state
+typedef enum _fs_rcu_kind {
+    RCU_CONTENT,
+    RCU_TABLE,
+    RCU_NODE
+} fs_rcu_kind_t;
+
+typedef struct _fs_rcu_retired {
+    void *ptr;
+    fs_rcu_kind_t kind;
+    uint64_t epoch;     // epoch it was retired in
+} fs_rcu_retired_t;
+
+// A reader thread, on a cache line of its own: the epoch it last saw
+// while holding no references, 0 if the slot is free
+typedef struct _fs_rcu_reader {
+    uint64_t epoch;
+    char pad[CACHE_LINE_SIZE - sizeof(uint64_t)];
+} fs_rcu_reader_t;
+
+// Quiescent state based reclamation
+typedef struct _fs_rcu {
+    uint64_t epoch;     // bumped by every retirement
+    fs_rcu_reader_t readers[FS_RCU_MAX_READERS];
+    pthread_mutex_t lock;   // taken by writers only
+    fs_rcu_retired_t *retired;
+    size_t count;
+    size_t size;
+    uint64_t reclaimed;
+} fs_rcu_t;
+
+struct _fs_reaper;
+struct _journal;
+struct _image_bgsave;
+
+// State a node had when a snapshot was taken: its children table or
+// its content, which the live node no longer uses
+typedef struct _fs_snap_state {
+    fs_node_t *node;    // NULL for a free slot
+    void *data;
+    uint32_t size;
+} fs_snap_state_t;
+
+// A frozen version of a file system. It shares every node with the
+// live tree until a writer changes it: the state the node had is then
+// moved here first, and nodes removed while the snapshot could see
+// them are kept until it is released. A snapshot that has no state
+// for a node finds it in the newer ones, or in the live node.
+typedef struct _fs_snapshot {
+    struct _fs_meta *meta;
+    fs_node_t *root;
+    uint32_t epoch;     // sees the nodes born before it
+    fs_snap_state_t *states;    // open addressing by node address
+    size_t nstates;
+    size_t states_size;
+    fs_node_t **buried;
+    size_t nburied;
+    size_t buried_size;
+    struct _fs_snapshot *older;
+    struct _fs_snapshot *newer;
+} fs_snapshot_t;
+
+// State shared by a whole file system.
+// In concurrent mode locks are always taken in this order: directory
+// locks from the root down, then `lock`, then the content locks, then
+// `snap_lock` or `cache_lock`. `lock` is held for writing while nodes are added or
+// removed, so holding it for reading freezes the shape of the tree.
+typedef struct _fs_meta {
+    ht_t *names;        // name -> fs_name_entry_t
+    tg_index_t *trigrams;   // trigram -> fs_name_entry_t, NULL until the first substring query
+    size_t nodes;
+    size_t bytes;       // content of all the files, updated atomically
+    unsigned int threads;   // used by find, 1 unless configured
+    uint64_t gen;       // bumped by every node added or removed
+    fs_find_cache_t cache;
+    uint8_t concurrent;     // FS_LOCK_* flags, locks are only taken if set
+    uint8_t rcu;            // readers take no locks at all
+    pthread_rwlock_t lock;  // names, trigrams, counters, children tables
+    pthread_rwlock_t content_locks[FS_CONTENT_LOCKS];
+    uint32_t content_seq[FS_CONTENT_LOCKS];     // odd while a content is replaced
+    pthread_mutex_t cache_lock;
+    fs_rcu_t *rcu_state;
+    uint32_t snap_epoch;    // epoch of the last snapshot taken
+    fs_snapshot_t *snaps;   // newest live snapshot
+    pthread_mutex_t snap_lock;  // snapshot states and lists
+    struct _fs_reaper *reaper;
+    size_t detached;    // subtrees still in the name index, not in the tree
+    char *image;        // file mapped by `image_load`, names and contents
+    size_t image_len;   // of the loaded nodes are in it until replaced
+    char *arena;        // the loaded nodes themselves, allocated at once
+    size_t arena_len;
+    struct _journal *journal;   // mutations are logged to, see journal.h
+    uint64_t journal_seq;       // last journal record applied
+    struct _image_bgsave *bgsave;   // see image.h
+} fs_meta_t;
+
+// Directories also point to the file system state, files reach it
+// through their parent
+typedef struct _fs_dir_node {
+    fs_node_t node;
+    fs_meta_t *meta;
+    pthread_rwlock_t lock;  // children table, for path lookups
+    size_t nodes;       // nodes below it, at any depth
+    // Counting Bloom filter of the names of those nodes. A saturated
+    // counter is never decremented again, until the directory empties.
+    uint8_t bloom[FS_BLOOM_SIZE / 2];
+} fs_dir_node_t;
+
+#define FS_DIR(n) ((fs_dir_node_t *) (n))
+// Content lock and sequence counter of file `n`
+#define FS_CONTENT_STRIPE(n) (((uintptr_t) (n) / sizeof(fs_node_t)) % FS_CONTENT_LOCKS)
+
+// Paths matched by find, stored back to back in a single arena and
+// referenced by offset until the search is over
+typedef struct _fs_find_res {
+    char *arena;
+    size_t arena_len;
+    size_t arena_size;
+    size_t *offs;
+    size_t count;
+    size_t offs_size;
+} fs_find_res_t;
+
+// State of a find running on several threads, each one collecting
+// and sorting its own results before they are merged
+typedef struct _fs_find_par {
+    char *keyword;
+    size_t klen;
+    unsigned int nthreads;
+    fs_find_res_t *res;
+    char ***sorted;
+    fs_name_entry_t *entry;
+    match_kind_t kind;      // grep only: MATCH_SUBSTR or MATCH_REGEX
+    match_re_t *re;
+    uint32_t bloom[FS_BLOOM_HASHES];   // counters standing for the keyword
+} fs_find_par_t;
+
+typedef struct _fs_find_slice {
+    fs_find_par_t *par;
+    unsigned int tid;
+} fs_find_slice_t;
+
+struct _walker;
+
+// One entry of a directory as seen by the sorted find cursor: either
+// the node itself, if it matches, or the subtree below it. A subtree
+// sorts as its name followed by a slash.
+typedef struct _fs_cursor_item {
+    fs_node_t *node;
+    uint8_t subtree;
+} fs_cursor_item_t;
+
+typedef struct _fs_cursor_frame {
+    fs_cursor_item_t *items;    // sorted
+    size_t count;
+    size_t size;
+    size_t next;
+    size_t pathlen;     // length of the directory path, slash included
+} fs_cursor_frame_t;
+
+// Yields the results of a find one at a time in sorted order, keeping
+// only one sorted directory per level in memory
+typedef struct _fs_find_cursor {
+    fs_meta_t *meta;
+    char *keyword;
+    uint32_t bloom[FS_BLOOM_HASHES];
+    char *path;
+    int top;
+    fs_cursor_frame_t stack[256];
+} fs_find_cursor_t;
+
+// Directory being visited by the iterative find
+typedef struct _fs_find_frame {
+    fs_node_t *dir;
+    ht_t *children;     // its table as seen by a snapshot
+    size_t next;        // next slot of its children table
+    size_t pathlen;     // length of its path, trailing slash included
+} fs_find_frame_t;
+
+// Subtrees unlinked by `delete_r`, freed in the background a slice
+// at a time, by a thread of their own or by `ramfs_reap`
+typedef struct _fs_reaper {
+    pthread_t thread;
+    uint8_t threaded;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fs_node_t **queue;
+    size_t count;
+    size_t size;
+    uint8_t stop;       // exit once the queue is empty
+    uint64_t reaped;    // nodes freed
+    fs_find_frame_t stack[256];     // subtree being freed
+    int sp;             // -1 between subtrees
+} fs_reaper_t;
+
+// A find, count or grep run a slice at a time against a snapshot, so
+// that the tree can change between slices. Either the nodes named
+// `keyword` are taken from the name index, and checked one by one,
+// or the directories are walked. The results of every slice are
+// sorted at its end, and merged once they are all found.
+typedef struct _fs_task {
+    fs_meta_t *meta;
+    fs_snapshot_t *snap;
+    fs_node_t *dir;     // where the search starts
+    char *keyword;      // own copy, the grep pattern has `klen` bytes
+    size_t klen;
+    match_kind_t kind;  // grep only: MATCH_SUBSTR or MATCH_REGEX
+    match_re_t re;
+    uint8_t grep;
+    uint8_t count_only;
+    uint8_t done;       // all the results were found
+    unsigned int maxdepth;
+    size_t count;       // results found so far
+    size_t bytes;       // length of their paths
+
+    fs_node_t **nodes;  // from the name index, unless walking
+    size_t nnodes;
+    size_t next;
+    fs_find_frame_t stack[256];
+    int top;            // -1 once walked, or if not walking
+    char *path;
+    size_t path_size;
+
+    fs_find_par_t runs; // one sorted run per slice, as if per thread
+    size_t runs_size;
+    unsigned int *heap;
+    size_t *pos;
+    size_t hlen;
+} fs_task_t;
+
+// Operations a transaction can batch
+typedef enum _fs_txn_op {
+    TXN_CREATE,
+    TXN_CREATE_DIR,
+    TXN_WRITE,
+    TXN_DELETE,
+    TXN_DELETE_R
+} fs_txn_op_t;
+
+// A node as the operations of a batch checked so far leave it: a node
+// of the tree, looked up once, or one the batch creates or removes.
+// Every change makes a new one, so each operation keeps the version it
+// was checked against.
+typedef struct _fs_txn_node {
+    char *name;         // points into the path of an operation
+    fs_node_t *node;    // for new nodes, set once the batch creates it
+    ht_t *children;     // versions looked up or made below it, by name
+    size_t nchildren;   // children it has at this point of the batch
+    fs_node_type_t type;
+    uint8_t exists;
+    uint8_t fresh;      // none of its children are in the tree
+    uint8_t depth;
+    uint8_t locked;     // holds the lock of `node`
+    uint8_t gone;       // `node` is removed if the batch is applied
+    struct _fs_txn_node *prev;  // the version it replaced
+    struct _fs_txn_node *next;  // all of them, to be freed
+} fs_txn_node_t;
+
+typedef struct _fs_txn_item {
+    fs_txn_op_t op;
+    char *path;         // own copy, tokenized by the check
+    char *content;      // writes only, adopted like `ramfs_write_adopt`
+    size_t len;
+    size_t pos;         // position in the batch, from 1
+    fs_txn_node_t *dir;     // its directory, set by the check
+    fs_txn_node_t *node;    // the node it changes, or creates
+} fs_txn_item_t;
+
+// Operations applied all together by `ramfs_txn_commit`, or not at all
+typedef struct _fs_txn {
+    fs_txn_item_t *items;
+    size_t count;
+    size_t size;
+    size_t failed;      // position of the first one that can't be applied
+    uint8_t open;       // for front-ends: between `begin` and `commit`
+    fs_txn_node_t *nodes;
+} fs_txn_t;
 // end:datatypes
 
 // start:declarations
 int ramfs_create(fs_node_t *root, char *path);
 int ramfs_create_dir(fs_node_t *root, char *path);
 char * ramfs_read(fs_node_t *root, char *path);
+char * ramfs_read_n(fs_node_t *root, char *path, size_t *len);
 int ramfs_write(fs_node_t *root, char *path, char *content);
+int ramfs_write_n(fs_node_t *root, char *path, char *content, size_t len);
+int ramfs_write_adopt(fs_node_t *root, char *path, char *content, size_t len);
 int ramfs_delete(fs_node_t *root, char *path);
 int ramfs_delete_r(fs_node_t *root, char *path);
 char **ramfs_find(fs_node_t *root, char *keyword, size_t *nres);
+char **ramfs_find_walk(fs_node_t *root, char *keyword, size_t *nres);
+void   ramfs_set_threads(fs_node_t *root, unsigned int nthreads);
+size_t ramfs_find_count(fs_node_t *root, char *keyword);
+char **ramfs_find_match(fs_node_t *root, match_kind_t kind, char *pattern, size_t *nres);
+void   ramfs_find_open(fs_find_cursor_t *c, fs_node_t *root, char *keyword);
+char  *ramfs_find_next(fs_find_cursor_t *c, size_t *len);
+void   ramfs_find_close(fs_find_cursor_t *c);
+char **ramfs_find_in(fs_node_t *root, char *path, char *keyword, unsigned int maxdepth, size_t *nres);
+int    ramfs_count_in(fs_node_t *root, char *path, char *keyword, unsigned int maxdepth, size_t *count);
+char **ramfs_grep(fs_node_t *root, char *path, match_kind_t kind, char *pattern, size_t plen, size_t *nres);
+const fs_find_cache_t *ramfs_find_cache(fs_node_t *root);
+void   ramfs_set_concurrent(fs_node_t *root);
+void   ramfs_set_rcu(fs_node_t *root);
+void   ramfs_set_reaper(fs_node_t *root, uint8_t thread);
+uint8_t ramfs_reap(fs_node_t *root);
+int    ramfs_rcu_register(fs_node_t *root);
+void   ramfs_rcu_quiescent(fs_node_t *root, int id);
+void   ramfs_rcu_unregister(fs_node_t *root, int id);
+char  *ramfs_read_copy(fs_node_t *root, char *path, size_t *len);
+fs_snapshot_t *ramfs_snapshot(fs_node_t *root);
+void   ramfs_snapshot_release(fs_snapshot_t *snap);
+char  *ramfs_snapshot_read(fs_snapshot_t *snap, char *path, size_t *len);
+char **ramfs_snapshot_find(fs_snapshot_t *snap, char *path, char *keyword, unsigned int maxdepth, size_t *nres);
+int    ramfs_task_find(fs_task_t *t, fs_node_t *root, char *path, char *keyword, unsigned int maxdepth,
+                       uint8_t count_only);
+int    ramfs_task_grep(fs_task_t *t, fs_node_t *root, char *path, match_kind_t kind, char *pattern, size_t plen);
+uint8_t ramfs_task_step(fs_task_t *t, uint64_t deadline);
+char  *ramfs_task_next(fs_task_t *t, size_t *len);
+void   ramfs_task_close(fs_task_t *t);
+void   ramfs_txn_init(fs_txn_t *txn);
+void   ramfs_txn_add(fs_txn_t *txn, fs_txn_op_t op, char *path, char *content, size_t len);
+int    ramfs_txn_commit(fs_node_t *root, fs_txn_t *txn);
+void   ramfs_txn_clear(fs_txn_t *txn);
 fs_node_t  *ramfs_mkfs();
 
-fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname);
+fs_node_t *_ramfs_resolve_node(fs_node_t *root, char *path, char **newname, uint8_t write, fs_node_t **locked);
+size_t      _ramfs_path_depth(const char *path);
+void        _ramfs_lock(fs_node_t *dir, uint8_t write);
+void        _ramfs_unlock(fs_node_t *dir);
+void        _ramfs_tree_lock(fs_meta_t *meta, uint8_t write);
+void        _ramfs_tree_unlock(fs_meta_t *meta);
+void        _ramfs_content_lock(fs_node_t *file, uint8_t write);
+void        _ramfs_content_unlock(fs_node_t *file, uint8_t write);
+void        _ramfs_reader_lock(fs_meta_t *meta);
+void        _ramfs_reader_unlock(fs_meta_t *meta);
+ht_t       *_ramfs_children(fs_node_t *dir);
+uint8_t     _ramfs_children_add(fs_node_t *dir, char *name, fs_node_t *node);
+void        _ramfs_children_del(fs_node_t *dir, char *name);
+char       *_ramfs_content_get(fs_node_t *file, uint32_t *size);
+void        _ramfs_content_set(fs_node_t *file, char *content, uint32_t size);
+void        _ramfs_rcu_retire(fs_meta_t *meta, void *ptr, fs_rcu_kind_t kind);
+void        _ramfs_rcu_reclaim(fs_meta_t *meta, uint8_t all);
+void        _ramfs_rcu_free(fs_meta_t *meta, fs_rcu_retired_t *r);
+uint8_t     _ramfs_in_image(fs_meta_t *meta, const void *ptr);
+void        _ramfs_free_data(fs_meta_t *meta, void *ptr);
+void        _ramfs_free_node(fs_meta_t *meta, fs_node_t *node);
+void        _ramfs_dispose(fs_meta_t *meta, void *ptr, fs_rcu_kind_t kind);
+void        _ramfs_snap_freeze(fs_meta_t *meta);
+void        _ramfs_snap_thaw(fs_meta_t *meta);
+uint8_t     _ramfs_snap_wants(fs_node_t *node);
+void        _ramfs_snap_keep(fs_node_t *node, void *data, uint32_t size);
+uint8_t     _ramfs_snap_bury(fs_node_t *node);
+fs_snapshot_t   *_ramfs_snap_take(fs_meta_t *meta, fs_node_t *root);
+fs_snap_state_t *_ramfs_snap_slot(fs_snapshot_t *snap, fs_node_t *node);
+void        _ramfs_snap_insert(fs_snapshot_t *snap, fs_node_t *node, void *data, uint32_t size);
+uint8_t     _ramfs_snap_state(fs_snapshot_t *snap, fs_node_t *node, void **data, uint32_t *size);
+ht_t       *_ramfs_snap_children(fs_snapshot_t *snap, fs_node_t *dir);
+char       *_ramfs_snap_content(fs_snapshot_t *snap, fs_node_t *file, uint32_t *size);
+fs_node_t  *_ramfs_snap_resolve(fs_snapshot_t *snap, char *path);
+size_t      _ramfs_snap_find(fs_snapshot_t *snap, fs_node_t *dir, char *keyword, unsigned int maxdepth,
+                             fs_find_res_t *res);
 char       *_ramfs_getpath(fs_node_t *node);
+char       *_ramfs_nodepath(fs_node_t *node);
+size_t      _ramfs_nodepath_len(fs_node_t *node);
+void        _ramfs_nodepath_fill(fs_node_t *node, char *path, size_t len);
+fs_meta_t  *_ramfs_meta(fs_node_t *node);
+void        _ramfs_index_add(fs_meta_t *meta, fs_node_t *node);
+void        _ramfs_index_trigrams(tg_index_t *t, fs_name_entry_t *entry);
+void        _ramfs_trigrams(fs_meta_t *meta);
+void        _ramfs_index_del(fs_meta_t *meta, fs_node_t *node);
 fs_node_t  *_ramfs_mknode(fs_node_t *parent, char *name, fs_node_type_t type, void *data);
+fs_node_t  *_ramfs_node_new(fs_node_t *parent, char *name, fs_node_type_t type, void *data);
+fs_node_t  *_ramfs_node_link(fs_node_t *parent, fs_node_t *node);
 int _ramfs_rmnode(fs_node_t *node, uint8_t no_rm_from_parent);
 int _ramfs_rmnode_r(fs_node_t *node, uint8_t no_rm_from_parent);
-size_t _ramfs_find(fs_node_t *node, char *curpath, char *keyword, char ***results, size_t *len, size_t *pos);
-int _pathcmp(const void *p1, const void *p2);
+int _ramfs_rmnode_locked(fs_node_t *node, uint8_t no_rm_from_parent);
+int _ramfs_rmnode_r_locked(fs_node_t *node, uint8_t no_rm_from_parent);
+void _ramfs_lock_r(fs_node_t *node);
+uint8_t _ramfs_detach(fs_node_t *node);
+uint8_t _ramfs_detached(fs_meta_t *meta, fs_node_t *node);
+void *_ramfs_reaper_thread(void *arg);
+uint8_t _ramfs_reap_slice(fs_meta_t *meta);
+uint8_t _ramfs_reap_node(fs_meta_t *meta, fs_node_t *node);
+void  _ramfs_reap_drain(fs_meta_t *meta, fs_node_t *dir);
+void  _ramfs_reaper_stop(fs_meta_t *meta);
+void  _ramfs_task_init(fs_task_t *t, fs_snapshot_t *snap, fs_node_t *dir, unsigned int maxdepth, uint8_t walk);
+void  _ramfs_task_index(fs_task_t *t, uint64_t deadline);
+void  _ramfs_task_walk(fs_task_t *t, uint64_t deadline);
+uint8_t _ramfs_task_match(fs_task_t *t, fs_node_t *node);
+int  _ramfs_txn_check(fs_node_t *root, fs_txn_t *txn);
+void _ramfs_txn_apply(fs_node_t *root, fs_txn_t *txn);
+void _ramfs_txn_unlock(fs_txn_t *txn, uint8_t applied);
+void _ramfs_txn_lock_r(fs_txn_t *txn, fs_txn_node_t *dir);
+fs_txn_node_t *_ramfs_txn_node(fs_txn_t *txn, char *name, fs_node_t *node, fs_node_type_t type,
+                               uint8_t exists, uint8_t depth);
+fs_txn_node_t *_ramfs_txn_child(fs_txn_t *txn, fs_txn_node_t *dir, char *name);
+fs_txn_node_t *_ramfs_txn_resolve(fs_txn_t *txn, fs_txn_node_t *root, char *path, char **name);
+uint8_t _ramfs_txn_same_dir(const char *prev, const char *path, size_t len);
+void _ramfs_txn_replace(fs_txn_node_t *dir, fs_txn_node_t *node);
+size_t _ramfs_find(fs_node_t *dir, char *keyword, unsigned int maxdepth, fs_find_res_t *res);
+size_t _ramfs_find_under(fs_node_t *dir, char *keyword, unsigned int maxdepth, fs_find_res_t *res);
+char  *_ramfs_find_res_reserve(fs_find_res_t *res, size_t len);
+char **_ramfs_find_res_finish(fs_find_res_t *res, size_t *nres);
+void   _ramfs_find_par_init(fs_find_par_t *par, char *keyword, unsigned int nthreads);
+char **_ramfs_find_par_merge(fs_find_par_t *par, size_t *nres);
+void   _ramfs_find_visit(struct _walker *w, unsigned int tid, fs_node_t *dir, const char *path, size_t pathlen);
+void   _ramfs_find_sort(fs_find_par_t *par, unsigned int tid);
+void   _ramfs_find_done(struct _walker *w, unsigned int tid);
+void  *_ramfs_find_slice(void *arg);
+void   _ramfs_find_sift(fs_find_par_t *par, unsigned int *heap, size_t hlen, size_t *pos, size_t i);
+void    _ramfs_bloom_pos(const char *name, uint32_t *pos);
+void    _ramfs_bloom_add(fs_node_t *dir, const uint32_t *pos);
+void    _ramfs_bloom_merge(fs_node_t *dir, fs_node_t *sub);
+void    _ramfs_bloom_del(fs_node_t *dir, const uint32_t *pos);
+void    _ramfs_bloom_sub(fs_node_t *dir, fs_node_t *sub);
+uint8_t _ramfs_bloom_has(fs_node_t *dir, const uint32_t *pos);
+void _ramfs_find_entry(fs_meta_t *meta, fs_find_res_t *res, fs_name_entry_t *entry);
+char **_ramfs_find_index(fs_meta_t *meta, char *keyword, size_t *nres);
+char **_ramfs_cache_get(fs_meta_t *meta, char *key, char *keyword, size_t *nres);
+void   _ramfs_cache_put(fs_meta_t *meta, char *key, char *keyword, char **results, size_t nres);
+void   _ramfs_cache_drop(fs_find_cache_t *cache, fs_cache_entry_t *entry);
+void   _ramfs_cache_clear(fs_find_cache_t *cache);
+void   _ramfs_cache_flush(fs_meta_t *meta);
+char **_ramfs_results_copy(char **results, size_t nres, size_t size);
+void    _ramfs_grep_visit(struct _walker *w, unsigned int tid, fs_node_t *node, const char *path, size_t pathlen);
+uint8_t _ramfs_grep_match(fs_find_par_t *par, fs_node_t *file);
+void _ramfs_cursor_load(fs_find_cursor_t *c, fs_node_t *dir, size_t pathlen);
+int  _ramfs_cursor_cmp(const void *p1, const void *p2);
 
 
 #ifdef DEBUG
@@ -0,0 +1,397 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ramfs_client.h"
+// end:includes
+
+// start:definitions
+// Binary protocol client library. It does not depend on the rest of
+// the file system code, memory errors are reported instead of exiting.
+
+/*
+ * Create a new connection reading replies from `rfd` and writing
+ * requests to `wfd` (they may be the same socket).
+ * Returns NULL if memory couldn't be allocated.
+ */
+
+rc_conn_t *rc_open(int rfd, int wfd) {
+    rc_conn_t *c = calloc(1, sizeof(rc_conn_t));
+    if (c == NULL)
+        return NULL;
+    c->rfd = rfd;
+    c->wfd = wfd;
+    return c;
+}
+
+/*
+ * Free connection `c`. File descriptors are not closed.
+ */
+
+void rc_close(rc_conn_t *c) {
+    free(c->wbuf);
+    free(c->rbuf);
+    free(c);
+}
+
+/*
+ * (Internal) Grow `*buf` so it can hold at least `needed` bytes.
+ * Returns 0 on success, -1 if memory couldn't be allocated.
+ */
+
+int _rc_reserve(unsigned char **buf, size_t *size, size_t needed) {
+    size_t newsize = *size > 0 ? *size : 4096;
+    unsigned char *newbuf;
+
+    if (needed <= *size)
+        return 0;
+    while (newsize < needed)
+        newsize *= 2;
+    if ((newbuf = realloc(*buf, newsize)) == NULL)
+        return -1;
+    *buf = newbuf;
+    *size = newsize;
+    return 0;
+}
+
+/*
+ * Queue a request with opcode `op`. `payload` may be NULL if `len` is 0.
+ * Nothing is sent until `rc_flush` is called.
+ * Returns 0 on success, -1 on error.
+ */
+
+int rc_send(rc_conn_t *c, uint8_t op, const char *path, const void *payload, size_t len) {
+    return _rc_send_flags(c, op, 0, path, payload, len);
+}
+
+/*
+ * (Internal) Like `rc_send`, also setting the `flags` of the request.
+ */
+
+int _rc_send_flags(rc_conn_t *c, uint8_t op, uint8_t flags, const char *path, const void *payload, size_t len) {
+    size_t plen = path != NULL ? strlen(path) : 0;
+    bin_req_hdr_t hdr = {op, flags, (uint32_t) plen, (uint32_t) len};
+
+    if (len > UINT32_MAX || plen > UINT32_MAX)
+        return -1;
+    if (_rc_reserve(&c->wbuf, &c->wsize, c->wlen + BIN_HDR_SIZE + plen + len) != 0)
+        return -1;
+
+    bin_encode_req(c->wbuf + c->wlen, &hdr);
+    c->wlen += BIN_HDR_SIZE;
+    if (plen > 0)
+        memcpy(c->wbuf + c->wlen, path, plen);
+    c->wlen += plen;
+    if (len > 0)
+        memcpy(c->wbuf + c->wlen, payload, len);
+    c->wlen += len;
+    return 0;
+}
+
+/*
+ * Write all queued requests.
+ * Returns 0 on success, -1 on error.
+ */
+
+int rc_flush(rc_conn_t *c) {
+    size_t pos = 0;
+    ssize_t n;
+
+    while (pos < c->wlen) {
+        n = write(c->wfd, c->wbuf + pos, c->wlen - pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        pos += (size_t) n;
+    }
+    c->wlen = 0;
+    return 0;
+}
+
+/*
+ * (Internal) Read from the connection until at least `needed` bytes
+ * are buffered. Returns 0 on success, -1 on error or EOF.
+ */
+
+int _rc_fill(rc_conn_t *c, size_t needed) {
+    ssize_t n;
+
+    if (c->rlen - c->rpos >= needed)
+        return 0;
+
+    // Move leftovers to the beginning of the buffer
+    memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+    c->rlen -= c->rpos;
+    c->rpos = 0;
+
+    if (_rc_reserve(&c->rbuf, &c->rsize, needed) != 0)
+        return -1;
+
+    while (c->rlen < needed) {
+        n = read(c->rfd, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        c->rlen += (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Receive the reply to the oldest request in flight into `reply`.
+ * The body must be freed with `rc_reply_free`.
+ * Returns 0 on success, -1 on error.
+ */
+
+int rc_recv(rc_conn_t *c, rc_reply_t *reply) {
+    bin_reply_hdr_t hdr;
+
+    if (_rc_fill(c, BIN_HDR_SIZE) != 0)
+        return -1;
+    bin_decode_reply(c->rbuf + c->rpos, &hdr);
+    c->rpos += BIN_HDR_SIZE;
+
+    reply->status = hdr.status;
+    reply->count = hdr.count;
+    reply->len = hdr.len;
+    reply->body = NULL;
+
+    if (hdr.len == 0)
+        return 0;
+
+    if ((reply->body = malloc((size_t) hdr.len + 1)) == NULL)
+        return -1;
+
+    // Copy whatever is already buffered, read the rest directly
+    size_t have = c->rlen - c->rpos < hdr.len ? c->rlen - c->rpos : hdr.len;
+    memcpy(reply->body, c->rbuf + c->rpos, have);
+    c->rpos += have;
+    while (have < hdr.len) {
+        ssize_t n = read(c->rfd, reply->body + have, hdr.len - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rc_reply_free(reply);
+            return -1;
+        }
+        have += (size_t) n;
+    }
+    reply->body[hdr.len] = '\0';
+    return 0;
+}
+
+void rc_reply_free(rc_reply_t *reply) {
+    free(reply->body);
+    reply->body = NULL;
+}
+
+/*
+ * (Internal) Send a single request and wait for its reply.
+ * Returns 0 on success, -1 on error.
+ */
+
+int _rc_call(rc_conn_t *c, uint8_t op, const char *path, const void *payload, size_t len, rc_reply_t *reply) {
+    if (rc_send(c, op, path, payload, len) != 0 || rc_flush(c) != 0)
+        return -1;
+    return rc_recv(c, reply);
+}
+
+/*
+ * Synchronous wrappers. They return -1 if the operation failed
+ * or the connection broke, 0 (or the number of bytes written) otherwise.
+ * Inside a batch, operations that were queued count as done.
+ */
+
+int rc_create(rc_conn_t *c, const char *path) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_CREATE, path, NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK || r.status == BIN_STATUS_QUEUED ? 0 : -1;
+}
+
+int rc_create_dir(rc_conn_t *c, const char *path) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_CREATE_DIR, path, NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK || r.status == BIN_STATUS_QUEUED ? 0 : -1;
+}
+
+int rc_delete(rc_conn_t *c, const char *path) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_DELETE, path, NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK || r.status == BIN_STATUS_QUEUED ? 0 : -1;
+}
+
+int rc_delete_r(rc_conn_t *c, const char *path) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_DELETE_R, path, NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK || r.status == BIN_STATUS_QUEUED ? 0 : -1;
+}
+
+ssize_t rc_write(rc_conn_t *c, const char *path, const void *data, size_t len) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_WRITE, path, data, len, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK || r.status == BIN_STATUS_QUEUED ? (ssize_t) r.count : -1;
+}
+
+/*
+ * Read the file at `path`. On success `*data` points to a newly
+ * allocated NUL-terminated buffer of `*len` bytes (NULL if empty).
+ */
+
+int rc_read(rc_conn_t *c, const char *path, char **data, size_t *len) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_READ, path, NULL, 0, &r) != 0)
+        return -1;
+    if (r.status != BIN_STATUS_OK) {
+        rc_reply_free(&r);
+        return -1;
+    }
+    *data = r.body;
+    *len = r.len;
+    return 0;
+}
+
+/*
+ * Find all nodes named `name`. On success `*paths` is a newly
+ * allocated array of `*npaths` sorted paths; both the array and
+ * each path must be freed.
+ */
+
+int rc_find(rc_conn_t *c, const char *name, char ***paths, size_t *npaths) {
+    return rc_find_match(c, 0, name, paths, npaths);
+}
+
+/*
+ * Like `rc_find`, but matches names against `pattern` the way `kind`
+ * requires (one of the find flags listed in binproto.h).
+ */
+
+int rc_find_match(rc_conn_t *c, uint8_t kind, const char *pattern, char ***paths, size_t *npaths) {
+    if (_rc_send_flags(c, BIN_OP_FIND, kind, pattern, NULL, 0) != 0)
+        return -1;
+    return _rc_recv_paths(c, paths, npaths);
+}
+
+/*
+ * Find all files at or under `path` whose content contains the `len`
+ * bytes at `pattern`, a literal or a regex if `regex` is true. The
+ * results are returned like by `rc_find`.
+ */
+
+int rc_grep(rc_conn_t *c, const char *path, uint8_t regex, const void *pattern, size_t len,
+            char ***paths, size_t *npaths) {
+    if (_rc_send_flags(c, BIN_OP_GREP, regex ? BIN_GREP_REGEX : BIN_GREP_LITERAL, path, pattern, len) != 0)
+        return -1;
+    return _rc_recv_paths(c, paths, npaths);
+}
+
+/*
+ * Start a batch: the following create, write and delete requests are
+ * only queued, until `rc_commit` or `rc_abort`.
+ */
+
+int rc_begin(rc_conn_t *c) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_BEGIN, "", NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK ? 0 : -1;
+}
+
+/*
+ * Apply the operations queued since `rc_begin`, all of them or none.
+ * If one of them would fail, nothing is applied and, if `failed` is
+ * not NULL, its position in the batch, from 1, is stored into it.
+ */
+
+int rc_commit(rc_conn_t *c, size_t *failed) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_COMMIT, "", NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    if (failed != NULL)
+        *failed = r.status == BIN_STATUS_ERR ? r.count : 0;
+    return r.status == BIN_STATUS_OK ? 0 : -1;
+}
+
+int rc_abort(rc_conn_t *c) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_ABORT, "", NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK ? 0 : -1;
+}
+
+/*
+ * Have the server write an image of its file system to `file`, a path
+ * on the server side.
+ */
+
+int rc_save(rc_conn_t *c, const char *file) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_SAVE, file, NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK ? 0 : -1;
+}
+
+/*
+ * Like `rc_save`, but the server writes the image in the background:
+ * it returns once the server started it, and fails if the server is
+ * still writing another one.
+ */
+
+int rc_bgsave(rc_conn_t *c, const char *file) {
+    rc_reply_t r;
+    if (_rc_call(c, BIN_OP_BGSAVE, file, NULL, 0, &r) != 0)
+        return -1;
+    rc_reply_free(&r);
+    return r.status == BIN_STATUS_OK ? 0 : -1;
+}
+
+/*
+ * (Internal) Send the queued requests and parse the reply to the last
+ * one, a list of paths, into `paths` and `npaths`.
+ */
+
+int _rc_recv_paths(rc_conn_t *c, char ***paths, size_t *npaths) {
+    rc_reply_t r;
+    size_t pos = 0;
+    uint32_t plen;
+
+    if (rc_flush(c) != 0 || rc_recv(c, &r) != 0)
+        return -1;
+    if (r.status != BIN_STATUS_OK || (*paths = calloc(r.count + 1, sizeof(char *))) == NULL) {
+        rc_reply_free(&r);
+        return -1;
+    }
+
+    for (*npaths = 0; *npaths < r.count && pos + 4 <= r.len; (*npaths)++) {
+        plen = bin_get_u32((unsigned char *) r.body + pos);
+        pos += 4;
+        if (pos + plen > r.len || ((*paths)[*npaths] = malloc(plen + 1)) == NULL)
+            break;
+        memcpy((*paths)[*npaths], r.body + pos, plen);
+        (*paths)[*npaths][plen] = '\0';
+        pos += plen;
+    }
+    rc_reply_free(&r);
+    return 0;
+}
+// end:definitions
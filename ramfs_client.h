@@ -0,0 +1,70 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_RAMFS_CLIENT_H
+#define API_RAMFS_RAMFS_CLIENT_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "binproto.h"
+// end:includes
+
+// start:datatypes
+// Client side of the binary protocol. Requests are queued with
+// `rc_send` and written with `rc_flush`, so many requests can be in
+// flight at once; replies come back in order through `rc_recv`.
+typedef struct _rc_conn {
+    int rfd;
+    int wfd;
+    unsigned char *wbuf;
+    size_t wlen;
+    size_t wsize;
+    unsigned char *rbuf;
+    size_t rpos;
+    size_t rlen;
+    size_t rsize;
+} rc_conn_t;
+
+typedef struct _rc_reply {
+    uint8_t status;
+    uint32_t count;
+    uint32_t len;
+    char *body;         // NUL-terminated, NULL if len is 0
+} rc_reply_t;
+// end:datatypes
+
+// start:declarations
+rc_conn_t *rc_open(int rfd, int wfd);
+void       rc_close(rc_conn_t *c);
+int        rc_send(rc_conn_t *c, uint8_t op, const char *path, const void *payload, size_t len);
+int        rc_flush(rc_conn_t *c);
+int        rc_recv(rc_conn_t *c, rc_reply_t *reply);
+void       rc_reply_free(rc_reply_t *reply);
+
+int     rc_create(rc_conn_t *c, const char *path);
+int     rc_create_dir(rc_conn_t *c, const char *path);
+int     rc_delete(rc_conn_t *c, const char *path);
+int     rc_delete_r(rc_conn_t *c, const char *path);
+ssize_t rc_write(rc_conn_t *c, const char *path, const void *data, size_t len);
+int     rc_read(rc_conn_t *c, const char *path, char **data, size_t *len);
+int     rc_find(rc_conn_t *c, const char *name, char ***paths, size_t *npaths);
+int     rc_find_match(rc_conn_t *c, uint8_t kind, const char *pattern, char ***paths, size_t *npaths);
+int     rc_grep(rc_conn_t *c, const char *path, uint8_t regex, const void *pattern, size_t len,
+                char ***paths, size_t *npaths);
+int     rc_begin(rc_conn_t *c);
+int     rc_commit(rc_conn_t *c, size_t *failed);
+int     rc_abort(rc_conn_t *c);
+int     rc_save(rc_conn_t *c, const char *file);
+int     rc_bgsave(rc_conn_t *c, const char *file);
+
+int _rc_send_flags(rc_conn_t *c, uint8_t op, uint8_t flags, const char *path, const void *payload, size_t len);
+int _rc_reserve(unsigned char **buf, size_t *size, size_t needed);
+int _rc_fill(rc_conn_t *c, size_t needed);
+int _rc_recv_paths(rc_conn_t *c, char ***paths, size_t *npaths);
+int _rc_call(rc_conn_t *c, uint8_t op, const char *path, const void *payload, size_t len, rc_reply_t *reply);
+// end:declarations
+
+#endif //API_RAMFS_RAMFS_CLIENT_H
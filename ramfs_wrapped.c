@@ -3,57 +3,189 @@
 //
 
 // start:includes
+#include <string.h>
 #include "ramfs_wrapped.h"
 #include "utils.h"
 #include "ramfs.h"
+#include "image.h"
 // end:includes
 
 // start:definitions
 // Wrapper for ramfs.h
 
-void ramfs_create_w(fs_node_t *root, char *cmd) {
-    call_with_1(ramfs_create, root, cmd);
+void ramfs_create_w(fs_node_t *root, char **args, strbuf_t *out) {
+    call_with_1(ramfs_create, root, args, out);
 }
 
-void ramfs_create_dir_w(fs_node_t *root, char *cmd) {
-    call_with_1(ramfs_create_dir, root, cmd);
+void ramfs_create_dir_w(fs_node_t *root, char **args, strbuf_t *out) {
+    call_with_1(ramfs_create_dir, root, args, out);
 }
 
-void ramfs_read_w(fs_node_t *root, char *cmd) {
-    char *save_ptr;
-    char *arg1 = readcmd(cmd, &save_ptr);
-    char* ret = ramfs_read(root, arg1);
+void ramfs_read_w(fs_node_t *root, char **args, strbuf_t *out) {
+    char *ret = args[0] != NULL ? ramfs_read(root, args[0]) : NULL;
     if (ret == NULL)
-        printf("no\n");
-    else
-        printf("contenuto %s\n", ret);
+        strbuf_puts(out, "no\n");
+    else {
+        strbuf_puts(out, "contenuto ");
+        strbuf_puts(out, ret);
+        strbuf_puts(out, "\n");
+    }
 }
 
-void ramfs_write_w(fs_node_t *root, char *cmd) {
-    call_with_2(ramfs_write, root, cmd);
+void ramfs_write_w(fs_node_t *root, char **args, strbuf_t *out) {
+    call_with_2(ramfs_write, root, args, out);
 }
 
-void ramfs_delete_w(fs_node_t *root, char *cmd) {
-    call_with_1(ramfs_delete, root, cmd);
+void ramfs_delete_w(fs_node_t *root, char **args, strbuf_t *out) {
+    call_with_1(ramfs_delete, root, args, out);
 }
 
-void ramfs_delete_r_w(fs_node_t *root, char *cmd) {
-    call_with_1(ramfs_delete_r, root, cmd);
+void ramfs_delete_r_w(fs_node_t *root, char **args, strbuf_t *out) {
+    call_with_1(ramfs_delete_r, root, args, out);
 }
 
-void ramfs_find_w(fs_node_t *root, char *cmd) {
-    char *save_ptr;
-    char *arg1 = readcmd(cmd, &save_ptr);
+void ramfs_find_w(fs_node_t *root, char **args, strbuf_t *out) {
     size_t nres;
-    char **results = ramfs_find(root, arg1, &nres);
 
-    if (nres == 0)
-        printf("no\n");
-    else {
-        for (size_t i = 0; i < nres; i++) {
-            printf("ok %s\n", results[i]);
-            free(results[i]);
+    if (args[0] == NULL) {
+        strbuf_puts(out, "no\n");
+        return;
+    }
+
+    // Stream large result sets in sorted order as they are found
+    if (ramfs_find_count(root, args[0]) >= FIND_STREAM_MIN_RESULTS) {
+        fs_find_cursor_t cursor;
+        size_t len;
+        char *path;
+
+        ramfs_find_open(&cursor, root, args[0]);
+        while ((path = ramfs_find_next(&cursor, &len)) != NULL) {
+            strbuf_puts(out, "ok ");
+            strbuf_append(out, path, len);
+            strbuf_puts(out, "\n");
+            strbuf_spill(out);
         }
+        ramfs_find_close(&cursor);
+        return;
+    }
+
+    char **results = ramfs_find(root, args[0], &nres);
+    _ramfs_results_w(results, nres, out);
+}
+
+void ramfs_find_match_w(fs_node_t *root, char **args, match_kind_t kind, strbuf_t *out) {
+    size_t nres;
+
+    if (args[0] == NULL) {
+        strbuf_puts(out, "no\n");
+        return;
+    }
+
+    char **results = ramfs_find_match(root, kind, args[0], &nres);
+    _ramfs_results_w(results, nres, out);
+}
+
+void ramfs_find_in_w(fs_node_t *root, char **args, strbuf_t *out) {
+    unsigned int maxdepth;
+    size_t nres;
+
+    if (args[0] == NULL || args[1] == NULL || _ramfs_maxdepth_w(args[2], &maxdepth) != 0) {
+        strbuf_puts(out, "no\n");
+        return;
+    }
+
+    char **results = ramfs_find_in(root, args[0], args[1], maxdepth, &nres);
+    _ramfs_results_w(results, nres, out);
+}
+
+void ramfs_count_in_w(fs_node_t *root, char **args, strbuf_t *out) {
+    unsigned int maxdepth;
+    size_t count;
+
+    if (args[0] == NULL || args[1] == NULL || _ramfs_maxdepth_w(args[2], &maxdepth) != 0 ||
+        ramfs_count_in(root, args[0], args[1], maxdepth, &count) != 0) {
+        strbuf_puts(out, "no\n");
+        return;
+    }
+    strbuf_printf(out, "ok %zu\n", count);
+}
+
+void ramfs_grep_w(fs_node_t *root, char **args, match_kind_t kind, strbuf_t *out) {
+    size_t nres;
+
+    if (args[0] == NULL || args[1] == NULL) {
+        strbuf_puts(out, "no\n");
+        return;
+    }
+
+    char **results = ramfs_grep(root, args[0], kind, args[1], strlen(args[1]), &nres);
+    _ramfs_results_w(results, nres, out);
+}
+
+void ramfs_cache_stats_w(fs_node_t *root, char **args, strbuf_t *out) {
+    const fs_find_cache_t *cache = ramfs_find_cache(root);
+
+    (void) args;
+    _ramfs_cache_stats_w(cache, cache->entries->used, out);
+}
+
+void ramfs_save_w(fs_node_t *root, char **args, strbuf_t *out) {
+    print_status(args[0] != NULL ? image_save(root, args[0]) : -1, out);
+}
+
+void ramfs_bgsave_w(fs_node_t *root, char **args, strbuf_t *out) {
+    print_status(args[0] != NULL ? image_bgsave(root, args[0]) : -1, out);
+}
+
+/*
+ * (Internal) Parse the optional maximum depth argument `arg` into
+ * `maxdepth`, unlimited if it is missing.
+ * Returns 0 on success, -1 if it is not a positive number.
+ */
+
+int _ramfs_maxdepth_w(char *arg, unsigned int *maxdepth) {
+    unsigned long value;
+    char *end;
+
+    *maxdepth = FIND_DEPTH_ALL;
+    if (arg == NULL)
+        return 0;
+
+    if (*arg < '0' || *arg > '9')
+        return -1;
+
+    // Out of range values saturate, which is still unlimited
+    value = strtoul(arg, &end, 10);
+    if (*end != '\0' || value == 0)
+        return -1;
+    if (value < FIND_DEPTH_ALL)
+        *maxdepth = (unsigned int) value;
+    return 0;
+}
+
+/*
+ * (Internal) Print the counters of find cache `cache`, which holds
+ * `entries` results.
+ */
+
+void _ramfs_cache_stats_w(const fs_find_cache_t *cache, size_t entries, strbuf_t *out) {
+    strbuf_printf(out, "ok hits %llu misses %llu invalidations %llu evictions %llu entries %zu bytes %zu\n",
+                  (unsigned long long) cache->hits, (unsigned long long) cache->misses,
+                  (unsigned long long) cache->invalidations, (unsigned long long) cache->evictions,
+                  entries, cache->bytes);
+}
+
+/*
+ * (Internal) Print the `nres` paths in `results` as "ok path" lines,
+ * or "no" if there are none, and free them.
+ */
+
+void _ramfs_results_w(char **results, size_t nres, strbuf_t *out) {
+    if (nres == 0)
+        strbuf_puts(out, "no\n");
+    for (size_t i = 0; i < nres; i++) {
+        strbuf_printf(out, "ok %s\n", results[i]);
+        strbuf_spill(out);
     }
     free(results);
 }
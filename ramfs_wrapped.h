@@ -7,16 +7,28 @@
 
 // start:includes
 #include "ramfs.h"
+#include "utils.h"
 // end:includes
 
 // start:declarations
-void ramfs_create_w(fs_node_t *root, char *cmd);
-void ramfs_create_dir_w(fs_node_t *root, char *cmd);
-void ramfs_read_w(fs_node_t *root, char *cmd);
-void ramfs_write_w(fs_node_t *root, char *cmd);
-void ramfs_delete_w(fs_node_t *root, char *cmd);
-void ramfs_delete_r_w(fs_node_t *root, char *cmd);
-void ramfs_find_w(fs_node_t *root, char *cmd);
+void ramfs_create_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_create_dir_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_read_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_write_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_delete_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_delete_r_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_find_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_find_match_w(fs_node_t *root, char **args, match_kind_t kind, strbuf_t *out);
+void ramfs_find_in_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_count_in_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_grep_w(fs_node_t *root, char **args, match_kind_t kind, strbuf_t *out);
+void ramfs_cache_stats_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_save_w(fs_node_t *root, char **args, strbuf_t *out);
+void ramfs_bgsave_w(fs_node_t *root, char **args, strbuf_t *out);
+
+int  _ramfs_maxdepth_w(char *arg, unsigned int *maxdepth);
+void _ramfs_results_w(char **results, size_t nres, strbuf_t *out);
+void _ramfs_cache_stats_w(const fs_find_cache_t *cache, size_t entries, strbuf_t *out);
 // end:declarations
 
 #endif //API_RAMFS_RAMFS_WRAPPED_H
@@ -0,0 +1,134 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include "ringbuf.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Single-producer single-consumer ring buffer
+
+/*
+ * Create a new ring buffer that can hold at least `size` items.
+ * The actual capacity is rounded up to a power of two.
+ * It needs to be freed with `ringbuf_del`.
+ */
+
+ringbuf_t *ringbuf_new(size_t size) {
+    size_t cap = 2;
+    ringbuf_t *rb = calloc_or_die(1, sizeof(ringbuf_t));
+
+    while (cap < size)
+        cap *= 2;
+
+    rb->mask = cap - 1;
+    rb->slots = calloc_or_die(cap, sizeof(void *));
+    return rb;
+}
+
+/*
+ * Frees ring buffer `rb`. Items still queued are not freed.
+ */
+
+void ringbuf_del(ringbuf_t *rb) {
+    free(rb->slots);
+    free(rb);
+}
+
+/*
+ * (Producer) Append `item` to the queue. `item` must not be NULL.
+ * Returns 0 if the item was queued, 1 if the queue is full.
+ */
+
+uint8_t ringbuf_trypush(ringbuf_t *rb, void *item) {
+    size_t tail = rb->tail;
+
+    if (tail - rb->head_cache > rb->mask) {
+        rb->head_cache = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+        if (tail - rb->head_cache > rb->mask)
+            return 1;
+    }
+
+    rb->slots[tail & rb->mask] = item;
+    // Publish the slot before moving the tail
+    __atomic_store_n(&rb->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * (Consumer) Remove the oldest item from the queue and return it.
+ * Returns NULL if the queue is empty.
+ */
+
+void *ringbuf_trypop(ringbuf_t *rb) {
+    size_t head = rb->head;
+    void *item;
+
+    if (head == rb->tail_cache) {
+        rb->tail_cache = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+        if (head == rb->tail_cache)
+            return NULL;
+    }
+
+    item = rb->slots[head & rb->mask];
+    // Release the slot to the producer only after reading it
+    __atomic_store_n(&rb->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+/*
+ * (Consumer) Returns 1 if there is nothing left to pop, 0 otherwise.
+ */
+
+uint8_t ringbuf_empty(ringbuf_t *rb) {
+    return (uint8_t) (rb->head == __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Wait a little before retrying an operation on a full or empty
+ * queue. Spins first, then yields the CPU, then sleeps, so that idle
+ * stages don't burn a core when the pipeline is stalled.
+ */
+
+void ringbuf_backoff(unsigned int *spins) {
+    struct timespec ts = {0, 50000};
+
+    (*spins)++;
+    if (*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if (*spins < 128) {
+        sched_yield();
+    } else {
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * (Producer) Blocking version of `ringbuf_trypush`.
+ */
+
+void ringbuf_push(ringbuf_t *rb, void *item) {
+    unsigned int spins = 0;
+    while (ringbuf_trypush(rb, item) != 0)
+        ringbuf_backoff(&spins);
+}
+
+/*
+ * (Consumer) Blocking version of `ringbuf_trypop`.
+ */
+
+void *ringbuf_pop(ringbuf_t *rb) {
+    unsigned int spins = 0;
+    void *item;
+    while ((item = ringbuf_trypop(rb)) == NULL)
+        ringbuf_backoff(&spins);
+    return item;
+}
+// end:definitions
@@ -0,0 +1,48 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_RINGBUF_H
+#define API_RAMFS_RINGBUF_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+// end:includes
+
+// start:macros
+#define CACHE_LINE_SIZE 64
+// end:macros
+
+// start:datatypes
+// Bounded single-producer single-consumer lock-free queue of pointers.
+// `head` is only written by the consumer, `tail` only by the producer,
+// each side keeps a cached copy of the other's index so the shared
+// cache lines are only touched when the queue looks full or empty.
+typedef struct _ringbuf {
+    size_t mask;
+    void **slots;
+    char pad0[CACHE_LINE_SIZE];
+
+    size_t head;
+    size_t tail_cache;
+    char pad1[CACHE_LINE_SIZE];
+
+    size_t tail;
+    size_t head_cache;
+    char pad2[CACHE_LINE_SIZE];
+} ringbuf_t;
+// end:datatypes
+
+// start:declarations
+ringbuf_t *ringbuf_new(size_t size);
+void       ringbuf_del(ringbuf_t *rb);
+uint8_t    ringbuf_trypush(ringbuf_t *rb, void *item);
+void      *ringbuf_trypop(ringbuf_t *rb);
+void       ringbuf_push(ringbuf_t *rb, void *item);
+void      *ringbuf_pop(ringbuf_t *rb);
+uint8_t    ringbuf_empty(ringbuf_t *rb);
+void       ringbuf_backoff(unsigned int *spins);
+// end:declarations
+
+#endif //API_RAMFS_RINGBUF_H
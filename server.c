@@ -0,0 +1,1138 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "server.h"
+#include "command.h"
+#include "journal.h"
+#include "image.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Unix domain socket server. A single thread multiplexes all clients
+// with epoll and executes their commands against the same tree, so
+// commands are applied one at a time and each client gets its replies
+// in order. With a shard pool, the thread only parses commands and
+// hands them to the shards, then sends the replies of each client in
+// order as they come back. With sliced searches, long ones run a
+// slice at a time, between the commands of the other clients. With a
+// journal, the replies of all the clients served in a round wait for
+// a single commit.
+
+volatile sig_atomic_t server_stop = 0;
+
+/*
+ * (Internal) Signal handler used to stop `server_run`.
+ */
+
+void _server_on_stop(int sig) {
+    (void) sig;
+    server_stop = 1;
+}
+
+/*
+ * Listen on the Unix domain socket at `path`, replacing any stale
+ * socket file. Clients speak the binary protocol if `binary` is true,
+ * the text protocol otherwise.
+ * Returns 0 on success, -1 on error (errno is set).
+ */
+
+int server_open(server_t *s, fs_node_t *root, const char *path, uint8_t binary) {
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+
+    memset(s, 0, sizeof(server_t));
+    s->root = root;
+    s->path = path;
+    s->binary = binary;
+    s->lfd = s->epfd = -1;
+#ifdef HAVE_IO_URING
+    s->ring.fd = -1;
+#endif
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if ((s->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(s->lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(s->lfd, SERVER_BACKLOG) < 0 ||
+        (s->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        server_close(s);
+        return -1;
+    }
+
+    // The listening socket is the only one with a NULL pointer
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->lfd, &ev) < 0) {
+        server_close(s);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Execute commands on the shards of pool `p` instead of the tree
+ * given to `server_open`, which is left untouched. Only the epoll
+ * backend supports it.
+ * Returns 0 on success, -1 on error (errno is set).
+ */
+
+int server_set_shards(server_t *s, shard_pool_t *p) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, p->efd, &ev) < 0)
+        return -1;
+    s->shards = p;
+    return 0;
+}
+
+/*
+ * Run long searches a slice of SERVER_SLICE_NS at a time (see
+ * `cmd_start`), executing the commands of the other clients in
+ * between, and free the directories removed by `delete_r` the same
+ * way, unless the file system has a reaper thread already. A client
+ * waits for its search to be over before its next command runs. Only
+ * the epoll backend without shards supports it.
+ */
+
+void server_set_sliced(server_t *s) {
+    s->sliced = 1;
+    if (FS_DIR(s->root)->meta->reaper == NULL)
+        ramfs_set_reaper(s->root, 0);
+}
+
+/*
+ * (Internal) Accept all pending connections.
+ */
+
+void _server_accept(server_t *s) {
+    struct epoll_event ev;
+    server_conn_t *c;
+    int fd;
+
+    for (;;) {
+        s->syscalls++;
+        if ((fd = accept4(s->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+            break;
+
+        c = calloc_or_die(1, sizeof(server_conn_t));
+        c->fd = c->wfd = fd;
+        strbuf_init(&c->in);
+        strbuf_init(&c->out);
+        c->events = EPOLLIN;
+
+        ev.events = c->events;
+        ev.data.ptr = c;
+        s->syscalls++;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        s->accepted++;
+    }
+}
+
+/*
+ * (Internal) Start receiving the raw content of `write_begin` command
+ * `cmd`. The path is copied, as the input buffer is going to move.
+ */
+
+void _server_upload_begin(server_conn_t *c, cmd_t *cmd) {
+    size_t len = strlen(cmd->args[0]);
+
+    c->upload = *cmd;
+    c->upload.line = malloc_or_die(len + 1);
+    memcpy(c->upload.line, cmd->args[0], len + 1);
+    c->upload.name = NULL;
+    memset(c->upload.args, 0, sizeof(c->upload.args));
+    c->upload.args[0] = c->upload.line;
+    c->upload_got = 0;
+    c->uploading = 1;
+}
+
+/*
+ * (Internal) Execute `cmd` for `c`, or submit it to the shards. The
+ * line and payload of `cmd` are freed afterwards if `owned` is true,
+ * and must be if the server is sharded.
+ */
+
+void _server_exec(server_t *s, server_conn_t *c, cmd_t *cmd, uint8_t owned) {
+    shard_job_t *job;
+
+    if (s->shards == NULL || cmd->op == CMD_NONE || cmd->op == CMD_EXIT) {
+        // A long search replies later, a slice at a time
+        if (!s->sliced || !_server_start(s, c, cmd)) {
+            if (s->binary)
+                cmd_exec_bin(s->root, &c->txn, cmd, &c->out);
+            else
+                cmd_exec(s->root, &c->txn, cmd, &c->out);
+        }
+        if (owned) {
+            free(cmd->line);
+            free(cmd->payload);
+        }
+        return;
+    }
+
+    job = shard_job_new(cmd, c);
+    if (c->jobs_tail != NULL)
+        c->jobs_tail->next = job;
+    else
+        c->jobs = job;
+    c->jobs_tail = job;
+    c->njobs++;
+
+    // The batch is kept here until it is committed, its reply waits
+    // for the ones before it
+    if (cmd_txn(&c->txn, &job->cmd, s->binary, &job->out)) {
+        job->done = 1;
+        _server_collect(c);
+        return;
+    }
+    if (job->cmd.op == CMD_COMMIT) {
+        c->txn.open = 0;
+        shard_job_txn(s->shards, job, &c->txn);
+    }
+    shard_submit(s->shards, job);
+}
+
+/*
+ * (Internal) Start the search of `c` if `cmd` is a long one.
+ * Returns true if it was started.
+ */
+
+uint8_t _server_start(server_t *s, server_conn_t *c, cmd_t *cmd) {
+    if (c->task == NULL)
+        c->task = malloc_or_die(sizeof(cmd_task_t));
+    if (!cmd_start(s->root, cmd, s->binary, c->task))
+        return 0;
+
+    c->busy = 1;
+    c->next_task = s->tasks;
+    s->tasks = c;
+    s->searches++;
+    return 1;
+}
+
+/*
+ * (Internal) Release the search of `c`, over or not, so that its next
+ * commands can run.
+ */
+
+void _server_task_done(server_t *s, server_conn_t *c) {
+    server_conn_t **p = &s->tasks;
+
+    while (*p != c)
+        p = &(*p)->next_task;
+    *p = c->next_task;
+    cmd_task_close(c->task);
+    c->busy = 0;
+}
+
+/*
+ * (Internal) Run a slice of the search of every client that has room
+ * for more replies, then a slice of the reaper. Clients whose search
+ * is over go on with their next commands.
+ * Returns true if there is more to run right away.
+ */
+
+uint8_t _server_slices(server_t *s) {
+    server_conn_t *c, *next;
+    size_t backlog;
+    uint8_t more;
+
+    for (c = s->tasks; c != NULL; c = next) {
+        next = c->next_task;
+        // Replies are sent before more are made
+        if ((backlog = c->out.len - c->out_pos) >= SERVER_OUT_LIMIT)
+            continue;
+        s->slices++;
+        if (cmd_resume(c->task, &c->out, now_ns() + SERVER_SLICE_NS, SERVER_OUT_LIMIT - backlog))
+            _server_task_done(s, c);
+        _server_service(s, c);
+    }
+
+    more = ramfs_reap(s->root);
+    for (c = s->tasks; c != NULL && !more; c = c->next_task)
+        more = (uint8_t) (c->out.len - c->out_pos < SERVER_OUT_LIMIT);
+    return more;
+}
+
+/*
+ * (Internal) Put `c` on the list of connections to be serviced once
+ * some jobs are done.
+ */
+
+void _server_mark(server_t *s, server_conn_t *c) {
+    if (c->listed)
+        return;
+    c->listed = 1;
+    c->next = s->ready;
+    s->ready = c;
+}
+
+/*
+ * (Internal) Move the replies of the jobs of `c` that are done, up to
+ * the first one that isn't, to its output buffer.
+ */
+
+void _server_collect(server_conn_t *c) {
+    shard_job_t *job;
+
+    while ((job = c->jobs) != NULL && job->done) {
+        strbuf_append(&c->out, job->out.data, job->out.len);
+        if ((c->jobs = job->next) == NULL)
+            c->jobs_tail = NULL;
+        c->njobs--;
+        shard_job_del(job);
+    }
+}
+
+/*
+ * (Internal) Collect the jobs done by the shards and service the
+ * connections they belong to, as well as those waiting for room.
+ */
+
+void _server_shards_done(server_t *s) {
+    server_conn_t *c, *next;
+    shard_job_t *job;
+
+    shard_ack(s->shards);
+    while ((job = shard_poll(s->shards)) != NULL)
+        _server_mark(s, job->owner);
+
+    // Servicing may list connections again
+    c = s->ready;
+    s->ready = NULL;
+    for (; c != NULL; c = next) {
+        next = c->next;
+        c->listed = 0;
+        _server_collect(c);
+        _server_service(s, c);
+    }
+}
+
+/*
+ * (Internal) Execute all complete commands buffered for `c`, unless
+ * too many replies are waiting to be sent, or too many of its
+ * commands are on the shards. At EOF, a trailing partial
+ * line is executed as well, like when reading from stdin, while a
+ * truncated upload fails.
+ */
+
+void _server_process(server_t *s, server_conn_t *c) {
+    size_t pos = 0;
+    size_t used;
+    uint8_t held = 0;
+    char *line, *nl;
+    cmd_t cmd;
+
+    while (!c->closing && !c->busy && (pos < c->in.len || c->uploading) &&
+           c->out.len - c->out_pos < SERVER_OUT_LIMIT) {
+        if (s->shards != NULL && (c->njobs >= SERVER_SHARD_JOBS || shard_full(s->shards))) {
+            // Done jobs of other clients make room for this one
+            if (c->njobs == 0)
+                _server_mark(s, c);
+            held = 1;
+            break;
+        }
+        if (c->uploading) {
+            used = c->upload.payload_len - c->upload_got;
+            if (used > c->in.len - pos)
+                used = c->in.len - pos;
+            // Content too large to be kept is only skipped
+            if (c->upload.payload != NULL)
+                memcpy(c->upload.payload + c->upload_got, c->in.data + pos, used);
+            c->upload_got += used;
+            pos += used;
+
+            if (c->upload_got < c->upload.payload_len) {
+                if (!c->eof)
+                    break;
+                free(c->upload.payload);
+                c->upload.payload = NULL;
+            }
+            _server_exec(s, c, &c->upload, 1);
+            c->uploading = 0;
+            s->commands++;
+            continue;
+        }
+
+        if (s->binary) {
+            if ((used = cmd_parse_bin(c->in.data + pos, c->in.len - pos, &cmd)) == 0)
+                break;
+            _server_exec(s, c, &cmd, 1);
+        } else {
+            line = c->in.data + pos;
+            nl = memchr(line, '\n', c->in.len - pos);
+            if (nl == NULL) {
+                if (!c->eof)
+                    break;
+                // Last line without terminator
+                strbuf_reserve(&c->in, 1);
+                line = c->in.data + pos;
+                nl = c->in.data + c->in.len;
+            }
+            *nl = '\0';
+            used = (size_t) (nl - line) + 1;
+            // Jobs outlive the input buffer
+            if (s->shards != NULL)
+                line = memcpy(malloc_or_die(used), line, used);
+            if (cmd_parse(line, &cmd) != CMD_NONE && cmd_payload_begin(&cmd) == 0)
+                _server_upload_begin(c, &cmd);
+            else if (cmd.op != CMD_NONE)
+                _server_exec(s, c, &cmd, s->shards != NULL);
+            // The upload has its own copy of the path
+            if (s->shards != NULL && (c->uploading || cmd.op == CMD_NONE))
+                free(line);
+        }
+
+        pos += used;
+        if (pos > c->in.len)
+            pos = c->in.len;
+        if (cmd.op != CMD_NONE && !c->uploading)
+            s->commands++;
+        if (cmd.op == CMD_EXIT)
+            c->closing = 1;
+    }
+
+    // Drop consumed input
+    memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+    c->in.len -= pos;
+
+    // Release a buffer grown by a long line, unless a one-shot
+    // io_uring recv is about to write into it
+    if (!c->recv_armed || c->stdio)
+        strbuf_shrink(&c->in, SERVER_IN_SHRINK);
+
+    if (c->eof && !c->uploading && !c->busy && (c->in.len == 0 || (s->binary && !held)))
+        c->closing = 1;
+}
+
+/*
+ * (Internal) Free connection `c` and its buffers, the descriptors
+ * must have been closed already.
+ */
+
+void _server_conn_free(server_conn_t *c) {
+    strbuf_free(&c->in);
+    strbuf_free(&c->out);
+    strbuf_free(&c->sending);
+    if (c->uploading) {
+        free(c->upload.line);
+        free(c->upload.payload);
+    }
+    ramfs_txn_clear(&c->txn);
+    free(c->task);
+    free(c);
+}
+
+/*
+ * (Internal) Send as many pending replies as possible to `c`.
+ * Returns 0 if the connection is still usable, -1 otherwise.
+ */
+
+int _server_flush(server_t *s, server_conn_t *c) {
+    ssize_t n;
+
+    while (c->out_pos < c->out.len) {
+        s->syscalls++;
+        n = send(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0)
+            return -1;
+        c->out_pos += (size_t) n;
+    }
+    strbuf_reset(&c->out);
+    c->out_pos = 0;
+    return 0;
+}
+
+/*
+ * (Internal) Register interest in reading only while the client isn't
+ * backlogged, and in writing only while replies are pending. Clients
+ * waiting for the shards are serviced once jobs are done instead.
+ */
+
+void _server_update_events(server_t *s, server_conn_t *c) {
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if (!c->eof && !c->closing && c->out.len - c->out_pos < SERVER_OUT_LIMIT &&
+        c->njobs < SERVER_SHARD_JOBS && !c->listed && !c->busy)
+        events |= EPOLLIN;
+    if (c->out_pos < c->out.len)
+        events |= EPOLLOUT;
+
+    if (events == c->events)
+        return;
+
+    c->events = events;
+    ev.events = events;
+    ev.data.ptr = c;
+    s->syscalls++;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+ * (Internal) Close connection `c` and free it.
+ */
+
+void _server_drop(server_t *s, server_conn_t *c) {
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    _server_conn_free(c);
+}
+
+/*
+ * (Internal) Execute the commands of `c` and send their replies, then
+ * close it if it is done, or wait for more events.
+ */
+
+void _server_service(server_t *s, server_conn_t *c) {
+    journal_t *journal = _ramfs_meta(s->root)->journal;
+
+    // Keep executing while replies can be sent right away and
+    // commands held back by the output limit make progress
+    for (;;) {
+        size_t pending = c->in.len;
+        _server_process(s, c);
+        // Replies wait for the journal to have the records of the
+        // commands run so far
+        if (journal != NULL && journal->pending > 0) {
+            _server_mark(s, c);
+            break;
+        }
+        if (_server_flush(s, c) != 0) {
+            c->closing = 1;
+            strbuf_reset(&c->out);
+            c->out_pos = 0;
+            // Nobody is waiting for the rest of the reply
+            if (c->busy)
+                _server_task_done(s, c);
+            break;
+        }
+        if (c->out.len > 0 || c->in.len == 0 || c->in.len == pending)
+            break;
+    }
+
+    // Jobs on the shards, and searches, still point to it
+    if (c->closing && c->out_pos == c->out.len && c->jobs == NULL && !c->listed && !c->busy) {
+        _server_drop(s, c);
+        return;
+    }
+    _server_update_events(s, c);
+}
+
+/*
+ * (Internal) Commit the journal of the file system, then service the
+ * connections waiting for it.
+ */
+
+void _server_commit(server_t *s) {
+    server_conn_t *c, *next;
+
+    journal_commit(_ramfs_meta(s->root)->journal);
+    // Servicing may list connections again
+    c = s->ready;
+    s->ready = NULL;
+    for (; c != NULL; c = next) {
+        next = c->next;
+        c->listed = 0;
+        _server_service(s, c);
+    }
+}
+
+/*
+ * Serve clients until SIGINT or SIGTERM is received. The file system
+ * may have a journal, unless the server is sharded.
+ * Returns 0 on clean shutdown, -1 on error.
+ */
+
+int server_run(server_t *s) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    journal_t *journal = _ramfs_meta(s->root)->journal;
+    server_conn_t *c;
+    uint64_t start = now_ns();
+    uint8_t shards_ready;
+    uint8_t more = 0;
+    ssize_t n;
+    int nev, timeout;
+
+    _server_install_signals();
+
+    while (!server_stop) {
+        s->syscalls++;
+        // Searches go on once the ready clients were served, and so
+        // do clients that waited for the journal. The journal is
+        // flushed to the disk in time, even if no command comes, and
+        // the end of a background save is noticed.
+        timeout = more || (journal != NULL && s->ready != NULL) ? 0 :
+                  journal != NULL ? journal_timeout(journal) : -1;
+        if (image_bgsave_poll(s->root, 0) && (timeout < 0 || timeout > IMAGE_BGSAVE_POLL_MS))
+            timeout = IMAGE_BGSAVE_POLL_MS;
+        nev = epoll_wait(s->epfd, events, SERVER_MAX_EVENTS, timeout);
+        if (nev < 0 && errno == EINTR)
+            continue;
+        if (nev < 0)
+            return -1;
+
+        shards_ready = 0;
+        for (int i = 0; i < nev; i++) {
+            c = events[i].data.ptr;
+            if (c == NULL) {
+                _server_accept(s);
+                continue;
+            }
+            if (events[i].data.ptr == s->shards) {
+                shards_ready = 1;
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                s->syscalls++;
+                if (c->uploading && c->in.len == 0 && c->upload.payload != NULL) {
+                    // Upload content goes straight to the file buffer
+                    n = read(c->fd, c->upload.payload + c->upload_got,
+                             c->upload.payload_len - c->upload_got);
+                    if (n > 0)
+                        c->upload_got += (size_t) n;
+                } else {
+                    strbuf_reserve(&c->in, SERVER_READ_SIZE);
+                    n = read(c->fd, c->in.data + c->in.len, SERVER_READ_SIZE);
+                    if (n > 0)
+                        c->in.len += (size_t) n;
+                }
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                    c->eof = 1;
+            }
+
+            _server_service(s, c);
+        }
+
+        // Connections serviced here may have events above
+        if (shards_ready)
+            _server_shards_done(s);
+        if (s->sliced)
+            more = _server_slices(s);
+        if (journal != NULL)
+            _server_commit(s);
+    }
+
+    s->wall_ns = now_ns() - start;
+    return 0;
+}
+
+/*
+ * (Internal) Stop `server_run` on SIGINT and SIGTERM.
+ */
+
+void _server_install_signals() {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _server_on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+#ifdef HAVE_IO_URING
+// io_uring backend. Every operation in flight carries its connection
+// and its kind in user_data. All the SQEs prepared while handling a
+// batch of completions are submitted together with the wait for the
+// next ones, in a single io_uring_enter call.
+
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV   2
+#define URING_OP_SEND   3
+#define URING_OP_CANCEL 4
+#define URING_OP_MASK   7
+
+/*
+ * (Internal) Set up the ring, the provided buffer ring used by
+ * multishot recv and the registered buffer used for stdin.
+ * Returns 0 on success, -1 if io_uring is not usable.
+ */
+
+int _server_uring_setup(server_t *s) {
+    struct iovec iov;
+
+    if (uring_init(&s->ring, URING_ENTRIES) != 0)
+        return -1;
+
+    // stdin is read into a registered buffer with READ_FIXED
+    s->stdio_buf = malloc_or_die(SERVER_READ_SIZE);
+    iov.iov_base = s->stdio_buf;
+    iov.iov_len = SERVER_READ_SIZE;
+    if (uring_register(&s->ring, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+        _server_uring_teardown(s);
+        return -1;
+    }
+
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_buf_reg reg;
+    size_t ringsize = SERVER_URING_BUFS * sizeof(struct io_uring_buf);
+
+    s->bufring = mmap(NULL, ringsize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    s->bufs = malloc_or_die((size_t) SERVER_URING_BUFS * SERVER_URING_BUF_SIZE);
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) s->bufring;
+    reg.ring_entries = SERVER_URING_BUFS;
+    reg.bgid = 0;
+
+    if (s->bufring != MAP_FAILED &&
+        uring_register(&s->ring, IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+        s->bufring->tail = 0;
+        for (unsigned int i = 0; i < SERVER_URING_BUFS; i++)
+            _server_uring_recycle(s, i);
+        s->multishot_recv = 1;
+        s->multishot_accept = 1;
+    } else {
+        // Old kernel, fall back to one-shot operations
+        if (s->bufring != MAP_FAILED)
+            munmap(s->bufring, ringsize);
+        s->bufring = NULL;
+        free(s->bufs);
+        s->bufs = NULL;
+    }
+#endif
+
+    s->uring = 1;
+    return 0;
+}
+
+/*
+ * (Internal) Release everything set up by `_server_uring_setup`.
+ */
+
+void _server_uring_teardown(server_t *s) {
+    uring_exit(&s->ring);
+    if (s->bufring != NULL)
+        munmap(s->bufring, SERVER_URING_BUFS * sizeof(struct io_uring_buf));
+    free(s->bufs);
+    free(s->stdio_buf);
+    s->bufring = NULL;
+    s->bufs = s->stdio_buf = NULL;
+}
+
+/*
+ * (Internal) Give provided buffer `bid` back to the kernel.
+ */
+
+void _server_uring_recycle(server_t *s, unsigned int bid) {
+#ifdef IORING_RECV_MULTISHOT
+    unsigned short tail = s->bufring->tail;
+    struct io_uring_buf *buf = &s->bufring->bufs[tail & (SERVER_URING_BUFS - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (s->bufs + (size_t) bid * SERVER_URING_BUF_SIZE);
+    buf->len = SERVER_URING_BUF_SIZE;
+    buf->bid = (uint16_t) bid;
+    __atomic_store_n(&s->bufring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+#else
+    (void) s;
+    (void) bid;
+#endif
+}
+
+/*
+ * (Internal) Accept connections, possibly with a single multishot SQE.
+ */
+
+void _server_uring_arm_accept(server_t *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->lfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+#ifdef IORING_ACCEPT_MULTISHOT
+    if (s->multishot_accept)
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+#endif
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+/*
+ * (Internal) Start receiving from `c`: multishot recv into provided
+ * buffers if available, a one-shot recv into the input buffer
+ * otherwise, or a fixed-buffer read for stdin.
+ */
+
+void _server_uring_arm_recv(server_t *s, server_conn_t *c) {
+    struct io_uring_sqe *sqe;
+
+    if (c->recv_armed || c->eof || c->closing ||
+        c->out.len + c->sending.len - c->out_pos >= SERVER_OUT_LIMIT)
+        return;
+    if ((sqe = uring_get_sqe(&s->ring)) == NULL)
+        return;
+
+    sqe->fd = c->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) c | URING_OP_RECV;
+
+    if (c->stdio) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t) (uintptr_t) s->stdio_buf;
+        sqe->len = SERVER_READ_SIZE;
+        sqe->off = (uint64_t) -1;   // current file position
+        sqe->buf_index = 0;
+    } else if (s->multishot_recv) {
+#ifdef IORING_RECV_MULTISHOT
+        sqe->opcode = IORING_OP_RECV;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio |= IORING_RECV_MULTISHOT;
+#endif
+    } else {
+        strbuf_reserve(&c->in, SERVER_READ_SIZE);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uint64_t) (uintptr_t) (c->in.data + c->in.len);
+        sqe->len = SERVER_READ_SIZE;
+    }
+
+    c->recv_armed = 1;
+    c->inflight++;
+}
+
+/*
+ * (Internal) Send pending replies of `c`, unless a send is already
+ * in flight. Replies produced meanwhile are collected in `c->out`,
+ * the buffer being sent is never touched until the send completes.
+ */
+
+void _server_uring_send(server_t *s, server_conn_t *c) {
+    struct io_uring_sqe *sqe;
+    strbuf_t tmp;
+
+    if (c->send_busy)
+        return;
+
+    if (c->out_pos == c->sending.len) {
+        if (c->out.len == 0)
+            return;
+        tmp = c->sending;
+        c->sending = c->out;
+        c->out = tmp;
+        strbuf_reset(&c->out);
+        c->out_pos = 0;
+    }
+
+    if ((sqe = uring_get_sqe(&s->ring)) == NULL)
+        return;
+    sqe->opcode = c->stdio ? IORING_OP_WRITE : IORING_OP_SEND;
+    sqe->fd = c->wfd;
+    sqe->addr = (uint64_t) (uintptr_t) (c->sending.data + c->out_pos);
+    sqe->len = (uint32_t) (c->sending.len - c->out_pos);
+    if (c->stdio)
+        sqe->off = (uint64_t) -1;
+    else
+        sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) c | URING_OP_SEND;
+
+    c->send_busy = 1;
+    c->inflight++;
+}
+
+/*
+ * (Internal) Execute what `c` has received, send the replies and keep
+ * receiving, or tear the connection down once it's done.
+ */
+
+void _server_uring_advance(server_t *s, server_conn_t *c) {
+    struct io_uring_sqe *sqe;
+
+    // While a send is in flight `out_pos` belongs to it, keep the
+    // backlog check in `_server_process` meaningful
+    size_t out_pos = c->out_pos;
+    c->out_pos = 0;
+    _server_process(s, c);
+    c->out_pos = out_pos;
+
+    _server_uring_send(s, c);
+
+    if (c->closing) {
+        if (c->send_busy || c->out.len > 0)
+            return;
+        if (c->stdio) {
+            s->stdio_done = 1;
+            return;
+        }
+        if (c->inflight == 0) {
+            close(c->fd);
+            _server_conn_free(c);
+        } else if (!c->shut) {
+            // Make the pending recv complete
+            shutdown(c->fd, SHUT_RDWR);
+            c->shut = 1;
+        }
+        return;
+    }
+
+    if (c->out.len + c->sending.len >= SERVER_OUT_LIMIT) {
+        // Backlogged: stop a multishot recv until replies drain
+        if (c->recv_armed && !c->stdio && s->multishot_recv && !c->cancelling &&
+            (sqe = uring_get_sqe(&s->ring)) != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t) (uintptr_t) c | URING_OP_RECV;
+            sqe->user_data = (uint64_t) (uintptr_t) c | URING_OP_CANCEL;
+            c->cancelling = 1;
+            c->inflight++;
+        }
+        return;
+    }
+
+    _server_uring_arm_recv(s, c);
+}
+
+/*
+ * (Internal) Handle one completion.
+ */
+
+void _server_uring_complete(server_t *s, uint64_t data, int32_t res, uint32_t flags) {
+    server_conn_t *c = (server_conn_t *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK);
+    uint8_t more = 0;
+
+#ifdef IORING_CQE_F_MORE
+    more = (flags & IORING_CQE_F_MORE) != 0;
+#endif
+
+    switch (data & URING_OP_MASK) {
+        case URING_OP_ACCEPT:
+            if (res >= 0) {
+                c = calloc_or_die(1, sizeof(server_conn_t));
+                c->fd = c->wfd = res;
+                strbuf_init(&c->in);
+                strbuf_init(&c->out);
+                strbuf_init(&c->sending);
+                s->accepted++;
+                _server_uring_arm_recv(s, c);
+            } else if (res == -EINVAL && s->multishot_accept) {
+                s->multishot_accept = 0;
+            }
+            if (!more && !server_stop)
+                _server_uring_arm_accept(s);
+            return;
+
+        case URING_OP_RECV:
+            if (!more) {
+                c->recv_armed = 0;
+                c->inflight--;
+            }
+            if (res > 0) {
+                if (c->stdio) {
+                    strbuf_append(&c->in, s->stdio_buf, (size_t) res);
+                } else if (s->multishot_recv) {
+#ifdef IORING_CQE_F_BUFFER
+                    unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    strbuf_append(&c->in, s->bufs + (size_t) bid * SERVER_URING_BUF_SIZE, (size_t) res);
+                    _server_uring_recycle(s, bid);
+#endif
+                } else {
+                    c->in.len += (size_t) res;
+                }
+            } else if (res == -EINVAL && s->multishot_recv && !c->stdio) {
+                // Kernel knows provided buffers but not multishot recv
+                s->multishot_recv = 0;
+            } else if (res != -ENOBUFS && res != -ECANCELED && res != -EINTR) {
+                c->eof = 1;
+            }
+            if (res == -ECANCELED)
+                c->cancelling = 0;
+            break;
+
+        case URING_OP_SEND:
+            c->send_busy = 0;
+            c->inflight--;
+            if (res < 0) {
+                c->closing = 1;
+                strbuf_reset(&c->out);
+                strbuf_reset(&c->sending);
+                c->out_pos = 0;
+                break;
+            }
+            c->out_pos += (size_t) res;
+            if (c->out_pos == c->sending.len) {
+                strbuf_reset(&c->sending);
+                c->out_pos = 0;
+            }
+            break;
+
+        case URING_OP_CANCEL:
+            c->inflight--;
+            c->cancelling = 0;
+            break;
+    }
+
+    _server_uring_advance(s, c);
+}
+
+/*
+ * (Internal) Run the io_uring event loop until stopped.
+ * Returns 0 on clean shutdown, -1 on error.
+ */
+
+int _server_uring_loop(server_t *s) {
+    struct io_uring_cqe *cqe;
+    uint64_t data;
+    int32_t res;
+    uint32_t flags;
+
+    while (!server_stop && !s->stdio_done) {
+        if (uring_submit_and_wait(&s->ring, 1) < 0 && errno != EINTR)
+            return -1;
+
+        while ((cqe = uring_peek_cqe(&s->ring)) != NULL) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&s->ring);
+            _server_uring_complete(s, data, res, flags);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Same as `server_run`, using io_uring instead of epoll.
+ * Returns -1 without serving anyone if io_uring is not available,
+ * so that the caller can fall back to `server_run`, 0 otherwise.
+ */
+
+int server_run_uring(server_t *s) {
+    uint64_t start = now_ns();
+
+    if (_server_uring_setup(s) != 0)
+        return -1;
+
+    _server_install_signals();
+    _server_uring_arm_accept(s);
+    _server_uring_loop(s);
+
+    s->wall_ns = now_ns() - start;
+    s->syscalls = s->ring.enters;
+    _server_uring_teardown(s);
+    return 0;
+}
+
+/*
+ * Execute commands read from stdin and write replies to stdout using
+ * io_uring, with the same semantics as the sequential loop.
+ * Returns -1 without reading anything if io_uring is not available,
+ * 0 otherwise.
+ */
+
+int server_run_stdio_uring(server_t *s, fs_node_t *root, uint8_t binary) {
+    server_conn_t c;
+    uint64_t start = now_ns();
+
+    memset(s, 0, sizeof(server_t));
+    s->root = root;
+    s->binary = binary;
+    s->lfd = s->epfd = -1;
+
+    if (_server_uring_setup(s) != 0)
+        return -1;
+
+    memset(&c, 0, sizeof(c));
+    c.fd = STDIN_FILENO;
+    c.wfd = STDOUT_FILENO;
+    c.stdio = 1;
+    strbuf_init(&c.in);
+    strbuf_init(&c.out);
+    strbuf_init(&c.sending);
+
+    _server_uring_arm_recv(s, &c);
+    _server_uring_loop(s);
+
+    s->wall_ns = now_ns() - start;
+    s->syscalls = s->ring.enters;
+    _server_uring_teardown(s);
+    strbuf_free(&c.in);
+    strbuf_free(&c.out);
+    strbuf_free(&c.sending);
+    if (c.uploading) {
+        free(c.upload.line);
+        free(c.upload.payload);
+    }
+    return 0;
+}
+
+#else
+
+int server_run_uring(server_t *s) {
+    (void) s;
+    errno = ENOSYS;
+    return -1;
+}
+
+int server_run_stdio_uring(server_t *s, fs_node_t *root, uint8_t binary) {
+    (void) s;
+    (void) root;
+    (void) binary;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+/*
+ * Stop listening and remove the socket file. Connections still open
+ * are closed by the kernel when the process exits.
+ */
+
+void server_close(server_t *s) {
+    if (s->shards != NULL)
+        shard_pool_stop(s->shards);
+    if (s->epfd >= 0)
+        close(s->epfd);
+    if (s->lfd >= 0) {
+        close(s->lfd);
+        unlink(s->path);
+    }
+    s->epfd = s->lfd = -1;
+}
+
+void server_print_stats(server_t *s, FILE *stream) {
+    double wall = (double) s->wall_ns / 1e9;
+    fprintf(stream, "server (%s): %lu connections, %lu commands in %.3f s (%.0f cmd/s)\n",
+            s->uring ? "io_uring" : "epoll",
+            (unsigned long) s->accepted, (unsigned long) s->commands, wall,
+            wall > 0 ? (double) s->commands / wall : 0.0);
+    fprintf(stream, "  %lu syscalls, %.3f per command\n", (unsigned long) s->syscalls,
+            s->commands > 0 ? (double) s->syscalls / (double) s->commands : 0.0);
+    if (s->sliced)
+        fprintf(stream, "  %lu searches run in %lu slices\n", (unsigned long) s->searches,
+                (unsigned long) s->slices);
+    if (s->shards != NULL)
+        shard_pool_print_stats(s->shards, stream);
+}
+// end:definitions
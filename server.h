@@ -0,0 +1,144 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_SERVER_H
+#define API_RAMFS_SERVER_H
+
+// start:includes
+#include <stdio.h>
+#include <stdint.h>
+#include "ramfs.h"
+#include "command.h"
+#include "utils.h"
+#include "uring.h"
+#include "shard.h"
+// end:includes
+
+// start:macros
+#define SERVER_MAX_EVENTS 256
+#define SERVER_BACKLOG    128
+// Bytes read from a connection per readiness event
+#define SERVER_READ_SIZE  65536
+// Stop reading from a client whose replies pile up beyond this
+#define SERVER_OUT_LIMIT  (1 << 20)
+// Input buffers grown past this size by long lines are released
+#define SERVER_IN_SHRINK  (4 * SERVER_READ_SIZE)
+// io_uring backend: provided receive buffers for multishot recv
+#define SERVER_URING_BUFS     256
+#define SERVER_URING_BUF_SIZE 16384
+// Sharded executor: commands of a client in flight at once
+#define SERVER_SHARD_JOBS     256
+// Sliced searches: time they run for before the other clients' turn
+#define SERVER_SLICE_NS       1000000
+// end:macros
+
+// start:datatypes
+typedef struct _server_conn {
+    int fd;
+    int wfd;            // same as fd, except for stdin/stdout
+    strbuf_t in;        // received but not yet executed
+    strbuf_t out;       // replies not yet sent
+    size_t out_pos;
+    uint32_t events;    // epoll events currently registered
+    uint8_t eof;        // peer closed its side
+    uint8_t closing;    // close as soon as replies are sent
+    uint8_t uploading;  // receiving the raw content of `upload`
+    cmd_t upload;       // pending `write_begin`, owns its path copy
+    size_t upload_got;
+    fs_txn_t txn;       // writes queued between `begin` and `commit`
+
+    // sharded executor only
+    shard_job_t *jobs;  // in flight, in the order they were received
+    shard_job_t *jobs_tail;
+    unsigned int njobs;
+    struct _server_conn *next;  // in the ready list
+    uint8_t listed;
+
+    // sliced searches only
+    cmd_task_t *task;   // kept once allocated
+    uint8_t busy;       // `task` is running, later commands wait
+    struct _server_conn *next_task;
+
+    // io_uring backend only
+    strbuf_t sending;   // replies owned by the send in flight
+    unsigned int inflight;
+    uint8_t stdio;
+    uint8_t recv_armed;
+    uint8_t send_busy;
+    uint8_t cancelling;
+    uint8_t shut;
+} server_conn_t;
+
+typedef struct _server {
+    fs_node_t *root;
+    const char *path;
+    int lfd;
+    int epfd;
+    uint8_t binary;
+    uint8_t uring;      // true if the io_uring backend is running
+    uint64_t accepted;
+    uint64_t commands;
+    uint64_t syscalls;
+    uint64_t wall_ns;
+    shard_pool_t *shards;   // NULL unless sharded
+    server_conn_t *ready;   // to be serviced once jobs are done
+    uint8_t sliced;
+    server_conn_t *tasks;   // running a sliced search
+    uint64_t searches;
+    uint64_t slices;
+#ifdef HAVE_IO_URING
+    uring_t ring;
+    struct io_uring_buf_ring *bufring;
+    char *bufs;
+    char *stdio_buf;
+    uint8_t multishot_recv;
+    uint8_t multishot_accept;
+    uint8_t stdio_done;
+#endif
+} server_t;
+// end:datatypes
+
+// start:declarations
+int  server_open(server_t *s, fs_node_t *root, const char *path, uint8_t binary);
+int  server_set_shards(server_t *s, shard_pool_t *p);
+void server_set_sliced(server_t *s);
+int  server_run(server_t *s);
+int  server_run_uring(server_t *s);
+int  server_run_stdio_uring(server_t *s, fs_node_t *root, uint8_t binary);
+void server_close(server_t *s);
+void server_print_stats(server_t *s, FILE *stream);
+
+void _server_accept(server_t *s);
+void _server_process(server_t *s, server_conn_t *c);
+void _server_upload_begin(server_conn_t *c, cmd_t *cmd);
+void _server_exec(server_t *s, server_conn_t *c, cmd_t *cmd, uint8_t owned);
+void _server_mark(server_t *s, server_conn_t *c);
+void _server_collect(server_conn_t *c);
+void _server_shards_done(server_t *s);
+void _server_commit(server_t *s);
+uint8_t _server_start(server_t *s, server_conn_t *c, cmd_t *cmd);
+void _server_task_done(server_t *s, server_conn_t *c);
+uint8_t _server_slices(server_t *s);
+void _server_service(server_t *s, server_conn_t *c);
+void _server_conn_free(server_conn_t *c);
+int  _server_flush(server_t *s, server_conn_t *c);
+void _server_update_events(server_t *s, server_conn_t *c);
+void _server_drop(server_t *s, server_conn_t *c);
+void _server_on_stop(int sig);
+void _server_install_signals();
+
+#ifdef HAVE_IO_URING
+int  _server_uring_setup(server_t *s);
+void _server_uring_teardown(server_t *s);
+int  _server_uring_loop(server_t *s);
+void _server_uring_arm_accept(server_t *s);
+void _server_uring_arm_recv(server_t *s, server_conn_t *c);
+void _server_uring_send(server_t *s, server_conn_t *c);
+void _server_uring_advance(server_t *s, server_conn_t *c);
+void _server_uring_complete(server_t *s, uint64_t data, int32_t res, uint32_t flags);
+void _server_uring_recycle(server_t *s, unsigned int bid);
+#endif
+// end:declarations
+
+#endif //API_RAMFS_SERVER_H
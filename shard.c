@@ -0,0 +1,688 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "shard.h"
+#include "command.h"
+#include "ramfs_wrapped.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Sharded executor for the socket server. Every top-level directory
+// belongs to one shard, picked by hashing its name, and lives in a
+// tree of its own that only the shard thread touches, so commands run
+// without any locking. Commands on the root as a whole (`find`,
+// `delete_r /`, ...) are sent to every shard and the last one to get
+// to them merges the parts. Each shard runs its commands in the order
+// they were submitted, and the front-end puts the replies of each
+// client back in order. A batch is committed by the shards it touches
+// together: they check their parts, wait for each other, and apply
+// them only if all of them can.
+
+/*
+ * Start `nshards` shards, each using `threads` threads for find, and
+ * a reaper if `reap` is true (see `ramfs_set_reaper`).
+ * Replies use the binary protocol if `binary` is true.
+ * Returns the pool, or NULL if the eventfds can't be created.
+ */
+
+shard_pool_t *shard_pool_new(unsigned int nshards, unsigned int threads, uint8_t binary, uint8_t reap) {
+    shard_pool_t *p = calloc_or_die(1, sizeof(shard_pool_t));
+    shard_t *sh;
+
+    if (nshards < 1)
+        nshards = 1;
+    if (nshards > SHARD_MAX)
+        nshards = SHARD_MAX;
+
+    if ((p->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        free(p);
+        return NULL;
+    }
+    p->nshards = nshards;
+    p->binary = binary;
+    // Spinning only delays the thread we are waiting for
+    p->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHARD_SPINS : 0;
+    p->shards = calloc_or_die(nshards, sizeof(shard_t));
+    for (unsigned int i = 0; i < nshards; i++) {
+        sh = &p->shards[i];
+        if ((sh->efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            while (i-- > 0)
+                close(p->shards[i].efd);
+            close(p->efd);
+            free(p->shards);
+            free(p);
+            return NULL;
+        }
+    }
+    for (unsigned int i = 0; i < nshards; i++) {
+        sh = &p->shards[i];
+        sh->pool = p;
+        sh->id = i;
+        sh->root = ramfs_mkfs();
+        ramfs_set_threads(sh->root, threads);
+        if (reap)
+            ramfs_set_reaper(sh->root, 1);
+        sh->jobs = ringbuf_new(SHARD_MAX_JOBS);
+        sh->done = ringbuf_new(SHARD_MAX_JOBS);
+    }
+
+    p->start_ns = now_ns();
+    for (unsigned int i = 0; i < nshards; i++)
+        if (pthread_create(&p->shards[i].thread, NULL, _shard_thread, &p->shards[i]) != 0)
+            exit(4);
+    return p;
+}
+
+/*
+ * Stop the shards of `p` once they ran the jobs already submitted.
+ * Jobs still waiting to be polled are dropped.
+ */
+
+void shard_pool_stop(shard_pool_t *p) {
+    shard_job_t *job;
+
+    for (unsigned int i = 0; i < p->nshards; i++)
+        _shard_push(&p->shards[i], &p->stop);
+    for (unsigned int i = 0; i < p->nshards; i++)
+        pthread_join(p->shards[i].thread, NULL);
+    p->wall_ns = now_ns() - p->start_ns;
+
+    while ((job = shard_poll(p)) != NULL)
+        shard_job_del(job);
+}
+
+/*
+ * Free pool `p`, stopped with `shard_pool_stop`, and the trees of its
+ * shards.
+ */
+
+void shard_pool_del(shard_pool_t *p) {
+    for (unsigned int i = 0; i < p->nshards; i++) {
+        _ramfs_rmnode_r(p->shards[i].root, 0);
+        _ramfs_rmnode(p->shards[i].root, 0);
+        ringbuf_del(p->shards[i].jobs);
+        ringbuf_del(p->shards[i].done);
+        close(p->shards[i].efd);
+    }
+    close(p->efd);
+    free(p->shards);
+    free(p);
+}
+
+/*
+ * Print the commands run by each shard of `p` and how busy it was to
+ * `stream`. A shard is busy whenever it is not waiting for jobs.
+ */
+
+void shard_pool_print_stats(shard_pool_t *p, FILE *stream) {
+    fprintf(stream, "  %u shards, %lu commands sent to all of them\n", p->nshards,
+            (unsigned long) p->fanouts);
+    for (unsigned int i = 0; i < p->nshards; i++) {
+        double busy = p->wall_ns > 0
+                      ? 100.0 * (1.0 - (double) p->shards[i].wait_ns / (double) p->wall_ns)
+                      : 0.0;
+        fprintf(stream, "  shard %-3u %10lu commands, %5.1f%% busy\n", i,
+                (unsigned long) p->shards[i].executed, busy < 0 ? 0.0 : busy);
+    }
+}
+
+/*
+ * Returns a job running `cmd`, which is taken over together with its
+ * line and payload, on behalf of `owner`.
+ */
+
+shard_job_t *shard_job_new(cmd_t *cmd, void *owner) {
+    shard_job_t *job = calloc_or_die(1, sizeof(shard_job_t));
+
+    job->cmd = *cmd;
+    job->owner = owner;
+    strbuf_init(&job->out);
+    return job;
+}
+
+/*
+ * Free job `job`, its command and its reply.
+ */
+
+void shard_job_del(shard_job_t *job) {
+    for (unsigned int i = 0; i < job->ntxns; i++)
+        ramfs_txn_clear(&job->txns[i]);
+    free(job->txns);
+    free(job->cmd.line);
+    free(job->cmd.payload);
+    strbuf_free(&job->out);
+    free(job);
+}
+
+/*
+ * Make job `job`, a `commit`, apply batch `txn`, which is emptied.
+ * Each shard gets the operations on its own top-level directories, in
+ * order, and those on the root as a whole go to all of them.
+ */
+
+void shard_job_txn(shard_pool_t *p, shard_job_t *job, fs_txn_t *txn) {
+    fs_txn_item_t *item;
+    fs_txn_t *part;
+    int target;
+
+    job->txns = calloc_or_die(p->nshards, sizeof(fs_txn_t));
+    job->ntxns = p->nshards;
+    for (size_t i = 0; i < txn->count; i++) {
+        item = &txn->items[i];
+        target = _shard_path(p, item->path);
+        for (unsigned int k = 0; k < p->nshards; k++) {
+            if (target >= 0 && k != (unsigned int) target)
+                continue;
+            part = &job->txns[k];
+            // Only one shard gets the content: a write to the root fails anyway
+            ramfs_txn_add(part, item->op, item->path, item->content, item->len);
+            part->items[part->count - 1].pos = item->pos;
+            item->content = NULL;
+        }
+    }
+    ramfs_txn_clear(txn);
+}
+
+/*
+ * Hand job `job` over to the shard owning its path, or to all of
+ * them, or for a batch to those it concerns. It comes back from
+ * `shard_poll` with its reply. Only one thread may submit and poll.
+ */
+
+void shard_submit(shard_pool_t *p, shard_job_t *job) {
+    int target = job->txns != NULL ? -1 : _shard_route(p, &job->cmd);
+
+    p->inflight++;
+    if (target >= 0) {
+        _shard_push(&p->shards[target], job);
+        return;
+    }
+
+    job->parts = calloc_or_die(p->nshards, sizeof(shard_part_t));
+    for (unsigned int i = 0; i < p->nshards; i++)
+        job->pending += job->txns == NULL || job->txns[i].count > 0;
+    job->nparts = job->txns != NULL ? job->pending : 0;
+    if (job->nparts > 1)
+        pthread_barrier_init(&job->barrier, NULL, job->nparts);
+    p->fanouts++;
+    for (unsigned int i = 0; i < p->nshards; i++)
+        if (job->txns == NULL || job->txns[i].count > 0)
+            _shard_push(&p->shards[i], job);
+}
+
+/*
+ * Returns true if no more jobs can be submitted to `p` until some
+ * are polled.
+ */
+
+uint8_t shard_full(shard_pool_t *p) {
+    return (uint8_t) (p->inflight >= SHARD_MAX_JOBS);
+}
+
+/*
+ * Acknowledge that the eventfd of `p` became readable. Jobs done from
+ * now on write it again, so all of them must be polled next.
+ */
+
+void shard_ack(shard_pool_t *p) {
+    uint64_t n;
+
+    if (read(p->efd, &n, sizeof(n)) < 0)
+        n = 0;
+    __atomic_exchange_n(&p->wake, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns a job of `p` whose reply is ready, or NULL if there are
+ * none. Shards are polled round robin.
+ */
+
+shard_job_t *shard_poll(shard_pool_t *p) {
+    shard_job_t *job;
+    unsigned int i;
+
+    for (unsigned int k = 0; k < p->nshards; k++) {
+        i = (p->next + k) % p->nshards;
+        if ((job = ringbuf_trypop(p->shards[i].done)) != NULL) {
+            p->next = (i + 1) % p->nshards;
+            p->inflight--;
+            job->done = 1;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * (Internal) Returns the shard owning the path of `cmd`, or -1 if the
+ * command needs all of them. Commands on the root that can't be
+ * split, and invalid ones, go to shard 0, which replies like a single
+ * tree would.
+ */
+
+int _shard_route(shard_pool_t *p, cmd_t *cmd) {
+    char *path = cmd->args[0];
+    unsigned int maxdepth;
+    int target;
+
+    // The first argument of find is a name, the one of save a file
+    if (cmd->op == CMD_CACHE_STATS || (cmd->op == CMD_FIND && path != NULL))
+        return -1;
+    if (path == NULL || cmd->op == CMD_SAVE || cmd->op == CMD_BGSAVE)
+        return 0;
+
+    if ((target = _shard_path(p, path)) >= 0)
+        return target;
+
+    switch (cmd->op) {
+        case CMD_DELETE_R:
+            return -1;
+        case CMD_GREP:
+            return p->binary || cmd->args[1] != NULL ? -1 : 0;
+        case CMD_FIND_IN:
+        case CMD_COUNT_IN:
+            return cmd->args[1] != NULL && _ramfs_maxdepth_w(cmd->args[2], &maxdepth) == 0 ? -1 : 0;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * (Internal) Returns the shard owning `path`, or -1 if it is the root.
+ */
+
+int _shard_path(shard_pool_t *p, const char *path) {
+    size_t len;
+
+    while (*path == '/')
+        path++;
+    if ((len = strcspn(path, "/")) > 0)
+        return (int) (hash(path, len) % p->nshards);
+    return -1;
+}
+
+/*
+ * (Internal) Shard thread: run jobs until the stop job comes.
+ */
+
+void *_shard_thread(void *arg) {
+    shard_t *sh = arg;
+    shard_pool_t *p = sh->pool;
+    shard_job_t *job;
+    uint64_t start;
+
+    for (;;) {
+        if ((job = ringbuf_trypop(sh->jobs)) == NULL) {
+            start = now_ns();
+            job = _shard_wait(sh);
+            sh->wait_ns += now_ns() - start;
+        }
+        if (job == &p->stop)
+            break;
+        sh->executed++;
+
+        if (job->parts == NULL) {
+            _shard_exec(sh, &job->cmd, &job->out);
+        } else {
+            _shard_part(sh, job);
+            // The last shard to finish its part builds the reply
+            if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) > 0)
+                continue;
+            _shard_gather(p, job);
+        }
+        _shard_finish(sh, job);
+    }
+    return NULL;
+}
+
+/*
+ * (Internal) Queue job `job` on shard `sh`, waking it up if it is
+ * blocked.
+ */
+
+void _shard_push(shard_t *sh, shard_job_t *job) {
+    uint64_t one = 1;
+
+    ringbuf_push(sh->jobs, job);
+    // Pairs with the fence in `_shard_wait`: either the shard sees the
+    // job, or we see it idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sh->idle, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&sh->idle, 0, __ATOMIC_ACQ_REL) &&
+        write(sh->efd, &one, sizeof(one)) < 0)
+        exit(4);
+}
+
+/*
+ * (Internal) Wait for the next job of shard `sh`. The shard backs off
+ * for a while, then blocks on its eventfd, so that the front-end gets
+ * the CPU and wakeups don't wait for a sleep to expire.
+ * Returns the job.
+ */
+
+shard_job_t *_shard_wait(shard_t *sh) {
+    shard_job_t *job;
+    unsigned int spins = 0;
+    uint64_t n;
+
+    for (;;) {
+        if ((job = ringbuf_trypop(sh->jobs)) != NULL)
+            return job;
+        if (spins < sh->pool->spins) {
+            ringbuf_backoff(&spins);
+            continue;
+        }
+
+        __atomic_store_n(&sh->idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((job = ringbuf_trypop(sh->jobs)) != NULL) {
+            // Unless the front-end already woke us up
+            if (!__atomic_exchange_n(&sh->idle, 0, __ATOMIC_ACQ_REL) && read(sh->efd, &n, sizeof(n)) < 0)
+                exit(4);
+            return job;
+        }
+        if (read(sh->efd, &n, sizeof(n)) < 0 && errno != EINTR)
+            exit(4);
+        spins = 0;
+    }
+}
+
+/*
+ * (Internal) Run `cmd` against the tree of shard `sh`, appending its
+ * reply to `out`. The root holds at most MAX_CHILDREN nodes over all
+ * the shards, like a single tree.
+ */
+
+void _shard_exec(shard_t *sh, cmd_t *cmd, strbuf_t *out) {
+    shard_pool_t *p = sh->pool;
+    size_t before = sh->root->data.children->used;
+    size_t reserved = 0;
+
+    if ((cmd->op == CMD_CREATE || cmd->op == CMD_CREATE_DIR) && cmd->args[0] != NULL &&
+        _ramfs_path_depth(cmd->args[0]) == 1) {
+        if (__atomic_fetch_add(&p->top, 1, __ATOMIC_RELAXED) >= MAX_CHILDREN) {
+            __atomic_sub_fetch(&p->top, 1, __ATOMIC_RELAXED);
+            if (p->binary)
+                _cmd_bin_reply(out, BIN_STATUS_ERR, 0, 0);
+            else
+                print_status(-1, out);
+            return;
+        }
+        reserved = 1;
+    }
+
+    // A shard only has a part of the file system, images are of a whole one
+    if (cmd->op == CMD_SAVE || cmd->op == CMD_BGSAVE) {
+        if (p->binary)
+            _cmd_bin_reply(out, BIN_STATUS_ERR, 0, 0);
+        else
+            print_status(-1, out);
+        return;
+    }
+
+    // Batches are kept by the front-end, see `shard_job_txn`
+    if (p->binary)
+        cmd_exec_bin(sh->root, NULL, cmd, out);
+    else
+        cmd_exec(sh->root, NULL, cmd, out);
+
+    // Give back the reservation, or account for deleted children
+    __atomic_add_fetch(&p->top, sh->root->data.children->used - before - reserved, __ATOMIC_RELAXED);
+}
+
+/*
+ * (Internal) Run the part of the job `job`, sent to all shards, that
+ * concerns the tree of shard `sh`. Arguments were checked by
+ * `_shard_route`.
+ */
+
+void _shard_part(shard_t *sh, shard_job_t *job) {
+    shard_part_t *part = &job->parts[sh->id];
+    cmd_t *cmd = &job->cmd;
+    fs_node_t *root = sh->root;
+    unsigned int maxdepth;
+    size_t before, len;
+
+    if (job->txns != NULL) {
+        _shard_commit(sh, job);
+        return;
+    }
+
+    // Every shard resolves the path in place
+    if (cmd->op != CMD_FIND && cmd->op != CMD_CACHE_STATS) {
+        len = strlen(cmd->args[0]);
+        part->path = malloc_or_die(len + 1);
+        memcpy(part->path, cmd->args[0], len + 1);
+    }
+
+    switch (cmd->op) {
+        case CMD_FIND:
+            if (cmd->match == MATCH_EXACT)
+                part->results = ramfs_find(root, cmd->args[0], &part->nres);
+            else
+                part->results = ramfs_find_match(root, cmd->match, cmd->args[0], &part->nres);
+            break;
+        case CMD_FIND_IN:
+            _ramfs_maxdepth_w(cmd->args[2], &maxdepth);
+            part->results = ramfs_find_in(root, part->path, cmd->args[1], maxdepth, &part->nres);
+            break;
+        case CMD_COUNT_IN:
+            _ramfs_maxdepth_w(cmd->args[2], &maxdepth);
+            part->ret = ramfs_count_in(root, part->path, cmd->args[1], maxdepth, &part->count);
+            break;
+        case CMD_GREP:
+            // Binary patterns are the payload and may contain NULs
+            if (sh->pool->binary)
+                part->results = ramfs_grep(root, part->path, cmd->match, cmd->payload, cmd->payload_len,
+                                           &part->nres);
+            else
+                part->results = ramfs_grep(root, part->path, cmd->match, cmd->args[1], strlen(cmd->args[1]),
+                                           &part->nres);
+            break;
+        case CMD_DELETE_R:
+            before = root->data.children->used;
+            part->ret = ramfs_delete_r(root, part->path);
+            __atomic_sub_fetch(&sh->pool->top, before - root->data.children->used, __ATOMIC_RELAXED);
+            break;
+        case CMD_CACHE_STATS:
+            part->cache = *ramfs_find_cache(root);
+            part->count = part->cache.entries->used;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * (Internal) Check the part of the batch of job `job` that concerns
+ * the tree of shard `sh`, and wait for the other shards it concerns
+ * to check theirs: either all of them apply their part, or none.
+ * Every shard runs the jobs submitted before the batch before it and
+ * the ones submitted after it after it, so no client sees it half
+ * done.
+ */
+
+void _shard_commit(shard_t *sh, shard_job_t *job) {
+    shard_pool_t *p = sh->pool;
+    shard_part_t *part = &job->parts[sh->id];
+    fs_txn_t *txn = &job->txns[sh->id];
+    fs_txn_item_t *item;
+    size_t before = sh->root->data.children->used;
+
+    // Children of the root are counted over all the shards, and the
+    // check tokenizes the paths
+    for (size_t i = 0; i < txn->count; i++) {
+        item = &txn->items[i];
+        if ((item->op == TXN_CREATE || item->op == TXN_CREATE_DIR) && _ramfs_path_depth(item->path) == 1 &&
+            part->count++ == 0)
+            part->first = item->pos;
+    }
+    part->ret = _ramfs_txn_check(sh->root, txn);
+
+    // A batch within one shard needs no agreement
+    if (job->nparts == 1) {
+        _shard_decide(p, job);
+    } else {
+        if (pthread_barrier_wait(&job->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+            _shard_decide(p, job);
+        pthread_barrier_wait(&job->barrier);
+    }
+
+    if (job->commit) {
+        _ramfs_txn_apply(sh->root, txn);
+        // Give back the reservation, or account for deleted children
+        __atomic_add_fetch(&p->top, sh->root->data.children->used - before - part->count, __ATOMIC_RELAXED);
+    }
+    ramfs_txn_clear(txn);
+}
+
+/*
+ * (Internal) Decide whether the batch of job `job` is applied, once
+ * every shard of `p` it concerns checked its part. Creating children
+ * of the root reserves room for all of them at once, even if the
+ * batch deletes some first.
+ */
+
+void _shard_decide(shard_pool_t *p, shard_job_t *job) {
+    size_t failed = 0, creates = 0, first = 0;
+
+    for (unsigned int i = 0; i < p->nshards; i++) {
+        if (job->parts[i].ret < 0 && (failed == 0 || job->txns[i].failed < failed))
+            failed = job->txns[i].failed;
+        if (job->parts[i].count > 0 && (first == 0 || job->parts[i].first < first))
+            first = job->parts[i].first;
+        creates += job->parts[i].count;
+    }
+    if (failed == 0 && creates > 0 &&
+        __atomic_add_fetch(&p->top, creates, __ATOMIC_RELAXED) > MAX_CHILDREN) {
+        __atomic_sub_fetch(&p->top, creates, __ATOMIC_RELAXED);
+        failed = first;
+    }
+    job->failed = failed;
+    job->commit = (uint8_t) (failed == 0);
+}
+
+/*
+ * (Internal) Build the reply of job `job` out of the parts of all the
+ * shards of `p`, and free them.
+ */
+
+void _shard_gather(shard_pool_t *p, shard_job_t *job) {
+    fs_find_cache_t cache = {0};
+    char **results;
+    size_t nres, count = 0;
+    int ret = 0;
+
+    switch (job->cmd.op) {
+        case CMD_FIND:
+        case CMD_FIND_IN:
+        case CMD_GREP:
+            results = _shard_merge(p, job, &nres);
+            if (p->binary) {
+                _cmd_bin_paths(&job->out, results, nres);
+                free(results);
+            } else {
+                _ramfs_results_w(results, nres, &job->out);
+            }
+            break;
+        case CMD_COUNT_IN:
+            for (unsigned int i = 0; i < p->nshards; i++)
+                count += job->parts[i].count;
+            strbuf_printf(&job->out, "ok %zu\n", count);
+            break;
+        case CMD_DELETE_R:
+            for (unsigned int i = 0; i < p->nshards; i++)
+                ret |= job->parts[i].ret;
+            if (p->binary)
+                _cmd_bin_reply(&job->out, ret < 0 ? BIN_STATUS_ERR : BIN_STATUS_OK, 0, 0);
+            else
+                print_status(ret, &job->out);
+            break;
+        case CMD_CACHE_STATS:
+            for (unsigned int i = 0; i < p->nshards; i++) {
+                cache.lookups += job->parts[i].cache.lookups;
+                cache.hits += job->parts[i].cache.hits;
+                cache.misses += job->parts[i].cache.misses;
+                cache.invalidations += job->parts[i].cache.invalidations;
+                cache.evictions += job->parts[i].cache.evictions;
+                cache.bytes += job->parts[i].cache.bytes;
+                count += job->parts[i].count;
+            }
+            _ramfs_cache_stats_w(&cache, count, &job->out);
+            break;
+        case CMD_COMMIT:
+            if (job->nparts > 1)
+                pthread_barrier_destroy(&job->barrier);
+            _cmd_committed(&job->out, p->binary, job->commit ? 0 : -1, job->failed);
+            break;
+        default:
+            break;
+    }
+
+    for (unsigned int i = 0; i < p->nshards; i++) {
+        free(job->parts[i].path);
+        free(job->parts[i].results);
+    }
+    free(job->parts);
+    job->parts = NULL;
+}
+
+/*
+ * (Internal) Merge the sorted results of all the shards of `p` for
+ * job `job`. The paths are not copied.
+ * Returns the sorted array, their number is stored into `nres`.
+ */
+
+char **_shard_merge(shard_pool_t *p, shard_job_t *job, size_t *nres) {
+    shard_part_t *parts = job->parts;
+    size_t pos[SHARD_MAX] = {0};
+    size_t total = 0;
+    char **merged;
+    int best;
+
+    for (unsigned int i = 0; i < p->nshards; i++)
+        total += parts[i].nres;
+    merged = malloc_or_die((total + 1) * sizeof(char *));
+
+    for (size_t k = 0; k < total; k++) {
+        best = -1;
+        for (unsigned int i = 0; i < p->nshards; i++)
+            if (pos[i] < parts[i].nres &&
+                (best < 0 || strcmp(parts[i].results[pos[i]], parts[best].results[pos[best]]) < 0))
+                best = (int) i;
+        merged[k] = parts[best].results[pos[best]++];
+    }
+    *nres = total;
+    return merged;
+}
+
+/*
+ * (Internal) Hand job `job`, whose reply is ready, back to the
+ * front-end. It is woken up, unless it was already, once the shard
+ * runs out of jobs or every SHARD_BATCH of them, so that replies are
+ * sent in batches.
+ */
+
+void _shard_finish(shard_t *sh, shard_job_t *job) {
+    shard_pool_t *p = sh->pool;
+    uint64_t one = 1;
+
+    ringbuf_push(sh->done, job);
+    if (++sh->unsignalled < SHARD_BATCH && !ringbuf_empty(sh->jobs))
+        return;
+    sh->unsignalled = 0;
+    if (__atomic_exchange_n(&p->wake, 1, __ATOMIC_SEQ_CST) == 0 &&
+        write(p->efd, &one, sizeof(one)) < 0)
+        __atomic_store_n(&p->wake, 0, __ATOMIC_SEQ_CST);
+}
+// end:definitions
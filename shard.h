@@ -0,0 +1,121 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_SHARD_H
+#define API_RAMFS_SHARD_H
+
+// start:includes
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "ramfs.h"
+#include "command.h"
+#include "ringbuf.h"
+#include "utils.h"
+// end:includes
+
+// start:macros
+#define SHARD_MAX 64
+// Jobs in flight at once. Every queue can hold all of them, so that
+// neither the front-end nor a shard ever waits for room.
+#define SHARD_MAX_JOBS 4096
+// Backoff rounds before an idle shard blocks on its eventfd, when
+// there is more than one CPU to spin on
+#define SHARD_SPINS    64
+// Jobs done by a shard before it wakes the front-end up anyway
+#define SHARD_BATCH    64
+// end:macros
+
+// start:datatypes
+// What one shard found for a command sent to all of them
+typedef struct _shard_part {
+    char *path;         // own copy, tokenized while resolving it
+    char **results;
+    size_t nres;
+    size_t count;
+    int ret;
+    size_t first;       // batches: position of the first create at the root
+    fs_find_cache_t cache;      // counters only
+} shard_part_t;
+
+// A command and its reply. The front-end chains the jobs of each of
+// its clients in order through `next`.
+typedef struct _shard_job {
+    cmd_t cmd;          // owns its line and payload
+    strbuf_t out;
+    void *owner;
+    struct _shard_job *next;
+    uint8_t done;       // set by `shard_poll`
+    unsigned int pending;   // shards still working on it
+    shard_part_t *parts;    // one per shard if sent to all of them
+
+    // `commit` only: sent to the shards with a part of the batch
+    fs_txn_t *txns;         // the part of each shard
+    unsigned int ntxns;
+    unsigned int nparts;    // shards with a part, they wait for each other
+    pthread_barrier_t barrier;
+    uint8_t commit;         // every part can be applied
+    size_t failed;
+} shard_job_t;
+
+typedef struct _shard {
+    struct _shard_pool *pool;
+    unsigned int id;
+    fs_node_t *root;    // the top-level directories hashed to it
+    pthread_t thread;
+    ringbuf_t *jobs;    // from the front-end
+    ringbuf_t *done;    // back to it
+    int efd;            // written to wake the shard up
+    uint8_t idle;       // blocked, or about to block, on efd
+    unsigned int unsignalled;   // jobs done since the last wakeup
+    uint64_t executed;
+    uint64_t wait_ns;
+    char pad[CACHE_LINE_SIZE];
+} shard_t;
+
+typedef struct _shard_pool {
+    unsigned int nshards;
+    uint8_t binary;
+    shard_t *shards;
+    int efd;            // eventfd written when jobs are done
+    uint8_t wake;       // efd was written and not acknowledged yet
+    size_t top;         // children of the root, over all shards
+    size_t inflight;    // front-end only
+    unsigned int next;  // done queue polled first
+    unsigned int spins; // SHARD_SPINS, or 0 on a single CPU
+    uint64_t fanouts;
+    uint64_t start_ns;
+    uint64_t wall_ns;
+    shard_job_t stop;
+} shard_pool_t;
+// end:datatypes
+
+// start:declarations
+shard_pool_t *shard_pool_new(unsigned int nshards, unsigned int threads, uint8_t binary, uint8_t reap);
+void          shard_pool_stop(shard_pool_t *p);
+void          shard_pool_del(shard_pool_t *p);
+void          shard_pool_print_stats(shard_pool_t *p, FILE *stream);
+shard_job_t  *shard_job_new(cmd_t *cmd, void *owner);
+void          shard_job_del(shard_job_t *job);
+void          shard_job_txn(shard_pool_t *p, shard_job_t *job, fs_txn_t *txn);
+void          shard_submit(shard_pool_t *p, shard_job_t *job);
+uint8_t       shard_full(shard_pool_t *p);
+void          shard_ack(shard_pool_t *p);
+shard_job_t  *shard_poll(shard_pool_t *p);
+
+int    _shard_route(shard_pool_t *p, cmd_t *cmd);
+int    _shard_path(shard_pool_t *p, const char *path);
+void  *_shard_thread(void *arg);
+void   _shard_exec(shard_t *sh, cmd_t *cmd, strbuf_t *out);
+void   _shard_part(shard_t *sh, shard_job_t *job);
+void   _shard_commit(shard_t *sh, shard_job_t *job);
+void   _shard_decide(shard_pool_t *p, shard_job_t *job);
+void   _shard_gather(shard_pool_t *p, shard_job_t *job);
+char **_shard_merge(shard_pool_t *p, shard_job_t *job, size_t *nres);
+void   _shard_finish(shard_t *sh, shard_job_t *job);
+void   _shard_push(shard_t *sh, shard_job_t *job);
+shard_job_t *_shard_wait(shard_t *sh);
+// end:declarations
+
+#endif //API_RAMFS_SHARD_H
@@ -0,0 +1,201 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include "strsort.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Sorting of NUL terminated strings, such as the paths found by find,
+// that tend to share long prefixes
+
+/*
+ * Sort `count` strings in byte order, like qsort with strcmp would.
+ * It is a multikey quicksort working 8 bytes at a time: the next 8
+ * bytes of every string are loaded once into an array of integers,
+ * the strings are split in three groups on those, lower, equal and
+ * higher than a pivot, and only the equal group moves on to the next
+ * 8 bytes. Partitioning only touches the two arrays, bytes that all
+ * the strings of a group share are read once for the whole group
+ * rather than once per comparison, and nothing is called through a
+ * pointer. Before loading the bytes of a group, whatever prefix its
+ * strings still share is skipped, in a pass that stops at the first
+ * string that differs.
+ */
+
+void strsort(char **strings, size_t count) {
+    strsort_job_t *stack;
+    size_t top = 0, size = 64;
+    uint64_t seed = count;
+    uint64_t *keys, *k, pivot, k0, k1, k2, tk;
+    char **a, *ts;
+    size_t n, depth, lt, gt, i;
+
+    if (count < 2)
+        return;
+
+    keys = malloc_or_die(count * sizeof(uint64_t));
+    stack = malloc_or_die(size * sizeof(strsort_job_t));
+    stack[top].strings = strings;
+    stack[top].keys = keys;
+    stack[top].count = count;
+    stack[top].depth = 0;
+    stack[top++].cached = 0;
+
+    while (top > 0) {
+        top--;
+        a = stack[top].strings;
+        k = stack[top].keys;
+        n = stack[top].count;
+        depth = stack[top].depth;
+        if (!stack[top].cached) {
+            depth += _strsort_lcp(a, n, depth);
+            for (i = 0; i < n; i++)
+                k[i] = _strsort_key(a[i] + depth);
+        }
+
+        while (n > STRSORT_SMALL) {
+            // Median of three picked at random, as results often come
+            // in runs that fixed positions would sample badly
+            k0 = k[_strsort_rand(&seed) % n];
+            k1 = k[_strsort_rand(&seed) % n];
+            k2 = k[_strsort_rand(&seed) % n];
+            if (k0 > k1) {
+                tk = k0;
+                k0 = k1;
+                k1 = tk;
+            }
+            pivot = k2 < k0 ? k0 : k2 > k1 ? k1 : k2;
+
+            // [0, lt) < pivot, [lt, i) == pivot, [gt, n) > pivot
+            lt = i = 0;
+            gt = n;
+            while (i < gt) {
+                if (k[i] < pivot) {
+                    tk = k[lt], ts = a[lt];
+                    k[lt] = k[i], a[lt++] = a[i];
+                    k[i] = tk, a[i++] = ts;
+                } else if (k[i] > pivot) {
+                    gt--;
+                    tk = k[gt], ts = a[gt];
+                    k[gt] = k[i], a[gt] = a[i];
+                    k[i] = tk, a[i] = ts;
+                } else {
+                    i++;
+                }
+            }
+
+            // Queue the lower and higher groups, same bytes
+            if (top + 2 > size) {
+                size *= 2;
+                stack = realloc_or_die(stack, size * sizeof(strsort_job_t));
+            }
+            if (lt > 1) {
+                stack[top].strings = a;
+                stack[top].keys = k;
+                stack[top].count = lt;
+                stack[top].depth = depth;
+                stack[top++].cached = 1;
+            }
+            if (n - gt > 1) {
+                stack[top].strings = a + gt;
+                stack[top].keys = k + gt;
+                stack[top].count = n - gt;
+                stack[top].depth = depth;
+                stack[top++].cached = 1;
+            }
+
+            // Strings that end within these bytes are all the same
+            if ((pivot & 0xff) == 0) {
+                n = 0;
+                break;
+            }
+            a += lt;
+            k += lt;
+            n = gt - lt;
+            depth += 8 + _strsort_lcp(a, n, depth + 8);
+            for (i = 0; i < n; i++)
+                k[i] = _strsort_key(a[i] + depth);
+        }
+
+        if (n > 1)
+            _strsort_small(a, k, n, depth);
+    }
+
+    free(stack);
+    free(keys);
+}
+
+/*
+ * (Internal) Returns the first 8 bytes of `s` as a big endian integer,
+ * so that integers compare like the strings do, padded with zeros if
+ * the string is shorter. A zero low byte means the string ends there.
+ */
+
+inline uint64_t _strsort_key(const char *s) {
+    uint64_t key = 0;
+    int i;
+
+    for (i = 0; i < 8 && s[i] != '\0'; i++)
+        key = key << 8 | (unsigned char) s[i];
+    return i > 0 ? key << (8 * (8 - i)) : 0;
+}
+
+/*
+ * (Internal) Returns the next number from the generator in `seed`.
+ */
+
+inline size_t _strsort_rand(uint64_t *seed) {
+    *seed = *seed * 6364136223846793005ull + 1442695040888963407ull;
+    return (size_t) (*seed >> 33);
+}
+
+/*
+ * (Internal) Returns how many bytes, from `depth` on, all the `count`
+ * strings share. The shared terminator is not counted.
+ */
+
+size_t _strsort_lcp(char **strings, size_t count, size_t depth) {
+    const char *first = strings[0] + depth;
+    size_t lcp = strlen(first), j;
+
+    for (size_t i = 1; i < count && lcp > 0; i++) {
+        const char *s = strings[i] + depth;
+        for (j = 0; j < lcp && s[j] == first[j]; j++)
+            ;
+        lcp = j;
+    }
+    return lcp;
+}
+
+/*
+ * (Internal) Insertion sort of `count` strings whose first `depth`
+ * bytes are known to be the same and whose next 8 are in `keys`.
+ */
+
+void _strsort_small(char **strings, uint64_t *keys, size_t count, size_t depth) {
+    uint64_t key;
+    char *s;
+    size_t j;
+
+    for (size_t i = 1; i < count; i++) {
+        s = strings[i];
+        key = keys[i];
+        for (j = i; j > 0; j--) {
+            if (keys[j - 1] < key)
+                break;
+            if (keys[j - 1] == key &&
+                ((key & 0xff) == 0 || strcmp(strings[j - 1] + depth + 8, s + depth + 8) <= 0))
+                break;
+            strings[j] = strings[j - 1];
+            keys[j] = keys[j - 1];
+        }
+        strings[j] = s;
+        keys[j] = key;
+    }
+}
+// end:definitions
@@ -0,0 +1,40 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_STRSORT_H
+#define API_RAMFS_STRSORT_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+// end:includes
+
+// start:macros
+// Groups this small are finished with insertion sort
+#define STRSORT_SMALL 16
+// end:macros
+
+// start:datatypes
+// A group of strings that share their first `depth` bytes, still to
+// be sorted. `cached` tells whether `keys` already hold their next 8
+// bytes.
+typedef struct _strsort_job {
+    char **strings;
+    uint64_t *keys;
+    size_t count;
+    size_t depth;
+    uint8_t cached;
+} strsort_job_t;
+// end:datatypes
+
+// start:declarations
+void     strsort(char **strings, size_t count);
+
+uint64_t _strsort_key(const char *s);
+size_t   _strsort_rand(uint64_t *seed);
+size_t   _strsort_lcp(char **strings, size_t count, size_t depth);
+void     _strsort_small(char **strings, uint64_t *keys, size_t count, size_t depth);
+// end:declarations
+
+#endif //API_RAMFS_STRSORT_H
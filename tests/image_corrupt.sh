@@ -0,0 +1,27 @@
+#!/bin/sh
+# Images whose records point outside of the file must be refused.
+# Usage: image_corrupt.sh API_RAMFS
+set -e
+BIN=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+# Debug builds put the line number and the command before each reply
+replies() { sed 's/^[0-9][0-9]* [a-z_]* //'; }
+
+printf 'create /f\nwrite /f "hello"\nsave %s/ok.img\n' "$DIR" | "$BIN" > /dev/null
+printf 'read /f\n' | "$BIN" -i "$DIR/ok.img" | replies | grep -q '^contenuto hello$'
+
+# Record 1 is /f: after the 80 bytes of header and the 32 of the root,
+# its content offset is at 120 and its size at 132. 2^64 - 0x100000
+# plus 0x100011 wraps around to 17, a NUL in the header.
+cp "$DIR/ok.img" "$DIR/bad.img"
+printf '\000\000\360\377\377\377\377\377' | dd of="$DIR/bad.img" bs=1 seek=120 conv=notrunc 2> /dev/null
+printf '\021\000\020\000' | dd of="$DIR/bad.img" bs=1 seek=132 conv=notrunc 2> /dev/null
+
+status=0
+"$BIN" -i "$DIR/bad.img" < /dev/null > /dev/null 2> "$DIR/err" || status=$?
+if [ "$status" -ne 1 ] || ! grep -q 'Invalid argument' "$DIR/err"; then
+    echo "corrupt image not refused (exit $status)" >&2
+    cat "$DIR/err" >&2
+    exit 1
+fi
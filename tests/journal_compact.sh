@@ -0,0 +1,49 @@
+#!/bin/sh
+# A fresh journal must be compacted into the image again and again,
+# also when records are logged while the image is being saved.
+# Usage: journal_compact.sh API_RAMFS
+set -e
+BIN=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+# Debug builds put the line number and the command before each reply
+replies() { sed 's/^[0-9][0-9]* [a-z_]* //'; }
+
+# 96 writes of 2 MiB go past JOURNAL_COMPACT_SIZE (64 MiB) twice. A
+# save is only noticed to be over after IMAGE_BGSAVE_POLL (1024)
+# commands, the reads of /k between the writes, so the writes logged
+# meanwhile have to be kept. Reading /f back makes the reply large
+# enough for every write to be committed on its own.
+head -c 2097152 /dev/zero | tr '\000' a > "$DIR/content"
+i=0
+while [ $i -lt 40 ]; do
+    printf 'read /k\n'
+    i=$((i + 1))
+done > "$DIR/reads"
+{
+    printf 'create /f\ncreate /k\n'
+    i=0
+    while [ $i -lt 96 ]; do
+        printf 'write_begin /f 2097152\n'
+        cat "$DIR/content"
+        printf 'read /f\nwrite /k "v%d"\n' $i
+        cat "$DIR/reads"
+        i=$((i + 1))
+    done
+    printf 'write /f "fine"\n'
+} | "$BIN" -s -J "$DIR/j" -i "$DIR/img" > /dev/null 2> "$DIR/err"
+
+compactions=$(sed -n 's/^ *\([0-9]*\) compactions$/\1/p' "$DIR/err")
+size=$(wc -c < "$DIR/j")
+if [ "${compactions:-0}" -lt 2 ] || [ "$size" -ge 67108864 ]; then
+    echo "journal not compacted (${compactions:-0} compactions, $size bytes)" >&2
+    cat "$DIR/err" >&2
+    exit 1
+fi
+
+printf 'read /f\nread /k\n' | "$BIN" -J "$DIR/j" -i "$DIR/img" | replies > "$DIR/out"
+printf 'contenuto fine\ncontenuto v95\n' | cmp -s - "$DIR/out" || {
+    echo "state lost across compactions" >&2
+    cat "$DIR/out" >&2
+    exit 1
+}
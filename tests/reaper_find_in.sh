@@ -0,0 +1,37 @@
+#!/bin/sh
+# find_in and count_in must skip the nodes of a subtree deleted with
+# -r, which stay in the name index until the reaper frees them.
+# Usage: reaper_find_in.sh API_RAMFS
+set -e
+BIN=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+# Debug builds put the line number and the command before each reply
+replies() { sed 's/^[0-9][0-9]* [a-z_]* //'; }
+
+# /t2 is far larger than FS_REAP_SLICE (1024), and there are fewer
+# nodes named f1 than nodes under /, so the index is used
+awk 'BEGIN {
+    print "create_dir /keep"
+    print "create_dir /t2"
+    for (d = 0; d < 100; d++) {
+        printf "create_dir /keep/d%d\ncreate_dir /t2/d%d\n", d, d
+        for (i = 0; i < 300; i++)
+            printf "create /keep/d%d/n%d\ncreate /t2/d%d/n%d\n", d, i, d, i
+    }
+    for (i = 0; i < 100; i++)
+        printf "create /t2/f%d\n", i
+    print "create /keep/f1"
+    print "delete_r /t2"
+    print "find_in / f1"
+    print "count_in / f1"
+    print "find_in /keep f1"
+}' > "$DIR/in"
+
+"$BIN" -r < "$DIR/in" > "$DIR/all"
+tail -n 3 "$DIR/all" | replies > "$DIR/out"
+printf 'ok /keep/f1\nok 1\nok /keep/f1\n' | cmp -s - "$DIR/out" || {
+    echo "detached nodes found" >&2
+    cat "$DIR/out" >&2
+    exit 1
+}
@@ -0,0 +1,166 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include "trigram.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Trigram index: maps every 3-byte sequence to the items (distinct
+// node names) containing it, so that a substring query only has to
+// check the names in the shortest posting list of its trigrams.
+
+/*
+ * Create a new empty trigram index. It needs to be freed with `tg_del`.
+ */
+
+tg_index_t *tg_new() {
+    tg_index_t *t = malloc_or_die(sizeof(tg_index_t));
+
+    t->size = TG_BASE_SIZE;
+    t->used = 0;
+    t->lists = calloc_or_die(TG_BASE_SIZE, sizeof(tg_list_t));
+    return t;
+}
+
+/*
+ * Frees trigram index `t`. Items are not freed.
+ */
+
+void tg_del(tg_index_t *t) {
+    for (size_t i = 0; i < t->size; i++)
+        free(t->lists[i].items);
+    free(t->lists);
+    free(t);
+}
+
+/*
+ * (Internal) Helper function used to sort trigram codes.
+ */
+
+int _tg_codecmp(const void *p1, const void *p2) {
+    uint32_t a = * (const uint32_t *) p1;
+    uint32_t b = * (const uint32_t *) p2;
+    return (a > b) - (a < b);
+}
+
+/*
+ * Store into `codes` the distinct trigrams of the `len` bytes at `s`,
+ * sorted, so the same string always yields the same sequence. `codes`
+ * must have room for `len - 2` codes. `s` must not contain NULs.
+ * Returns the number of codes.
+ */
+
+size_t tg_codes(const char *s, size_t len, uint32_t *codes) {
+    const unsigned char *u = (const unsigned char *) s;
+    size_t n = 0, d = 0;
+
+    if (len < 3)
+        return 0;
+
+    for (size_t i = 0; i + 2 < len; i++)
+        codes[n++] = (uint32_t) u[i] << 16 | (uint32_t) u[i + 1] << 8 | u[i + 2];
+    qsort(codes, n, sizeof(uint32_t), _tg_codecmp);
+
+    for (size_t i = 0; i < n; i++)
+        if (d == 0 || codes[d - 1] != codes[i])
+            codes[d++] = codes[i];
+    return d;
+}
+
+/*
+ * (Internal) Finds the slot for `code` in `lists`, either the one
+ * holding it or the first empty one.
+ */
+
+tg_list_t *_tg_slot(tg_list_t *lists, size_t size, uint32_t code) {
+    size_t i = (size_t) ((code * 2654435761u) & (size - 1));
+
+    while (lists[i].code != 0 && lists[i].code != code)
+        i = (i + 1) & (size - 1);
+    return &lists[i];
+}
+
+/*
+ * (Internal) Double the number of slots of `t`.
+ */
+
+void _tg_grow(tg_index_t *t) {
+    size_t newsize = t->size * 2;
+    tg_list_t *lists = calloc_or_die(newsize, sizeof(tg_list_t));
+
+    for (size_t i = 0; i < t->size; i++)
+        if (t->lists[i].code != 0)
+            *_tg_slot(lists, newsize, t->lists[i].code) = t->lists[i];
+    free(t->lists);
+    t->lists = lists;
+    t->size = newsize;
+}
+
+/*
+ * Returns the posting list of trigram `code`, or NULL if no item
+ * was ever added to it.
+ */
+
+tg_list_t *tg_get(tg_index_t *t, uint32_t code) {
+    tg_list_t *l = _tg_slot(t->lists, t->size, code);
+    return l->code != 0 ? l : NULL;
+}
+
+/*
+ * Add `item` to the posting lists of all the trigrams of `name`,
+ * `len` bytes long. `slots` must have room for one position per
+ * distinct trigram and must stay at the same address until the item
+ * is removed.
+ */
+
+void tg_add(tg_index_t *t, void *item, const char *name, size_t len, uint32_t *slots) {
+    uint32_t codes[TG_MAX_CODES];
+    size_t n = tg_codes(name, len, codes);
+    tg_list_t *l;
+
+    for (size_t k = 0; k < n; k++) {
+        l = _tg_slot(t->lists, t->size, codes[k]);
+        if (l->code == 0) {
+            if ((t->used + 1) * 2 > t->size) {
+                _tg_grow(t);
+                l = _tg_slot(t->lists, t->size, codes[k]);
+            }
+            l->code = codes[k];
+            t->used++;
+        }
+        if (l->count == l->size) {
+            l->size = l->size > 0 ? l->size * 2 : 4;
+            l->items = realloc_or_die(l->items, l->size * sizeof(tg_posting_t));
+        }
+        slots[k] = l->count;
+        l->items[l->count].item = item;
+        l->items[l->count].slotp = &slots[k];
+        l->count++;
+    }
+}
+
+/*
+ * Remove the item added with `name` and `slots` from the posting
+ * lists, moving the last item of each list into its position.
+ */
+
+void tg_remove(tg_index_t *t, const char *name, size_t len, uint32_t *slots) {
+    uint32_t codes[TG_MAX_CODES];
+    size_t n = tg_codes(name, len, codes);
+    tg_posting_t *last;
+    tg_list_t *l;
+
+    for (size_t k = 0; k < n; k++) {
+        if ((l = tg_get(t, codes[k])) == NULL)
+            continue;
+        last = &l->items[--l->count];
+        l->items[slots[k]] = *last;
+        *last->slotp = slots[k];
+    }
+}
+// end:definitions
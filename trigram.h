@@ -0,0 +1,57 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_TRIGRAM_H
+#define API_RAMFS_TRIGRAM_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+// end:includes
+
+// start:macros
+#define TG_BASE_SIZE 1024
+// Longest name is 255 chars, so at most 253 trigrams
+#define TG_MAX_CODES 253
+// end:macros
+
+// start:datatypes
+// An item of a posting list. `slotp` points to where the item keeps
+// its position in this list, updated when items are moved around so
+// that removal is O(1).
+typedef struct _tg_posting {
+    void *item;
+    uint32_t *slotp;
+} tg_posting_t;
+
+// All the items whose name contains trigram `code`
+typedef struct _tg_list {
+    uint32_t code;      // 0 marks an empty slot
+    uint32_t count;
+    uint32_t size;
+    tg_posting_t *items;
+} tg_list_t;
+
+// Trigram -> posting list, open addressing on the trigram code
+typedef struct _tg_index {
+    tg_list_t *lists;
+    size_t size;
+    size_t used;
+} tg_index_t;
+// end:datatypes
+
+// start:declarations
+tg_index_t *tg_new();
+void        tg_del(tg_index_t *t);
+size_t      tg_codes(const char *s, size_t len, uint32_t *codes);
+void        tg_add(tg_index_t *t, void *item, const char *name, size_t len, uint32_t *slots);
+void        tg_remove(tg_index_t *t, const char *name, size_t len, uint32_t *slots);
+tg_list_t  *tg_get(tg_index_t *t, uint32_t code);
+
+tg_list_t  *_tg_slot(tg_list_t *lists, size_t size, uint32_t code);
+void        _tg_grow(tg_index_t *t);
+int         _tg_codecmp(const void *p1, const void *p2);
+// end:declarations
+
+#endif //API_RAMFS_TRIGRAM_H
@@ -0,0 +1,173 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+// end:includes
+
+// start:definitions
+#ifdef HAVE_IO_URING
+// Minimal io_uring support, without depending on liburing
+
+/*
+ * Set up a ring with `entries` submission queue entries.
+ * Returns 0 on success, -1 if the kernel does not support io_uring
+ * or the ring couldn't be mapped (errno is set).
+ */
+
+int uring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+    r->features = p.features;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // Both rings share one mapping on recent kernels
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_head = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+
+    r->cq_head = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    uring_exit(r);
+    return -1;
+}
+
+/*
+ * Unmap and close ring `r`.
+ */
+
+void uring_exit(uring_t *r) {
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring && r->cq_ring != MAP_FAILED)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(uring_t));
+    r->fd = -1;
+}
+
+/*
+ * Get a zeroed submission queue entry to fill in. It will be submitted
+ * by the next `uring_submit_and_wait`. If the queue is full, pending
+ * entries are submitted first.
+ */
+
+struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        uring_submit_and_wait(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries)
+            return NULL;
+    }
+
+    sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[r->sq_local_tail & *r->sq_mask] = r->sq_local_tail & *r->sq_mask;
+    r->sq_local_tail++;
+    return sqe;
+}
+
+/*
+ * Submit all prepared entries and wait for at least `wait_nr`
+ * completions, with a single system call.
+ * Returns the number of entries submitted, or -1 on error.
+ */
+
+int uring_submit_and_wait(uring_t *r, unsigned wait_nr) {
+    unsigned submit = r->sq_local_tail - *r->sq_tail;
+    int ret;
+
+    // Publish the new tail
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+    r->enters++;
+    ret = (int) syscall(__NR_io_uring_enter, r->fd, submit, wait_nr,
+                        wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return ret;
+}
+
+/*
+ * Returns the oldest completion, or NULL if there is none.
+ * It must be released with `uring_cqe_seen` once handled.
+ */
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Thin wrapper around io_uring_register(2).
+ */
+
+int uring_register(uring_t *r, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, r->fd, opcode, arg, nr_args);
+}
+
+#endif
+// end:definitions
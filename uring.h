@@ -0,0 +1,61 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_URING_H
+#define API_RAMFS_URING_H
+
+// start:includes
+#include <stdlib.h>
+#include <stdint.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+// end:includes
+
+// start:macros
+#define URING_ENTRIES 256
+// end:macros
+
+#ifdef HAVE_IO_URING
+// start:datatypes
+// Minimal io_uring wrapper on top of the raw system calls
+typedef struct _uring {
+    int fd;
+    uint32_t features;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // SQEs prepared but not submitted yet
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    uint64_t enters;            // io_uring_enter calls, for statistics
+} uring_t;
+// end:datatypes
+
+// start:declarations
+int  uring_init(uring_t *r, unsigned entries);
+void uring_exit(uring_t *r);
+struct io_uring_sqe *uring_get_sqe(uring_t *r);
+int  uring_submit_and_wait(uring_t *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+int  uring_register(uring_t *r, unsigned opcode, void *arg, unsigned nr_args);
+// end:declarations
+#endif
+
+#endif //API_RAMFS_URING_H
@@ -8,6 +8,10 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 #include "utils.h"
 // end:includes
 
@@ -45,7 +49,7 @@ inline void *realloc_or_die(void *ptr, size_t size) {
 
 /*
  * Implementation of POSIX `getline`.
- * Reads `stream` until a new line character is found.
+ * Reads `in` until a new line character is found.
  * `**lineptr` is where the read line will be stored. It must be
  * allocated with {m,c,re}alloc. It will be realloc'd if there's
  * not enough space to store the line. `*n` is its initial size.
@@ -53,9 +57,8 @@ inline void *realloc_or_die(void *ptr, size_t size) {
  * Returns the number of characters read, or -1 on error.
  */
 
-ssize_t getline_depau(char **lineptr, size_t *n, FILE *stream) {
-    ssize_t charsread;
-    char *ptr;
+ssize_t getline_depau(char **lineptr, size_t *n, reader_t *in) {
+    size_t len = 0;
 
     if (*lineptr == (char *) NULL) {
         *lineptr = malloc_or_die(BASE_BUF_SIZE * sizeof(char));
@@ -63,32 +66,130 @@ ssize_t getline_depau(char **lineptr, size_t *n, FILE *stream) {
     if (*n == 0)
         *n = BASE_BUF_SIZE;
 
-    ptr = *lineptr;
+    for (;;) {
+        char *start, *nl;
+        size_t chunk;
+
+        if (in->pos == in->len && !_reader_fill(in)) {
+            (*lineptr)[len] = '\0';
+            return -1;
+        }
 
-    // charsread starts at 1 so we are already counting the terminator
-    for (charsread = 1;; charsread++) {
-        char c = (char) getc(stream);
+        // Copy up to the new line, or whatever is buffered
+        start = in->data + in->pos;
+        nl = memchr(start, '\n', in->len - in->pos);
+        chunk = nl != NULL ? (size_t) (nl - start) : in->len - in->pos;
 
-        // allocate more space for command line
-        if ((size_t) charsread > *n - 2) {
-            *n += BASE_BUF_SIZE * sizeof(char);
+        // allocate more space for command line, doubling it so that
+        // long lines take a logarithmic number of reallocations
+        while (len + chunk + 1 > *n) {
+            *n *= 2;
             *lineptr = realloc_or_die(*lineptr, *n);
-            ptr = *lineptr + (charsread - 1);
         }
-
-        if (c == EOF) {
-            *ptr = '\0';
-            return -1;
+        memcpy(*lineptr + len, start, chunk);
+        len += chunk;
+        in->pos += chunk;
+
+        if (nl != NULL) {
+            in->pos++;
+            (*lineptr)[len] = '\0';
+            // Counting the new line
+            return (ssize_t) len + 1;
         }
+    }
+}
 
-        if (c == '\n') {
-            *ptr = '\0';
-            return charsread;
-        }
+/*
+ * reader_*: helpers for `reader_t`. Input is read from `fd` into
+ * a buffer of READER_BUF_SIZE bytes whenever it runs out.
+ */
 
-        *ptr = c;
-        ptr++;
+void reader_init(reader_t *r, int fd) {
+    r->fd = fd;
+    r->data = malloc_or_die(READER_BUF_SIZE);
+    r->pos = 0;
+    r->len = 0;
+    r->eof = 0;
+}
+
+inline void reader_free(reader_t *r) {
+    free(r->data);
+    r->data = NULL;
+}
+
+/*
+ * (Internal) Refill the buffer of `r`, which must have been consumed.
+ * Returns 0 on EOF or error.
+ */
+
+uint8_t _reader_fill(reader_t *r) {
+    ssize_t n;
+
+    r->pos = 0;
+    r->len = 0;
+    if (r->eof)
+        return 0;
+    do {
+        n = read(r->fd, r->data, READER_BUF_SIZE);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        r->eof = 1;
+        return 0;
     }
+    r->len = (size_t) n;
+    return 1;
+}
+
+/*
+ * Read `len` bytes from `r` into `dst`. Whatever doesn't fit in the
+ * buffer is read straight into `dst`. Returns the number of bytes
+ * read, less than `len` only on EOF or error.
+ */
+
+size_t reader_read(reader_t *r, void *dst, size_t len) {
+    char *out = dst;
+    size_t done = 0;
+
+    while (done < len) {
+        size_t chunk;
+
+        if (r->pos == r->len) {
+            if (len - done >= READER_BUF_SIZE && !r->eof) {
+                ssize_t n = read(r->fd, out + done, len - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    r->eof = 1;
+                    break;
+                }
+                done += (size_t) n;
+                continue;
+            }
+            if (!_reader_fill(r))
+                break;
+        }
+        chunk = r->len - r->pos < len - done ? r->len - r->pos : len - done;
+        memcpy(out + done, r->data + r->pos, chunk);
+        r->pos += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/*
+ * True if input can be read from `r` without waiting: either it is
+ * already buffered or the descriptor has some.
+ */
+
+uint8_t reader_ready(reader_t *r) {
+    struct pollfd p;
+
+    if (r->pos < r->len)
+        return 1;
+    p.fd = r->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    return (uint8_t) (poll(&p, 1, 0) > 0);
 }
 
 /*
@@ -208,70 +309,174 @@ char *strcat_auto(int n_args, ...) {
 
 
 /*
- * Print "ok" if ret is 0, "no" if ret < 0, "ok `ret`" if ret > 0.
+ * strbuf_*: helpers for `strbuf_t`, a growable buffer replies are
+ * formatted into before being written out. The buffer is not
+ * necessarily NUL-terminated, always use `len`.
+ */
+
+inline void strbuf_init(strbuf_t *b) {
+    b->data = NULL;
+    b->len = 0;
+    b->size = 0;
+    b->sink = NULL;
+}
+
+inline void strbuf_free(strbuf_t *b) {
+    free(b->data);
+    strbuf_init(b);
+}
+
+inline void strbuf_reset(strbuf_t *b) {
+    b->len = 0;
+}
+
+/*
+ * Release the memory of `b` if it is empty and larger than `max`
+ * bytes, so that one oversized message does not pin it forever.
  */
 
-inline void print_status(int ret) {
+void strbuf_shrink(strbuf_t *b, size_t max) {
+    if (b->len == 0 && b->size > max)
+        strbuf_free(b);
+}
+
+/*
+ * Make sure at least `extra` more bytes can be appended to `b`
+ * without reallocating.
+ */
+
+void strbuf_reserve(strbuf_t *b, size_t extra) {
+    size_t newsize;
+
+    if (b->len + extra <= b->size)
+        return;
+
+    newsize = b->size > 0 ? b->size : BASE_BUF_SIZE;
+    while (newsize < b->len + extra)
+        newsize *= 2;
+
+    b->data = realloc_or_die(b->data, newsize);
+    b->size = newsize;
+}
+
+void strbuf_append(strbuf_t *b, const char *s, size_t len) {
+    strbuf_reserve(b, len);
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+inline void strbuf_puts(strbuf_t *b, const char *s) {
+    strbuf_append(b, s, strlen(s));
+}
+
+void strbuf_printf(strbuf_t *b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    // Try with the space we have first, retry once if it was not enough
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return;
+
+    if ((size_t) n >= b->size - b->len) {
+        strbuf_reserve(b, (size_t) n + 1);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+/*
+ * Write the content of `b` out to its sink, if it has one and the
+ * content grew past STRBUF_SPILL_SIZE, so that long replies are
+ * streamed instead of piling up in memory.
+ */
+
+void strbuf_spill(strbuf_t *b) {
+    if (b->sink == NULL || b->len < STRBUF_SPILL_SIZE)
+        return;
+    fwrite(b->data, 1, b->len, b->sink);
+    b->len = 0;
+}
+
+
+/*
+ * Append "ok" to `out` if ret is 0, "no" if ret < 0, "ok `ret`" if ret > 0.
+ */
+
+inline void print_status(int ret, strbuf_t *out) {
     if (ret < 0)
-        printf("no\n");
+        strbuf_puts(out, "no\n");
     else if (ret == 0)
-        printf("ok\n");
+        strbuf_puts(out, "ok\n");
     else
-        printf("ok %i\n", ret);
+        strbuf_printf(out, "ok %i\n", ret);
 }
 
 /*
- * Reads one string argument from `cmd`, then calls `func` passing
- * `root` and that argument to it.
+ * Calls `func` passing `root` and the first argument in `args` to it.
+ * If the argument is missing, the command fails.
  */
 
-inline void call_with_1(int (*func)(fs_node_t *, char *), fs_node_t *root, char *cmd) {
-    char *save_ptr;
-    char *arg1 = readcmd(cmd, &save_ptr);
-    int ret = (*func)(root, arg1);
-    print_status(ret);
+inline void call_with_1(int (*func)(fs_node_t *, char *), fs_node_t *root, char **args, strbuf_t *out) {
+    if (args[0] == NULL) {
+        print_status(-1, out);
+        return;
+    }
+    int ret = (*func)(root, args[0]);
+    print_status(ret, out);
 }
 
 /*
- * Reads two string arguments from `cmd`, then calls `func` passing
- * `root` and those arguments to it.
+ * Calls `func` passing `root` and the first two arguments in `args`
+ * to it. If any of the arguments is missing, the command fails.
  */
 
-inline void call_with_2(int (*func)(fs_node_t *, char *, char *), fs_node_t *root, char *cmd) {
-    char *save_ptr;
-    char *arg1 = readcmd(cmd, &save_ptr);
-    char *arg2 = readcmd(NULL, &save_ptr);
+inline void call_with_2(int (*func)(fs_node_t *, char *, char *), fs_node_t *root, char **args, strbuf_t *out) {
+    if (args[0] == NULL || args[1] == NULL) {
+        print_status(-1, out);
+        return;
+    }
+    int ret = (*func)(root, args[0], args[1]);
+    print_status(ret, out);
+}
+
+/*
+ * Monotonic clock in nanoseconds, used for statistics.
+ */
 
-    int ret = (*func)(root, arg1, arg2);
-    print_status(ret);
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
 }
 
 /*
- * Hash function for the hash table. Starts with the length of the
- * string being hashed, xor's on top of each of its bytes, in turn,
- * each byte of the string starting from the last one.
- * If the string's length is not a multiple of 4, the last byte is
- * repeatedly xor'd to ensure all bytes are xor'd the same number of
- * times.
+ * Hash function for the hash tables: 32-bit FNV-1a followed by the
+ * MurmurHash3 finalizer, so that the low bits used to pick a slot in
+ * power-of-two sized tables depend on every byte of the key.
  */
 
 uint32_t hash(const char *data, size_t len) {
-    size_t shift = 0;
-    uint32_t hash = (uint32_t) len;
+    uint32_t hash = 2166136261u;
 
     if (len <= 0 || data == NULL)
         return 0;
 
-    // Ensure all 4 bytes of the uint32 are filled with some value
-    size_t orig_len = len;
-    len += sizeof(uint32_t)/sizeof(char) -
-            (len % sizeof(uint32_t)/sizeof(char));
-
-    for (; len > 0; len--) {
-        hash ^= ((uint32_t) data[len % orig_len]) << shift;
-        shift = (shift + sizeof(char)) % sizeof(uint32_t);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) data[i];
+        hash *= 16777619u;
     }
 
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
     return hash;
 }
 
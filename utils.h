@@ -9,11 +9,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include "ramfs.h"
 // end:includes
 
 // start:macros
 #define BASE_BUF_SIZE 64
+// Line buffers grown past this size are released after use
+#define LINE_SHRINK_SIZE 65536
+// Buffers with a sink are written out past this size by strbuf_spill
+#define STRBUF_SPILL_SIZE 65536
+// Bytes read from the input at a time by reader_t
+#define READER_BUF_SIZE 65536
 
 // Add ssize_t if missing
 #if !defined(ssize_t)
@@ -22,19 +29,57 @@ typedef intmax_t ssize_t;
 
 // end:macros
 
+// start:datatypes
+// Growable output buffer, commands write their replies here
+typedef struct _strbuf {
+    char *data;
+    size_t len;
+    size_t size;
+    FILE *sink;     // optional, see strbuf_spill
+} strbuf_t;
+
+// Buffered input from a file descriptor. The buffer is our own, so
+// whether more input is ready can be told without waiting
+typedef struct _reader {
+    int fd;
+    char *data;
+    size_t pos;     // first byte not consumed yet
+    size_t len;     // bytes in data
+    uint8_t eof;
+} reader_t;
+// end:datatypes
+
 // start:declarations
 void *malloc_or_die(size_t size);
 void *calloc_or_die(size_t nmemb, size_t size);
 void *realloc_or_die(void *ptr, size_t size);
-ssize_t getline_depau(char **lineptr, size_t *n, FILE *stream);
+ssize_t getline_depau(char **lineptr, size_t *n, reader_t *in);
 char *strtok_depau(char *s, const char *delim, char **save_ptr);
 char *strtok_escape(char *s, const char *delim, char **save_ptr, char escape_char);
 char *readcmd(char *s, char **save_ptr);
 char *strcat_auto(int n_args, ...);
 
-void print_status(int ret);
-void call_with_1(int (*func)(fs_node_t *, char *string), fs_node_t *root, char *cmd);
-void call_with_2(int (*func)(fs_node_t *, char *, char *string), fs_node_t *root, char *cmd);
+void    reader_init(reader_t *r, int fd);
+void    reader_free(reader_t *r);
+size_t  reader_read(reader_t *r, void *dst, size_t len);
+uint8_t reader_ready(reader_t *r);
+uint8_t _reader_fill(reader_t *r);
+
+void strbuf_init(strbuf_t *b);
+void strbuf_free(strbuf_t *b);
+void strbuf_reset(strbuf_t *b);
+void strbuf_shrink(strbuf_t *b, size_t max);
+void strbuf_reserve(strbuf_t *b, size_t extra);
+void strbuf_append(strbuf_t *b, const char *s, size_t len);
+void strbuf_puts(strbuf_t *b, const char *s);
+void strbuf_printf(strbuf_t *b, const char *fmt, ...);
+void strbuf_spill(strbuf_t *b);
+
+void print_status(int ret, strbuf_t *out);
+void call_with_1(int (*func)(fs_node_t *, char *string), fs_node_t *root, char **args, strbuf_t *out);
+void call_with_2(int (*func)(fs_node_t *, char *, char *string), fs_node_t *root, char **args, strbuf_t *out);
+
+uint64_t now_ns();
 
 uint32_t hash(const char * data, size_t len);
 
@@ -0,0 +1,199 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+// start:includes
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "walker.h"
+#include "ringbuf.h"
+#include "utils.h"
+// end:includes
+
+// start:definitions
+// Parallel tree walker. Every thread owns a deque of directories to
+// visit; it works depth-first on its own deque and, once that is
+// empty, steals from the others. A directory is a unit of work, so
+// subtrees are split among threads at directory boundaries.
+
+/*
+ * (Internal) Update the bounds of deque `d`, with its lock held.
+ * Thieves peek at them without the lock to skip empty deques.
+ */
+
+void _walker_set(walker_deque_t *d, size_t top, size_t bottom) {
+    if (top == bottom)
+        top = bottom = 0;
+    __atomic_store_n(&d->top, top, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+}
+
+/*
+ * Push directory `dir` to the deque of thread `tid`, to be visited
+ * later by it or by a thief. Only thread `tid` may call this.
+ */
+
+void walker_push(walker_t *w, unsigned int tid, fs_node_t *dir) {
+    walker_deque_t *d = &w->deques[tid];
+
+    // Count it before anyone can see it, so that `pending` can't
+    // drop to zero while work is still around
+    __atomic_fetch_add(&w->pending, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->size) {
+        if (d->top > 0) {
+            memmove(d->items, d->items + d->top, (d->bottom - d->top) * sizeof(fs_node_t *));
+            _walker_set(d, 0, d->bottom - d->top);
+        }
+        if (d->bottom == d->size) {
+            d->size *= 2;
+            d->items = realloc_or_die(d->items, d->size * sizeof(fs_node_t *));
+        }
+    }
+    d->items[d->bottom] = dir;
+    _walker_set(d, d->top, d->bottom + 1);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * (Internal) Pop the most recently pushed directory of thread `tid`.
+ * Returns NULL if its deque is empty.
+ */
+
+fs_node_t *_walker_pop(walker_t *w, unsigned int tid) {
+    walker_deque_t *d = &w->deques[tid];
+    fs_node_t *dir = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) {
+        dir = d->items[d->bottom - 1];
+        _walker_set(d, d->top, d->bottom - 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return dir;
+}
+
+/*
+ * (Internal) Steal the oldest directory from another thread's deque.
+ * Returns NULL if there is nothing to steal.
+ */
+
+fs_node_t *_walker_steal(walker_t *w, unsigned int tid) {
+    walker_deque_t *d;
+    fs_node_t *dir = NULL;
+
+    for (unsigned int i = 1; i < w->nthreads && dir == NULL; i++) {
+        d = &w->deques[(tid + i) % w->nthreads];
+
+        // Don't take the lock of deques that look empty
+        if (__atomic_load_n(&d->bottom, __ATOMIC_RELAXED) <= __atomic_load_n(&d->top, __ATOMIC_RELAXED))
+            continue;
+
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom > d->top) {
+            dir = d->items[d->top];
+            _walker_set(d, d->top + 1, d->bottom);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    return dir;
+}
+
+/*
+ * (Internal) Worker loop: visit directories until all of them have
+ * been visited by some thread.
+ */
+
+void *_walker_thread(void *arg) {
+    walker_thread_t *t = arg;
+    walker_t *w = t->w;
+    unsigned int spins = 0;
+    fs_node_t *dir;
+    size_t pathlen;
+
+    for (;;) {
+        if ((dir = _walker_pop(w, t->tid)) == NULL &&
+            (dir = _walker_steal(w, t->tid)) != NULL)
+            t->stolen++;
+
+        if (dir == NULL) {
+            if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0)
+                break;
+            ringbuf_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        // Rebuild the directory path, it may come from another thread
+        if (dir->parent == NULL) {
+            pathlen = 1;
+            t->path[0] = '/';
+        } else {
+            pathlen = _ramfs_nodepath_len(dir);
+            _ramfs_nodepath_fill(dir, t->path, pathlen);
+            t->path[pathlen++] = '/';
+        }
+
+        w->visit(w, t->tid, dir, t->path, pathlen);
+        t->visited++;
+        __atomic_fetch_sub(&w->pending, 1, __ATOMIC_RELEASE);
+    }
+
+    if (w->done != NULL)
+        w->done(w, t->tid);
+    return NULL;
+}
+
+/*
+ * Visit all the directories under `root` (included) with `nthreads`
+ * threads, calling `visit` for each of them and `done` (if not NULL)
+ * once per thread at the end. The calling thread is one of them.
+ * `arg` is available to the callbacks as `w->arg`.
+ */
+
+void walker_run(walker_t *w, fs_node_t *root, unsigned int nthreads,
+                walker_visit_fn visit, walker_done_fn done, void *arg) {
+    pthread_t threads[WALKER_MAX_THREADS];
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > WALKER_MAX_THREADS)
+        nthreads = WALKER_MAX_THREADS;
+
+    memset(w, 0, sizeof(walker_t));
+    w->nthreads = nthreads;
+    w->visit = visit;
+    w->done = done;
+    w->arg = arg;
+    w->deques = calloc_or_die(nthreads, sizeof(walker_deque_t));
+    w->threads = calloc_or_die(nthreads, sizeof(walker_thread_t));
+
+    for (unsigned int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&w->deques[i].lock, NULL);
+        w->deques[i].size = WALKER_DEQUE_SIZE;
+        w->deques[i].items = malloc_or_die(WALKER_DEQUE_SIZE * sizeof(fs_node_t *));
+        w->threads[i].w = w;
+        w->threads[i].tid = i;
+        w->threads[i].path = malloc_or_die(WALKER_PATH_SIZE);
+    }
+
+    walker_push(w, 0, root);
+
+    for (unsigned int i = 1; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, _walker_thread, &w->threads[i]) != 0)
+            exit(4);
+    _walker_thread(&w->threads[0]);
+    for (unsigned int i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (unsigned int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&w->deques[i].lock);
+        free(w->deques[i].items);
+        free(w->threads[i].path);
+    }
+    free(w->deques);
+    free(w->threads);
+}
+// end:definitions
@@ -0,0 +1,79 @@
+//
+// Created by depaulicious on 19/10/26.
+//
+
+#ifndef API_RAMFS_WALKER_H
+#define API_RAMFS_WALKER_H
+
+// start:includes
+#include <stdint.h>
+#include <pthread.h>
+#include "ramfs.h"
+#include "ringbuf.h"
+// end:includes
+
+// start:macros
+#define WALKER_MAX_THREADS 64
+#define WALKER_DEQUE_SIZE  64
+// Longest path: 255 levels of 255 chars, slashes and terminator
+#define WALKER_PATH_SIZE   (256 * 256 + 1)
+// end:macros
+
+// start:datatypes
+struct _walker;
+
+// Visit the children of directory `dir`, whose path (trailing slash
+// included) is the `pathlen` bytes at `path`. Subdirectories to be
+// visited must be handed back with `walker_push`. Files can be pushed
+// too when they are worth a unit of work of their own; they are
+// visited the same way, their path also followed by a slash.
+typedef void (*walker_visit_fn)(struct _walker *w, unsigned int tid,
+                                fs_node_t *dir, const char *path, size_t pathlen);
+// Called by every thread once there is nothing left to visit
+typedef void (*walker_done_fn)(struct _walker *w, unsigned int tid);
+
+// Directories waiting to be visited by one thread. The owner pushes
+// and pops at the bottom, thieves steal the oldest (and usually
+// largest) subtrees from the top.
+typedef struct _walker_deque {
+    pthread_mutex_t lock;
+    fs_node_t **items;
+    size_t top;
+    size_t bottom;
+    size_t size;
+    char pad[CACHE_LINE_SIZE];
+} walker_deque_t;
+
+typedef struct _walker_thread {
+    struct _walker *w;
+    unsigned int tid;
+    char *path;
+    uint64_t visited;
+    uint64_t stolen;
+} walker_thread_t;
+
+typedef struct _walker {
+    unsigned int nthreads;
+    walker_visit_fn visit;
+    walker_done_fn done;
+    void *arg;
+    walker_deque_t *deques;
+    walker_thread_t *threads;
+    char pad0[CACHE_LINE_SIZE];
+    size_t pending;     // directories pushed but not visited yet
+    char pad1[CACHE_LINE_SIZE];
+} walker_t;
+// end:datatypes
+
+// start:declarations
+void walker_run(walker_t *w, fs_node_t *root, unsigned int nthreads,
+                walker_visit_fn visit, walker_done_fn done, void *arg);
+void walker_push(walker_t *w, unsigned int tid, fs_node_t *dir);
+
+void       _walker_set(walker_deque_t *d, size_t top, size_t bottom);
+fs_node_t *_walker_pop(walker_t *w, unsigned int tid);
+fs_node_t *_walker_steal(walker_t *w, unsigned int tid);
+void      *_walker_thread(void *arg);
+// end:declarations
+
+#endif //API_RAMFS_WALKER_H